@@ -0,0 +1,96 @@
+#!/usr/bin/env python
+#
+# Usage: python bench_channel.py [count [size]]
+#
+# Throughput of chutneys passed between two processes, through a
+# ShmChannel and through a Unix socket (length-prefixed dumps/loads).
+#
+
+import os
+import sys
+import time
+import struct
+import socket
+import chutney
+
+
+def message(i, size):
+    return {'seq': i, 'name': u'worker', 'ok': True, 'data': 'x' * size}
+
+
+def recv_exactly(sock, n):
+    chunks = []
+    while n:
+        chunk = sock.recv(n)
+        if not chunk:
+            raise EOFError
+        chunks.append(chunk)
+        n -= len(chunk)
+    return ''.join(chunks)
+
+
+def run(produce, consume, count):
+    pid = os.fork()
+    if pid == 0:
+        try:
+            produce()
+        finally:
+            os._exit(0)
+    start = time.time()
+    consume()
+    elapsed = time.time() - start
+    os.waitpid(pid, 0)
+    return count / elapsed
+
+
+def bench_channel(count, size):
+    name = '/chutney-bench-%d' % os.getpid()
+    tx = chutney.ShmChannel(name, 1 << 20)
+    rx = chutney.ShmChannel(name)
+
+    def produce():
+        for i in xrange(count):
+            tx.send(message(i, size))
+
+    def consume():
+        for i in xrange(count):
+            rx.recv()
+
+    try:
+        return run(produce, consume, count)
+    finally:
+        rx.close()
+        tx.close()
+
+
+def bench_socket(count, size):
+    tx, rx = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+
+    def produce():
+        for i in xrange(count):
+            data = chutney.dumps(message(i, size))
+            tx.sendall(struct.pack('<I', len(data)) + data)
+
+    def consume():
+        for i in xrange(count):
+            n, = struct.unpack('<I', recv_exactly(rx, 4))
+            chutney.loads(recv_exactly(rx, n))
+
+    try:
+        return run(produce, consume, count)
+    finally:
+        rx.close()
+        tx.close()
+
+
+def main():
+    count = len(sys.argv) > 1 and int(sys.argv[1]) or 100000
+    size = len(sys.argv) > 2 and int(sys.argv[2]) or 100
+    for label, fn in (('ShmChannel', bench_channel),
+                      ('Unix socket', bench_socket)):
+        rate = fn(count, size)
+        print '%-12s %9.0f msgs/s %8.1f MB/s' % (label, rate,
+                                                 rate * size / 1e6)
+
+if __name__ == '__main__':
+    main()
@@ -1,6 +1,7 @@
 #include <Python.h>
-#include <cStringIO.h>
-#include <limits.h>
+#include <pythread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include "chutney.h"
 
 #if (PY_VERSION_HEX < 0x02050000)
@@ -9,6 +10,69 @@ typedef int Py_ssize_t;
 
 static PyObject *ChutneyError, *UnpickleableError, *UnpicklingError;
 
+/* Cumulative instrumentation for all loads and dumps - see chutney_stats() */
+static chutney_load_stats load_stats;
+static chutney_dump_stats dump_stats;
+
+/* Classes saved and loaded as EXT codes - see chutney_register_extension() */
+static chutney_registry registry;
+
+/*
+ * The load states' own buffers, reset after each load - see load_init(). A
+ * load started during another (say by a dict key's __hash__) uses malloc.
+ */
+static chutney_arena load_arena;
+static int load_arena_busy;
+
+/* Interned attribute names */
+static PyObject *module_str, *getstate_str;
+
+/*
+ * Instances of the same class all start with the same MARK, GLOBAL and OBJ
+ * opcodes, so each dump keeps a small cache of these headers, pre-encoded
+ * and keyed by class. An entry holds references to the __module__ and
+ * __name__ objects it was encoded from, and is rebuilt if the class's
+ * attributes no longer refer to the same objects.
+ */
+#define CLASS_CACHE_SIZE 64     /* must be a power of two */
+
+typedef struct {
+    PyObject *class;
+    PyObject *module;
+    PyObject *name;
+    char *header;
+    int header_len;
+} class_entry;
+
+/*
+ * Dict keys are nearly always interned strings from a small vocabulary, so
+ * each dump also keeps a direct mapped cache of their encodings (opcode,
+ * length and body), keyed by the string object, which the entry holds.
+ * The cache is allocated on first use, and abandoned if keys keep missing
+ * it, as they will with a large vocabulary.
+ */
+#define KEY_CACHE_SIZE 256      /* must be a power of two */
+#define KEY_CACHE_MAXLEN 62     /* longest key cached */
+#define KEY_CACHE_GIVEUP 1024   /* misses, if they outnumber hits */
+
+typedef struct {
+    PyObject *key;
+    int len;
+    char encoded[KEY_CACHE_MAXLEN + 2];
+} key_entry;
+
+/* The library dump state must be first, so save() can cast between them */
+typedef struct {
+    chutney_dump_state dump;
+    int class_count;
+    class_entry classes[CLASS_CACHE_SIZE];
+    PyObject *refs;             /* dumps_iov: referenced payload owners */
+    int columnar;               /* see save_columns */
+    key_entry *keys;            /* see save_key */
+    long key_hits;
+    long key_misses;            /* or -1, cache abandoned */
+} pickler_state;
+
 static int save(chutney_dump_state *self, PyObject *obj);
 
 static void
@@ -17,6 +81,12 @@ creator_dealloc(void *obj)
     Py_DECREF((PyObject *)obj);
 }
 
+static void
+creator_incref(void *obj)
+{
+    Py_INCREF((PyObject *)obj);
+}
+
 static void *
 creator_null(void) {
     Py_INCREF(Py_None);
@@ -41,13 +111,13 @@ creator_float(double value) {
 }
 
 static void *
-creator_string(const char *value, long len)
+creator_string(const char *value, size_t len)
 {
     return (void *)PyString_FromStringAndSize(value, len);
 }
 
 static void *
-creator_unicode(const char *value, long len)
+creator_unicode(const char *value, size_t len)
 {
     return (void *)PyUnicode_DecodeUTF8(value, len, NULL);
 }
@@ -56,7 +126,7 @@ static void *
 creator_tuple(void **values, long count)
 {
     PyObject *obj;
-    int i;
+    Py_ssize_t i;
 
     obj = PyTuple_New(count);
     if (obj)
@@ -149,8 +219,8 @@ object_build(void *objraw, void *stateraw)
     PyObject *obj = (PyObject *)objraw;
     PyObject *state = (PyObject *)stateraw;
     PyObject *dict = NULL, *key, *value;
+    Py_ssize_t i;
     int res = -1;
-    int i;
 
     if (!PyDict_Check(state)) {
         PyErr_SetString(UnpicklingError, "state is not a dictionary");
@@ -188,26 +258,107 @@ static chutney_load_callbacks load_callbacks = {
     get_global,         /* get global reference */
     creator_object,     /* instance */
     object_build,       /* update instance attrs */
+    creator_incref,     /* share a class or name between instances */
 };
 
+/* Get a view of obj's buffer, via the new or old style buffer interface */
+static int
+get_read_buffer(PyObject *obj, Py_buffer *view)
+{
+    const void *buf;
+    Py_ssize_t len;
+
+    /* unicode is refused, as its buffer is the internal representation, not
+     * a byte stream. */
+    if (PyUnicode_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "expected a buffer, not unicode");
+        return -1;
+    }
+    if (PyObject_CheckBuffer(obj))
+        return PyObject_GetBuffer(obj, view, PyBUF_SIMPLE);
+    if (PyObject_AsReadBuffer(obj, &buf, &len) < 0)
+        return -1;
+    return PyBuffer_FillInfo(view, obj, (void *)buf, len, 1, PyBUF_SIMPLE);
+}
+
+/*
+ * Initialise a load state for the binding, allocating from load_arena
+ * unless another load is using it.
+ */
+static int
+load_init(chutney_load_state *state)
+{
+    const chutney_allocator *allocator = NULL;
+
+    if (!load_arena_busy) {
+        load_arena_busy = 1;
+        allocator = &load_arena.allocator;
+    }
+    if (chutney_load_init(state, &load_callbacks, allocator) < 0) {
+        if (allocator)
+            load_arena_busy = 0;
+        PyErr_NoMemory();
+        return -1;
+    }
+    state->stats = &load_stats;
+    state->registry = &registry;
+    return 0;
+}
+
+/*
+ * Release a state from load_init, and reset the arena. If the load needed
+ * more than a block, the blocks are freed rather than kept for the next.
+ */
+static void
+load_dealloc(chutney_load_state *state)
+{
+    int arena = state->allocator.context == (void *)&load_arena;
+    size_t used = state->stack_alloc * sizeof(void *) +
+                  state->marks_alloc * sizeof(size_t) + state->buf_alloc;
+
+    chutney_load_dealloc(state);
+    if (!arena)
+        return;
+    if (used > CHUTNEY_ARENA_BLOCK_SIZE)
+        chutney_arena_dealloc(&load_arena);
+    else
+        chutney_arena_reset(&load_arena);
+    load_arena_busy = 0;
+}
+
+/* Parse the chutney in /data/, optionally a framed container */
+static PyObject *load_finish(chutney_load_state *state, 
+                             enum chutney_status status);
+
 static PyObject *
-chutney_loads(PyObject *self, PyObject *args)
+load(const char *data, Py_ssize_t size, int framed)
 {
-    PyObject *obj;
-    const char *data;
-    int len;
+    PyObject *obj = NULL;
     chutney_load_state state;
+    chutney_frame_reader reader;
+    enum chutney_status status;
+    size_t len = size;
 
-    if (!PyArg_ParseTuple(args, "S", &obj))
-        return NULL;
-    if (PyString_AsStringAndSize(obj, (char **)&data, &len) < 0)
-        return NULL;
-    if (chutney_load_init(&state, &load_callbacks) < 0) {
-        PyErr_NoMemory();
+    if (load_init(&state) < 0)
         return NULL;
-    }
-    obj = NULL;
-    switch (chutney_load(&state, &data, &len)) {
+    if (framed) {
+        chutney_frame_reader_init(&reader);
+        status = chutney_frame_load(&reader, &state, &data, &len);
+        chutney_frame_reader_dealloc(&reader);
+    } else
+        status = chutney_load(&state, &data, &len);
+    obj = load_finish(&state, status);
+    load_dealloc(&state);
+    return obj;
+}
+
+/* The result of a load, or the exception corresponding to its status */
+static PyObject *
+load_finish(chutney_load_state *state, enum chutney_status status)
+{
+    PyObject *obj = NULL;
+
+    switch (status) {
     case CHUTNEY_CONTINUE:
         PyErr_SetNone(PyExc_EOFError);
         break;
@@ -215,8 +366,11 @@ chutney_loads(PyObject *self, PyObject *args)
         if (!PyErr_Occurred())
             PyErr_NoMemory();
         break;
+    case CHUTNEY_CHECKSUM_ERR:
+        PyErr_SetString(UnpicklingError, "checksum error");
+        break;
     case CHUTNEY_OKAY:
-        obj = (PyObject *)chutney_load_result(&state);
+        obj = (PyObject *)chutney_load_result(state);
         if (obj) {
             Py_INCREF(obj);
             break;
@@ -227,206 +381,1069 @@ chutney_loads(PyObject *self, PyObject *args)
             PyErr_SetString(UnpicklingError, "parse error");
         break;
     }
-    chutney_load_dealloc(&state);
     return obj;
 }
 
-static int
-cString_write(void *context, const char *s, long n)
-{
-    if (!s)
-        return 0;
-
-    if (PycStringIO->cwrite((PyObject *)context, (char *)s, (Py_ssize_t)n) != n)
-        return -1;
-
-    return (int)n;
-}
-
-static int
-save_inst(chutney_dump_state *self, PyObject *obj)
+/* Parse a chutney split across a sequence of buffers, without joining them */
+static PyObject *
+load_segments(PyObject *seq, int framed)
 {
-    PyObject *class = NULL;
-    PyObject *instance_dict = NULL;
-    PyObject *global_name = NULL;
-    PyObject *module_name = NULL;
-    char *name_str, *module_str;
-    int res = -1;
+    PyObject *obj = NULL;
+    Py_buffer *views;
+    struct iovec *iov;
+    chutney_load_state state;
+    chutney_frame_reader reader;
+    enum chutney_status status = CHUTNEY_CONTINUE;
+    Py_ssize_t i, count = PySequence_Fast_GET_SIZE(seq), got = 0;
+    const char *data;
+    size_t len;
 
-    if ((class = PyObject_GetAttrString(obj, "__class__")) == NULL)
-        goto finally;
-    if (obj->ob_type->ob_size != 0) {
-        PyErr_SetObject(UnpickleableError, obj);
-        goto finally;
+    if (count > INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "too many buffers");
+        return NULL;
     }
-    if ((instance_dict = PyObject_GetAttrString(obj, "__dict__")) == NULL) {
-        PyErr_SetObject(UnpickleableError, obj);
+    views = PyMem_New(Py_buffer, count ? count : 1);
+    iov = PyMem_New(struct iovec, count ? count : 1);
+    if (!views || !iov) {
+        PyErr_NoMemory();
         goto finally;
     }
-    if ((global_name = PyObject_GetAttrString(class, "__name__")) == NULL)
-        goto finally;
-    if ((name_str = PyString_AsString(global_name)) == NULL)
-        goto finally;
-    if ((module_name = PyObject_GetAttrString(class, "__module__")) == NULL)
-        goto finally;
-    if ((module_str = PyString_AsString(module_name)) == NULL)
-        goto finally;
-    if (PyObject_HasAttrString(obj, "__getstate__")) {
-        PyErr_Format(UnpickleableError, "__getstate__ method on %.200s.%.200s "
-                     "not supported by chutney", module_str, name_str);
-        goto finally;
+    for (got = 0; got < count; ++got) {
+        if (get_read_buffer(PySequence_Fast_GET_ITEM(seq, got), 
+                            &views[got]) < 0)
+            goto finally;
+        iov[got].iov_base = views[got].buf;
+        iov[got].iov_len = views[got].len;
     }
-    if (chutney_save_mark(self) < 0)
-        goto finally;
-    if (chutney_save_global(self, module_str, name_str) < 0)
-        goto finally;
-    if (chutney_save_obj(self) < 0)
+    if (load_init(&state) < 0)
         goto finally;
-    if (save(self, instance_dict) < 0)
-        goto finally;
-    if (chutney_save_build(self) < 0)
-        goto finally;
-    res = 0;
+    if (framed) {
+        chutney_frame_reader_init(&reader);
+        for (i = 0; i < count && status == CHUTNEY_CONTINUE; ++i) {
+            data = (const char *)views[i].buf;
+            len = views[i].len;
+            status = chutney_frame_load(&reader, &state, &data, &len);
+        }
+        chutney_frame_reader_dealloc(&reader);
+    } else
+        status = chutney_loadv(&state, iov, (int)count, NULL);
+    obj = load_finish(&state, status);
+    load_dealloc(&state);
+
 finally:
-    Py_XDECREF(module_name);
-    Py_XDECREF(global_name);
-    Py_XDECREF(instance_dict);
-    Py_XDECREF(class);
-    return res;
+    for (i = 0; i < got; ++i)
+        PyBuffer_Release(&views[i]);
+    PyMem_Free(views);
+    PyMem_Free(iov);
+    return obj;
 }
 
-static int
-save(chutney_dump_state *self, PyObject *obj)
+static PyObject *
+chutney_loads(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    PyTypeObject *type;
-    int res = -1;
+    static char *kwlist[] = {"data", "framed", NULL};
+    PyObject *obj, *data;
+    Py_buffer view;
+    int framed = 0;
 
-    if (self->depth++ > Py_GetRecursionLimit()){
-        PyErr_SetString(PyExc_RuntimeError, "maximum recursion depth exceeded");
-            goto finally;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i:loads", kwlist,
+                                     &obj, &framed))
+        return NULL;
+    /* A list or tuple of buffers is parsed as one chutney, in place */
+    if (PyList_Check(obj) || PyTuple_Check(obj)) {
+        if (!(obj = PySequence_Fast(obj, "expected a sequence")))
+            return NULL;
+        data = load_segments(obj, framed);
+        Py_DECREF(obj);
+        return data;
     }
-    if (obj == Py_None) {
-        res = chutney_save_null(self);
+    /* Anything exporting a read buffer (str, bytearray, buffer, memoryview,
+     * mmap) is parsed in place */
+    if (get_read_buffer(obj, &view) < 0)
+        return NULL;
+    obj = load((const char *)view.buf, view.len, framed);
+    PyBuffer_Release(&view);
+    return obj;
+}
+
+/*
+ * Load the value at a path of dict keys (str or unicode, also matching
+ * instance attributes) and tuple indices, without building the rest.
+ */
+static PyObject *
+chutney_extract_path(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"data", "path", "default", NULL};
+    PyObject *obj, *path, *dflt = NULL, *item, *res = NULL;
+    PyObject *keys = NULL;      /* holds encoded unicode keys */
+    chutney_path_step *steps = NULL;
+    chutney_load_state state;
+    enum chutney_status status;
+    Py_buffer view;
+    Py_ssize_t i, depth, len;
+    char *key;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO!|O:extract", kwlist,
+                                     &obj, &PyTuple_Type, &path, &dflt))
+        return NULL;
+    if ((depth = PyTuple_GET_SIZE(path)) > INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "path too long");
+        return NULL;
+    }
+    if (get_read_buffer(obj, &view) < 0)
+        return NULL;
+    if (!(keys = PyList_New(0)) ||
+            !(steps = malloc((depth ? depth : 1) * sizeof(*steps)))) {
+        PyErr_NoMemory();
         goto finally;
     }
-    type = obj->ob_type;
-    switch (type->tp_name[0]) {
-    case 'b':
-        if (obj == Py_False || obj == Py_True) {
-            res = chutney_save_bool(self, obj == Py_True);
-            goto finally;
-        }
-        break;
-
-    case 'i':
-        if (type == &PyInt_Type) {
-            long value = PyInt_AS_LONG((PyIntObject *)obj);
-            res = chutney_save_int(self, value);
-            goto finally;
-        } else if (type == &PyInstance_Type) {
-            res = save_inst(self, obj);
-            goto finally;
+    for (i = 0; i < depth; ++i) {
+        item = PyTuple_GET_ITEM(path, i);
+        if (PyUnicode_Check(item)) {
+            if (!(item = PyUnicode_AsUTF8String(item)))
+                goto finally;
+            if (PyList_Append(keys, item) < 0) {
+                Py_DECREF(item);
+                goto finally;
+            }
+            Py_DECREF(item);
         }
-        break;
-
-    case 'f':
-        if (type == &PyFloat_Type) {
-            double value = PyFloat_AS_DOUBLE((PyFloatObject *)obj);
-            res = chutney_save_float(self, value);
+        if (PyString_Check(item)) {
+            if (PyString_AsStringAndSize(item, &key, &len) < 0)
+                goto finally;
+            steps[i].key = key;
+            steps[i].len = len;
+        } else if (PyInt_Check(item) || PyLong_Check(item)) {
+            steps[i].key = NULL;
+            if ((steps[i].index = PyInt_AsLong(item)) == -1 && 
+                    PyErr_Occurred())
+                goto finally;
+        } else {
+            PyErr_SetString(PyExc_TypeError, 
+                            "path items must be strings or integers");
             goto finally;
         }
-        break;
-
-    case 's':
-        if (type == &PyString_Type) {
-            const char *value;
-            int size = PyString_Size(obj);
-            if (size >= 0 && size <= INT_MAX) {
-                value = PyString_AS_STRING((PyStringObject *)obj);
-                res = chutney_save_string(self, value, size);
-            }
-            goto finally;
+    }
+    if (load_init(&state) < 0)
+        goto finally;
+    status = chutney_extract(&state, (const char *)view.buf, view.len,
+                             steps, (int)depth);
+    if (status == CHUTNEY_NOT_FOUND) {
+        if (dflt) {
+            Py_INCREF(dflt);
+            res = dflt;
+        } else if ((item = PyTuple_Pack(1, path)) != NULL) {
+            /* wrapped, so that KeyError.args is (path,) */
+            PyErr_SetObject(PyExc_KeyError, item);
+            Py_DECREF(item);
         }
-        break;
+    } else
+        res = load_finish(&state, status);
+    load_dealloc(&state);
 
-    case 'u':
-        if (type == &PyUnicode_Type) {
-            PyObject *value = NULL;
-            int size;
+finally:
+    free(steps);
+    Py_XDECREF(keys);
+    PyBuffer_Release(&view);
+    return res;
+}
 
-            if (!(value = PyUnicode_AsUTF8String(obj)))
-                goto unicode_finally;
-            if ((size = PyString_Size(value)) < 0 || size > INT_MAX)
-                goto unicode_finally;
-            res = chutney_save_utf8(self, PyString_AS_STRING(value), size);
-        unicode_finally:
-            Py_XDECREF(value);
+/*
+ * Check untrusted data without loading it, returning a dict of counts of
+ * what a load would make. /globals/, if given, is a sequence of (module,
+ * name) pairs, the only classes allowed.
+ */
+static PyObject *
+chutney_validate_data(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"data", "max_depth", "max_objects", 
+                             "max_payload", "max_string", "max_stack",
+                             "globals", NULL};
+    PyObject *obj, *globals = Py_None, *names = NULL, *res = NULL;
+    const char **allow = NULL;
+    chutney_limits limits;
+    chutney_report report;
+    enum chutney_status status;
+    Py_buffer view;
+    Py_ssize_t i, count;
+
+    memset(&limits, 0, sizeof(limits));
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|lKKKlO:validate", kwlist,
+                                     &obj, &limits.max_depth, 
+                                     &limits.max_objects, &limits.max_payload,
+                                     &limits.max_string, &limits.max_stack,
+                                     &globals))
+        return NULL;
+    if (get_read_buffer(obj, &view) < 0)
+        return NULL;
+    if (globals != Py_None) {
+        if (!(names = PySequence_Fast(globals, "globals must be a sequence")))
             goto finally;
-        }
-        break;
-
-    case 't':
-        if (type == &PyTuple_Type) {
-            int i, len = PyTuple_Size(obj);
-            if (len < 0)
-                goto finally;
-            if (chutney_save_mark(self) < 0)
-                goto finally;
-            for (i = 0; i < len; i++) {
-                PyObject *element = PyTuple_GET_ITEM(obj, i);
-                if (!element)
-                    goto finally;
-                if (save(self, element) < 0)
-                    goto finally;
-                
-            }
-            res = chutney_save_tuple(self);
+        count = PySequence_Fast_GET_SIZE(names);
+        if (!(allow = PyMem_New(const char *, count * 2 + 1))) {
+            PyErr_NoMemory();
             goto finally;
         }
-        break;
-
-    case 'l':
-        if (type == &PyList_Type) {
-            int i, len = PyList_Size(obj);
-            if (len < 0)
-                goto finally;
-            if (chutney_save_mark(self) < 0)
+        for (i = 0; i < count; ++i) {
+            obj = PySequence_Fast_GET_ITEM(names, i);
+            if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) != 2 ||
+                    !PyString_Check(PyTuple_GET_ITEM(obj, 0)) ||
+                    !PyString_Check(PyTuple_GET_ITEM(obj, 1))) {
+                PyErr_SetString(PyExc_TypeError, 
+                                "globals must be (module, name) pairs");
                 goto finally;
-            for (i = 0; i < len; i++) {
-                PyObject *element = PyList_GET_ITEM(obj, i);
-                if (!element)
-                    goto finally;
-                if (save(self, element) < 0)
-                    goto finally;
-                
             }
-            res = chutney_save_tuple(self);
-            goto finally;
+            allow[i * 2] = PyString_AS_STRING(PyTuple_GET_ITEM(obj, 0));
+            allow[i * 2 + 1] = PyString_AS_STRING(PyTuple_GET_ITEM(obj, 1));
         }
+        allow[count * 2] = NULL;
+        limits.globals = allow;
+    }
+    limits.registry = &registry;
+
+    status = chutney_validate((const char *)view.buf, view.len, &limits,
+                              &report);
+    switch (status) {
+    case CHUTNEY_OKAY:
+        res = Py_BuildValue("{s:n,s:K,s:K,s:K,s:K,s:K,s:l,s:l}",
+                            "length", (Py_ssize_t)report.length,
+                            "objects", report.objects,
+                            "strings", report.strings,
+                            "containers", report.containers,
+                            "instances", report.instances,
+                            "payload", report.payload,
+                            "depth", report.max_depth,
+                            "stack", report.max_stack);
+        break;
+    case CHUTNEY_CONTINUE:
+        PyErr_SetNone(PyExc_EOFError);
+        break;
+    case CHUTNEY_NOMEM:
+        PyErr_NoMemory();
+        break;
+    case CHUTNEY_LIMIT_ERR:
+        PyErr_SetString(UnpicklingError, "over a limit, or class not allowed");
         break;
+    default:
+        PyErr_SetString(UnpicklingError, "parse error");
+        break;
+    }
 
-    case 'd':
-        if (type == &PyDict_Type) {
-            PyObject *iter = NULL;
-            int n, fail = 0;
+finally:
+    PyMem_Free(allow);
+    Py_XDECREF(names);
+    PyBuffer_Release(&view);
+    return res;
+}
 
-            if (chutney_save_empty_dict(self) < 0)
-                goto finally;
-            iter = PyObject_CallMethod(obj, "iteritems", "()");
-            if (iter == NULL)
-		goto finally;
-            do {
-                PyObject *kv;
-                for (n = 0; n < CHUTNEY_BATCHSIZE; ++n) {
-                    if (!(kv = PyIter_Next(iter))) {
-                        if (PyErr_Occurred())
-                            goto dict_finally;
-                        break;
-                    }
-                    if (n == 0)
-                        if (chutney_save_mark(self) < 0) 
+/* Names of the pull parser events, by chutney_event_type */
+static const char *event_names[] = {
+    "none", "bool", "int", "float", "string", "unicode", "mark", "tuple",
+    "dict", "setitems", "global", "obj", "build", "stop",
+};
+
+/* Tuple for a pull parser event: the name then the event's values */
+static PyObject *
+event_tuple(const chutney_event *event)
+{
+    const char *name = event_names[event->type];
+
+    switch (event->type) {
+    case CHUTNEY_EV_BOOL:
+    case CHUTNEY_EV_INT:
+    case CHUTNEY_EV_TUPLE:
+    case CHUTNEY_EV_SETITEMS:
+        return Py_BuildValue("(sl)", name, event->ival);
+    case CHUTNEY_EV_FLOAT:
+        return Py_BuildValue("(sd)", name, event->fval);
+    case CHUTNEY_EV_STRING:
+    case CHUTNEY_EV_UNICODE:
+        return Py_BuildValue("(sNLLi)", name, 
+                             PyString_FromStringAndSize(event->str, 
+                                                        event->len),
+                             event->offset, event->total, event->more);
+    case CHUTNEY_EV_GLOBAL:
+        return Py_BuildValue("(sNN)", name, 
+                             PyString_FromStringAndSize(event->str, 
+                                                        event->len),
+                             PyString_FromStringAndSize(event->name_str,
+                                                        event->name_len));
+    default:
+        return Py_BuildValue("(s)", name);
+    }
+}
+
+/*
+ * Run the pull parser over a string or buffer (or list of them, fed to
+ * it in turn), returning its events as a list of tuples.
+ */
+static PyObject *
+chutney_read_events(PyObject *self, PyObject *args)
+{
+    PyObject *obj, *seq, *events = NULL, *item;
+    chutney_reader reader;
+    chutney_event event;
+    enum chutney_status status;
+    Py_buffer view;
+    Py_ssize_t i, count;
+    const char *data;
+    size_t len;
+
+    if (!PyArg_ParseTuple(args, "O:read_events", &obj))
+        return NULL;
+    if (PyList_Check(obj) || PyTuple_Check(obj)) {
+        Py_INCREF(obj);
+        seq = obj;
+    } else if (!(seq = PyTuple_Pack(1, obj)))
+        return NULL;
+    if (!(events = PyList_New(0)))
+        goto error;
+
+    chutney_reader_init(&reader);
+    reader.registry = &registry;
+    count = PySequence_Fast_GET_SIZE(seq);
+    for (i = 0; i < count; ++i) {
+        if (get_read_buffer(PySequence_Fast_GET_ITEM(seq, i), &view) < 0)
+            goto error;
+        data = (const char *)view.buf;
+        len = view.len;
+        while ((status = chutney_reader_next(&reader, &data, &len, 
+                                             &event)) == CHUTNEY_OKAY) {
+            /* event strings may point into the buffer - copy them now */
+            if (!(item = event_tuple(&event)) || 
+                    PyList_Append(events, item) < 0) {
+                Py_XDECREF(item);
+                PyBuffer_Release(&view);
+                goto error;
+            }
+            Py_DECREF(item);
+        }
+        PyBuffer_Release(&view);
+        if (status != CHUTNEY_CONTINUE) {
+            PyErr_SetString(UnpicklingError, "parse error");
+            goto error;
+        }
+    }
+    if (reader.state != CHUTNEY_R_OPCODE) {
+        PyErr_SetNone(PyExc_EOFError);
+        goto error;
+    }
+    Py_DECREF(seq);
+    return events;
+
+error:
+    Py_XDECREF(events);
+    Py_DECREF(seq);
+    return NULL;
+}
+
+/*
+ * Load from a file, which is memory mapped and parsed in place - unlike
+ * reading it into a string first, the file is never copied in memory.
+ */
+static PyObject *
+chutney_load_path(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"path", "framed", NULL};
+    PyObject *obj;
+    chutney_mapping map;
+    chutney_load_state state;
+    chutney_frame_reader reader;
+    enum chutney_status status;
+    char *path;
+    int framed = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|i:load_path", kwlist,
+                                     &path, &framed))
+        return NULL;
+    if (chutney_map_file(&map, path) < 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    if (load_init(&state) < 0) {
+        chutney_unmap_file(&map);
+        return NULL;
+    }
+    if (framed) {
+        chutney_frame_reader_init(&reader);
+        status = chutney_load_mapping(&state, &reader, &map);
+        chutney_frame_reader_dealloc(&reader);
+    } else
+        status = chutney_load_mapping(&state, NULL, &map);
+    obj = load_finish(&state, status);
+    load_dealloc(&state);
+    chutney_unmap_file(&map);
+    return obj;
+}
+
+/*
+ * A string being written by dumps. It is grown geometrically, so large
+ * chutneys are built in linear time, and trimmed to length when complete
+ * rather than copied.
+ */
+typedef struct {
+    PyObject *str;
+    Py_ssize_t len;
+} string_output;
+
+static int
+string_write(void *context, const char *s, size_t n)
+{
+    string_output *out = (string_output *)context;
+    Py_ssize_t size;
+
+    if (!s)
+        return 0;
+    size = PyString_GET_SIZE(out->str);
+    if (n > (size_t)(PY_SSIZE_T_MAX - out->len)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (out->len + (Py_ssize_t)n > size) {
+        while (size < out->len + (Py_ssize_t)n)
+            size = size > PY_SSIZE_T_MAX / 2 ? PY_SSIZE_T_MAX : size * 2;
+        if (_PyString_Resize(&out->str, size) < 0)
+            return -1;
+    }
+    memcpy(PyString_AS_STRING(out->str) + out->len, s, n);
+    out->len += n;
+    return 0;
+}
+
+static void
+pickler_init(pickler_state *pickler)
+{
+    pickler->class_count = 0;
+    memset(pickler->classes, 0, sizeof(pickler->classes));
+    pickler->refs = NULL;
+    pickler->columnar = 0;
+    pickler->keys = NULL;
+    pickler->key_hits = pickler->key_misses = 0;
+}
+
+static void
+class_entry_clear(class_entry *entry)
+{
+    Py_CLEAR(entry->module);
+    Py_CLEAR(entry->name);
+    free(entry->header);
+    entry->header = NULL;
+}
+
+static void
+pickler_dealloc(pickler_state *pickler)
+{
+    int i;
+
+    chutney_dump_dealloc(&pickler->dump);
+    for (i = 0; i < CLASS_CACHE_SIZE; ++i) {
+        class_entry_clear(&pickler->classes[i]);
+        Py_CLEAR(pickler->classes[i].class);
+    }
+    pickler->class_count = 0;
+    Py_CLEAR(pickler->refs);
+    if (pickler->keys) {
+        for (i = 0; i < KEY_CACHE_SIZE; ++i)
+            Py_XDECREF(pickler->keys[i].key);
+        free(pickler->keys);
+        pickler->keys = NULL;
+    }
+}
+
+/*
+ * A string payload of /size/ bytes from /owner/ is about to be saved - if
+ * the library will reference it rather than copy it, keep the owner so
+ * the output can refer to it.
+ */
+static int
+keep_payload(chutney_dump_state *self, PyObject *owner, Py_ssize_t size)
+{
+    pickler_state *pickler = (pickler_state *)self;
+
+    if (!self->iov_threshold || (size_t)size < self->iov_threshold)
+        return 0;
+    return PyList_Append(pickler->refs, owner);
+}
+
+/*
+ * Check a string of /size/ bytes has a length field at the protocol being
+ * generated - BINSTRING's is signed, and 4GB or more needs protocol 4.
+ */
+static int
+check_payload(chutney_dump_state *self, Py_ssize_t size, int unicode)
+{
+    unsigned long long max = 0x7fffffffUL;
+
+    if (self->protocol >= 4)
+        return 0;
+    if (self->protocol >= 3 || unicode)
+        max = 0xffffffffUL;
+    if ((unsigned long long)size <= max)
+        return 0;
+    PyErr_Format(PyExc_OverflowError, 
+                 "%s of %zd bytes is too large for protocol %d",
+                 unicode ? "unicode" : "string", size, self->protocol);
+    return -1;
+}
+
+/*
+ * The class of /obj/, if its __class__ and __dict__ attributes can be
+ * fetched directly: classic instances, and new-style instances that use the
+ * generic attribute lookup. Returns a borrowed reference, or NULL.
+ */
+static PyObject *
+direct_class(PyObject *obj)
+{
+    if (PyInstance_Check(obj)) {
+        PyClassObject *class = ((PyInstanceObject *)obj)->in_class;
+        return class->cl_getattr ? NULL : (PyObject *)class;
+    }
+    if (obj->ob_type->tp_getattro == PyObject_GenericGetAttr)
+        return (PyObject *)obj->ob_type;
+    return NULL;
+}
+
+/*
+ * Find the objects a class's __module__ and __name__ attributes come from
+ * (borrowed), returning 0 if the class is not one whose header can be
+ * cached.
+ */
+static int
+class_names(PyObject *class, PyObject **module, PyObject **name)
+{
+    if (PyClass_Check(class)) {
+        *name = ((PyClassObject *)class)->cl_name;
+        *module = PyDict_GetItem(((PyClassObject *)class)->cl_dict, 
+                                 module_str);
+    } else if (PyType_Check(class) && 
+               PyType_HasFeature((PyTypeObject *)class, Py_TPFLAGS_HEAPTYPE)) {
+        *name = ((PyHeapTypeObject *)class)->ht_name;
+        *module = PyDict_GetItem(((PyTypeObject *)class)->tp_dict, 
+                                 module_str);
+    } else
+        return 0;
+    return *module && *name && PyString_Check(*module) && PyString_Check(*name);
+}
+
+static class_entry *
+class_cache_slot(pickler_state *pickler, PyObject *class)
+{
+    size_t i = ((size_t)class >> 4) & (CLASS_CACHE_SIZE - 1);
+
+    while (pickler->classes[i].class && pickler->classes[i].class != class)
+        i = (i + 1) & (CLASS_CACHE_SIZE - 1);
+    return &pickler->classes[i];
+}
+
+/* The cached header for /class/, or NULL if it is absent or stale */
+static class_entry *
+class_cache_lookup(pickler_state *pickler, PyObject *class)
+{
+    class_entry *entry;
+    PyObject *module, *name;
+
+    entry = class_cache_slot(pickler, class);
+    if (entry->class == NULL || entry->header == NULL)
+        return NULL;
+    if (!class_names(class, &module, &name) || 
+            module != entry->module || name != entry->name) {
+        class_entry_clear(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+/* 
+ * Remember the header for a class that has passed save_inst's checks. 
+ * A full cache, or a class we can't track, just isn't cached.
+ */
+static int
+class_cache_insert(pickler_state *pickler, PyObject *class)
+{
+    class_entry *entry;
+    PyObject *module, *name;
+    char *header;
+    int len;
+
+    if (!class_names(class, &module, &name))
+        return 0;
+    entry = class_cache_slot(pickler, class);
+    if (entry->class == NULL) {
+        /* keep a free slot so probing always terminates */
+        if (pickler->class_count >= CLASS_CACHE_SIZE - 1)
+            return 0;
+        Py_INCREF(class);
+        entry->class = class;
+        pickler->class_count++;
+    }
+    class_entry_clear(entry);
+    len = chutney_encode_inst_header(&pickler->dump, 
+                                     PyString_AS_STRING(module),
+                                     PyString_AS_STRING(name), NULL, 0);
+    if ((header = malloc(len)) == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    chutney_encode_inst_header(&pickler->dump, PyString_AS_STRING(module),
+                               PyString_AS_STRING(name), header, len);
+    Py_INCREF(module);
+    Py_INCREF(name);
+    entry->module = module;
+    entry->name = name;
+    entry->header = header;
+    entry->header_len = len;
+    return 0;
+}
+
+/* The __dict__ of an instance of a direct_class, if it exists (borrowed) */
+static PyObject *
+direct_dict(PyObject *obj)
+{
+    PyObject **dictptr;
+
+    if (PyInstance_Check(obj))
+        return ((PyInstanceObject *)obj)->in_dict;
+    if ((dictptr = _PyObject_GetDictPtr(obj)) != NULL)
+        return *dictptr;
+    return NULL;
+}
+
+/* Save an instance whose class header is cached */
+static int
+save_cached_inst(chutney_dump_state *self, PyObject *obj, class_entry *entry)
+{
+    PyObject *instance_dict;
+    int res = -1;
+
+    if ((instance_dict = direct_dict(obj)) != NULL) 
+        Py_INCREF(instance_dict);
+    /* created on demand */
+    else if ((instance_dict = PyObject_GetAttrString(obj, "__dict__")) == NULL)
+        return -1;
+
+    if (PyDict_Check(instance_dict) &&
+            PyDict_GetItem(instance_dict, getstate_str) != NULL) {
+        PyErr_Format(UnpickleableError, "__getstate__ method on %.200s.%.200s "
+                     "not supported by chutney", 
+                     PyString_AS_STRING(entry->module),
+                     PyString_AS_STRING(entry->name));
+        goto finally;
+    }
+    if (chutney_save_inst_header(self, entry->header, entry->header_len) < 0)
+        goto finally;
+    if (save(self, instance_dict) < 0)
+        goto finally;
+    if (chutney_save_build(self) < 0)
+        goto finally;
+    res = 0;
+finally:
+    Py_DECREF(instance_dict);
+    return res;
+}
+
+static int
+save_inst(chutney_dump_state *self, PyObject *obj)
+{
+    pickler_state *pickler = (pickler_state *)self;
+    PyObject *class = NULL;
+    PyObject *instance_dict = NULL;
+    PyObject *global_name = NULL;
+    PyObject *module_name = NULL;
+    PyObject *direct;
+    class_entry *entry;
+    char *name_str, *module_str;
+    int res = -1;
+
+    if ((direct = direct_class(obj)) != NULL &&
+            (entry = class_cache_lookup(pickler, direct)) != NULL)
+        return save_cached_inst(self, obj, entry);
+
+    if ((class = PyObject_GetAttrString(obj, "__class__")) == NULL)
+        goto finally;
+    if (obj->ob_type->ob_size != 0) {
+        PyErr_SetObject(UnpickleableError, obj);
+        goto finally;
+    }
+    if ((instance_dict = PyObject_GetAttrString(obj, "__dict__")) == NULL) {
+        PyErr_SetObject(UnpickleableError, obj);
+        goto finally;
+    }
+    if ((global_name = PyObject_GetAttrString(class, "__name__")) == NULL)
+        goto finally;
+    if ((name_str = PyString_AsString(global_name)) == NULL)
+        goto finally;
+    if ((module_name = PyObject_GetAttrString(class, "__module__")) == NULL)
+        goto finally;
+    if ((module_str = PyString_AsString(module_name)) == NULL)
+        goto finally;
+    if (PyObject_HasAttrString(obj, "__getstate__")) {
+        PyErr_Format(UnpickleableError, "__getstate__ method on %.200s.%.200s "
+                     "not supported by chutney", module_str, name_str);
+        goto finally;
+    }
+    if (direct == class && class_cache_insert(pickler, class) < 0)
+        goto finally;
+    if (chutney_save_mark(self) < 0)
+        goto finally;
+    if (chutney_save_global(self, module_str, name_str) < 0)
+        goto finally;
+    if (chutney_save_obj(self) < 0)
+        goto finally;
+    if (save(self, instance_dict) < 0)
+        goto finally;
+    if (chutney_save_build(self) < 0)
+        goto finally;
+    res = 0;
+finally:
+    Py_XDECREF(module_name);
+    Py_XDECREF(global_name);
+    Py_XDECREF(instance_dict);
+    Py_XDECREF(class);
+    return res;
+}
+
+/* Save a dict key, through the key cache if it is an interned string */
+static int
+save_key(chutney_dump_state *self, PyObject *key)
+{
+    pickler_state *pickler = (pickler_state *)self;
+    key_entry *entry;
+    int len;
+
+    if (key->ob_type != &PyString_Type || !PyString_CHECK_INTERNED(key) ||
+            PyString_GET_SIZE(key) > KEY_CACHE_MAXLEN || 
+            pickler->key_misses < 0)
+        return save(self, key);
+    if (pickler->keys == NULL &&
+            (pickler->keys = calloc(KEY_CACHE_SIZE, sizeof(key_entry))) 
+            == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    entry = &pickler->keys[((size_t)key >> 4) & (KEY_CACHE_SIZE - 1)];
+    if (entry->key == key) {
+        pickler->key_hits++;
+        return chutney_save_encoded(self, entry->encoded, entry->len);
+    }
+    if (++pickler->key_misses > KEY_CACHE_GIVEUP && 
+            pickler->key_misses > pickler->key_hits)
+        pickler->key_misses = -1;
+    len = chutney_encode_string(self, PyString_AS_STRING(key), 
+                                PyString_GET_SIZE(key), entry->encoded, 
+                                sizeof(entry->encoded));
+    if (len < 0 || len > (int)sizeof(entry->encoded)) {
+        Py_CLEAR(entry->key);
+        return save(self, key);
+    }
+    Py_INCREF(key);
+    Py_XDECREF(entry->key);
+    entry->key = key;
+    entry->len = len;
+    return chutney_save_encoded(self, entry->encoded, len);
+}
+
+/*
+ * Save one column of a save_columns sequence: packed if every value is an
+ * int that fits in 32 bits, or a float, else value by value.
+ */
+static int
+save_column(chutney_dump_state *self, PyObject *values)
+{
+    Py_ssize_t i, n = PyTuple_GET_SIZE(values);
+    PyObject *value;
+    int ints = 1, floats = 1, res;
+    long l;
+    void *column;
+
+    for (i = 0; i < n && (ints || floats); ++i) {
+        value = PyTuple_GET_ITEM(values, i);
+        if (value->ob_type != &PyInt_Type)
+            ints = 0;
+        else {
+            l = PyInt_AS_LONG(value);
+            if (l < INT_MIN || l > INT_MAX)
+                ints = 0;
+        }
+        if (value->ob_type != &PyFloat_Type)
+            floats = 0;
+    }
+    if (!ints && !floats) {
+        for (i = 0; i < n; ++i)
+            if (save(self, PyTuple_GET_ITEM(values, i)) < 0)
+                return -1;
+        return 0;
+    }
+    if ((column = malloc(n * (ints ? sizeof(int) : sizeof(double)) + 1)) 
+            == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        value = PyTuple_GET_ITEM(values, i);
+        if (ints)
+            ((int *)column)[i] = (int)PyInt_AS_LONG(value);
+        else
+            ((double *)column)[i] = PyFloat_AS_DOUBLE(value);
+    }
+    if (ints)
+        res = chutney_save_ints(self, (int *)column, n);
+    else
+        res = chutney_save_floats(self, (double *)column, n);
+    free(column);
+    return res;
+}
+
+/*
+ * With the "columnar" option, a list or tuple of instances of one class,
+ * all with the same attributes, is saved as the class and attribute names
+ * once, then a column of values for each attribute (see
+ * chutney_save_columns). It loads as a tuple, as any sequence does.
+ * Returns 1, having saved nothing, if /seq/ doesn't qualify - it is then
+ * saved as usual, which also reports anything save_inst refuses.
+ */
+static int
+save_columns(chutney_dump_state *self, PyObject *seq)
+{
+    PyObject *items, *dicts = NULL, *keys = NULL, *column = NULL;
+    PyObject *first, *class, *module, *name, *dict, *value;
+    Py_ssize_t i, j, n, nkeys;
+    int res = -1;
+
+    /* a quick look at the first item, before copying the sequence */
+    if (PySequence_Fast_GET_SIZE(seq) < 2 ||
+            (class = direct_class(PySequence_Fast_GET_ITEM(seq, 0))) == NULL ||
+            !class_names(class, &module, &name))
+        return 1;
+    if ((items = PySequence_Tuple(seq)) == NULL)
+        return -1;
+    n = PyTuple_GET_SIZE(items);
+    first = PyTuple_GET_ITEM(items, 0);
+    res = 1;
+    if (n > CHUTNEY_COLUMNS_MAX || first->ob_type->ob_size != 0 ||
+            PyObject_HasAttrString(first, "__getstate__"))
+        goto finally;
+    res = -1;
+    if ((dicts = PyTuple_New(n)) == NULL)
+        goto finally;
+    for (i = 0; i < n; ++i) {
+        if (direct_class(PyTuple_GET_ITEM(items, i)) != class ||
+                (dict = direct_dict(PyTuple_GET_ITEM(items, i))) == NULL ||
+                !PyDict_CheckExact(dict) ||
+                PyDict_GetItem(dict, getstate_str) != NULL) {
+            res = 1;
+            goto finally;
+        }
+        Py_INCREF(dict);
+        PyTuple_SET_ITEM(dicts, i, dict);
+    }
+    /* every instance has the first's attributes, and no others */
+    if ((keys = PyDict_Keys(PyTuple_GET_ITEM(dicts, 0))) == NULL ||
+            PyList_Sort(keys) < 0)
+        goto finally;
+    nkeys = PyList_GET_SIZE(keys);
+    res = 1;
+    if (nkeys == 0 || nkeys > CHUTNEY_COLUMNS_MAX)
+        goto finally;
+    for (i = 1; i < n; ++i) {
+        dict = PyTuple_GET_ITEM(dicts, i);
+        if (PyDict_Size(dict) != nkeys)
+            goto finally;
+        for (j = 0; j < nkeys; ++j)
+            if (!PyDict_GetItem(dict, PyList_GET_ITEM(keys, j)))
+                goto finally;
+    }
+    res = -1;
+    if (chutney_save_mark(self) < 0 ||
+            chutney_save_global(self, PyString_AS_STRING(module), 
+                                PyString_AS_STRING(name)) < 0)
+        goto finally;
+    for (j = 0; j < nkeys; ++j)
+        if (save_key(self, PyList_GET_ITEM(keys, j)) < 0)
+            goto finally;
+    for (j = 0; j < nkeys; ++j) {
+        /* saving may run code that changes the instances */
+        if ((column = PyTuple_New(n)) == NULL)
+            goto finally;
+        for (i = 0; i < n; ++i) {
+            value = PyDict_GetItem(PyTuple_GET_ITEM(dicts, i), 
+                                   PyList_GET_ITEM(keys, j));
+            if (value == NULL) {
+                PyErr_SetString(PyExc_RuntimeError, 
+                                "instance attributes changed during dump");
+                goto finally;
+            }
+            Py_INCREF(value);
+            PyTuple_SET_ITEM(column, i, value);
+        }
+        if (save_column(self, column) < 0)
+            goto finally;
+        Py_CLEAR(column);
+    }
+    res = chutney_save_columns(self, nkeys, n);
+finally:
+    Py_XDECREF(column);
+    Py_XDECREF(keys);
+    Py_XDECREF(dicts);
+    Py_DECREF(items);
+    return res;
+}
+
+static int
+save(chutney_dump_state *self, PyObject *obj)
+{
+    PyTypeObject *type;
+    int res = -1;
+
+    if (self->depth++ > Py_GetRecursionLimit()){
+        PyErr_SetString(PyExc_RuntimeError, "maximum recursion depth exceeded");
+            goto finally;
+    }
+    if (obj == Py_None) {
+        res = chutney_save_null(self);
+        goto finally;
+    }
+    type = obj->ob_type;
+    switch (type->tp_name[0]) {
+    case 'b':
+        if (obj == Py_False || obj == Py_True) {
+            res = chutney_save_bool(self, obj == Py_True);
+            goto finally;
+        }
+        break;
+
+    case 'i':
+        if (type == &PyInt_Type) {
+            long value = PyInt_AS_LONG((PyIntObject *)obj);
+            res = chutney_save_int(self, value);
+            goto finally;
+        } else if (type == &PyInstance_Type) {
+            res = save_inst(self, obj);
+            goto finally;
+        }
+        break;
+
+    case 'f':
+        if (type == &PyFloat_Type) {
+            double value = PyFloat_AS_DOUBLE((PyFloatObject *)obj);
+            res = chutney_save_float(self, value);
+            goto finally;
+        }
+        break;
+
+    case 's':
+        if (type == &PyString_Type) {
+            const char *value;
+            Py_ssize_t size = PyString_GET_SIZE(obj);
+            if (check_payload(self, size, 0) == 0) {
+                value = PyString_AS_STRING((PyStringObject *)obj);
+                if (keep_payload(self, obj, size) == 0)
+                    res = chutney_save_string(self, value, size);
+            }
+            goto finally;
+        }
+        break;
+
+    case 'u':
+        if (type == &PyUnicode_Type) {
+            PyObject *value = NULL;
+            Py_ssize_t size;
+
+            if (!(value = PyUnicode_AsUTF8String(obj)))
+                goto unicode_finally;
+            size = PyString_GET_SIZE(value);
+            if (check_payload(self, size, 1) < 0)
+                goto unicode_finally;
+            if (keep_payload(self, value, size) == 0)
+                res = chutney_save_utf8(self, PyString_AS_STRING(value), 
+                                        size);
+        unicode_finally:
+            Py_XDECREF(value);
+            goto finally;
+        }
+        break;
+
+    case 't':
+        if (type == &PyTuple_Type) {
+            Py_ssize_t i, len = PyTuple_Size(obj);
+            if (len < 0)
+                goto finally;
+            if (((pickler_state *)self)->columnar) {
+                if ((res = save_columns(self, obj)) <= 0)
+                    goto finally;
+                res = -1;
+            }
+            if (chutney_save_mark(self) < 0)
+                goto finally;
+            for (i = 0; i < len; i++) {
+                PyObject *element = PyTuple_GET_ITEM(obj, i);
+                if (!element)
+                    goto finally;
+                if (save(self, element) < 0)
+                    goto finally;
+                
+            }
+            res = chutney_save_tuple(self);
+            goto finally;
+        }
+        break;
+
+    case 'l':
+        if (type == &PyList_Type) {
+            Py_ssize_t i, len = PyList_Size(obj);
+            if (len < 0)
+                goto finally;
+            if (((pickler_state *)self)->columnar) {
+                if ((res = save_columns(self, obj)) <= 0)
+                    goto finally;
+                res = -1;
+            }
+            if (chutney_save_mark(self) < 0)
+                goto finally;
+            /* the GIL may be released while writing (see channel_write),
+             * so the list can change under us */
+            for (i = 0; i < len && i < PyList_GET_SIZE(obj); i++) {
+                PyObject *element = PyList_GET_ITEM(obj, i);
+                int fail;
+                Py_INCREF(element);
+                fail = save(self, element) < 0;
+                Py_DECREF(element);
+                if (fail)
+                    goto finally;
+            }
+            res = chutney_save_tuple(self);
+            goto finally;
+        }
+        break;
+
+    case 'd':
+        if (type == &PyDict_Type) {
+            PyObject *iter = NULL;
+            int n, fail = 0;
+
+            if (chutney_save_empty_dict(self) < 0)
+                goto finally;
+            if (self->canonical) {
+                /* items in key order, so equal dicts give equal output */
+                PyObject *items = PyDict_Items(obj);
+                if (items == NULL)
+                    goto finally;
+                if (PyList_Sort(items) == 0)
+                    iter = PyObject_GetIter(items);
+                Py_DECREF(items);
+            } else
+                iter = PyObject_CallMethod(obj, "iteritems", "()");
+            if (iter == NULL)
+		goto finally;
+            do {
+                PyObject *kv;
+                for (n = 0; n < CHUTNEY_BATCHSIZE; ++n) {
+                    if (!(kv = PyIter_Next(iter))) {
+                        if (PyErr_Occurred())
+                            goto dict_finally;
+                        break;
+                    }
+                    if (n == 0)
+                        if (chutney_save_mark(self) < 0) 
                             fail = 1;
-                    if (!fail && save(self, PyTuple_GET_ITEM(kv, 0)) < 0)
+                    if (!fail && save_key(self, PyTuple_GET_ITEM(kv, 0)) < 0)
                         fail = 1;
                     if (!fail && save(self, PyTuple_GET_ITEM(kv, 1)) < 0)
                         fail = 1;
@@ -440,68 +1457,1763 @@ save(chutney_dump_state *self, PyObject *obj)
             } while (n == CHUTNEY_BATCHSIZE);
             res = 0;
 
-        dict_finally:
-            Py_XDECREF(iter);
-            goto finally;
-        }
-        break;
+        dict_finally:
+            Py_XDECREF(iter);
+            goto finally;
+        }
+        break;
+
+    }
+    /* Object not handled in switch: either a new-style instance, or a type we
+     * can't handle */
+    res = save_inst(self, obj);
+
+finally:
+    self->depth--;
+    return res;
+}    
+
+static int
+dump(chutney_dump_state *self, PyObject *obj)
+{
+    if (save(self, obj) < 0)
+        return -1;
+
+    if (chutney_save_stop(self) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * dumps(threads=N) - the object is copied into a tree of tree_nodes while
+ * the GIL is held (lists and dicts as snapshots of their items, unicode
+ * as its UTF-8 encoding), which chutney_dump_tree's threads then walk and
+ * save without touching the Python API. Values of other types fail the
+ * save that meets them, recording the first such value to be raised.
+ */
+typedef struct tree_node {
+    PyObject *obj;              // value, or the container
+    enum chutney_tree_kind kind;
+    int unicode;                // obj is the UTF-8 encoding of a unicode
+    long count;
+    struct tree_node *items;    // count items, or keys and values of a dict
+} tree_node;
+
+typedef struct {
+    PyObject *keep;             // references the tree relies on
+    PyObject *failed;           // first unsaveable value, set atomically
+} tree_context;
+
+static void
+tree_free(tree_node *node)
+{
+    long i, n = node->kind == CHUTNEY_TREE_DICT ? 2 * node->count 
+                                                : node->count;
+
+    if (node->items) {
+        for (i = 0; i < n; ++i)
+            tree_free(&node->items[i]);
+        free(node->items);
+    }
+}
+
+static int
+tree_build(chutney_dump_state *self, tree_context *context, tree_node *node,
+           PyObject *obj, int depth)
+{
+    PyObject *items = NULL, *item;
+    Py_ssize_t i;
+
+    node->obj = obj;
+    if (depth > Py_GetRecursionLimit()) {
+        PyErr_SetString(PyExc_RuntimeError, 
+                        "maximum recursion depth exceeded");
+        return -1;
+    }
+    if (PyUnicode_CheckExact(obj)) {
+        if (!(items = PyUnicode_AsUTF8String(obj)) ||
+                PyList_Append(context->keep, items) < 0) {
+            Py_XDECREF(items);
+            return -1;
+        }
+        Py_DECREF(items);
+        node->obj = items;
+        node->unicode = 1;
+        return check_payload(self, PyString_GET_SIZE(items), 1);
+    }
+    if (PyString_CheckExact(obj))
+        return check_payload(self, PyString_GET_SIZE(obj), 0);
+    if (PyTuple_CheckExact(obj)) {
+        node->kind = CHUTNEY_TREE_TUPLE;
+        Py_INCREF(obj);
+        items = obj;
+    } else if (PyList_CheckExact(obj)) {
+        node->kind = CHUTNEY_TREE_TUPLE;
+        items = PyList_AsTuple(obj);
+    } else if (PyDict_CheckExact(obj)) {
+        node->kind = CHUTNEY_TREE_DICT;
+        /* in the order save would use */
+        if ((items = PyDict_Items(obj)) && self->canonical &&
+                PyList_Sort(items) < 0)
+            Py_CLEAR(items);
+    } else
+        return 0;
+    if (!items || PyList_Append(context->keep, items) < 0)
+        goto error;
+
+    node->count = PySequence_Fast_GET_SIZE(items);
+    if (node->count && !(node->items = calloc(
+            node->kind == CHUTNEY_TREE_DICT ? 2 * node->count : node->count,
+            sizeof(tree_node)))) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i = 0; i < node->count; ++i) {
+        item = PySequence_Fast_GET_ITEM(items, i);
+        if (node->kind == CHUTNEY_TREE_TUPLE) {
+            if (tree_build(self, context, &node->items[i], item, 
+                           depth + 1) < 0)
+                goto error;
+        } else if (tree_build(self, context, &node->items[2 * i], 
+                              PyTuple_GET_ITEM(item, 0), depth + 1) < 0 ||
+                   tree_build(self, context, &node->items[2 * i + 1], 
+                              PyTuple_GET_ITEM(item, 1), depth + 1) < 0)
+            goto error;
+    }
+    Py_DECREF(items);
+    return 0;
+
+error:
+    Py_XDECREF(items);
+    return -1;
+}
+
+static enum chutney_tree_kind
+tree_kind(void *context, const void *node, long *count)
+{
+    *count = ((const tree_node *)node)->count;
+    return ((const tree_node *)node)->kind;
+}
+
+static const void *
+tree_child(void *context, const void *node, long i)
+{
+    return &((const tree_node *)node)->items[i];
+}
+
+static int
+tree_save(chutney_dump_state *self, void *arg, const void *node)
+{
+    tree_context *context = (tree_context *)arg;
+    PyObject *obj = ((const tree_node *)node)->obj;
+
+    if (((const tree_node *)node)->unicode)
+        return chutney_save_utf8(self, PyString_AS_STRING(obj), 
+                                 PyString_GET_SIZE(obj));
+    if (obj == Py_None)
+        return chutney_save_null(self);
+    if (obj == Py_False || obj == Py_True)
+        return chutney_save_bool(self, obj == Py_True);
+    if (PyInt_CheckExact(obj))
+        return chutney_save_int(self, PyInt_AS_LONG(obj));
+    if (PyFloat_CheckExact(obj))
+        return chutney_save_float(self, PyFloat_AS_DOUBLE(obj));
+    if (PyString_CheckExact(obj))
+        return chutney_save_string(self, PyString_AS_STRING(obj),
+                                   PyString_GET_SIZE(obj));
+    __sync_bool_compare_and_swap(&context->failed, NULL, obj);
+    return -1;
+}
+
+/* As dump, encoding on up to /threads/ threads with chutney_dump_tree */
+static int
+dump_threads(chutney_dump_state *self, PyObject *obj, int threads)
+{
+    tree_context context;
+    chutney_tree tree;
+    tree_node root;
+    int res = -1;
+
+    context.failed = NULL;
+    if (!(context.keep = PyList_New(0)))
+        return -1;
+    tree.kind = tree_kind;
+    tree.child = tree_child;
+    tree.save = tree_save;
+    tree.context = &context;
+    memset(&root, 0, sizeof(root));
+
+    if (tree_build(self, &context, &root, obj, self->depth) < 0)
+        goto finally;
+    if (chutney_dump_tree(self, &tree, &root, threads) < 0 ||
+            chutney_save_stop(self) < 0) {
+        if (context.failed)
+            PyErr_SetObject(UnpickleableError, context.failed);
+        else if (!PyErr_Occurred())
+            PyErr_NoMemory();
+        goto finally;
+    }
+    res = 0;
+
+finally:
+    tree_free(&root);
+    Py_DECREF(context.keep);
+    return res;
+}
+
+static int
+set_protocol(chutney_dump_state *pickler, int protocol)
+{
+    if (protocol && chutney_dump_set_protocol(pickler, protocol) < 0) {
+        PyErr_Format(PyExc_ValueError, "unsupported protocol %d", protocol);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Return a chutney of /obj/ as a string, optionally a framed container,
+ * and optionally hashing the (uncompressed) chutney into /hash/.
+ * /canonical/ sorts dict items, /columnar/ enables save_columns, and
+ * /threads/, if not zero, encodes with dump_threads.
+ */
+static PyObject *
+dumps(PyObject *obj, int framed, int protocol, int canonical, int columnar,
+      int threads, chutney_hash *hash)
+{
+    PyObject *res = NULL;
+    pickler_state pickler;
+    chutney_frame_writer writer;
+    string_output out;
+
+    out.len = 0;
+    if (!(out.str = PyString_FromStringAndSize(NULL, 128)))
+        goto finally;
+
+    if (framed && chutney_frame_writer_init(&writer, string_write, 
+                                            (void *)&out, 0) < 0) {
+        PyErr_NoMemory();
+        goto finally;
+    }
+
+    pickler_init(&pickler);
+    if (framed)
+        chutney_dump_init(&pickler.dump, chutney_frame_write, (void *)&writer);
+    else
+        chutney_dump_init(&pickler.dump, string_write, (void *)&out);
+    pickler.dump.stats = &dump_stats;
+    pickler.dump.registry = &registry;
+    pickler.dump.hash = hash;
+    pickler.dump.canonical = canonical;
+    pickler.columnar = columnar;
+
+    if (set_protocol(&pickler.dump, protocol) < 0)
+        goto dump_finally;
+
+    if ((threads ? dump_threads(&pickler.dump, obj, threads) 
+                 : dump(&pickler.dump, obj)) < 0)
+        goto dump_finally;
+
+    if (framed && chutney_frame_flush(&writer) < 0)
+        goto dump_finally;
+
+    if (_PyString_Resize(&out.str, out.len) < 0)
+        goto dump_finally;
+    res = out.str;
+    out.str = NULL;
+
+dump_finally:
+    pickler_dealloc(&pickler);
+    if (framed)
+        chutney_frame_writer_dealloc(&writer);
+
+finally:
+    Py_XDECREF(out.str);
+
+    return res;
+}
+
+static PyObject *
+chutney_dumps(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"obj", "framed", "protocol", "hash", 
+                             "canonical", "columnar", "threads", NULL};
+    PyObject *obj, *data;
+    chutney_hash hash;
+    int framed = 0, protocol = 0, want_hash = 0, canonical = 0, columnar = 0;
+    int threads = 0;
+
+    if (!(PyArg_ParseTupleAndKeywords(args, kwds, "O|iiiiii:dumps", kwlist,
+                                      &obj, &framed, &protocol, &want_hash,
+                                      &canonical, &columnar, &threads)))
+        return NULL;
+    if (threads < 0 || (threads && columnar)) {
+        PyErr_SetString(PyExc_ValueError, 
+                        "threads must not be negative, or columnar");
+        return NULL;
+    }
+
+    if (!want_hash)
+        return dumps(obj, framed, protocol, canonical, columnar, threads, 
+                     NULL);
+
+    chutney_hash_init(&hash, 0);
+    if (!(data = dumps(obj, framed, protocol, canonical, columnar, threads,
+                       &hash)))
+        return NULL;
+    return Py_BuildValue("NK", data, chutney_hash_digest(&hash));
+}
+
+static PyObject *
+chutney_dumps_into(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"obj", "buffer", "offset", "protocol", NULL};
+    PyObject *obj, *res = NULL;
+    Py_buffer view;
+    Py_ssize_t offset = 0;
+    pickler_state pickler;
+    size_t needed;
+    int protocol = 0;
+
+    if (!(PyArg_ParseTupleAndKeywords(args, kwds, "Ow*|ni:dumps_into", kwlist,
+                                      &obj, &view, &offset, &protocol)))
+        return NULL;
+
+    if (offset < 0 || offset > view.len) {
+        PyErr_SetString(PyExc_ValueError, "offset out of range");
+        goto finally;
+    }
+
+    pickler_init(&pickler);
+    chutney_dump_init_buffer(&pickler.dump, (char *)view.buf + offset, 
+                             view.len - offset);
+    pickler.dump.stats = &dump_stats;
+    pickler.dump.registry = &registry;
+
+    if (set_protocol(&pickler.dump, protocol) < 0 || 
+            dump(&pickler.dump, obj) < 0) {
+        pickler_dealloc(&pickler);
+        goto finally;
+    }
+
+    pickler_dealloc(&pickler);
+
+    needed = chutney_dump_buffer_len(&pickler.dump);
+    if (needed > (size_t)(view.len - offset)) {
+        PyErr_Format(PyExc_ValueError, 
+                     "chutney does not fit in buffer (%zu bytes needed)", 
+                     needed);
+        goto finally;
+    }
+    res = PyInt_FromSize_t(needed);
+
+finally:
+    PyBuffer_Release(&view);
+
+    return res;
+}
+
+/* Little-endian 32 bit field of a framed container block header */
+static unsigned int
+frame_le32(const char *s)
+{
+    const unsigned char *p = (const unsigned char *)s;
+
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/*
+ * Locate the blocks of a framed container from their headers, without
+ * decompressing them, so they can be skipped or decoded independently
+ * with frame_decode_into.
+ */
+static PyObject *
+chutney_frame_blocks(PyObject *self, PyObject *args)
+{
+    PyObject *obj, *res = NULL, *item;
+    Py_buffer view;
+    const char *data;
+    Py_ssize_t pos, len;
+
+    if (!PyArg_ParseTuple(args, "O:frame_blocks", &obj))
+        return NULL;
+    if (get_read_buffer(obj, &view) < 0)
+        return NULL;
+    data = (const char *)view.buf;
+    if (view.len < 4 || memcmp(data, CHUTNEY_FRAME_MAGIC, 4) != 0) {
+        PyErr_SetString(UnpicklingError, "not a framed container");
+        goto finally;
+    }
+    if (!(res = PyList_New(0)))
+        goto finally;
+    for (pos = 4; pos < view.len; pos += len) {
+        if (view.len - pos < CHUTNEY_FRAME_HEADER) {
+            PyErr_SetNone(PyExc_EOFError);
+            goto error;
+        }
+        len = CHUTNEY_FRAME_HEADER + 
+              (frame_le32(data + pos + 4) & ~CHUTNEY_FRAME_STORED);
+        if (len > view.len - pos) {
+            PyErr_SetNone(PyExc_EOFError);
+            goto error;
+        }
+        if (!(item = Py_BuildValue("(nn)", pos, len)) ||
+                PyList_Append(res, item) < 0) {
+            Py_XDECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+    }
+    goto finally;
+
+error:
+    Py_CLEAR(res);
+finally:
+    PyBuffer_Release(&view);
+    return res;
+}
+
+/*
+ * Decode one block of a framed container (header and body) into a
+ * writable buffer at /offset/, returning the decoded length.
+ */
+static PyObject *
+chutney_frame_decode_into(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"block", "buffer", "offset", NULL};
+    PyObject *obj, *res = NULL;
+    Py_buffer block, view;
+    Py_ssize_t offset = 0;
+    int len;
+
+    if (!(PyArg_ParseTupleAndKeywords(args, kwds, "Ow*|n:frame_decode_into",
+                                      kwlist, &obj, &view, &offset)))
+        return NULL;
+    if (get_read_buffer(obj, &block) < 0) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    if (offset < 0 || offset > view.len) {
+        PyErr_SetString(PyExc_ValueError, "offset out of range");
+        goto finally;
+    }
+    if (block.len > INT_MAX || view.len - offset > INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "block or buffer too large");
+        goto finally;
+    }
+
+    len = chutney_frame_decode((const char *)block.buf, (int)block.len,
+                               (char *)view.buf + offset, 
+                               (int)(view.len - offset));
+    switch (len) {
+    case CHUTNEY_NOMEM:
+        PyErr_Format(PyExc_ValueError, 
+                     "block does not fit in buffer (%u bytes needed)",
+                     frame_le32((const char *)block.buf));
+        break;
+    case CHUTNEY_CHECKSUM_ERR:
+        PyErr_SetString(UnpicklingError, "checksum error");
+        break;
+    default:
+        if (len < 0)
+            PyErr_SetString(UnpicklingError, "parse error");
+        else
+            res = PyInt_FromLong(len);
+        break;
+    }
+
+finally:
+    PyBuffer_Release(&block);
+    PyBuffer_Release(&view);
+    return res;
+}
+
+
+/*
+ * Streaming output - dump_iter and dump_iter_items save the items of an
+ * iterator as they are produced, so only one is held at a time. Output
+ * is collected into a buffer of STREAM_BUFFER bytes, which is passed to
+ * the Python write function whenever it fills.
+ */
+#define STREAM_BUFFER 65536
+
+typedef struct {
+    PyObject *write;
+    char *buf;
+    size_t len;
+} stream_output;
+
+static int
+stream_call(stream_output *out, const char *s, size_t n)
+{
+    PyObject *str, *res;
+
+    if ((str = PyString_FromStringAndSize(s, n)) == NULL)
+        return -1;
+    res = PyObject_CallFunctionObjArgs(out->write, str, NULL);
+    Py_DECREF(str);
+    if (res == NULL)
+        return -1;
+    Py_DECREF(res);
+    return 0;
+}
+
+static int
+stream_flush(stream_output *out)
+{
+    size_t len = out->len;
+
+    out->len = 0;
+    return len ? stream_call(out, out->buf, len) : 0;
+}
+
+static int
+stream_write(void *context, const char *s, size_t n)
+{
+    stream_output *out = (stream_output *)context;
+
+    if (!s)
+        return 0;
+    if (out->len + n > STREAM_BUFFER && stream_flush(out) < 0)
+        return -1;
+    if (n >= STREAM_BUFFER)
+        return stream_call(out, s, n);
+    memcpy(out->buf + out->len, s, n);
+    out->len += n;
+    return 0;
+}
+
+/* Save the (key, value) pairs of /iter/ as a dict */
+static int
+save_iter_items(chutney_dump_state *self, PyObject *iter, Py_ssize_t *count)
+{
+    PyObject *item, *pair;
+    int n, fail;
+
+    if (chutney_save_empty_dict(self) < 0)
+        return -1;
+    do {
+        for (n = 0; n < CHUTNEY_BATCHSIZE; ++n) {
+            if ((item = PyIter_Next(iter)) == NULL) {
+                if (PyErr_Occurred())
+                    return -1;
+                break;
+            }
+            pair = PySequence_Tuple(item);
+            Py_DECREF(item);
+            if (pair == NULL)
+                return -1;
+            fail = PyTuple_GET_SIZE(pair) != 2;
+            if (fail)
+                PyErr_SetString(PyExc_ValueError, 
+                                "dump_iter_items needs (key, value) pairs");
+            if (!fail && n == 0)
+                fail = chutney_save_mark(self) < 0;
+            if (!fail)
+                fail = save_key(self, PyTuple_GET_ITEM(pair, 0)) < 0 ||
+                       save(self, PyTuple_GET_ITEM(pair, 1)) < 0;
+            Py_DECREF(pair);
+            if (fail)
+                return -1;
+            ++*count;
+        }
+        if (n > 0 && chutney_save_setitems(self) < 0)
+            return -1;
+    } while (n == CHUTNEY_BATCHSIZE);
+    return 0;
+}
+
+/* Save the items of /iter/ as a tuple */
+static int
+save_iter(chutney_dump_state *self, PyObject *iter, Py_ssize_t *count)
+{
+    PyObject *item;
+    int fail;
+
+    if (chutney_save_mark(self) < 0)
+        return -1;
+    while ((item = PyIter_Next(iter)) != NULL) {
+        fail = save(self, item) < 0;
+        Py_DECREF(item);
+        if (fail)
+            return -1;
+        ++*count;
+    }
+    if (PyErr_Occurred())
+        return -1;
+    return chutney_save_tuple(self);
+}
+
+/*
+ * Write a chutney of the items of /iterable/ - as a tuple, or if /items/,
+ * a dict of its (key, value) pairs - to /file/, a file-like object or a
+ * write function. Returns the number of items.
+ */
+static PyObject *
+dump_iter(PyObject *iterable, PyObject *file, int items, int protocol, 
+          int framed)
+{
+    PyObject *iter, *res = NULL;
+    pickler_state pickler;
+    chutney_frame_writer writer;
+    stream_output out;
+    Py_ssize_t count = 0;
+
+    out.len = 0;
+    out.buf = NULL;
+    if ((out.write = PyObject_GetAttrString(file, "write")) == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+            return NULL;
+        PyErr_Clear();
+        if (!PyCallable_Check(file)) {
+            PyErr_SetString(PyExc_TypeError, 
+                            "file must have a write method, or be callable");
+            return NULL;
+        }
+        Py_INCREF(file);
+        out.write = file;
+    }
+    if ((iter = PyObject_GetIter(iterable)) == NULL) {
+        Py_DECREF(out.write);
+        return NULL;
+    }
+    if ((out.buf = malloc(STREAM_BUFFER)) == NULL) {
+        PyErr_NoMemory();
+        goto finally;
+    }
+    if (framed && chutney_frame_writer_init(&writer, stream_write, 
+                                            (void *)&out, 0) < 0) {
+        PyErr_NoMemory();
+        goto finally;
+    }
+
+    pickler_init(&pickler);
+    if (framed)
+        chutney_dump_init(&pickler.dump, chutney_frame_write, (void *)&writer);
+    else
+        chutney_dump_init(&pickler.dump, stream_write, (void *)&out);
+    pickler.dump.stats = &dump_stats;
+    pickler.dump.registry = &registry;
+
+    if (set_protocol(&pickler.dump, protocol) == 0 &&
+            (items ? save_iter_items : save_iter)(&pickler.dump, iter, 
+                                                  &count) == 0 &&
+            chutney_save_stop(&pickler.dump) == 0 &&
+            (!framed || chutney_frame_flush(&writer) == 0) &&
+            stream_flush(&out) == 0)
+        res = PyInt_FromSsize_t(count);
+
+    pickler_dealloc(&pickler);
+    if (framed)
+        chutney_frame_writer_dealloc(&writer);
+finally:
+    free(out.buf);
+    Py_DECREF(iter);
+    Py_DECREF(out.write);
+    return res;
+}
+
+static PyObject *
+chutney_dump_iter(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"iterable", "file", "protocol", "framed", NULL};
+    PyObject *iterable, *file;
+    int protocol = 0, framed = 0;
+
+    if (!(PyArg_ParseTupleAndKeywords(args, kwds, "OO|ii:dump_iter", kwlist,
+                                      &iterable, &file, &protocol, &framed)))
+        return NULL;
+    return dump_iter(iterable, file, 0, protocol, framed);
+}
+
+static PyObject *
+chutney_dump_iter_items(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"iterable", "file", "protocol", "framed", NULL};
+    PyObject *iterable, *file;
+    int protocol = 0, framed = 0;
+
+    if (!(PyArg_ParseTupleAndKeywords(args, kwds, "OO|ii:dump_iter_items", 
+                                      kwlist, &iterable, &file, &protocol, 
+                                      &framed)))
+        return NULL;
+    return dump_iter(iterable, file, 1, protocol, framed);
+}
+
+
+/*
+ * Delta encoding. A patch is a chutney of a tuple of entries, each a
+ * tuple of a path (a tuple of dict keys) and the new value, or of the
+ * path alone for a removed key - an empty path replaces the whole object.
+ * Dicts are compared key by key: values that are the same object are
+ * skipped, dicts are descended into, and anything else is compared by the
+ * digest of its canonical chutney, so a patch only holds what changed.
+ */
+static int
+discard_write(void *context, const char *s, size_t n)
+{
+    return 0;
+}
+
+/* The digest of the canonical chutney of /obj/ */
+static int
+digest(PyObject *obj, unsigned long long *value)
+{
+    pickler_state pickler;
+    chutney_hash hash;
+    int res;
+
+    chutney_hash_init(&hash, 0);
+    pickler_init(&pickler);
+    chutney_dump_init(&pickler.dump, discard_write, NULL);
+    pickler.dump.hash = &hash;
+    pickler.dump.canonical = 1;
+    res = dump(&pickler.dump, obj);
+    pickler_dealloc(&pickler);
+    *value = chutney_hash_digest(&hash);
+    return res;
+}
+
+/* Save a patch entry for /path/, with /value/ unless it is NULL */
+static int
+delta_entry(chutney_dump_state *self, PyObject *path, PyObject *value)
+{
+    Py_ssize_t i;
+
+    if (chutney_save_mark(self) < 0 || chutney_save_mark(self) < 0)
+        return -1;
+    for (i = 0; i < PyList_GET_SIZE(path); ++i)
+        if (save(self, PyList_GET_ITEM(path, i)) < 0)
+            return -1;
+    if (chutney_save_tuple(self) < 0)
+        return -1;
+    if (value && save(self, value) < 0)
+        return -1;
+    return chutney_save_tuple(self);
+}
+
+/* Whether /a/ and /b/ would be saved identically */
+static int
+delta_differs(PyObject *a, PyObject *b)
+{
+    unsigned long long da, db;
+
+    if (a == b)
+        return 0;
+    if (digest(a, &da) < 0 || digest(b, &db) < 0)
+        return -1;
+    return da != db;
+}
+
+/* Save the entries turning dict /base/ into dict /new/, both at /path/ */
+static int
+delta_dict(chutney_dump_state *self, PyObject *path, PyObject *new, 
+           PyObject *base)
+{
+    PyObject *key, *value, *old;
+    Py_ssize_t pos = 0;
+    int res = 0, differs;
+
+    /* keys are borrowed from dicts that save could run code to mutate */
+    while (res == 0 && PyDict_Next(new, &pos, &key, &value)) {
+        if ((old = PyDict_GetItem(base, key)) == value)
+            continue;
+        Py_INCREF(key);
+        Py_INCREF(value);
+        Py_XINCREF(old);
+        if ((res = PyList_Append(path, key)) == 0) {
+            if (old && PyDict_CheckExact(old) && PyDict_CheckExact(value))
+                res = delta_dict(self, path, value, old);
+            else if (!old || (differs = delta_differs(value, old)) > 0)
+                res = delta_entry(self, path, value);
+            else
+                res = differs;
+            PySequence_DelItem(path, PyList_GET_SIZE(path) - 1);
+        }
+        Py_XDECREF(old);
+        Py_DECREF(value);
+        Py_DECREF(key);
+    }
+    pos = 0;
+    while (res == 0 && PyDict_Next(base, &pos, &key, &value)) {
+        if (PyDict_GetItem(new, key))
+            continue;
+        Py_INCREF(key);
+        if ((res = PyList_Append(path, key)) == 0) {
+            res = delta_entry(self, path, NULL);
+            PySequence_DelItem(path, PyList_GET_SIZE(path) - 1);
+        }
+        Py_DECREF(key);
+    }
+    return res;
+}
+
+static int
+delta(chutney_dump_state *self, PyObject *new, PyObject *base)
+{
+    PyObject *path;
+    int res = -1, differs;
+
+    if (!(path = PyList_New(0)))
+        return -1;
+    if (chutney_save_mark(self) < 0)
+        goto finally;
+    if (PyDict_CheckExact(new) && PyDict_CheckExact(base)) {
+        if (delta_dict(self, path, new, base) < 0)
+            goto finally;
+    } else if ((differs = delta_differs(new, base)) < 0 ||
+               (differs && delta_entry(self, path, new) < 0))
+        goto finally;
+    if (chutney_save_tuple(self) < 0 || chutney_save_stop(self) < 0)
+        goto finally;
+    res = 0;
+finally:
+    Py_DECREF(path);
+    return res;
+}
+
+static PyObject *
+chutney_dumps_delta(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"new", "base", "protocol", NULL};
+    PyObject *new, *base, *res = NULL;
+    pickler_state pickler;
+    string_output out;
+    int protocol = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i:dumps_delta", kwlist,
+                                     &new, &base, &protocol))
+        return NULL;
+    out.len = 0;
+    if (!(out.str = PyString_FromStringAndSize(NULL, 128)))
+        return NULL;
+    pickler_init(&pickler);
+    chutney_dump_init(&pickler.dump, string_write, (void *)&out);
+    pickler.dump.stats = &dump_stats;
+    pickler.dump.registry = &registry;
+    if (set_protocol(&pickler.dump, protocol) == 0 &&
+            delta(&pickler.dump, new, base) == 0 &&
+            _PyString_Resize(&out.str, out.len) == 0) {
+        res = out.str;
+        out.str = NULL;
+    }
+    pickler_dealloc(&pickler);
+    Py_XDECREF(out.str);
+    return res;
+}
+
+static int
+delta_mismatch(void)
+{
+    PyErr_SetString(PyExc_ValueError, "patch does not match base");
+    return -1;
+}
+
+/* Apply one patch entry to the dict /obj/ */
+static int
+apply_entry(PyObject *obj, PyObject *path, PyObject *value)
+{
+    Py_ssize_t i, depth = PyTuple_GET_SIZE(path);
+
+    for (i = 0; i < depth - 1; ++i)
+        if (!(obj = PyDict_GetItem(obj, PyTuple_GET_ITEM(path, i))) ||
+                !PyDict_Check(obj))
+            return delta_mismatch();
+    if (value)
+        return PyDict_SetItem(obj, PyTuple_GET_ITEM(path, depth - 1), value);
+    if (PyDict_DelItem(obj, PyTuple_GET_ITEM(path, depth - 1)) < 0) {
+        if (!PyErr_ExceptionMatches(PyExc_KeyError))
+            return -1;
+        PyErr_Clear();
+        return delta_mismatch();
+    }
+    return 0;
+}
+
+static PyObject *
+chutney_apply_delta(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"base", "patch", NULL};
+    PyObject *base, *patch, *entries, *entry, *path, *value;
+    Py_buffer view;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO:apply_delta", kwlist,
+                                     &base, &patch))
+        return NULL;
+    if (get_read_buffer(patch, &view) < 0)
+        return NULL;
+    entries = load((const char *)view.buf, view.len, 0);
+    PyBuffer_Release(&view);
+    if (!entries)
+        return NULL;
+    Py_INCREF(base);
+    if (!PyTuple_Check(entries))
+        goto mismatch;
+    for (i = 0; i < PyTuple_GET_SIZE(entries); ++i) {
+        entry = PyTuple_GET_ITEM(entries, i);
+        if (!PyTuple_Check(entry) || PyTuple_GET_SIZE(entry) < 1 ||
+                PyTuple_GET_SIZE(entry) > 2 ||
+                !PyTuple_Check(path = PyTuple_GET_ITEM(entry, 0)))
+            goto mismatch;
+        value = PyTuple_GET_SIZE(entry) > 1 ? 
+                PyTuple_GET_ITEM(entry, 1) : NULL;
+        if (PyTuple_GET_SIZE(path) == 0) {
+            if (!value)
+                goto mismatch;
+            Py_INCREF(value);
+            Py_DECREF(base);
+            base = value;
+        } else if (!PyDict_Check(base)) {
+            goto mismatch;
+        } else if (apply_entry(base, path, value) < 0)
+            goto error;
+    }
+    Py_DECREF(entries);
+    return base;
+
+mismatch:
+    delta_mismatch();
+error:
+    Py_DECREF(entries);
+    Py_DECREF(base);
+    return NULL;
+}
+
+
+/*
+ * Record logs - chutney.LogWriter and chutney.LogReader wrap a
+ * chutney_log opened to append or to read.
+ */
+typedef struct {
+    PyObject_HEAD
+    chutney_log log;
+    int open;
+} LogObject;
+
+static PyTypeObject LogWriter_Type, LogReader_Type;
+
+static int
+log_check_open(LogObject *self)
+{
+    if (!self->open) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed log");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+log_init(LogObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"path", NULL};
+    char *path;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s:open", kwlist, &path))
+        return -1;
+    if (self->open) {
+        chutney_log_close(&self->log);
+        self->open = 0;
+    }
+    if (chutney_log_open(&self->log, path, 
+                         Py_TYPE(self) == &LogWriter_Type) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+        return -1;
+    }
+    self->open = 1;
+    return 0;
+}
+
+static PyObject *
+log_close(LogObject *self)
+{
+    int res = 0;
 
+    if (self->open) {
+        self->open = 0;
+        res = chutney_log_close(&self->log);
     }
-    /* Object not handled in switch: either a new-style instance, or a type we
-     * can't handle */
-    res = save_inst(self, obj);
+    if (res < 0)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    Py_RETURN_NONE;
+}
 
-finally:
-    self->depth--;
-    return res;
-}    
+static void
+log_dealloc(LogObject *self)
+{
+    if (self->open)
+        chutney_log_close(&self->log);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+log_enter(LogObject *self)
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+log_exit(LogObject *self, PyObject *args)
+{
+    return log_close(self);
+}
+
+static PyObject *
+log_append(LogObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"obj", "key", "protocol", NULL};
+    PyObject *obj, *data;
+    char *key = NULL;
+    int key_len = 0, protocol = 0, res;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|z#i:append", kwlist,
+                                     &obj, &key, &key_len, &protocol))
+        return NULL;
+    if (log_check_open(self) < 0)
+        return NULL;
+    if (!(data = dumps(obj, 0, protocol, 0, 0, 0, NULL)))
+        return NULL;
+    res = chutney_log_append(&self->log, key, key_len, 
+                             PyString_AS_STRING(data), PyString_GET_SIZE(data));
+    Py_DECREF(data);
+    if (res < 0)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    return PyLong_FromLongLong(self->log.count - 1);
+}
+
+static PyObject *
+log_sync(LogObject *self)
+{
+    int res;
+
+    if (log_check_open(self) < 0)
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    res = chutney_log_sync(&self->log);
+    Py_END_ALLOW_THREADS
+    if (res < 0)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+log_length(LogObject *self)
+{
+    if (log_check_open(self) < 0)
+        return -1;
+    return (Py_ssize_t)self->log.count;
+}
+
+/* Load record /n/ */
+static PyObject *
+log_item(LogObject *self, Py_ssize_t n)
+{
+    const char *data;
+    size_t len;
+
+    if (log_check_open(self) < 0)
+        return NULL;
+    if (n < 0 || n >= self->log.count) {
+        PyErr_SetString(PyExc_IndexError, "log index out of range");
+        return NULL;
+    }
+    switch (chutney_log_record(&self->log, n, NULL, NULL, &data, &len)) {
+    case CHUTNEY_OKAY:
+        return load(data, len, 0);
+    case CHUTNEY_CHECKSUM_ERR:
+        PyErr_Format(UnpicklingError, "checksum error in record %ld", 
+                     (long)n);
+        return NULL;
+    default:
+        PyErr_Format(UnpicklingError, "bad index for record %ld", (long)n);
+        return NULL;
+    }
+}
+
+static PyObject *
+log_find(LogObject *self, PyObject *args)
+{
+    char *key;
+    int key_len;
+
+    if (!PyArg_ParseTuple(args, "s#:find", &key, &key_len))
+        return NULL;
+    if (log_check_open(self) < 0)
+        return NULL;
+    return PyLong_FromLongLong(chutney_log_find(&self->log, key, key_len));
+}
+
+static PyMethodDef LogWriter_methods[] = {
+    {"append", (PyCFunction)log_append, METH_VARARGS | METH_KEYWORDS,
+        "Append a chutney of the given object, with an optional key,\n"
+        "returning its record number"},
+    {"sync", (PyCFunction)log_sync, METH_NOARGS,
+        "Flush appended records to disk"},
+    {"close", (PyCFunction)log_close, METH_NOARGS,
+        "Write the index footer and close the log"},
+    {"__enter__", (PyCFunction)log_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)log_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMethodDef LogReader_methods[] = {
+    {"find", (PyCFunction)log_find, METH_VARARGS,
+        "Return the number of the last record with the given key, or -1"},
+    {"close", (PyCFunction)log_close, METH_NOARGS,
+        "Close the log"},
+    {"__enter__", (PyCFunction)log_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)log_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PySequenceMethods LogReader_as_sequence = {
+    (lenfunc)log_length,        /* sq_length */
+    0,                          /* sq_concat */
+    0,                          /* sq_repeat */
+    (ssizeargfunc)log_item,     /* sq_item */
+};
+
+static PyTypeObject LogWriter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "chutney.LogWriter",        /* tp_name */
+    sizeof(LogObject),          /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)log_dealloc,    /* tp_dealloc */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    "LogWriter(path) - append chutneys to a record log",  /* tp_doc */
+    0, 0, 0, 0, 0, 0, 
+    LogWriter_methods,          /* tp_methods */
+    0, 0, 0, 0, 0, 0, 0, 
+    (initproc)log_init,         /* tp_init */
+    0,                          /* tp_alloc */
+    PyType_GenericNew,          /* tp_new */
+};
+
+static PyTypeObject LogReader_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "chutney.LogReader",        /* tp_name */
+    sizeof(LogObject),          /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)log_dealloc,    /* tp_dealloc */
+    0, 0, 0, 0, 0, 0, 
+    &LogReader_as_sequence,     /* tp_as_sequence */
+    0, 0, 0, 0, 0, 0, 0, 
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    "LogReader(path) - read chutneys from a record log by number",
+    0, 0, 0, 0, 0, 0, 
+    LogReader_methods,          /* tp_methods */
+    0, 0, 0, 0, 0, 0, 0, 
+    (initproc)log_init,         /* tp_init */
+    0,                          /* tp_alloc */
+    PyType_GenericNew,          /* tp_new */
+};
+
+/*
+ * chutney.ShmChannel wraps one side of a chutney_ring: send encodes
+ * straight into the ring, and recv parses the next message in place,
+ * waiting without the GIL. As the ring allows one producer and one
+ * consumer, and both share the chutney_ring's positions, calls on a
+ * channel are serialised by its lock - and it can't be closed while any
+ * are running or waiting, which would unmap the ring under them.
+ */
+typedef struct {
+    PyObject_HEAD
+    chutney_ring ring;
+    char *name;                 // unlinked on close, if we created it
+    int open;
+    int busy;                   // calls holding or waiting for the lock
+    PyThread_type_lock lock;
+} ChannelObject;
 
 static int
-dump(chutney_dump_state *self, PyObject *obj)
+channel_check_open(ChannelObject *self)
 {
-    if (save(self, obj) < 0)
+    if (!self->open) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed channel");
         return -1;
+    }
+    return 0;
+}
 
-    if (chutney_save_stop(self) < 0)
+/* Take the channel for a send or recv, waiting for any other call */
+static int
+channel_enter(ChannelObject *self)
+{
+    if (channel_check_open(self) < 0)
+        return -1;
+    self->busy++;
+    if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+    return 0;
+}
+
+static void
+channel_leave(ChannelObject *self)
+{
+    PyThread_release_lock(self->lock);
+    self->busy--;
+}
+
+static int
+channel_check_idle(ChannelObject *self)
+{
+    if (self->busy) {
+        PyErr_SetString(PyExc_ValueError, "channel in use by another thread");
         return -1;
+    }
+    return 0;
+}
+
+static void
+channel_do_close(ChannelObject *self)
+{
+    if (self->open)
+        chutney_ring_close(&self->ring);
+    self->open = 0;
+    if (self->name) {
+        shm_unlink(self->name);
+        PyMem_Free(self->name);
+        self->name = NULL;
+    }
+}
+
+static int
+channel_init(ChannelObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"name", "size", NULL};
+    char *name;
+    Py_ssize_t size = 0;
+    int res;
 
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|n:ShmChannel", kwlist, 
+                                     &name, &size))
+        return -1;
+    if (channel_check_idle(self) < 0)
+        return -1;
+    channel_do_close(self);
+    if (!self->lock && !(self->lock = PyThread_allocate_lock())) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (size) {
+        if (size < 0) {
+            PyErr_SetString(PyExc_ValueError, "negative ring size");
+            return -1;
+        }
+        if (!(self->name = PyMem_Malloc(strlen(name) + 1))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        strcpy(self->name, name);
+        res = chutney_ring_create(&self->ring, name, size);
+    } else
+        res = chutney_ring_open(&self->ring, name);
+    if (res < 0) {
+        PyMem_Free(self->name);
+        self->name = NULL;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, name);
+        return -1;
+    }
+    self->open = 1;
     return 0;
 }
 
 static PyObject *
-chutney_dumps(PyObject *self, PyObject *args)
+channel_close(ChannelObject *self)
 {
-    PyObject *obj, *file = NULL, *res = NULL;
-    chutney_dump_state pickler;
+    if (channel_check_idle(self) < 0)
+        return NULL;
+    channel_do_close(self);
+    Py_RETURN_NONE;
+}
+
+static void
+channel_dealloc(ChannelObject *self)
+{
+    channel_do_close(self);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+channel_exit(ChannelObject *self, PyObject *args)
+{
+    return channel_close(self);
+}
+
+/* Milliseconds for a timeout in seconds, or -1 for None */
+static int
+channel_timeout(PyObject *timeout, int *ms)
+{
+    double t;
+
+    *ms = -1;
+    if (timeout == Py_None)
+        return 0;
+    if ((t = PyFloat_AsDouble(timeout)) == -1.0 && PyErr_Occurred())
+        return -1;
+    *ms = t <= 0 ? 0 : t >= INT_MAX / 1000 ? INT_MAX : (int)(t * 1000);
+    return 0;
+}
+
+/*
+ * Write function for send - if the ring is full, the consumer may be
+ * another thread of this process, so wait for it without the GIL.
+ */
+static int
+channel_write(void *context, const char *s, size_t n)
+{
+    chutney_ring *ring = (chutney_ring *)context;
+    int res;
+
+    if (s && !chutney_ring_writable(ring, n)) {
+        Py_BEGIN_ALLOW_THREADS
+        res = chutney_ring_reserve(ring, n);
+        Py_END_ALLOW_THREADS
+        if (res < 0)
+            return -1;
+    }
+    return chutney_ring_write(ring, s, n);
+}
+
+static PyObject *
+channel_send(ChannelObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"obj", "protocol", "timeout", NULL};
+    PyObject *obj, *timeout = Py_None;
+    pickler_state pickler;
+    int protocol = 0, ms, res = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iO:send", kwlist,
+                                     &obj, &protocol, &timeout))
+        return NULL;
+    if (channel_timeout(timeout, &ms) < 0 || channel_enter(self) < 0)
+        return NULL;
+    self->ring.timeout = ms;
+    pickler_init(&pickler);
+    chutney_dump_init(&pickler.dump, channel_write, (void *)&self->ring);
+    pickler.dump.stats = &dump_stats;
+    pickler.dump.registry = &registry;
+    if (set_protocol(&pickler.dump, protocol) == 0) {
+        chutney_ring_send_begin(&self->ring);
+        if (dump(&pickler.dump, obj) == 0)
+            res = chutney_ring_send_end(&self->ring);
+    }
+    pickler_dealloc(&pickler);
+    channel_leave(self);
+    if (res < 0) {
+        if (!PyErr_Occurred())
+            PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+channel_recv(ChannelObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"timeout", NULL};
+    PyObject *obj, *timeout = Py_None;
+    chutney_load_state state;
+    struct iovec iov[2];
+    int iovcnt, ms, res;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:recv", kwlist, 
+                                     &timeout))
+        return NULL;
+    if (channel_timeout(timeout, &ms) < 0 || channel_enter(self) < 0)
+        return NULL;
+    self->ring.timeout = ms;
+    Py_BEGIN_ALLOW_THREADS
+    res = chutney_ring_recv(&self->ring, iov, &iovcnt);
+    Py_END_ALLOW_THREADS
+    obj = NULL;
+    if (res < 0)
+        PyErr_SetFromErrno(PyExc_OSError);
+    else if (chutney_load_init(&state, &load_callbacks, NULL) < 0) {
+        PyErr_NoMemory();
+        chutney_ring_release(&self->ring);
+    } else {
+        state.stats = &load_stats;
+        state.registry = &registry;
+        obj = load_finish(&state, chutney_loadv(&state, iov, iovcnt, NULL));
+        chutney_load_dealloc(&state);
+        chutney_ring_release(&self->ring);
+    }
+    channel_leave(self);
+    return obj;
+}
+
+static PyMethodDef Channel_methods[] = {
+    {"send", (PyCFunction)channel_send, METH_VARARGS | METH_KEYWORDS,
+        "Encode the given object into the ring, waiting up to timeout\n"
+        "seconds (or for ever) for space"},
+    {"recv", (PyCFunction)channel_recv, METH_VARARGS | METH_KEYWORDS,
+        "Load the next object from the ring, waiting up to timeout\n"
+        "seconds (or for ever) for one to arrive"},
+    {"close", (PyCFunction)channel_close, METH_NOARGS,
+        "Unmap the ring, and remove it if this channel created it"},
+    {"__enter__", (PyCFunction)log_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)channel_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject Channel_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "chutney.ShmChannel",       /* tp_name */
+    sizeof(ChannelObject),      /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)channel_dealloc,        /* tp_dealloc */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    "ShmChannel(name[, size]) - one end of a shared memory message ring,\n"
+    "created with the given size, or else opened",      /* tp_doc */
+    0, 0, 0, 0, 0, 0, 
+    Channel_methods,            /* tp_methods */
+    0, 0, 0, 0, 0, 0, 0, 
+    (initproc)channel_init,     /* tp_init */
+    0,                          /* tp_alloc */
+    PyType_GenericNew,          /* tp_new */
+};
+
+/*
+ * scan() - the C scan runs on several threads without the GIL, checking
+ * each record's CRC, and takes the GIL to load the record and call fn. The
+ * first exception raised is saved and re-raised once the scan stops.
+ */
+typedef struct {
+    PyObject *fn;
+    PyObject *type, *value, *traceback;
+} scan_context;
+
+static int
+scan_record(void *contextraw, long long n, const char *key, int key_len,
+            const char *data, size_t len)
+{
+    scan_context *context = (scan_context *)contextraw;
+    PyGILState_STATE gil = PyGILState_Ensure();
+    PyObject *obj, *res = NULL;
+
+    if ((obj = load(data, len, 0)) != NULL) {
+        res = PyObject_CallFunction(context->fn, "LN", n, obj);
+        Py_XDECREF(res);
+    }
+    if (!res) {
+        if (!context->type)
+            PyErr_Fetch(&context->type, &context->value, 
+                        &context->traceback);
+        else
+            PyErr_Clear();
+    }
+    PyGILState_Release(gil);
+    return res ? 0 : -1;
+}
+
+static PyObject *
+chutney_scan(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"path", "fn", "threads", NULL};
+    scan_context context = {NULL, NULL, NULL, NULL};
+    enum chutney_status status;
+    chutney_log log;
+    char *path;
+    int threads = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sO|i:scan", kwlist,
+                                     &path, &context.fn, &threads))
+        return NULL;
+    if (chutney_log_open(&log, path, 0) < 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    PyEval_InitThreads();
+    Py_BEGIN_ALLOW_THREADS
+    status = chutney_log_scan(&log, threads, scan_record, &context);
+    Py_END_ALLOW_THREADS
+    chutney_log_close(&log);
+    switch (status) {
+    case CHUTNEY_OKAY:
+        Py_RETURN_NONE;
+    case CHUTNEY_CALLBACK_ERR:
+        PyErr_Restore(context.type, context.value, context.traceback);
+        return NULL;
+    case CHUTNEY_CHECKSUM_ERR:
+        PyErr_SetString(UnpicklingError, "checksum error");
+        return NULL;
+    default:
+        PyErr_SetString(UnpicklingError, "bad index");
+        return NULL;
+    }
+}
 
-    if (!(PyArg_ParseTuple(args, "O", &obj)))
-        goto finally;
 
-    if (!(file = PycStringIO->NewOutput(128)))
+/*
+ * Return a chutney as a list of strings: encoded segments, interleaved
+ * with the large string payloads themselves (or for unicode, their UTF-8
+ * encoding), which are not copied.
+ */
+static PyObject *
+chutney_dumps_iov(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"obj", "threshold", "protocol", NULL};
+    PyObject *obj, *item, *res = NULL;
+    pickler_state pickler;
+    chutney_iov_segment *seg;
+    long threshold = 0;
+    int protocol = 0, i, ref = 0;
+
+    if (!(PyArg_ParseTupleAndKeywords(args, kwds, "O|li:dumps_iov", kwlist,
+                                      &obj, &threshold, &protocol)))
+        return NULL;
+
+    pickler_init(&pickler);
+    chutney_dump_init_iov(&pickler.dump, threshold);
+    pickler.dump.stats = &dump_stats;
+    pickler.dump.registry = &registry;
+    if (!(pickler.refs = PyList_New(0)))
         goto finally;
 
-    if (chutney_dump_init(&pickler, cString_write, (void *)file) < 0)
+    if (set_protocol(&pickler.dump, protocol) < 0 || 
+            dump(&pickler.dump, obj) < 0)
         goto finally;
 
-    if (dump(&pickler, obj) < 0)
+    if (!(res = PyList_New(pickler.dump.segment_count)))
         goto finally;
+    for (i = 0; i < pickler.dump.segment_count; ++i) {
+        seg = &pickler.dump.segments[i];
+        if (seg->ref) {
+            item = PyList_GET_ITEM(pickler.refs, ref++);
+            Py_INCREF(item);
+        } else
+            item = PyString_FromStringAndSize(
+                pickler.dump.segment_buf + seg->off, seg->len);
+        if (!item) {
+            Py_CLEAR(res);
+            goto finally;
+        }
+        PyList_SET_ITEM(res, i, item);
+    }
 
-    chutney_dump_dealloc(&pickler);
+finally:
+    pickler_dealloc(&pickler);
+    return res;
+}
 
-    res = PycStringIO->cgetvalue(file);
+/* Add name = value to dict, consuming the reference to value */
+static int
+stats_set(PyObject *dict, const char *name, PyObject *value)
+{
+    int res;
 
-finally:
-    Py_XDECREF(file);
+    if (value == NULL)
+        return -1;
+    res = PyDict_SetItemString(dict, name, value);
+    Py_DECREF(value);
+    return res;
+}
+
+/* Return a dictionary of the non-zero opcode counters, keyed by opcode */
+static PyObject *
+stats_opcodes(unsigned long *opcodes)
+{
+    PyObject *dict, *key, *value;
+    char op;
+    int i, res;
+
+    if ((dict = PyDict_New()) == NULL)
+        return NULL;
+    for (i = 0; i < 256; ++i) {
+        if (!opcodes[i])
+            continue;
+        op = (char)i;
+        key = PyString_FromStringAndSize(&op, 1);
+        value = PyLong_FromUnsignedLong(opcodes[i]);
+        res = (key && value) ? PyDict_SetItem(dict, key, value) : -1;
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+        if (res < 0) {
+            Py_DECREF(dict);
+            return NULL;
+        }
+    }
+    return dict;
+}
+
+static PyObject *
+stats_load(chutney_load_stats *stats)
+{
+    PyObject *dict;
+#ifdef CHUTNEY_STATS_CYCLES
+    static const char *classes[CHUTNEY_OPCLASS_COUNT] = {
+        "control", "scalar", "string", "container", "object",
+    };
+    PyObject *cycles;
+    int i;
+#endif
+
+    if ((dict = PyDict_New()) == NULL)
+        return NULL;
+    if (stats_set(dict, "opcodes", stats_opcodes(stats->opcodes)) < 0 ||
+        stats_set(dict, "bytes", PyLong_FromUnsignedLong(stats->bytes)) < 0 ||
+        stats_set(dict, "callbacks", 
+                  PyLong_FromUnsignedLong(stats->callbacks)) < 0 ||
+        stats_set(dict, "stack_max", PyInt_FromSize_t(stats->stack_max)) < 0 ||
+        stats_set(dict, "marks_max", PyInt_FromSize_t(stats->marks_max)) < 0 ||
+        stats_set(dict, "buf_max", PyInt_FromSize_t(stats->buf_max)) < 0 ||
+        stats_set(dict, "stack_grows", 
+                  PyLong_FromUnsignedLong(stats->stack_grows)) < 0 ||
+        stats_set(dict, "marks_grows", 
+                  PyLong_FromUnsignedLong(stats->marks_grows)) < 0 ||
+        stats_set(dict, "buf_grows", 
+                  PyLong_FromUnsignedLong(stats->buf_grows)) < 0)
+        goto error;
+#ifdef CHUTNEY_STATS_CYCLES
+    if ((cycles = PyDict_New()) == NULL || 
+        stats_set(dict, "cycles", cycles) < 0)
+        goto error;
+    for (i = 0; i < CHUTNEY_OPCLASS_COUNT; ++i)
+        if (stats_set(cycles, classes[i], 
+                      PyLong_FromUnsignedLongLong(stats->cycles[i])) < 0)
+            goto error;
+#endif
+    return dict;
+error:
+    Py_DECREF(dict);
+    return NULL;
+}
+
+static PyObject *
+stats_dump(chutney_dump_stats *stats)
+{
+    PyObject *dict;
+
+    if ((dict = PyDict_New()) == NULL)
+        return NULL;
+    if (stats_set(dict, "opcodes", stats_opcodes(stats->opcodes)) < 0 ||
+        stats_set(dict, "bytes", PyLong_FromUnsignedLong(stats->bytes)) < 0 ||
+        stats_set(dict, "writes", 
+                  PyLong_FromUnsignedLong(stats->writes)) < 0) {
+        Py_DECREF(dict);
+        return NULL;
+    }
+    return dict;
+}
+
+static PyObject *
+chutney_stats(PyObject *self, PyObject *args)
+{
+    PyObject *res;
+    int reset = 0;
 
+    if (!(PyArg_ParseTuple(args, "|i", &reset)))
+        return NULL;
+
+    if ((res = PyDict_New()) == NULL)
+        return NULL;
+    if (stats_set(res, "load", stats_load(&load_stats)) < 0 ||
+        stats_set(res, "dump", stats_dump(&dump_stats)) < 0) {
+        Py_DECREF(res);
+        return NULL;
+    }
+    if (reset) {
+        memset(&load_stats, 0, sizeof(load_stats));
+        memset(&dump_stats, 0, sizeof(dump_stats));
+    }
     return res;
 }
 
+static PyObject *
+chutney_register_extension(PyObject *self, PyObject *args)
+{
+    char *module, *name;
+    long code;
+
+    if (!PyArg_ParseTuple(args, "ssl:register_extension", 
+                          &module, &name, &code))
+        return NULL;
+    if (chutney_registry_add(&registry, module, name, code) < 0) {
+        if (errno == ENOMEM)
+            return PyErr_NoMemory();
+        if (errno == EINVAL)
+            PyErr_SetString(PyExc_ValueError, "code out of range");
+        else
+            PyErr_Format(PyExc_ValueError, "%.200s.%.200s or code %ld is "
+                         "already registered", module, name, code);
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 
 static PyMethodDef chutney_methods[] = {
-    {"loads",  chutney_loads, METH_VARARGS,
-        "Load a chutney from the given string"},
-    {"dumps",  chutney_dumps, METH_VARARGS,
-        "Return a \"chutney\" of the given object"},
+    {"loads",  (PyCFunction)chutney_loads, METH_VARARGS | METH_KEYWORDS,
+        "Load a chutney from the given string or buffer (or list of them),\n"
+        "optionally a framed container"},
+    {"extract",  (PyCFunction)chutney_extract_path, 
+        METH_VARARGS | METH_KEYWORDS,
+        "Load only the value at the given tuple of dict keys and tuple\n"
+        "indices, raising KeyError (or returning default) if there is none"},
+    {"validate",  (PyCFunction)chutney_validate_data, 
+        METH_VARARGS | METH_KEYWORDS,
+        "Check a chutney (within optional limits, and allowing only the\n"
+        "given (module, name) classes) without loading it, returning a\n"
+        "dict of counts of what loading it would make"},
+    {"read_events",  chutney_read_events, METH_VARARGS,
+        "Return the pull parser's events for the given string or buffer\n"
+        "(or list of them) as a list of (name, values...) tuples"},
+    {"load_path",  (PyCFunction)chutney_load_path, 
+        METH_VARARGS | METH_KEYWORDS,
+        "Load a chutney from the named file, optionally a framed container"},
+    {"dumps",  (PyCFunction)chutney_dumps, METH_VARARGS | METH_KEYWORDS,
+        "Return a \"chutney\" of the given object, optionally as a framed\n"
+        "container, or a tuple of the chutney and its 64 bit hash, and\n"
+        "optionally encoded on several threads"},
+    {"dumps_delta",  (PyCFunction)chutney_dumps_delta, 
+        METH_VARARGS | METH_KEYWORDS,
+        "Return a patch turning the base object into the new one"},
+    {"apply_delta",  (PyCFunction)chutney_apply_delta, 
+        METH_VARARGS | METH_KEYWORDS,
+        "Apply a patch from dumps_delta to the base object (dicts are\n"
+        "updated in place), returning the result"},
+    {"dumps_into",  (PyCFunction)chutney_dumps_into, 
+        METH_VARARGS | METH_KEYWORDS,
+        "Write a \"chutney\" of the given object into a writable buffer at\n"
+        "the given offset, returning the number of bytes written"},
+    {"frame_blocks",  chutney_frame_blocks, METH_VARARGS,
+        "Return the (offset, length) of each block of a framed container,\n"
+        "found from the block headers without decompressing them"},
+    {"frame_decode_into",  (PyCFunction)chutney_frame_decode_into, 
+        METH_VARARGS | METH_KEYWORDS,
+        "Decode one block of a framed container into a writable buffer at\n"
+        "the given offset, returning the number of bytes written"},
+    {"dump_iter",  (PyCFunction)chutney_dump_iter, 
+        METH_VARARGS | METH_KEYWORDS,
+        "Write a \"chutney\" of a tuple of the items of the iterable to the\n"
+        "file (or write function) as they are produced, returning the\n"
+        "number of items"},
+    {"dump_iter_items",  (PyCFunction)chutney_dump_iter_items, 
+        METH_VARARGS | METH_KEYWORDS,
+        "As dump_iter, writing a dict of the iterable's (key, value) pairs"},
+    {"dumps_iov",  (PyCFunction)chutney_dumps_iov, 
+        METH_VARARGS | METH_KEYWORDS,
+        "Return a \"chutney\" of the given object as a list of strings,\n"
+        "in which string payloads of at least threshold bytes appear\n"
+        "uncopied"},
+    {"scan",  (PyCFunction)chutney_scan, METH_VARARGS | METH_KEYWORDS,
+        "Call fn(n, obj) for each record of a record log, loading shards\n"
+        "of the log on the given number of threads"},
+    {"register_extension",  chutney_register_extension, METH_VARARGS,
+        "Save instances of module.name as the given extension code, and\n"
+        "accept the code when loading"},
+    {"stats",  chutney_stats, METH_VARARGS,
+        "Return the cumulative load and dump instrumentation counters,\n"
+        "optionally resetting them"},
     {NULL, NULL, 0, NULL}
 };
 
@@ -514,7 +3226,12 @@ initchutney(void)
 {
     PyObject *m;
 
-    PycString_IMPORT;
+
+    chutney_arena_init(&load_arena, 0);
+    module_str = PyString_InternFromString("__module__");
+    getstate_str = PyString_InternFromString("__getstate__");
+    if (!module_str || !getstate_str)
+        return;
 
     ChutneyError = PyErr_NewException("chutney.ChutneyError", NULL, NULL);
     if (!ChutneyError)
@@ -536,8 +3253,19 @@ initchutney(void)
     if (!m)
         return;
 
+    if (PyType_Ready(&LogWriter_Type) < 0 || 
+            PyType_Ready(&LogReader_Type) < 0 ||
+            PyType_Ready(&Channel_Type) < 0)
+        return;
+
     Py_INCREF(ChutneyError);
     PyModule_AddObject(m, "ChutneyError", ChutneyError);
     PyModule_AddObject(m, "UnpickleableError", UnpickleableError);
     PyModule_AddObject(m, "UnpicklingError", UnpicklingError);
+    Py_INCREF(&LogWriter_Type);
+    PyModule_AddObject(m, "LogWriter", (PyObject *)&LogWriter_Type);
+    Py_INCREF(&LogReader_Type);
+    PyModule_AddObject(m, "LogReader", (PyObject *)&LogReader_Type);
+    Py_INCREF(&Channel_Type);
+    PyModule_AddObject(m, "ShmChannel", (PyObject *)&Channel_Type);
 }
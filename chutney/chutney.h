@@ -1,7 +1,48 @@
 #include <sys/types.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define CHUTNEY_BATCHSIZE 1000
 
+struct iovec;                   // see chutneyiov.c
+
+/*
+ * Memory for the load and dump states' own buffers - see chutneyarena.c.
+ * The previous size of a block is passed to realloc and free, so an
+ * allocator need not record it. A NULL allocator means malloc.
+ */
+typedef struct {
+    void *(*alloc)(void *context, size_t size);
+    void *(*realloc)(void *context, void *ptr, size_t old_size, size_t size);
+    void (*free)(void *context, void *ptr, size_t size);
+    void *context;
+} chutney_allocator;
+
+extern const chutney_allocator chutney_malloc_allocator;
+
+/*
+ * Bump allocator: allocations are carved from blocks of at least
+ * block_size bytes, freeing is a no-op (except of the latest allocation),
+ * and chutney_arena_reset releases everything at once.
+ */
+typedef struct chutney_arena_block chutney_arena_block;
+
+typedef struct {
+    chutney_allocator allocator;        // allocates from this arena
+    chutney_arena_block *blocks;        // newest first
+    size_t block_size;
+    void *last;                         // latest allocation, or NULL
+} chutney_arena;
+
+#define CHUTNEY_ARENA_BLOCK_SIZE 65536
+#define CHUTNEY_ARENA_ALIGN 16
+
+extern void chutney_arena_init(chutney_arena *arena, size_t block_size);
+extern void chutney_arena_reset(chutney_arena *arena);
+extern void chutney_arena_dealloc(chutney_arena *arena);
+
 typedef struct {
     void (*dealloc)(void *value);
 
@@ -10,8 +51,8 @@ typedef struct {
     void *(*make_bool)(int value);
     void *(*make_int)(int value);
     void *(*make_float)(double value);
-    void *(*make_string)(const char *value, long length);
-    void *(*make_unicode)(const char *value, long length);
+    void *(*make_string)(const char *value, size_t length);
+    void *(*make_unicode)(const char *value, size_t length);
 
     void *(*make_tuple)(void **values, long count);
     void *(*make_empty_dict)(void);
@@ -20,6 +61,8 @@ typedef struct {
     void *(*get_global)(const char *module, const char *name);
     void *(*make_object)(void *cls);
     int (*object_build)(void *obj, void *state);
+
+    void (*incref)(void *value);        // optional, needed for COLUMNS
 } chutney_load_callbacks;
 
 enum chutney_states {
@@ -38,26 +81,110 @@ enum chutney_status {
     CHUTNEY_OPCODE_ERR = -4,
     CHUTNEY_NOMARK_ERR = -5,
     CHUTNEY_CALLBACK_ERR = -6,
+    CHUTNEY_CHECKSUM_ERR = -7,
+    CHUTNEY_LIMIT_ERR = -8,     // chutney_validate: over a limit, or a
+                                // class not allowed
+    CHUTNEY_NOT_FOUND = 2,      // chutney_extract: no value at the path
 };
 
 typedef struct {
     char *module;
     char *name;
+    size_t module_alloc;        // allocated sizes, for chutney_free
+    size_t name_alloc;
 } chutney_op_global;
 
+/*
+ * Extension registry - see chutneyregistry.c. Point the load or dump
+ * state's "registry" at one (after init) and registered classes are saved
+ * as EXT1, EXT2 or EXT4 codes, and loaded from them. Without a registry,
+ * or for an unregistered code, an EXT opcode is an error.
+ */
+#define CHUTNEY_EXT_MAX 0x7fffffffL
+
+typedef struct {
+    char *module;
+    char *name;
+    long code;
+} chutney_extension;
+
+typedef struct {
+    chutney_extension *entries; // in the order added
+    long count;
+    long entries_alloc;
+    long *by_name;              // entry index + 1 by module and name, or 0
+    long *by_code;              // entry index + 1 by code, or 0
+    long hash_size;             // of both hashes, a power of two
+} chutney_registry;
+
+/*
+ * Opcode classes, used to group the per-opcode cycle counts. See
+ * chutney_opcode_class().
+ */
+enum chutney_opclass {
+    CHUTNEY_OPCLASS_CONTROL,     // MARK, STOP
+    CHUTNEY_OPCLASS_SCALAR,      // NONE, bools, ints, floats, INTS, FLOATS
+    CHUTNEY_OPCLASS_STRING,      // strings and unicode
+    CHUTNEY_OPCLASS_CONTAINER,   // TUPLE, EMPTY_DICT, SETITEMS
+    CHUTNEY_OPCLASS_OBJECT,      // GLOBAL, EXT, OBJ, BUILD, COLUMNS
+    CHUTNEY_OPCLASS_COUNT,
+};
+
+/*
+ * Optional load instrumentation. Point chutney_load_state.stats at one of
+ * these (after chutney_load_init) and the parser will accumulate into it -
+ * the counters are never reset by the library, so one structure can be
+ * shared by many parses. If chutney is compiled with CHUTNEY_STATS_CYCLES
+ * defined, cycle counts are also accumulated per opcode class.
+ */
+typedef struct {
+    unsigned long opcodes[256];  // opcodes parsed, indexed by opcode byte
+    unsigned long bytes;         // bytes consumed
+    unsigned long callbacks;     // callback invocations
+    size_t stack_max;            // high-water marks
+    size_t marks_max;
+    size_t buf_max;
+    unsigned long stack_grows;   // reallocations
+    unsigned long marks_grows;
+    unsigned long buf_grows;
+#ifdef CHUTNEY_STATS_CYCLES
+    unsigned long long cycles[CHUTNEY_OPCLASS_COUNT];
+#endif
+} chutney_load_stats;
+
+/*
+ * Optional dump instrumentation - point chutney_dump_state.stats at one of
+ * these after chutney_dump_init.
+ */
+typedef struct {
+    unsigned long opcodes[256];  // opcodes generated, indexed by opcode byte
+    unsigned long bytes;         // bytes produced
+    unsigned long writes;        // write callback invocations
+} chutney_dump_stats;
+
 typedef struct chutney_load_state {
     chutney_load_callbacks callbacks;
+    chutney_allocator allocator;
     enum chutney_states parser_state;
+    chutney_load_stats *stats;  // NULL, or instrumentation counters
+    const chutney_registry *registry;   // NULL, or EXT codes
+    char opcode;                // opcode currently being parsed
     void **stack;
-    int stack_alloc;
-    int stack_size;
-    int *marks;                 // MARK stack
-    int marks_alloc;
-    int marks_size;
+    size_t stack_alloc;
+    size_t stack_size;
+    size_t *marks;              // MARK stack
+    size_t marks_alloc;
+    size_t marks_size;
+    const char *in;             // input being parsed by chutney_load
+    const char *in_end;
+    const char *in_pause;       // NULL, or chutney_load returns at the first
+                                // opcode at or after this
+    const char *arg;            // current opcode argument, either in buf or
+    size_t arg_len;             // directly in the input
     char *buf;
-    int buf_len;                // how many bytes are in the buffer
-    int buf_alloc;              // how many bytes of space we've allocated
-    int buf_want;               // how many bytes we're looking for
+    size_t buf_len;             // how many bytes are in the buffer
+    size_t buf_alloc;           // how many bytes of space we've allocated
+    size_t buf_want;            // how many bytes we're looking for
     enum chutney_status (*completion)(struct chutney_load_state *state);
                                 // Some states call this on completion of their
                                 // action.
@@ -67,26 +194,457 @@ typedef struct chutney_load_state {
 } chutney_load_state;
 typedef enum chutney_status (*completion_fn)(struct chutney_load_state *);
 
+#define CHUTNEY_HIGHEST_PROTOCOL 4
+#define CHUTNEY_FRAME_SIZE_TARGET 65536 // protocol 4 frame size
+
+/*
+ * Streaming content hash (XXH64) - see chutneyhash.c. Point
+ * chutney_dump_state.hash at one of these (after chutney_hash_init) and
+ * the chutney is hashed as it is written.
+ */
+typedef struct {
+    unsigned long long v[4];    // stripe accumulators
+    unsigned long long seed;
+    unsigned long long total;   // bytes hashed
+    unsigned char buf[32];      // partial stripe
+    int buf_len;
+} chutney_hash;
+
+/*
+ * Output segment of chutney_dump_init_iov: either a payload referenced in
+ * place, or bytes encoded into the dump state's segment buffer.
+ */
+typedef struct {
+    const char *ref;            // referenced payload, or NULL
+    size_t off;                 // otherwise, offset in segment_buf
+    size_t len;
+} chutney_iov_segment;
+
+#define CHUTNEY_IOV_THRESHOLD 16384     // default smallest payload referenced
+
+/*
+ * Output of one chutney_dump_tree task, recorded by a dump state whose
+ * "chunk" member points at it, and copied to the real output by
+ * chutney_save_chunk. Opcode offsets are only recorded with protocol 4,
+ * where a frame can end before any opcode. Payloads of at least threshold
+ * bytes are recorded by reference, and written as the real output state
+ * would write them.
+ */
+typedef struct {
+    size_t op;                  // offset of the payload's opcode in buf
+    size_t off;                 // offset following the opcode
+    const char *value;
+    size_t len;
+} chutney_chunk_payload;
+
+typedef struct chutney_dump_chunk {
+    char *buf;                  // encoded bytes, less referenced payloads
+    size_t len;
+    size_t alloc;
+    size_t *ops;                // opcode offsets in buf
+    size_t nops;
+    size_t ops_alloc;
+    chutney_chunk_payload *payloads;
+    size_t npayloads;
+    size_t payloads_alloc;
+    size_t threshold;           // smallest payload referenced, or 0
+    chutney_dump_stats stats;
+} chutney_dump_chunk;
+
 typedef struct {
     long depth;     // Recursion depth - not used by lib, available for user
-    int (*write)(void *context, const char *s, long n);
+    int (*write)(void *context, const char *s, size_t n);
     void *write_context;
+    chutney_dump_stats *stats;  // NULL, or instrumentation counters
+    chutney_hash *hash;         // NULL, or hash of the output
+    int canonical;              // caller saves dict items in key order
+    const chutney_registry *registry;   // NULL, or classes to save as EXT
+    int protocol;               // 0, or see chutney_dump_set_protocol
+    int started;                // something has been written
+    char *frame;                // protocol 4 frame being collected
+    size_t frame_len;
+    size_t frame_alloc;
+    char *out;                  // see chutney_dump_init_buffer
+    size_t out_cap;
+    size_t out_len;
+    size_t frame_start;         // offset of the current frame in out
+    size_t iov_threshold;       // see chutney_dump_init_iov
+    chutney_iov_segment *segments;
+    int segment_count;
+    int segment_alloc;
+    char *segment_buf;          // encoded bytes between references
+    size_t segment_buf_len;
+    size_t segment_buf_alloc;
+    void *iov;                  // struct iovec array from chutney_dump_iov
+    size_t iov_alloc;           // its size in bytes
+    chutney_dump_chunk *chunk;  // chutney_dump_tree: recording a task
+    chutney_allocator allocator;    // see chutney_dump_set_allocator
 } chutney_dump_state;
 
+/*
+ * A document tree for chutney_dump_tree, described by functions of the
+ * caller's choosing. "kind" returns the kind of a node, and for tuples and
+ * dicts sets *count to the number of items. "child" returns item i of a
+ * tuple, or for a dict, the key (2i) or value (2i + 1) of item i. "save"
+ * saves a CHUTNEY_TREE_VALUE node with the chutney_save functions. All
+ * three may be called concurrently from several threads.
+ */
+enum chutney_tree_kind {
+    CHUTNEY_TREE_VALUE,
+    CHUTNEY_TREE_TUPLE,
+    CHUTNEY_TREE_DICT,
+};
+
+typedef struct {
+    enum chutney_tree_kind (*kind)(void *context, const void *node,
+                                   long *count);
+    const void *(*child)(void *context, const void *node, long i);
+    int (*save)(chutney_dump_state *state, void *context, const void *node);
+    void *context;
+} chutney_tree;
+
+#define CHUTNEY_TREE_TASKS 8            // tasks per thread
+
+/*
+ * Framed, compressed container. The writer is a write function (and
+ * context) to be passed to chutney_dump_init, which collects the output
+ * into blocks, compresses them, and passes them to the underlying write
+ * function. Each block is independently compressed and carries a CRC32C of
+ * its contents.
+ */
+#define CHUTNEY_FRAME_MAGIC "CHZ\x01"
+#define CHUTNEY_FRAME_HEADER 12         // raw len, stored len, crc32c
+#define CHUTNEY_FRAME_STORED 0x80000000 // stored len flag: not compressed
+#define CHUTNEY_FRAME_BLOCKSIZE 65536   // default block size
+#define CHUTNEY_FRAME_MAXBLOCK (16 << 20)
+
+typedef struct {
+    int (*write)(void *context, const char *s, size_t n);
+    void *write_context;
+    int block_size;
+    int started;                // magic has been written
+    char *in;                   // raw data awaiting compression
+    int in_len;
+    char *out;                  // header and compressed block
+    int *hash;                  // compressor match table
+} chutney_frame_writer;
+
+enum chutney_frame_states {
+    CHUTNEY_FRAME_S_MAGIC,      // collecting the stream magic
+    CHUTNEY_FRAME_S_HEADER,     // collecting a block header
+    CHUTNEY_FRAME_S_BODY,       // collecting a block body
+};
+
+typedef struct {
+    enum chutney_frame_states state;
+    char header[CHUTNEY_FRAME_HEADER];
+    int header_len;
+    int raw_len;                // from current block header
+    int stored_len;
+    int compressed;
+    unsigned int crc;
+    char *in;                   // block body, if split across calls
+    int in_len;
+    int in_alloc;
+    char *out;                  // decompressed block
+    int out_alloc;
+} chutney_frame_reader;
+
+/*
+ * Pull parser - see chutney_reader_next. Events correspond to opcodes, so
+ * containers are reported in pickle (postfix) order: MARK, the items, then
+ * TUPLE; or DICT, then MARK, keys and values, SETITEMS.
+ */
+enum chutney_event_type {
+    CHUTNEY_EV_NONE,
+    CHUTNEY_EV_BOOL,            // ival
+    CHUTNEY_EV_INT,             // ival
+    CHUTNEY_EV_FLOAT,           // fval
+    CHUTNEY_EV_STRING,          // str and len, possibly in several chunks
+    CHUTNEY_EV_UNICODE,         // as STRING, UTF-8 encoded
+    CHUTNEY_EV_MARK,            // start of a tuple, dict items or instance
+    CHUTNEY_EV_TUPLE,           // ival items: -1 back to the MARK, or 0-3
+    CHUTNEY_EV_DICT,            // empty dict
+    CHUTNEY_EV_SETITEMS,        // ival pairs: -1 back to the MARK, or 1
+    CHUTNEY_EV_GLOBAL,          // module in str and len, name_str, name_len
+                                // (also for a registered EXT code)
+    CHUTNEY_EV_OBJ,             // instance of the GLOBAL after the MARK
+    CHUTNEY_EV_BUILD,           // apply state to the instance before it
+    CHUTNEY_EV_STOP,            // end of the chutney
+};
+
+typedef struct {
+    enum chutney_event_type type;
+    long ival;
+    double fval;
+    const char *str;            // string chunk, or GLOBAL module
+    size_t len;
+    const char *name_str;       // GLOBAL name
+    size_t name_len;
+    long long offset;           // position of this chunk within the string
+    long long total;            // length of the whole string
+    int more;                   // further chunks of this string follow
+} chutney_event;
+
+#define CHUTNEY_READER_SCRATCH 512      // longest INT or GLOBAL argument
+
+enum chutney_reader_states {
+    CHUTNEY_R_OPCODE,           // looking for an opcode
+    CHUTNEY_R_ARG,              // collecting the opcode's argument
+    CHUTNEY_R_BODY,             // passing through a string body
+};
+
+typedef struct {
+    enum chutney_reader_states state;
+    char opcode;
+    int want;                   // fixed argument length, or
+    int lines;                  // number of newline terminated arguments
+    int lines_found;
+    int scratch_len;            // argument bytes split across input
+    const chutney_registry *registry;   // NULL, or EXT codes
+    long long body_left;        // string bytes still to come
+    long long body_total;
+    char scratch[CHUTNEY_READER_SCRATCH];
+} chutney_reader;
+
 /* Load function */
 extern int chutney_load_init(chutney_load_state *state,
-                             chutney_load_callbacks *callbacks); 
+                             chutney_load_callbacks *callbacks,
+                             const chutney_allocator *allocator); 
 extern void chutney_load_dealloc(chutney_load_state *state); 
 extern enum chutney_status chutney_load(chutney_load_state *state, 
-                                        const char **data, int *length);
+                                        const char **data, size_t *length);
 extern void *chutney_load_result(chutney_load_state *state);
+extern enum chutney_opclass chutney_opcode_class(char opcode);
+
+/* Scatter/gather input - see chutneyiov.c */
+extern enum chutney_status chutney_loadv(chutney_load_state *state,
+                                         const struct iovec *iov, int iovcnt,
+                                         size_t *consumed);
+
+/*
+ * A step in a chutney_extract path: a dict key or instance attribute, or
+ * if key is NULL, a tuple index.
+ */
+typedef struct {
+    const char *key;
+    size_t len;
+    long index;                 // negative counts from the end
+} chutney_path_step;
+
+extern enum chutney_status chutney_extract(chutney_load_state *state,
+                                           const char *data, size_t length,
+                                           const chutney_path_step *path,
+                                           int depth);
+
+/*
+ * Validation of untrusted input - see chutneyvalidate.c. A zero limit is
+ * no limit. If globals is not NULL, it is a NULL terminated list of
+ * alternating module and class names, and any other class is refused.
+ */
+typedef struct {
+    unsigned long long max_objects;
+    unsigned long long max_payload;     // total string and column bytes
+    unsigned long long max_string;      // bytes of any one string
+    long max_depth;                     // nesting of containers
+    long max_stack;
+    const char *const *globals;
+    const chutney_registry *registry;   // NULL, or EXT codes
+} chutney_limits;
+
+typedef struct {
+    size_t length;                      // bytes up to and including STOP
+    unsigned long long objects;         // every object a load would make
+    unsigned long long strings;         // of which strings and unicode
+    unsigned long long containers;      // tuples and dicts
+    unsigned long long instances;
+    unsigned long long payload;
+    long max_depth;                     // a scalar is 0, a tuple of them 1
+    long max_stack;
+} chutney_report;
+
+extern enum chutney_status chutney_validate(const char *data, size_t length,
+                                            const chutney_limits *limits,
+                                            chutney_report *report);
+
+/* Extension registry - see chutneyregistry.c */
+extern void chutney_registry_init(chutney_registry *reg);
+extern void chutney_registry_dealloc(chutney_registry *reg);
+extern int chutney_registry_add(chutney_registry *reg, const char *module,
+                                const char *name, long code);
+extern long chutney_registry_code(const chutney_registry *reg,
+                                  const char *module, const char *name);
+extern const chutney_extension *
+chutney_registry_get(const chutney_registry *reg, unsigned long code);
+
+/* Memory mapped input - see chutneymap.c */
+typedef struct {
+    const char *data;
+    size_t len;
+} chutney_mapping;
+
+#define CHUTNEY_MAP_CHUNK (64 << 20)    // input parsed between releases
+
+extern int chutney_map_file(chutney_mapping *map, const char *path);
+extern void chutney_unmap_file(chutney_mapping *map);
+extern enum chutney_status chutney_load_mapping(chutney_load_state *state,
+                                                chutney_frame_reader *frames,
+                                                const chutney_mapping *map);
+
+/*
+ * Shared memory message ring - see chutneyring.c. The shared header keeps
+ * each side's counter on its own cache line.
+ */
+#define CHUTNEY_RING_MAGIC "CHRING\x01"     // 8 bytes with the nul
+#define CHUTNEY_RING_HEADER 256         // shared header, before the data
+#define CHUTNEY_RING_MAX (1UL << 30)    // largest ring
+#define CHUTNEY_RING_SPIN 1000          // checks before sleeping
+
+typedef struct {
+    char magic[8];
+    unsigned long long size;
+    char pad0[48];
+    volatile unsigned long long head;   // bytes published by the producer
+    volatile unsigned int head_word;    // low word of head, a futex
+    volatile unsigned int consumer_waiting;
+    char pad1[48];
+    volatile unsigned long long tail;   // bytes released by the consumer
+    volatile unsigned int tail_word;
+    volatile unsigned int producer_waiting;
+} chutney_ring_shared;
+
+typedef struct {
+    chutney_ring_shared *shared;
+    char *data;
+    size_t size;
+    int timeout;                // milliseconds to wait, or -1 for ever
+    unsigned long long start;   // message being sent or received
+    unsigned long long pos;
+} chutney_ring;
+
+extern int chutney_ring_create(chutney_ring *ring, const char *name,
+                               size_t size);
+extern int chutney_ring_open(chutney_ring *ring, const char *name);
+extern void chutney_ring_close(chutney_ring *ring);
+extern void chutney_ring_send_begin(chutney_ring *ring);
+extern int chutney_ring_writable(chutney_ring *ring, size_t n);
+extern int chutney_ring_reserve(chutney_ring *ring, size_t n);
+extern int chutney_ring_write(void *context, const char *s, size_t n);
+extern int chutney_ring_send_end(chutney_ring *ring);
+extern int chutney_ring_recv(chutney_ring *ring, struct iovec *iov,
+                             int *iovcnt);
+extern void chutney_ring_release(chutney_ring *ring);
+
+/*
+ * Append-only record log - see chutneylog.c. A log is opened either to
+ * append or to read; when reading, the whole file is mapped.
+ */
+#define CHUTNEY_LOG_MAGIC "CHL\x01"
+#define CHUTNEY_LOG_TRAILER_MAGIC "CHLE"
+#define CHUTNEY_LOG_HEADER 12           // kind, flags, key len, len, crc32c
+#define CHUTNEY_LOG_INDEX_EVERY 1024    // records per index block
+
+typedef struct {
+    long long record;
+    size_t key;                 // offset in keydata
+    int key_len;
+} chutney_log_key;
+
+typedef struct {
+    int fd;                     // appending, or -1
+    chutney_mapping map;        // reading
+    long long size;             // end of the last good frame
+    long long footer;           // offset of the footer, if there is one
+    long long count;            // records
+    long long *blocks;          // offsets of the index blocks
+    long nblocks;
+    long blocks_alloc;
+    long long tail[CHUTNEY_LOG_INDEX_EVERY];
+    int ntail;                  // records after the last index block
+    chutney_log_key *keys;      // in record order
+    long nkeys;
+    long keys_alloc;
+    char *keydata;
+    size_t keydata_len;
+    size_t keydata_alloc;
+    long *key_hash;             // reading: index + 1 into keys, or 0
+    long key_hash_size;
+} chutney_log;
+
+typedef int (*chutney_log_scan_fn)(void *context, long long record,
+                                   const char *key, int key_len,
+                                   const char *data, size_t len);
+
+extern int chutney_log_open(chutney_log *log, const char *path, int append);
+extern int chutney_log_append(chutney_log *log, const char *key, int key_len,
+                              const char *data, size_t len);
+extern int chutney_log_sync(chutney_log *log);
+extern int chutney_log_close(chutney_log *log);
+extern enum chutney_status chutney_log_record(const chutney_log *log,
+                                              long long n,
+                                              const char **key, int *key_len,
+                                              const char **data, 
+                                              size_t *len);
+extern long long chutney_log_find(const chutney_log *log,
+                                  const char *key, int key_len);
+extern enum chutney_status chutney_log_scan(const chutney_log *log,
+                                            int threads,
+                                            chutney_log_scan_fn fn,
+                                            void *context);
+
+/* Pull parser functions */
+extern void chutney_reader_init(chutney_reader *reader);
+extern enum chutney_status chutney_reader_next(chutney_reader *reader,
+                                               const char **data, 
+                                               size_t *length,
+                                               chutney_event *event);
+
+/* Content hash functions */
+extern void chutney_hash_init(chutney_hash *hash, unsigned long long seed);
+extern void chutney_hash_update(chutney_hash *hash, const char *s, size_t n);
+extern unsigned long long chutney_hash_digest(const chutney_hash *hash);
+
+/* Framed container functions */
+extern unsigned int chutney_crc32c(unsigned int crc, const char *s, size_t n);
+extern int chutney_frame_writer_init(chutney_frame_writer *writer,
+                      int (*write)(void *context, const char *s, size_t n),
+                      void *write_context, int block_size);
+extern int chutney_frame_write(void *writer, const char *s, size_t n);
+extern int chutney_frame_flush(chutney_frame_writer *writer);
+extern void chutney_frame_writer_dealloc(chutney_frame_writer *writer);
+extern void chutney_frame_reader_init(chutney_frame_reader *reader);
+extern void chutney_frame_reader_dealloc(chutney_frame_reader *reader);
+extern enum chutney_status chutney_frame_load(chutney_frame_reader *reader,
+                                              chutney_load_state *state,
+                                              const char **data, 
+                                              size_t *length);
+extern int chutney_frame_decode(const char *block, int length,
+                                char *out, int out_len);
 
 /* Dump functions */
 extern int chutney_dump_init(chutney_dump_state *state, 
-                      int (*write)(void *context, const char *s, long n),
+                      int (*write)(void *context, const char *s, size_t n),
                       void *write_context);
+extern int chutney_dump_init_buffer(chutney_dump_state *state, 
+                                    char *buf, size_t size);
+extern size_t chutney_dump_buffer_len(const chutney_dump_state *state);
+extern int chutney_dump_init_iov(chutney_dump_state *state, size_t threshold);
+extern int chutney_dump_iov(chutney_dump_state *state,
+                            const struct iovec **iov, int *iovcnt);
+extern int chutney_dump_writev(chutney_dump_state *state, int fd);
+extern int chutney_dump_set_protocol(chutney_dump_state *state, 
+                                     int protocol);
+extern int chutney_dump_set_allocator(chutney_dump_state *state, 
+                                      const chutney_allocator *allocator);
 extern void chutney_dump_dealloc(chutney_dump_state *state);
 
+/* Tree encoding - see chutneytree.c */
+extern int chutney_dump_tree(chutney_dump_state *state,
+                             const chutney_tree *tree, const void *root,
+                             int threads);
+extern int chutney_save_chunk(chutney_dump_state *self,
+                              const chutney_dump_chunk *chunk);
+
 extern int chutney_save_stop(chutney_dump_state *self);
 extern int chutney_save_mark(chutney_dump_state *self);
 extern int chutney_save_null(chutney_dump_state *self);
@@ -94,13 +652,37 @@ extern int chutney_save_bool(chutney_dump_state *self, int value);
 extern int chutney_save_int(chutney_dump_state *self, long value);
 extern int chutney_save_float(chutney_dump_state *self, double value);
 extern int chutney_save_string(chutney_dump_state *self, 
-                                const char *value, int size);
+                                const char *value, size_t size);
 extern int chutney_save_utf8(chutney_dump_state *self, 
-                                const char *value, int size);
+                                const char *value, size_t size);
+extern int chutney_encode_string(chutney_dump_state *self, 
+                                 const char *value, size_t len,
+                                 char *buf, int size);
+extern int chutney_save_encoded(chutney_dump_state *self, 
+                                const char *buf, int len);
 extern int chutney_save_tuple(chutney_dump_state *self);
 extern int chutney_save_empty_dict(chutney_dump_state *self);
 extern int chutney_save_setitems(chutney_dump_state *self);
 extern int chutney_save_global(chutney_dump_state *self, 
                                 const char *module, const char *name);
+extern int chutney_encode_inst_header(chutney_dump_state *self, 
+                                      const char *module, const char *name,
+                                      char *buf, int size);
+extern int chutney_save_inst_header(chutney_dump_state *self, 
+                                    const char *header, int len);
 extern int chutney_save_obj(chutney_dump_state *self);
 extern int chutney_save_build(chutney_dump_state *self);
+
+/* Columnar instances - not pickle compatible */
+#define CHUTNEY_COLUMNS_MAX 0x7fffffffL  // most attributes, rows or values
+
+extern int chutney_save_ints(chutney_dump_state *self, 
+                             const int *values, size_t count);
+extern int chutney_save_floats(chutney_dump_state *self, 
+                               const double *values, size_t count);
+extern int chutney_save_columns(chutney_dump_state *self, 
+                                size_t attrs, size_t rows);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,1071 @@
+/*
+ * Header-only C++17 interface to chutney - typed encoding and decoding.
+ *
+ *   std::string data = chutney::encode(std::make_tuple(1, 2.5, "abc"s));
+ *   auto t = chutney::decode<std::tuple<int, double, std::string>>(data);
+ *
+ * Values are encoded exactly as the C library (and Python binding) would
+ * encode them, but directly into the output, without a write function.
+ * Types with a fixed maximum encoded size (arithmetic types, and arrays,
+ * tuples and optionals of them) have it computed at compile time, so
+ * encoding them is a fixed sequence of stores into a single reservation.
+ *
+ * Supported types are bool, integers (within 32 bits), float and double,
+ * std::string and std::string_view, std::optional (None when empty),
+ * std::vector and std::array (as tuples), std::tuple and std::pair,
+ * std::map and std::unordered_map, and structs described by specialising
+ * chutney::fields:
+ *
+ *   namespace chutney {
+ *   template <> struct fields<Point> {
+ *       static constexpr const char *module = "geometry";
+ *       static constexpr const char *name = "Point";
+ *       static constexpr auto list = std::make_tuple(
+ *           field("x", &Point::x), field("y", &Point::y));
+ *   };
+ *   }
+ *
+ * which are saved as instances of module.name (MARK GLOBAL OBJ, then the
+ * named fields as the instance dictionary, then BUILD).
+ *
+ * chutney::parse(bytes, visitor) is the untyped equivalent of decode,
+ * calling on_int, on_string, begin_tuple, end_tuple and so on directly on
+ * the visitor (see chutney::visitor) as values are parsed.
+ *
+ * decode and parse accept the opcodes the C library's encoder generates,
+ * at any protocol, but not the postfix TUPLE1, TUPLE2, TUPLE3 and SETITEM
+ * forms, which can't be matched to a value without unbounded lookahead.
+ * Decoding into std::string_view refers directly to the input. Errors are
+ * reported by throwing chutney::error.
+ */
+#ifndef CHUTNEY_HPP
+#define CHUTNEY_HPP
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "chutney.h"
+
+namespace chutney {
+
+// Opcodes - chutneyprotocol.h is private to the library (and its macro
+// names would collide with user code)
+namespace op {
+inline constexpr char mark = '(';
+inline constexpr char stop = '.';
+inline constexpr char binfloat = 'G';
+inline constexpr char int_ = 'I';
+inline constexpr char binint = 'J';
+inline constexpr char binint1 = 'K';
+inline constexpr char binint2 = 'M';
+inline constexpr char none = 'N';
+inline constexpr char binstring = 'T';
+inline constexpr char short_binstring = 'U';
+inline constexpr char binunicode = 'X';
+inline constexpr char binbytes = 'B';
+inline constexpr char short_binbytes = 'C';
+inline constexpr char build = 'b';
+inline constexpr char global = 'c';
+inline constexpr char empty_dict = '}';
+inline constexpr char obj = 'o';
+inline constexpr char setitem = 's';
+inline constexpr char tuple = 't';
+inline constexpr char empty_tuple = ')';
+inline constexpr char setitems = 'u';
+inline constexpr char proto = '\x80';
+inline constexpr char tuple1 = '\x85';
+inline constexpr char tuple2 = '\x86';
+inline constexpr char tuple3 = '\x87';
+inline constexpr char newtrue = '\x88';
+inline constexpr char newfalse = '\x89';
+inline constexpr char short_binunicode = '\x8c';
+inline constexpr char binunicode8 = '\x8d';
+inline constexpr char binbytes8 = '\x8e';
+inline constexpr char memoize = '\x94';
+inline constexpr char frame = '\x95';
+}
+
+class error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Struct descriptions - see above
+template <class T> struct fields;
+
+template <class C, class M>
+struct field_ref {
+    const char *name;
+    M C::*member;
+};
+
+template <class C, class M>
+constexpr field_ref<C, M> field(const char *name, M C::*member)
+{
+    return {name, member};
+}
+
+namespace detail {
+
+/*
+ * Pulls opcodes from a chutney held in memory. PROTO, FRAME and MEMOIZE
+ * have no bearing on the decoded value, and are skipped.
+ */
+class reader {
+public:
+    explicit reader(std::string_view in)
+        : p_(in.data()), end_(in.data() + in.size()) {}
+
+    char peek()
+    {
+        for (;;) {
+            need(1);
+            switch (*p_) {
+            case op::proto:
+                need(2);
+                if ((unsigned char)p_[1] > CHUTNEY_HIGHEST_PROTOCOL)
+                    throw error("unsupported protocol");
+                p_ += 2;
+                break;
+            case op::frame:
+                need(9);
+                p_ += 9;
+                break;
+            case op::memoize:
+                ++p_;
+                break;
+            default:
+                return *p_;
+            }
+        }
+    }
+
+    char next()
+    {
+        char c = peek();
+        ++p_;
+        return c;
+    }
+
+    void expect(char c, const char *what)
+    {
+        if (next() != c)
+            throw error(what);
+    }
+
+    long long integer()
+    {
+        std::string_view s;
+
+        switch (next()) {
+        case op::newfalse:
+            return 0;
+        case op::newtrue:
+            return 1;
+        case op::binint1:
+            return (unsigned char)take(1)[0];
+        case op::binint2:
+            return (long long)length(2);
+        case op::binint:
+            return (std::int32_t)(std::uint32_t)length(4);
+        case op::int_: {
+            char buf[32], *end;
+            long long l;
+
+            s = line();
+            if (s.size() >= sizeof(buf))
+                throw error("bad integer");
+            std::memcpy(buf, s.data(), s.size());
+            buf[s.size()] = '\0';
+            errno = 0;
+            l = std::strtoll(buf, &end, 0);
+            if (errno || *end != '\0' || end == buf)
+                throw error("bad integer");
+            return l;
+        }
+        default:
+            throw error("expected integer");
+        }
+    }
+
+    double number()
+    {
+        std::uint64_t bits = 0;
+        double d;
+        int i;
+
+        if (peek() != op::binfloat)
+            return (double)integer();
+        ++p_;
+        std::string_view s = take(8);
+        for (i = 0; i < 8; ++i)
+            bits = (bits << 8) | (unsigned char)s[i];
+        std::memcpy(&d, &bits, sizeof(d));
+        return d;
+    }
+
+    std::string_view string()
+    {
+        switch (next()) {
+        case op::short_binstring:
+        case op::short_binbytes:
+        case op::short_binunicode:
+            return take(length(1));
+        case op::binstring:
+        case op::binbytes:
+        case op::binunicode:
+            return take(length(4));
+        case op::binbytes8:
+        case op::binunicode8:
+            return take(length(8));
+        default:
+            throw error("expected string");
+        }
+    }
+
+    // GLOBAL module and name
+    std::pair<std::string_view, std::string_view> global()
+    {
+        expect(op::global, "expected global");
+        std::string_view module = line();
+        return {module, line()};
+    }
+
+    // Start of a tuple - false if it is empty and already complete
+    bool begin_tuple()
+    {
+        char c = next();
+
+        if (c == op::empty_tuple)
+            return false;
+        if (c != op::mark)
+            throw error("expected tuple");
+        return true;
+    }
+
+    bool end_tuple()
+    {
+        if (peek() != op::tuple)
+            return false;
+        ++p_;
+        return true;
+    }
+
+    /*
+     * After a dictionary, a MARK could start a batch of its items, or the
+     * value following it. Only the opcode closing the MARK tells them apart.
+     */
+    bool begin_setitems()
+    {
+        if (peek() != op::mark || closer() != op::setitems)
+            return false;
+        ++p_;
+        return true;
+    }
+
+    bool end_setitems()
+    {
+        if (peek() != op::setitems)
+            return false;
+        ++p_;
+        return true;
+    }
+
+    const char *position() const
+    {
+        return p_;
+    }
+
+private:
+    void need(std::size_t n) const
+    {
+        if ((std::size_t)(end_ - p_) < n)
+            throw error("truncated chutney");
+    }
+
+    std::string_view take(std::size_t n)
+    {
+        need(n);
+        std::string_view s(p_, n);
+        p_ += n;
+        return s;
+    }
+
+    // Little-endian unsigned length of n bytes
+    std::uint64_t length(int n)
+    {
+        std::string_view s = take(n);
+        std::uint64_t l = 0;
+
+        while (n--)
+            l = (l << 8) | (unsigned char)s[n];
+        return l;
+    }
+
+    std::string_view line()
+    {
+        const char *nl;
+
+        need(1);
+        if ((nl = (const char *)std::memchr(p_, '\n', end_ - p_)) == nullptr)
+            throw error("truncated chutney");
+        std::string_view s(p_, nl - p_);
+        p_ = nl + 1;
+        return s;
+    }
+
+    // Position after the opcode at p and its argument
+    const char *skip(const char *p) const
+    {
+        const char *nl;
+        std::uint64_t l = 0;
+        int i, n = 0, lines = 0;
+
+        switch (*p++) {
+        case op::binint1: case op::proto:
+            l = 1;
+            break;
+        case op::binint2:
+            l = 2;
+            break;
+        case op::binint:
+            l = 4;
+            break;
+        case op::binfloat: case op::frame:
+            l = 8;
+            break;
+        case op::short_binstring: case op::short_binbytes:
+        case op::short_binunicode:
+            n = 1;
+            break;
+        case op::binstring: case op::binbytes: case op::binunicode:
+            n = 4;
+            break;
+        case op::binbytes8: case op::binunicode8:
+            n = 8;
+            break;
+        case op::int_:
+            lines = 1;
+            break;
+        case op::global:
+            lines = 2;
+            break;
+        case op::mark: case op::stop: case op::none: case op::newtrue:
+        case op::newfalse: case op::tuple: case op::empty_tuple:
+        case op::tuple1: case op::tuple2: case op::tuple3:
+        case op::empty_dict: case op::setitem: case op::setitems:
+        case op::obj: case op::build: case op::memoize:
+            break;
+        default:
+            throw error("unsupported opcode");
+        }
+        if ((std::size_t)(end_ - p) < (std::size_t)n)
+            throw error("truncated chutney");
+        for (i = n; i--; )
+            l = (l << 8) | (unsigned char)p[i];
+        p += n;
+        while (lines--) {
+            if ((nl = (const char *)std::memchr(p, '\n', end_ - p)) == nullptr)
+                throw error("truncated chutney");
+            p = nl + 1;
+        }
+        if ((std::uint64_t)(end_ - p) < l)
+            throw error("truncated chutney");
+        return p + l;
+    }
+
+    /*
+     * The opcode closing the MARK at the current position, or 0. The first
+     * call pairs every MARK from there to the STOP in one pass, and later
+     * calls, always further on, walk through the pairs.
+     */
+    char closer()
+    {
+        std::vector<std::size_t> open;
+        const char *p = p_;
+        char c;
+
+        if (!scanned_) {
+            scanned_ = true;
+            while (p < end_) {
+                c = *p;
+                if (c == op::mark) {
+                    open.push_back(closers_.size());
+                    closers_.push_back({p, 0});
+                } else if (c == op::tuple || c == op::obj ||
+                           c == op::setitems) {
+                    if (!open.empty()) {    // else closing an earlier MARK
+                        closers_[open.back()].second = c;
+                        open.pop_back();
+                    }
+                } else if (c == op::stop)
+                    break;
+                p = skip(p);
+            }
+        }
+        while (next_ < closers_.size() && closers_[next_].first < p_)
+            ++next_;
+        if (next_ < closers_.size() && closers_[next_].first == p_)
+            return closers_[next_].second;
+        return 0;
+    }
+
+    const char *p_, *end_;
+    bool scanned_ = false;
+    std::vector<std::pair<const char *, char>> closers_;  // MARK, closer
+    std::size_t next_ = 0;
+};
+
+template <class T, class = void> struct codec;
+
+// Codecs for values with a fixed maximum encoding have a constant "bound"
+template <class T, class = void>
+struct is_fixed : std::false_type {};
+template <class T>
+struct is_fixed<T, std::void_t<decltype(codec<T>::bound)>> : std::true_type {};
+template <class T>
+inline constexpr bool is_fixed_v = is_fixed<T>::value;
+
+template <std::size_t N> struct bounded {
+    static constexpr std::size_t bound = N;
+};
+struct unbounded {};
+template <bool Fixed, std::size_t N>
+using bound_base = std::conditional_t<Fixed, bounded<N>, unbounded>;
+
+template <class T>
+constexpr std::size_t bound_of()
+{
+    if constexpr (is_fixed_v<T>)
+        return codec<T>::bound;
+    else
+        return 0;
+}
+
+// Maximum encoded size of a value
+template <class T>
+std::size_t size_of(const T &value)
+{
+    if constexpr (is_fixed_v<T>)
+        return codec<T>::bound;
+    else
+        return codec<T>::size(value);
+}
+
+inline char *
+put_u32(char *p, std::uint32_t v)
+{
+    p[0] = (char)(v & 0xff);
+    p[1] = (char)((v >> 8) & 0xff);
+    p[2] = (char)((v >> 16) & 0xff);
+    p[3] = (char)((v >> 24) & 0xff);
+    return p + 4;
+}
+
+template <>
+struct codec<bool> : bounded<1> {
+    static char *put(char *p, bool value)
+    {
+        *p++ = value ? op::newtrue : op::newfalse;
+        return p;
+    }
+
+    static void get(reader &r, bool &value)
+    {
+        value = r.integer() != 0;
+    }
+};
+
+// As chutney_save_int - BININT2 for 0 to 65535, otherwise BININT
+template <class T>
+struct codec<T, std::enable_if_t<std::is_integral_v<T> &&
+                                 !std::is_same_v<T, bool>>> : bounded<5> {
+    static char *put(char *p, T value)
+    {
+        if constexpr (sizeof(T) > 4 || (sizeof(T) == 4 &&
+                                         std::is_unsigned_v<T>)) {
+            if (value > (T)INT32_MAX ||
+                    (std::is_signed_v<T> && value < (T)INT32_MIN))
+                throw error("integer out of range");
+        }
+        if (value >= 0 && value <= 0xffff) {
+            p[0] = op::binint2;
+            p[1] = (char)(value & 0xff);
+            p[2] = (char)((value >> 8) & 0xff);
+            return p + 3;
+        }
+        *p++ = op::binint;
+        return put_u32(p, (std::uint32_t)(std::int32_t)value);
+    }
+
+    static void get(reader &r, T &value)
+    {
+        long long l = r.integer();
+
+        if constexpr (std::is_signed_v<T>) {
+            if (l < (long long)std::numeric_limits<T>::min() ||
+                    l > (long long)std::numeric_limits<T>::max())
+                throw error("integer out of range");
+        } else {
+            if (l < 0 || (unsigned long long)l >
+                         (unsigned long long)std::numeric_limits<T>::max())
+                throw error("integer out of range");
+        }
+        value = (T)l;
+    }
+};
+
+// BINFLOAT is a big-endian IEEE double
+template <class T>
+struct codec<T, std::enable_if_t<std::is_floating_point_v<T>>>
+        : bounded<9> {
+    static_assert(std::numeric_limits<double>::is_iec559,
+                  "chutney requires IEEE floating point");
+
+    static char *put(char *p, T value)
+    {
+        double d = value;
+        std::uint64_t bits;
+        int i;
+
+        std::memcpy(&bits, &d, sizeof(bits));
+        *p++ = op::binfloat;
+        for (i = 0; i < 8; ++i)
+            *p++ = (char)((bits >> (56 - i * 8)) & 0xff);
+        return p;
+    }
+
+    static void get(reader &r, T &value)
+    {
+        value = (T)r.number();
+    }
+};
+
+// As chutney_save_string - SHORT_BINSTRING or BINSTRING
+template <>
+struct codec<std::string_view> {
+    static std::size_t size(std::string_view value)
+    {
+        return value.size() + 5;
+    }
+
+    static char *put(char *p, std::string_view value)
+    {
+        std::size_t size = value.size();
+
+        if (size < 256) {
+            *p++ = op::short_binstring;
+            *p++ = (char)size;
+        } else {
+            if (size > INT32_MAX)
+                throw error("string too long");
+            *p++ = op::binstring;
+            p = put_u32(p, (std::uint32_t)size);
+        }
+        std::memcpy(p, value.data(), size);
+        return p + size;
+    }
+
+    static void get(reader &r, std::string_view &value)
+    {
+        value = r.string();
+    }
+};
+
+template <class Tr, class A>
+struct codec<std::basic_string<char, Tr, A>> {
+    typedef std::basic_string<char, Tr, A> type;
+
+    static std::size_t size(const type &value)
+    {
+        return value.size() + 5;
+    }
+
+    static char *put(char *p, const type &value)
+    {
+        return codec<std::string_view>::put(p,
+                            std::string_view(value.data(), value.size()));
+    }
+
+    static void get(reader &r, type &value)
+    {
+        std::string_view s = r.string();
+
+        value.assign(s.data(), s.size());
+    }
+};
+
+template <class T>
+struct codec<std::optional<T>>
+        : bound_base<is_fixed_v<T>, (bound_of<T>() > 1 ? bound_of<T>() : 1)> {
+    static std::size_t size(const std::optional<T> &value)
+    {
+        return value ? size_of(*value) : 1;
+    }
+
+    static char *put(char *p, const std::optional<T> &value)
+    {
+        if (!value) {
+            *p++ = op::none;
+            return p;
+        }
+        return codec<T>::put(p, *value);
+    }
+
+    static void get(reader &r, std::optional<T> &value)
+    {
+        if (r.peek() == op::none) {
+            r.next();
+            value.reset();
+            return;
+        }
+        codec<T>::get(r, value.emplace());
+    }
+};
+
+// Sequences are saved as tuples: MARK, the items, TUPLE
+template <class T, class A>
+struct codec<std::vector<T, A>> {
+    static std::size_t size(const std::vector<T, A> &value)
+    {
+        std::size_t n = 2;
+
+        if constexpr (is_fixed_v<T>)
+            return n + value.size() * codec<T>::bound;
+        for (const auto &item : value)
+            n += size_of(item);
+        return n;
+    }
+
+    static char *put(char *p, const std::vector<T, A> &value)
+    {
+        *p++ = op::mark;
+        for (const auto &item : value)
+            p = codec<T>::put(p, item);
+        *p++ = op::tuple;
+        return p;
+    }
+
+    static void get(reader &r, std::vector<T, A> &value)
+    {
+        value.clear();
+        if (!r.begin_tuple())
+            return;
+        while (!r.end_tuple()) {
+            T item{};
+
+            codec<T>::get(r, item);
+            value.push_back(std::move(item));
+        }
+    }
+};
+
+template <class T, std::size_t N>
+struct codec<std::array<T, N>>
+        : bound_base<is_fixed_v<T>, 2 + N * bound_of<T>()> {
+    static std::size_t size(const std::array<T, N> &value)
+    {
+        std::size_t n = 2;
+
+        for (const auto &item : value)
+            n += size_of(item);
+        return n;
+    }
+
+    static char *put(char *p, const std::array<T, N> &value)
+    {
+        *p++ = op::mark;
+        for (const auto &item : value)
+            p = codec<T>::put(p, item);
+        *p++ = op::tuple;
+        return p;
+    }
+
+    static void get(reader &r, std::array<T, N> &value)
+    {
+        if (!r.begin_tuple()) {
+            if (N)
+                throw error("tuple too short");
+            return;
+        }
+        for (auto &item : value) {
+            if (r.end_tuple())
+                throw error("tuple too short");
+            codec<T>::get(r, item);
+        }
+        if (!r.end_tuple())
+            throw error("tuple too long");
+    }
+};
+
+template <class Tuple, class... T>
+struct tuple_codec
+        : bound_base<(is_fixed_v<T> && ...), 2 + (bound_of<T>() + ... + 0)> {
+    static std::size_t size(const Tuple &value)
+    {
+        return std::apply([](const auto &... item) {
+            return (std::size_t)2 + (size_of(item) + ... + 0);
+        }, value);
+    }
+
+    static char *put(char *p, const Tuple &value)
+    {
+        *p++ = op::mark;
+        std::apply([&p](const auto &... item) {
+            ((p = codec<std::decay_t<decltype(item)>>::put(p, item)), ...);
+        }, value);
+        *p++ = op::tuple;
+        return p;
+    }
+
+    static void get(reader &r, Tuple &value)
+    {
+        if (!r.begin_tuple()) {
+            if (std::tuple_size_v<Tuple>)
+                throw error("tuple too short");
+            return;
+        }
+        std::apply([&r](auto &... item) {
+            ((r.end_tuple() ? throw error("tuple too short") :
+                codec<std::decay_t<decltype(item)>>::get(r, item)), ...);
+        }, value);
+        if (!r.end_tuple())
+            throw error("tuple too long");
+    }
+};
+
+template <class... T>
+struct codec<std::tuple<T...>> : tuple_codec<std::tuple<T...>, T...> {};
+
+template <class T, class U>
+struct codec<std::pair<T, U>> : tuple_codec<std::pair<T, U>, T, U> {};
+
+// Mappings are saved as EMPTY_DICT, then batches of MARK, keys and values,
+// SETITEMS
+template <class Map>
+struct map_codec {
+    typedef typename Map::key_type key_type;
+    typedef typename Map::mapped_type mapped_type;
+
+    static std::size_t size(const Map &value)
+    {
+        std::size_t n = 1 + (value.size() + CHUTNEY_BATCHSIZE - 1) /
+                            CHUTNEY_BATCHSIZE * 2;
+
+        for (const auto &item : value)
+            n += size_of(item.first) + size_of(item.second);
+        return n;
+    }
+
+    static char *put(char *p, const Map &value)
+    {
+        std::size_t n = 0;
+
+        *p++ = op::empty_dict;
+        for (const auto &item : value) {
+            if (n % CHUTNEY_BATCHSIZE == 0) {
+                if (n)
+                    *p++ = op::setitems;
+                *p++ = op::mark;
+            }
+            p = codec<key_type>::put(p, item.first);
+            p = codec<mapped_type>::put(p, item.second);
+            ++n;
+        }
+        if (n)
+            *p++ = op::setitems;
+        return p;
+    }
+
+    static void get(reader &r, Map &value)
+    {
+        value.clear();
+        r.expect(op::empty_dict, "expected dict");
+        while (r.begin_setitems()) {
+            while (!r.end_setitems()) {
+                key_type key{};
+                mapped_type item{};
+
+                codec<key_type>::get(r, key);
+                codec<mapped_type>::get(r, item);
+                value.insert_or_assign(std::move(key), std::move(item));
+            }
+        }
+    }
+};
+
+template <class K, class V, class C, class A>
+struct codec<std::map<K, V, C, A>> : map_codec<std::map<K, V, C, A>> {};
+
+template <class K, class V, class H, class E, class A>
+struct codec<std::unordered_map<K, V, H, E, A>>
+        : map_codec<std::unordered_map<K, V, H, E, A>> {};
+
+// Structs described by chutney::fields are saved as instances
+template <class T>
+struct codec<T, std::void_t<decltype(fields<T>::list)>> {
+    typedef fields<T> desc;
+    static constexpr std::size_t count =
+        std::tuple_size_v<std::decay_t<decltype(desc::list)>>;
+    static_assert(count <= CHUTNEY_BATCHSIZE, "too many fields");
+
+    static std::size_t size(const T &value)
+    {
+        return std::strlen(desc::module) + std::strlen(desc::name) + 10 +
+            std::apply([&value](const auto &... f) {
+                return (std::size_t)0 +
+                    ((std::strlen(f.name) + 5 + size_of(value.*f.member)) +
+                     ... + 0);
+            }, desc::list);
+    }
+
+    static char *put(char *p, const T &value)
+    {
+        std::size_t len;
+
+        *p++ = op::mark;
+        *p++ = op::global;
+        len = std::strlen(desc::module);
+        std::memcpy(p, desc::module, len);
+        p += len;
+        *p++ = '\n';
+        len = std::strlen(desc::name);
+        std::memcpy(p, desc::name, len);
+        p += len;
+        *p++ = '\n';
+        *p++ = op::obj;
+        *p++ = op::empty_dict;
+        if (count) {
+            *p++ = op::mark;
+            std::apply([&p, &value](const auto &... f) {
+                ((p = codec<std::string_view>::put(p, f.name),
+                  p = codec<std::decay_t<decltype(value.*f.member)>>::put(
+                        p, value.*f.member)), ...);
+            }, desc::list);
+            *p++ = op::setitems;
+        }
+        *p++ = op::build;
+        return p;
+    }
+
+    static void get(reader &r, T &value)
+    {
+        r.expect(op::mark, "expected instance");
+        auto global = r.global();
+        if (global.first != desc::module || global.second != desc::name)
+            throw error("unexpected class");
+        r.expect(op::obj, "expected instance");
+        r.expect(op::empty_dict, "expected instance dict");
+        while (r.begin_setitems()) {
+            while (!r.end_setitems()) {
+                std::string_view name = r.string();
+                bool found = std::apply([&](const auto &... f) {
+                    return ((name == f.name ?
+                             (codec<std::decay_t<decltype(value.*f.member)>>
+                                ::get(r, value.*f.member), true) : false)
+                            || ...);
+                }, desc::list);
+                if (!found)
+                    throw error("unknown field");
+            }
+        }
+        r.expect(op::build, "expected BUILD");
+    }
+};
+
+} // namespace detail
+
+/*
+ * Base for chutney::parse visitors, ignoring every event. A visitor need
+ * only derive from this and define the events it is interested in - they
+ * are called directly on the visitor's own type, so can be inlined.
+ */
+struct visitor {
+    void on_none() {}
+    void on_bool(bool) {}
+    void on_int(long long) {}
+    void on_float(double) {}
+    void on_string(std::string_view) {}     // str or bytes
+    void on_unicode(std::string_view) {}    // UTF-8
+    void on_global(std::string_view, std::string_view) {}
+    void begin_tuple() {}
+    void end_tuple() {}
+    void begin_dict() {}                    // followed by keys and values
+    void end_dict() {}
+    void begin_object(std::string_view, std::string_view) {}
+    void end_object() {}                    // after the object's state
+};
+
+// Nesting limit for chutney::parse, which recurses
+inline constexpr int max_depth = 1000;
+
+namespace detail {
+
+template <class Visitor>
+void parse_value(reader &r, Visitor &v, int depth)
+{
+    std::pair<std::string_view, std::string_view> global;
+    char c;
+
+    if (depth > max_depth)
+        throw error("nesting too deep");
+    switch (c = r.peek()) {
+    case op::none:
+        r.next();
+        v.on_none();
+        break;
+    case op::newtrue:
+    case op::newfalse:
+        r.next();
+        v.on_bool(c == op::newtrue);
+        break;
+    case op::int_:
+    case op::binint:
+    case op::binint1:
+    case op::binint2:
+        v.on_int(r.integer());
+        break;
+    case op::binfloat:
+        v.on_float(r.number());
+        break;
+    case op::short_binstring:
+    case op::binstring:
+    case op::short_binbytes:
+    case op::binbytes:
+    case op::binbytes8:
+        v.on_string(r.string());
+        break;
+    case op::short_binunicode:
+    case op::binunicode:
+    case op::binunicode8:
+        v.on_unicode(r.string());
+        break;
+    case op::global:
+        global = r.global();
+        v.on_global(global.first, global.second);
+        break;
+    case op::empty_tuple:
+        r.next();
+        v.begin_tuple();
+        v.end_tuple();
+        break;
+    case op::empty_dict:
+        r.next();
+        v.begin_dict();
+        while (r.begin_setitems())
+            while (!r.end_setitems()) {
+                parse_value(r, v, depth + 1);
+                parse_value(r, v, depth + 1);
+            }
+        v.end_dict();
+        break;
+    case op::mark:
+        /* MARK GLOBAL OBJ is an instance, anything else a tuple */
+        r.next();
+        if (r.peek() == op::global) {
+            global = r.global();
+            if (r.peek() == op::obj) {
+                r.next();
+                v.begin_object(global.first, global.second);
+                c = r.peek();
+                if (c != op::stop && c != op::tuple && c != op::setitems) {
+                    parse_value(r, v, depth + 1);
+                    r.expect(op::build, "expected BUILD");
+                }
+                v.end_object();
+                break;
+            }
+            v.begin_tuple();
+            v.on_global(global.first, global.second);
+        } else
+            v.begin_tuple();
+        while (!r.end_tuple())
+            parse_value(r, v, depth + 1);
+        v.end_tuple();
+        break;
+    default:
+        throw error("unsupported opcode");
+    }
+}
+
+} // namespace detail
+
+/*
+ * Parse a complete chutney, calling the visitor's event methods for each
+ * value in turn. Strings are passed as views of the input; the only
+ * allocation is the reader's table of MARK closers, made if a dictionary is
+ * followed by a MARK. Returns the number of bytes consumed, including the
+ * STOP.
+ */
+template <class Visitor>
+std::size_t parse(std::string_view data, Visitor &v)
+{
+    detail::reader r(data);
+
+    detail::parse_value(r, v, 0);
+    r.expect(op::stop, "expected STOP");
+    return r.position() - data.data();
+}
+
+/*
+ * Append the chutney encoding of /value/ to /out/ - a std::string,
+ * std::vector<char> or similar contiguous container of bytes.
+ */
+template <class T, class Out>
+void encode(Out &out, const T &value)
+{
+    static_assert(sizeof(typename Out::value_type) == 1,
+                  "output must be a container of bytes");
+    std::size_t start = out.size();
+    char *p;
+
+    out.resize(start + detail::size_of(value) + 1);
+    try {
+        p = detail::codec<T>::put(reinterpret_cast<char *>(out.data()) +
+                                  start, value);
+    } catch (...) {
+        out.resize(start);
+        throw;
+    }
+    *p++ = op::stop;
+    out.resize(p - reinterpret_cast<char *>(out.data()));
+}
+
+template <class T>
+std::string encode(const T &value)
+{
+    std::string out;
+
+    encode(out, value);
+    return out;
+}
+
+// Decode a complete chutney as a T
+template <class T>
+T decode(std::string_view data)
+{
+    detail::reader r(data);
+    T value{};
+
+    detail::codec<T>::get(r, value);
+    r.expect(op::stop, "expected STOP");
+    return value;
+}
+
+} // namespace chutney
+
+#endif /* CHUTNEY_HPP */
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <string.h>
+#include "chutney.h"
+
+/*
+ * Allocators for the load and dump states. chutney_malloc_allocator is the
+ * default. A chutney_arena hands out memory from large blocks, so a
+ * per-request state costs a few pointer bumps rather than a malloc per
+ * buffer, and everything it allocated is released by one reset. The latest
+ * allocation can grow in place, which is the common case for the parser's
+ * stack and buffer. An arena is not thread safe.
+ */
+
+static void *
+malloc_alloc(void *context, size_t size)
+{
+    return malloc(size);
+}
+
+static void *
+malloc_realloc(void *context, void *ptr, size_t old_size, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void
+malloc_free(void *context, void *ptr, size_t size)
+{
+    free(ptr);
+}
+
+const chutney_allocator chutney_malloc_allocator = {
+    malloc_alloc, malloc_realloc, malloc_free, NULL,
+};
+
+struct chutney_arena_block {
+    chutney_arena_block *next;
+    size_t size;                // bytes following the header
+    size_t used;
+};
+
+#define ALIGN(n) (((n) + CHUTNEY_ARENA_ALIGN - 1) & \
+                  ~(size_t)(CHUTNEY_ARENA_ALIGN - 1))
+#define HEADER ALIGN(sizeof(chutney_arena_block))
+#define DATA(block) ((char *)(block) + HEADER)
+
+/* Start a new block with room for at least /size/ bytes */
+static chutney_arena_block *
+arena_grow(chutney_arena *arena, size_t size)
+{
+    chutney_arena_block *block;
+
+    if (size < arena->block_size)
+        size = arena->block_size;
+    if (size > (size_t)-1 - HEADER)
+        return NULL;
+    if ((block = malloc(HEADER + size)) == NULL)
+        return NULL;
+    block->next = arena->blocks;
+    block->size = size;
+    block->used = 0;
+    arena->blocks = block;
+    return block;
+}
+
+static void *
+arena_alloc(void *context, size_t size)
+{
+    chutney_arena *arena = (chutney_arena *)context;
+    chutney_arena_block *block = arena->blocks;
+    size_t want = ALIGN(size);
+
+    if (want < size)
+        return NULL;
+    if (!block || block->size - block->used < want)
+        if ((block = arena_grow(arena, want)) == NULL)
+            return NULL;
+    arena->last = DATA(block) + block->used;
+    block->used += want;
+    return arena->last;
+}
+
+static void *
+arena_realloc(void *context, void *ptr, size_t old_size, size_t size)
+{
+    chutney_arena *arena = (chutney_arena *)context;
+    chutney_arena_block *block = arena->blocks, *moved;
+    size_t start, want = ALIGN(size);
+    void *res;
+
+    if (!ptr)
+        return arena_alloc(context, size);
+    if (ptr == arena->last && want >= size) {
+        /* the latest allocation grows (or shrinks) in place */
+        start = (char *)ptr - DATA(block);
+        if (block->size - start >= want) {
+            block->used = start + want;
+            return ptr;
+        }
+        /* or if it is alone in its block, the block is resized */
+        if (start == 0) {
+            if (want > (size_t)-1 - HEADER ||
+                    (moved = realloc(block, HEADER + want)) == NULL)
+                return NULL;
+            moved->size = moved->used = want;
+            arena->blocks = moved;
+            return arena->last = DATA(moved);
+        }
+    }
+    if ((res = arena_alloc(context, size)) == NULL)
+        return NULL;
+    memcpy(res, ptr, old_size < size ? old_size : size);
+    return res;
+}
+
+static void
+arena_free(void *context, void *ptr, size_t size)
+{
+    chutney_arena *arena = (chutney_arena *)context;
+
+    /* only the latest allocation can be given back */
+    if (ptr && ptr == arena->last) {
+        arena->blocks->used = (char *)ptr - DATA(arena->blocks);
+        arena->last = NULL;
+    }
+}
+
+/* Initialise an arena allocating blocks of /block_size/ (or a default) */
+void
+chutney_arena_init(chutney_arena *arena, size_t block_size)
+{
+    arena->allocator.alloc = arena_alloc;
+    arena->allocator.realloc = arena_realloc;
+    arena->allocator.free = arena_free;
+    arena->allocator.context = arena;
+    arena->blocks = NULL;
+    arena->block_size = block_size ? block_size : CHUTNEY_ARENA_BLOCK_SIZE;
+    arena->last = NULL;
+}
+
+/*
+ * Release everything allocated from the arena. The newest block is kept
+ * for reuse, so a request pattern that repeats needs no further blocks.
+ */
+void
+chutney_arena_reset(chutney_arena *arena)
+{
+    chutney_arena_block *block, *next;
+
+    if (!arena->blocks)
+        return;
+    for (block = arena->blocks->next; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->blocks->next = NULL;
+    arena->blocks->used = 0;
+    arena->last = NULL;
+}
+
+void
+chutney_arena_dealloc(chutney_arena *arena)
+{
+    chutney_arena_reset(arena);
+    free(arena->blocks);
+    arena->blocks = NULL;
+}
@@ -0,0 +1,403 @@
+#include <stdlib.h>
+#include <string.h>
+#include "chutney.h"
+#include "chutneyprotocol.h"
+#include "chutneyutil.h"
+
+/*
+ * Selective extraction. A chutney is scanned without calling any
+ * callbacks: opcodes are tracked on a stack of item descriptions (where
+ * each item starts, and the bytes of string items), and string bodies are
+ * stepped over using their length prefix. Because pickles are postfix, a
+ * container's children are only known once the opcode that consumes them
+ * is reached - at that point, if the container is the root of the span
+ * being scanned, the span of the child named by the first path step is
+ * recorded. The scan then repeats within that span for the next step, and
+ * only the final span is passed to chutney_load.
+ */
+
+enum item_kind {
+    K_VALUE,                    // anything not otherwise distinguished
+    K_STRING,                   // string or unicode, a possible dict key
+    K_DICT,
+    K_TUPLE,
+    K_OBJ,
+};
+
+typedef struct {
+    enum item_kind kind;
+    const char *start;          // first opcode of the item
+    const char *str;            // K_STRING bytes
+    size_t len;
+    const char *match;          // span of the child named by the path step
+    const char *match_end;
+} item;
+
+typedef struct {
+    long size;                  // stack size when the MARK was seen
+    const char *pos;
+} mark;
+
+typedef struct {
+    const chutney_path_step *step;
+    const chutney_allocator *allocator;
+    item *stack;
+    long stack_size;
+    long stack_alloc;
+    mark *marks;
+    long marks_size;
+    long marks_alloc;
+} scanner;
+
+static int
+push(scanner *s, enum item_kind kind, const char *start)
+{
+    item *tmp;
+    long alloc;
+
+    if (s->stack_size == s->stack_alloc) {
+        alloc = s->stack_alloc ? s->stack_alloc * 2 : 64;
+        if (!(tmp = chutney_realloc(s->allocator, s->stack, 
+                                    s->stack_alloc * sizeof(*tmp),
+                                    alloc * sizeof(*tmp))))
+            return CHUTNEY_NOMEM;
+        s->stack = tmp;
+        s->stack_alloc = alloc;
+    }
+    tmp = &s->stack[s->stack_size++];
+    tmp->kind = kind;
+    tmp->start = start;
+    tmp->match = tmp->match_end = NULL;
+    return CHUTNEY_OKAY;
+}
+
+static int
+push_mark(scanner *s, const char *pos)
+{
+    mark *tmp;
+    long alloc;
+
+    if (s->marks_size == s->marks_alloc) {
+        alloc = s->marks_alloc ? s->marks_alloc * 2 : 16;
+        if (!(tmp = chutney_realloc(s->allocator, s->marks, 
+                                    s->marks_alloc * sizeof(*tmp),
+                                    alloc * sizeof(*tmp))))
+            return CHUTNEY_NOMEM;
+        s->marks = tmp;
+        s->marks_alloc = alloc;
+    }
+    s->marks[s->marks_size].size = s->stack_size;
+    s->marks[s->marks_size].pos = pos;
+    s->marks_size++;
+    return CHUTNEY_OKAY;
+}
+
+static int
+pop_mark(scanner *s, mark *m)
+{
+    if (!s->marks_size)
+        return CHUTNEY_NOMARK_ERR;
+    *m = s->marks[--s->marks_size];
+    return CHUTNEY_OKAY;
+}
+
+/* End of item /i/, whose successor (if any) is the next item on the stack */
+static const char *
+item_end(scanner *s, long i, const char *op)
+{
+    return i + 1 < s->stack_size ? s->stack[i + 1].start : op;
+}
+
+/*
+ * Whether the item at /index/ is the root of the span being scanned, or
+ * the state of a root instance, whose children are the ones the path step
+ * refers to.
+ */
+static int
+is_root(scanner *s, long index)
+{
+    return !s->marks_size && (index == 0 ||
+                              (index == 1 && s->stack[0].kind == K_OBJ));
+}
+
+/*
+ * Items /first/ to the top of the stack are the children (or key/value
+ * pairs) being consumed into a root container by opcode /op/ - record the
+ * span of the one named by the path step, if any.
+ */
+static void
+find_child(scanner *s, long first, int pairs, const char *op,
+           const char **match, const char **match_end)
+{
+    const chutney_path_step *step = s->step;
+    item *key;
+    long i, n = s->stack_size - first;
+
+    if (pairs) {
+        if (!step->key)
+            return;
+        for (i = first; i + 1 < s->stack_size; i += 2) {
+            key = &s->stack[i];
+            if (key->kind == K_STRING && key->len == step->len &&
+                    !memcmp(key->str, step->key, key->len)) {
+                *match = s->stack[i + 1].start;
+                *match_end = item_end(s, i + 1, op);
+            }
+        }
+    } else {
+        i = step->index < 0 ? step->index + n : step->index;
+        if (step->key || i < 0 || i >= n)
+            return;
+        *match = s->stack[first + i].start;
+        *match_end = item_end(s, first + i, op);
+    }
+}
+
+/* Replace items /first/ to the top of the stack with a tuple of them */
+static int
+make_tuple(scanner *s, long first, const char *start, const char *op)
+{
+    const char *match = NULL, *match_end = NULL;
+    int err;
+
+    if (is_root(s, first))
+        find_child(s, first, 0, op, &match, &match_end);
+    s->stack_size = first;
+    if ((err = push(s, K_TUPLE, start)) != CHUTNEY_OKAY)
+        return err;
+    s->stack[first].match = match;
+    s->stack[first].match_end = match_end;
+    return CHUTNEY_OKAY;
+}
+
+/* The size of the stack above the innermost MARK */
+static long
+above_mark(scanner *s)
+{
+    return s->stack_size -
+           (s->marks_size ? s->marks[s->marks_size - 1].size : 0);
+}
+
+static unsigned long long
+get_length(const char *p, int n)
+{
+    unsigned long long l = 0;
+
+    while (n--)
+        l = (l << 8) | (unsigned char)p[n];
+    return l;
+}
+
+/*
+ * Scan the span from /p/ to /end/ (or a STOP opcode), which must contain
+ * a single value. Returns the span of the child named by the path step in
+ * match and match_end, or NULL if there is none.
+ */
+static enum chutney_status
+scan(scanner *s, const char *p, const char *end,
+     const char **match, const char **match_end)
+{
+    const char *op, *nl;
+    unsigned long long len;
+    item *dict;
+    long first;
+    mark m;
+    int err, n;
+
+    s->stack_size = s->marks_size = 0;
+    while (p < end) {
+        op = p++;
+        err = CHUTNEY_OKAY;
+        switch (*op) {
+        case STOP:
+            end = op;
+            break;
+        case PROTO: case BININT1: case BININT2: case BININT: case BINFLOAT:
+        case EXT1: case EXT2: case EXT4:
+            n = *op == BINFLOAT ? 8 : (*op == BININT || *op == EXT4) ? 4 :
+                (*op == BININT2 || *op == EXT2) ? 2 : 1;
+            if (end - p < n)
+                return CHUTNEY_CONTINUE;
+            p += n;
+            if (*op != PROTO)
+                err = push(s, K_VALUE, op);
+            break;
+        case FRAME:
+            if (end - p < 8)
+                return CHUTNEY_CONTINUE;
+            p += 8;
+            break;
+        case MEMOIZE:
+            break;
+        case NONE: case NEWTRUE: case NEWFALSE:
+            err = push(s, K_VALUE, op);
+            break;
+        case INT:
+        case GLOBAL:
+            for (n = *op == GLOBAL ? 2 : 1; n; --n) {
+                if (!(nl = memchr(p, '\n', end - p)))
+                    return CHUTNEY_CONTINUE;
+                p = nl + 1;
+            }
+            err = push(s, K_VALUE, op);
+            break;
+        case SHORT_BINSTRING: case SHORT_BINBYTES: case SHORT_BINUNICODE:
+        case BINSTRING: case BINBYTES: case BINUNICODE:
+        case BINBYTES8: case BINUNICODE8:
+            n = (*op == SHORT_BINSTRING || *op == SHORT_BINBYTES ||
+                 *op == SHORT_BINUNICODE) ? 1 :
+                (*op == BINBYTES8 || *op == BINUNICODE8) ? 8 : 4;
+            if (end - p < n)
+                return CHUTNEY_CONTINUE;
+            len = get_length(p, n);
+            if (n == 4 && *op == BINSTRING && len > 0x7fffffffUL)
+                return CHUTNEY_PARSE_ERR;
+            p += n;
+            if (len > (unsigned long long)(end - p))
+                return CHUTNEY_CONTINUE;
+            if ((err = push(s, K_STRING, op)) == CHUTNEY_OKAY) {
+                s->stack[s->stack_size - 1].str = p;
+                s->stack[s->stack_size - 1].len = len;
+            }
+            p += len;
+            break;
+        case EMPTY_DICT:
+            err = push(s, K_DICT, op);
+            break;
+        case EMPTY_TUPLE:
+            err = push(s, K_TUPLE, op);
+            break;
+        case MARK:
+            err = push_mark(s, op);
+            break;
+        case TUPLE:
+            if ((err = pop_mark(s, &m)) == CHUTNEY_OKAY)
+                err = make_tuple(s, m.size, m.pos, op);
+            break;
+        case TUPLE1: case TUPLE2: case TUPLE3:
+            n = *op - TUPLE1 + 1;
+            if (above_mark(s) < n)
+                return CHUTNEY_STACK_ERR;
+            first = s->stack_size - n;
+            err = make_tuple(s, first, s->stack[first].start, op);
+            break;
+        case SETITEMS:
+            if ((err = pop_mark(s, &m)) != CHUTNEY_OKAY)
+                break;
+            if (m.size < 1 + (s->marks_size ?
+                              s->marks[s->marks_size - 1].size : 0) ||
+                    (s->stack_size - m.size) % 2)
+                return CHUTNEY_STACK_ERR;
+            dict = &s->stack[m.size - 1];
+            if (is_root(s, m.size - 1))
+                find_child(s, m.size, 1, op, &dict->match, &dict->match_end);
+            s->stack_size = m.size;
+            break;
+        case SETITEM:
+            if (above_mark(s) < 3)
+                return CHUTNEY_STACK_ERR;
+            dict = &s->stack[s->stack_size - 3];
+            if (is_root(s, s->stack_size - 3))
+                find_child(s, s->stack_size - 2, 1, op, 
+                           &dict->match, &dict->match_end);
+            s->stack_size -= 2;
+            break;
+        case INTS: case FLOATS:
+            if (end - p < 4)
+                return CHUTNEY_CONTINUE;
+            len = get_length(p, 4) * (*op == INTS ? 4 : 8);
+            p += 4;
+            if (len > (unsigned long long)(end - p))
+                return CHUTNEY_CONTINUE;
+            p += len;
+            err = push(s, K_VALUE, op);
+            break;
+        case COLUMNS:
+            /* the instances can't be looked into */
+            if (end - p < 8)
+                return CHUTNEY_CONTINUE;
+            p += 8;
+            if ((err = pop_mark(s, &m)) == CHUTNEY_OKAY) {
+                s->stack_size = m.size;
+                err = push(s, K_VALUE, m.pos);
+            }
+            break;
+        case OBJ:
+            if ((err = pop_mark(s, &m)) != CHUTNEY_OKAY)
+                break;
+            if (s->stack_size - m.size != 1)
+                return CHUTNEY_STACK_ERR;
+            s->stack_size = m.size;
+            err = push(s, K_OBJ, m.pos);
+            break;
+        case BUILD:
+            if (above_mark(s) < 2)
+                return CHUTNEY_STACK_ERR;
+            /* the state's match, if any, is the instance's */
+            if (s->stack_size == 2 && !s->marks_size &&
+                    s->stack[0].kind == K_OBJ) {
+                s->stack[0].match = s->stack[1].match;
+                s->stack[0].match_end = s->stack[1].match_end;
+            }
+            s->stack_size--;
+            break;
+        default:
+            return CHUTNEY_OPCODE_ERR;
+        }
+        if (err != CHUTNEY_OKAY)
+            return err;
+    }
+    if (s->stack_size != 1 || s->marks_size)
+        return CHUTNEY_STACK_ERR;
+    *match = s->stack[0].match;
+    *match_end = s->stack[0].match_end;
+    return CHUTNEY_OKAY;
+}
+
+/*
+ * Load only the value at /path/ (of /depth/ steps) within the chutney in
+ * /data/, using the callbacks of /state/ (which must be freshly
+ * initialised) - the result is then available from chutney_load_result.
+ * Nothing off the path is passed to the callbacks. Each step names a dict
+ * key (matching string or unicode keys with the same bytes, and also the
+ * attributes of instances), or if its key is NULL, a tuple index
+ * (negative counting from the end). Returns CHUTNEY_NOT_FOUND if there is
+ * no such value.
+ */
+enum chutney_status
+chutney_extract(chutney_load_state *state, const char *data, size_t len,
+                const chutney_path_step *path, int depth)
+{
+    static const char stop = STOP;
+    const char *start = data, *end = data + len, *match, *match_end;
+    scanner s;
+    int status = CHUTNEY_OKAY;
+    size_t n;
+
+    memset(&s, 0, sizeof(s));
+    s.allocator = &state->allocator;
+    for (; depth > 0; --depth, ++path) {
+        s.step = path;
+        status = scan(&s, start, end, &match, &match_end);
+        if (status != CHUTNEY_OKAY)
+            goto finally;
+        if (!match) {
+            status = CHUTNEY_NOT_FOUND;
+            goto finally;
+        }
+        start = match;
+        end = match_end;
+    }
+    /* load the span, which has no STOP unless it is the whole chutney */
+    n = end - start;
+    status = chutney_load(state, &start, &n);
+    if (status == CHUTNEY_CONTINUE) {
+        start = &stop;
+        n = 1;
+        status = chutney_load(state, &start, &n);
+    }
+finally:
+    chutney_free(s.allocator, s.stack, s.stack_alloc * sizeof(*s.stack));
+    chutney_free(s.allocator, s.marks, s.marks_alloc * sizeof(*s.marks));
+    return status;
+}
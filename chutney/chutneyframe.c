@@ -0,0 +1,555 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "chutney.h"
+
+/*
+ * Framed container. The stream starts with CHUTNEY_FRAME_MAGIC, and is
+ * followed by blocks, each of which has a header of three little-endian
+ * 32 bit words:
+ *
+ *      raw length      length of the block once decompressed
+ *      stored length   length of the block body that follows, with
+ *                      CHUTNEY_FRAME_STORED set if the body is not
+ *                      compressed
+ *      crc32c          CRC32C of the decompressed block
+ *
+ * Blocks are compressed independently, so a reader can skip a block
+ * without decompressing it, or decompress several in parallel.
+ *
+ * The compressed format is a byte-oriented LZ77 variant. Each sequence
+ * starts with a token byte - the high nibble is the literal count and the
+ * low nibble the match length less MINMATCH. A nibble of 15 is followed by
+ * further length bytes, each added to the count, until a byte less than
+ * 255 is seen. Then come the literals, then a two byte little-endian match
+ * offset and any match length bytes. The last sequence in a block has only
+ * literals.
+ */
+
+#define MINMATCH        4
+#define LASTLITERALS    5       // block always ends with literals
+#define MAXOFFSET       65535
+#define HASH_BITS       12
+#define HASH_SIZE       (1 << HASH_BITS)
+
+/* ------------------------------------------------------------------------ */
+/* CRC32C (Castagnoli) */
+
+static uint32_t crc32c_table[256];
+
+static void
+crc32c_init_table(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; ++i) {
+        crc = i;
+        for (j = 0; j < 8; ++j)
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t n)
+{
+    if (!crc32c_table[1])
+        crc32c_init_table();
+    while (n--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *p, size_t n)
+{
+    uint64_t crc64 = crc, v;
+
+    for (; n && ((uintptr_t)p & 7); --n)
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    for (; n; --n)
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+    return (uint32_t)crc64;
+}
+#endif
+
+unsigned int
+chutney_crc32c(unsigned int crc, const char *s, size_t n)
+{
+#ifdef HAVE_CRC32C_SSE42
+    static int have_sse42 = -1;
+
+    if (have_sse42 < 0)
+        have_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    if (have_sse42)
+        return ~crc32c_sse42(~crc, (const unsigned char *)s, n);
+#endif
+    return ~crc32c_sw(~crc, (const unsigned char *)s, n);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Block codec */
+
+static uint32_t
+read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned char *
+put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+    return p + 4;
+}
+
+static uint32_t
+get_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static unsigned char *
+put_length(unsigned char *op, unsigned char *op_end, int len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= op_end)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= op_end)
+        return NULL;
+    *op++ = len;
+    return op;
+}
+
+/*
+ * Compress /n/ bytes at /src/ into /dst/, returning the compressed length,
+ * or -1 if the result would not be smaller than the input. /hash/ is
+ * HASH_SIZE ints of scratch.
+ */
+static int
+block_compress(const char *src, int n, char *dst, int *hash)
+{
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base, *anchor = base, *ref;
+    const unsigned char *ip_end = base + n;
+    const unsigned char *match_limit = ip_end - LASTLITERALS;
+    unsigned char *op = (unsigned char *)dst, *token;
+    unsigned char *op_end = op + n - 1;
+    int lit, mlen;
+    uint32_t h;
+
+    memset(hash, 0, HASH_SIZE * sizeof(int));
+    if (n > MINMATCH + LASTLITERALS) {
+        while (ip < match_limit - MINMATCH) {
+            h = (read32(ip) * 2654435761U) >> (32 - HASH_BITS);
+            ref = base + hash[h];
+            hash[h] = ip - base;
+            if (ref >= ip || ip - ref > MAXOFFSET
+                    || read32(ref) != read32(ip)) {
+                ++ip;
+                continue;
+            }
+            for (mlen = MINMATCH; ip + mlen < match_limit
+                    && ref[mlen] == ip[mlen]; ++mlen)
+                ;
+            lit = ip - anchor;
+            if (op + 1 + lit + 2 > op_end)
+                return -1;
+            token = op++;
+            *token = (lit < 15 ? lit : 15) << 4;
+            if (lit >= 15 && !(op = put_length(op, op_end, lit - 15)))
+                return -1;
+            if (op + lit + 2 > op_end)
+                return -1;
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            *token |= mlen - MINMATCH < 15 ? mlen - MINMATCH : 15;
+            if (mlen - MINMATCH >= 15
+                    && !(op = put_length(op, op_end, mlen - MINMATCH - 15)))
+                return -1;
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    lit = ip_end - anchor;
+    if (op + 1 > op_end)
+        return -1;
+    token = op++;
+    *token = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15 && !(op = put_length(op, op_end, lit - 15)))
+        return -1;
+    if (op + lit > op_end)
+        return -1;
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - (unsigned char *)dst;
+}
+
+static int
+get_length(const unsigned char **ipp, const unsigned char *ip_end, int len)
+{
+    const unsigned char *ip = *ipp;
+    unsigned char c;
+
+    do {
+        if (ip >= ip_end)
+            return -1;
+        c = *ip++;
+        len += c;
+        if (len < 0)
+            return -1;
+    } while (c == 255);
+    *ipp = ip;
+    return len;
+}
+
+/*
+ * Decompress /n/ bytes at /src/ into exactly /out_len/ bytes at /dst/.
+ * Returns 0 on success, or -1 if the input is malformed.
+ */
+static int
+block_decompress(const char *src, int n, char *dst, int out_len)
+{
+    const unsigned char *ip = (const unsigned char *)src, *ip_end = ip + n;
+    unsigned char *op = (unsigned char *)dst, *op_end = op + out_len, *ref;
+    int lit, mlen, offset;
+    unsigned char token;
+
+    for (;;) {
+        if (ip >= ip_end)
+            return -1;
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15 && (lit = get_length(&ip, ip_end, lit)) < 0)
+            return -1;
+        if (lit > ip_end - ip || lit > op_end - op)
+            return -1;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == ip_end)
+            break;
+        if (ip_end - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - (unsigned char *)dst)
+            return -1;
+        mlen = token & 15;
+        if (mlen == 15 && (mlen = get_length(&ip, ip_end, mlen)) < 0)
+            return -1;
+        mlen += MINMATCH;
+        if (mlen > op_end - op)
+            return -1;
+        for (ref = op - offset; mlen--; )
+            *op++ = *ref++;
+    }
+    return op == op_end ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Writer */
+
+int
+chutney_frame_writer_init(chutney_frame_writer *writer,
+                          int (*write)(void *context, const char *s, size_t n),
+                          void *write_context, int block_size)
+{
+    if (block_size <= 0)
+        block_size = CHUTNEY_FRAME_BLOCKSIZE;
+    if (block_size > CHUTNEY_FRAME_MAXBLOCK)
+        return -1;
+    writer->write = write;
+    writer->write_context = write_context;
+    writer->block_size = block_size;
+    writer->started = 0;
+    writer->in_len = 0;
+    writer->in = malloc(block_size);
+    writer->out = malloc(CHUTNEY_FRAME_HEADER + block_size);
+    writer->hash = malloc(HASH_SIZE * sizeof(int));
+    if (!writer->in || !writer->out || !writer->hash) {
+        chutney_frame_writer_dealloc(writer);
+        return -1;
+    }
+    return 0;
+}
+
+void
+chutney_frame_writer_dealloc(chutney_frame_writer *writer)
+{
+    free(writer->in);
+    writer->in = NULL;
+    free(writer->out);
+    writer->out = NULL;
+    free(writer->hash);
+    writer->hash = NULL;
+}
+
+/* Compress and write the pending block */
+static int
+frame_write_block(chutney_frame_writer *writer, const char *data, int n)
+{
+    unsigned char *header = (unsigned char *)writer->out;
+    uint32_t stored;
+    int len;
+
+    if (!writer->started) {
+        if (writer->write(writer->write_context, CHUTNEY_FRAME_MAGIC, 4) < 0)
+            return -1;
+        writer->started = 1;
+    }
+    len = block_compress(data, n, writer->out + CHUTNEY_FRAME_HEADER,
+                         writer->hash);
+    if (len < 0) {
+        len = n;
+        stored = n | CHUTNEY_FRAME_STORED;
+        memcpy(writer->out + CHUTNEY_FRAME_HEADER, data, n);
+    } else
+        stored = len;
+    header = put_le32(header, n);
+    header = put_le32(header, stored);
+    put_le32(header, chutney_crc32c(0, data, n));
+    return writer->write(writer->write_context, writer->out,
+                         CHUTNEY_FRAME_HEADER + len);
+}
+
+/*
+ * Write function for chutney_dump_init - /writer/ is the
+ * chutney_frame_writer.
+ */
+int
+chutney_frame_write(void *context, const char *s, size_t n)
+{
+    chutney_frame_writer *writer = (chutney_frame_writer *)context;
+    size_t chunk;
+
+    while (n > 0) {
+        chunk = writer->block_size - writer->in_len;
+        if (chunk > n)
+            chunk = n;
+        memcpy(writer->in + writer->in_len, s, chunk);
+        writer->in_len += chunk;
+        s += chunk;
+        n -= chunk;
+        if (writer->in_len == writer->block_size) {
+            if (frame_write_block(writer, writer->in, writer->in_len) < 0)
+                return -1;
+            writer->in_len = 0;
+        }
+    }
+    return 0;
+}
+
+/* Write out any partial block - must be called after chutney_save_stop */
+int
+chutney_frame_flush(chutney_frame_writer *writer)
+{
+    if (writer->in_len || !writer->started) {
+        if (frame_write_block(writer, writer->in, writer->in_len) < 0)
+            return -1;
+        writer->in_len = 0;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Reader */
+
+void
+chutney_frame_reader_init(chutney_frame_reader *reader)
+{
+    reader->state = CHUTNEY_FRAME_S_MAGIC;
+    reader->header_len = 0;
+    reader->in = NULL;
+    reader->in_len = 0;
+    reader->in_alloc = 0;
+    reader->out = NULL;
+    reader->out_alloc = 0;
+}
+
+void
+chutney_frame_reader_dealloc(chutney_frame_reader *reader)
+{
+    free(reader->in);
+    reader->in = NULL;
+    free(reader->out);
+    reader->out = NULL;
+}
+
+/* Make sure *bufp has room for /want/ bytes */
+static int
+frame_reserve(char **bufp, int *allocp, int want)
+{
+    char *tmp;
+
+    if (*allocp >= want)
+        return 0;
+    if ((tmp = realloc(*bufp, want)) == NULL)
+        return -1;
+    *bufp = tmp;
+    *allocp = want;
+    return 0;
+}
+
+/* Decode a block body into reader->out */
+static enum chutney_status
+frame_decode_body(chutney_frame_reader *reader, const char *body)
+{
+    if (frame_reserve(&reader->out, &reader->out_alloc, reader->raw_len) < 0)
+        return CHUTNEY_NOMEM;
+    if (!reader->compressed)
+        memcpy(reader->out, body, reader->raw_len);
+    else if (block_decompress(body, reader->stored_len,
+                              reader->out, reader->raw_len) < 0)
+        return CHUTNEY_PARSE_ERR;
+    if (chutney_crc32c(0, reader->out, reader->raw_len) != reader->crc)
+        return CHUTNEY_CHECKSUM_ERR;
+    return CHUTNEY_OKAY;
+}
+
+/*
+ * Like chutney_load, but reading a framed container. Each block is
+ * decompressed (directly from the passed data if the whole block is
+ * present, otherwise once the block has been collected), checked, and
+ * then parsed.
+ */
+enum chutney_status
+chutney_frame_load(chutney_frame_reader *reader, chutney_load_state *state,
+                   const char **datap, size_t *len)
+{
+    const unsigned char *header;
+    const char *out;
+    enum chutney_status err;
+    uint32_t stored;
+    size_t chunk, out_len;
+
+    while (*len > 0) {
+        switch (reader->state) {
+        case CHUTNEY_FRAME_S_MAGIC:
+        case CHUTNEY_FRAME_S_HEADER:
+            chunk = (reader->state == CHUTNEY_FRAME_S_MAGIC ?
+                     4 : CHUTNEY_FRAME_HEADER) - reader->header_len;
+            if (chunk > *len)
+                chunk = *len;
+            memcpy(reader->header + reader->header_len, *datap, chunk);
+            reader->header_len += chunk;
+            *datap += chunk;
+            *len -= chunk;
+            if (reader->state == CHUTNEY_FRAME_S_MAGIC) {
+                if (reader->header_len < 4)
+                    break;
+                if (memcmp(reader->header, CHUTNEY_FRAME_MAGIC, 4) != 0)
+                    return CHUTNEY_PARSE_ERR;
+                reader->header_len = 0;
+                reader->state = CHUTNEY_FRAME_S_HEADER;
+                break;
+            }
+            if (reader->header_len < CHUTNEY_FRAME_HEADER)
+                break;
+            header = (const unsigned char *)reader->header;
+            reader->header_len = 0;
+            reader->raw_len = get_le32(header);
+            stored = get_le32(header + 4);
+            reader->crc = get_le32(header + 8);
+            reader->compressed = !(stored & CHUTNEY_FRAME_STORED);
+            reader->stored_len = stored & ~CHUTNEY_FRAME_STORED;
+            if ((uint32_t)reader->raw_len > CHUTNEY_FRAME_MAXBLOCK
+                    || (uint32_t)reader->stored_len > CHUTNEY_FRAME_MAXBLOCK
+                    || (!reader->compressed
+                        && reader->stored_len != reader->raw_len))
+                return CHUTNEY_PARSE_ERR;
+            reader->in_len = 0;
+            reader->state = CHUTNEY_FRAME_S_BODY;
+            break;
+
+        case CHUTNEY_FRAME_S_BODY:
+            if (reader->in_len == 0 && *len >= (size_t)reader->stored_len) {
+                /* Whole block present - decode straight from the input */
+                err = frame_decode_body(reader, *datap);
+                *datap += reader->stored_len;
+                *len -= reader->stored_len;
+            } else {
+                if (frame_reserve(&reader->in, &reader->in_alloc,
+                                  reader->stored_len) < 0)
+                    return CHUTNEY_NOMEM;
+                chunk = reader->stored_len - reader->in_len;
+                if (chunk > *len)
+                    chunk = *len;
+                memcpy(reader->in + reader->in_len, *datap, chunk);
+                reader->in_len += chunk;
+                *datap += chunk;
+                *len -= chunk;
+                if (reader->in_len < reader->stored_len)
+                    break;
+                err = frame_decode_body(reader, reader->in);
+            }
+            if (err != CHUTNEY_OKAY)
+                return err;
+            reader->state = CHUTNEY_FRAME_S_HEADER;
+            out = reader->out;
+            out_len = reader->raw_len;
+            err = chutney_load(state, &out, &out_len);
+            if (err != CHUTNEY_CONTINUE)
+                return err;
+            break;
+        }
+    }
+    return CHUTNEY_CONTINUE;
+}
+
+/*
+ * Decode a single block (header and body) at /block/ into /out/, returning
+ * the decoded length, or a (negative) chutney_status error. Allows blocks
+ * to be skipped or decoded in parallel by callers that locate the blocks
+ * themselves - the length of a block is CHUTNEY_FRAME_HEADER plus the
+ * stored length from its header.
+ */
+int
+chutney_frame_decode(const char *block, int length, char *out, int out_len)
+{
+    const unsigned char *header = (const unsigned char *)block;
+    uint32_t raw_len, stored, stored_len;
+
+    if (length < CHUTNEY_FRAME_HEADER)
+        return CHUTNEY_PARSE_ERR;
+    raw_len = get_le32(header);
+    stored = get_le32(header + 4);
+    stored_len = stored & ~CHUTNEY_FRAME_STORED;
+    if (raw_len > CHUTNEY_FRAME_MAXBLOCK
+            || stored_len > CHUTNEY_FRAME_MAXBLOCK)
+        return CHUTNEY_PARSE_ERR;
+    if ((uint32_t)length - CHUTNEY_FRAME_HEADER < stored_len)
+        return CHUTNEY_PARSE_ERR;
+    if (raw_len > (uint32_t)out_len)
+        return CHUTNEY_NOMEM;
+    block += CHUTNEY_FRAME_HEADER;
+    if (stored & CHUTNEY_FRAME_STORED) {
+        if (stored_len != raw_len)
+            return CHUTNEY_PARSE_ERR;
+        memcpy(out, block, raw_len);
+    } else if (block_decompress(block, stored_len, out, raw_len) < 0)
+        return CHUTNEY_PARSE_ERR;
+    if (chutney_crc32c(0, out, raw_len) != get_le32(header + 8))
+        return CHUTNEY_CHECKSUM_ERR;
+    return raw_len;
+}
@@ -1,22 +1,509 @@
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include "chutney.h"
 #include "chutneyprotocol.h"
 #include "chutneyutil.h"
 
+#define FRAME_HEADER 9          // FRAME opcode and 8 byte length
+
 int chutney_dump_init(chutney_dump_state *state, 
-                      int (*write)(void *context, const char *s, long n),
+                      int (*write)(void *context, const char *s, size_t n),
                       void *write_context)
 {
     state->depth = 0;
     state->write = write;
     state->write_context = write_context;
+    state->stats = NULL;
+    state->hash = NULL;
+    state->canonical = 0;
+    state->registry = NULL;
+    state->protocol = 0;
+    state->started = 0;
+    state->frame = NULL;
+    state->frame_len = 0;
+    state->frame_alloc = 0;
+    state->out = NULL;
+    state->out_cap = 0;
+    state->out_len = 0;
+    state->frame_start = 0;
+    state->iov_threshold = 0;
+    state->segments = NULL;
+    state->segment_count = 0;
+    state->segment_alloc = 0;
+    state->segment_buf = NULL;
+    state->segment_buf_len = 0;
+    state->segment_buf_alloc = 0;
+    state->iov = NULL;
+    state->iov_alloc = 0;
+    state->chunk = NULL;
+    state->allocator = chutney_malloc_allocator;
+    return 0;
+}
+
+/*
+ * Initialise the state to write directly into a caller-provided buffer of
+ * /size/ bytes, rather than through a write function. Nothing is allocated,
+ * even with protocol 4 framing. Output that doesn't fit is counted but not
+ * written, so the save functions still succeed - after chutney_save_stop,
+ * chutney_dump_buffer_len gives the number of bytes needed, and if this is
+ * more than /size/ the buffer holds an incomplete chutney.
+ */
+int
+chutney_dump_init_buffer(chutney_dump_state *state, char *buf, size_t size)
+{
+    chutney_dump_init(state, NULL, NULL);
+    state->out = buf;
+    state->out_cap = size;
+    return 0;
+}
+
+/* Bytes generated so far by a state initialised with a buffer */
+size_t
+chutney_dump_buffer_len(const chutney_dump_state *state)
+{
+    return state->out_len;
+}
+
+/* Add a segment, or extend the last if it is contiguous */
+static int
+add_segment(chutney_dump_state *self, const char *ref, size_t off, size_t len)
+{
+    chutney_iov_segment *seg;
+    int bigger;
+
+    if (self->segment_count) {
+        seg = &self->segments[self->segment_count - 1];
+        if (!ref && !seg->ref && seg->off + seg->len == off) {
+            seg->len += len;
+            return 0;
+        }
+    }
+    if (self->segment_count == self->segment_alloc) {
+        bigger = self->segment_alloc ? self->segment_alloc * 2 : 16;
+        seg = chutney_realloc(&self->allocator, self->segments,
+                              self->segment_alloc * sizeof(*seg),
+                              bigger * sizeof(*seg));
+        if (seg == NULL)
+            return -1;
+        self->segments = seg;
+        self->segment_alloc = bigger;
+    }
+    seg = &self->segments[self->segment_count++];
+    seg->ref = ref;
+    seg->off = off;
+    seg->len = len;
+    return 0;
+}
+
+/* Write function for chutney_dump_init_iov - copy into segment_buf */
+static int
+segment_write(void *context, const char *s, size_t n)
+{
+    chutney_dump_state *self = (chutney_dump_state *)context;
+    size_t bigger;
+    char *tmp;
+
+    if (self->segment_buf_alloc - self->segment_buf_len < n) {
+        bigger = self->segment_buf_alloc ? self->segment_buf_alloc : 4096;
+        while (bigger - self->segment_buf_len < n) {
+            if (bigger > SIZE_MAX / 2)
+                return -1;
+            bigger <<= 1;
+        }
+        if ((tmp = chutney_realloc(&self->allocator, self->segment_buf,
+                                   self->segment_buf_alloc, bigger)) == NULL)
+            return -1;
+        self->segment_buf = tmp;
+        self->segment_buf_alloc = bigger;
+    }
+    memcpy(self->segment_buf + self->segment_buf_len, s, n);
+    if (add_segment(self, NULL, self->segment_buf_len, n) < 0)
+        return -1;
+    self->segment_buf_len += n;
+    return 0;
+}
+
+/*
+ * Initialise the state to produce a list of segments, for writev or
+ * sendmsg. String payloads of at least /threshold/ bytes (0 for
+ * CHUTNEY_IOV_THRESHOLD) are not copied, but referenced where they lie,
+ * so they must remain unchanged until the output has been sent. Other
+ * output is collected in a buffer owned by the state. After
+ * chutney_save_stop, chutney_dump_iov or chutney_dump_writev send the
+ * output (see chutneyiov.c), or the segments can be read directly.
+ */
+int
+chutney_dump_init_iov(chutney_dump_state *state, size_t threshold)
+{
+    chutney_dump_init(state, segment_write, state);
+    state->iov_threshold = threshold ? threshold : CHUTNEY_IOV_THRESHOLD;
+    return 0;
+}
+
+/*
+ * Select the pickle protocol to generate - must be called before anything
+ * is saved. Without this, a protocol 1/2 mix is generated with no PROTO
+ * opcode. Protocol 3 saves strings as bytes, and protocol 4 adds framing
+ * and the short unicode form.
+ */
+int
+chutney_dump_set_protocol(chutney_dump_state *state, int protocol)
+{
+    if (protocol < 2 || protocol > CHUTNEY_HIGHEST_PROTOCOL || state->started)
+        return -1;
+    state->protocol = protocol;
+    return 0;
+}
+
+/*
+ * Allocate the state's frame and segment buffers from /allocator/ (or
+ * malloc, if NULL). Must be called before anything is saved. The chunks of
+ * chutney_dump_tree's worker threads are always allocated with malloc, as
+ * an allocator need not be thread safe.
+ */
+int
+chutney_dump_set_allocator(chutney_dump_state *state, 
+                           const chutney_allocator *allocator)
+{
+    if (state->started)
+        return -1;
+    state->allocator = allocator ? *allocator : chutney_malloc_allocator;
     return 0;
 }
 
 void
 chutney_dump_dealloc(chutney_dump_state *state)
 {
+    chutney_free(&state->allocator, state->frame, state->frame_alloc);
+    state->frame = NULL;
+    state->frame_alloc = 0;
+    chutney_free(&state->allocator, state->segments, 
+                 state->segment_alloc * sizeof(*state->segments));
+    chutney_free(&state->allocator, state->segment_buf, 
+                 state->segment_buf_alloc);
+    chutney_free(&state->allocator, state->iov, state->iov_alloc);
+    state->segments = NULL;
+    state->segment_buf = NULL;
+    state->iov = NULL;
+    state->segment_count = state->segment_alloc = 0;
+    state->segment_buf_len = state->segment_buf_alloc = 0;
+}
+
+/* Copy bytes into the caller's buffer - past its end, only count them */
+static void
+buffer_put(chutney_dump_state *self, const char *s, size_t n)
+{
+    if (self->out_len <= self->out_cap && n <= self->out_cap - self->out_len)
+        memcpy(self->out + self->out_len, s, n);
+    self->out_len += n;
+}
+
+/* Pass bytes to the write function, or the caller's buffer */
+static int
+dump_write(chutney_dump_state *self, const char *s, size_t n)
+{
+    if (self->stats) {
+        self->stats->bytes += n;
+        self->stats->writes++;
+    }
+    if (self->hash)
+        chutney_hash_update(self->hash, s, n);
+    if (self->write == NULL) {
+        buffer_put(self, s, n);
+        return 0;
+    }
+    return self->write(self->write_context, s, n);
+}
+
+/* Write the PROTO opcode, if a protocol has been selected */
+static int
+dump_start(chutney_dump_state *self)
+{
+    char c_str[2];
+
+    self->started = 1;
+    if (!self->protocol)
+        return 0;
+    c_str[0] = PROTO;
+    c_str[1] = self->protocol;
+    if (self->stats)
+        self->stats->opcodes[(unsigned char)PROTO]++;
+    return dump_write(self, c_str, 2);
+}
+
+/* Add bytes to the current frame */
+static int
+frame_append(chutney_dump_state *self, const char *s, size_t n)
+{
+    char *tmp;
+    size_t bigger;
+
+    /* Frames are built in place in a caller's buffer, leaving room for the 
+     * header */
+    if (self->write == NULL) {
+        if (!self->frame_len) {
+            self->frame_start = self->out_len;
+            self->out_len += FRAME_HEADER;
+        }
+        buffer_put(self, s, n);
+        self->frame_len += n;
+        return 0;
+    }
+    if (self->frame_alloc < FRAME_HEADER + self->frame_len + n) {
+        bigger = self->frame_alloc ? self->frame_alloc : 
+                 CHUTNEY_FRAME_SIZE_TARGET + FRAME_HEADER;
+        while (bigger - FRAME_HEADER - self->frame_len < n) {
+            if (bigger > SIZE_MAX / 2)
+                return -1;
+            bigger <<= 1;
+        }
+        if ((tmp = chutney_realloc(&self->allocator, self->frame,
+                                   self->frame_alloc, bigger)) == NULL)
+            return -1;
+        self->frame = tmp;
+        self->frame_alloc = bigger;
+    }
+    memcpy(self->frame + FRAME_HEADER + self->frame_len, s, n);
+    self->frame_len += n;
+    return 0;
+}
+
+/* Write the FRAME opcode and the frame collected so far */
+static int
+frame_commit(chutney_dump_state *self)
+{
+    unsigned long long len = self->frame_len;
+    char header[FRAME_HEADER];
+    int i;
+
+    if (!self->frame_len)
+        return 0;
+    header[0] = FRAME;
+    for (i = 0; i < 8; ++i)
+        header[1 + i] = (len >> (i * 8)) & 0xff;
+    if (self->stats)
+        self->stats->opcodes[(unsigned char)FRAME]++;
+    self->frame_len = 0;
+    if (self->write == NULL) {
+        if (self->frame_start + FRAME_HEADER <= self->out_cap)
+            memcpy(self->out + self->frame_start, header, FRAME_HEADER);
+        /* the frame is only hashed now its header is known, and is only
+         * complete if it fitted */
+        if (self->hash && self->out_len <= self->out_cap) {
+            chutney_hash_update(self->hash, header, FRAME_HEADER);
+            chutney_hash_update(self->hash, 
+                                self->out + self->frame_start + FRAME_HEADER,
+                                len);
+        }
+        if (self->stats) {
+            self->stats->bytes += FRAME_HEADER + len;
+            self->stats->writes++;
+        }
+        return 0;
+    }
+    memcpy(self->frame, header, FRAME_HEADER);
+    return dump_write(self, self->frame, FRAME_HEADER + len);
+}
+
+/* Grow an array of /alloc/ elements of /size/ bytes to hold /want/ */
+static int
+grow(void *arrayp, size_t *alloc, size_t want, size_t size)
+{
+    void *tmp;
+    size_t bigger = *alloc ? *alloc : 64;
+
+    if (want <= *alloc)
+        return 0;
+    while (bigger < want) {
+        if (bigger > SIZE_MAX / 2 / size)
+            return -1;
+        bigger <<= 1;
+    }
+    if ((tmp = realloc(*(void **)arrayp, bigger * size)) == NULL)
+        return -1;
+    *(void **)arrayp = tmp;
+    *alloc = bigger;
+    return 0;
+}
+
+/* Record bytes in the chunk of a chutney_dump_tree task */
+static int
+chunk_put(chutney_dump_chunk *chunk, const char *s, size_t n)
+{
+    if (grow(&chunk->buf, &chunk->alloc, chunk->len + n, 1) < 0)
+        return -1;
+    memcpy(chunk->buf + chunk->len, s, n);
+    chunk->len += n;
+    return 0;
+}
+
+/* Record an opcode (and possibly its arguments) in a chunk */
+static int
+chunk_op(chutney_dump_state *self, const char *s, size_t n)
+{
+    chutney_dump_chunk *chunk = self->chunk;
+
+    if (self->protocol >= 4) {
+        if (grow(&chunk->ops, &chunk->ops_alloc, chunk->nops + 1,
+                 sizeof(*chunk->ops)) < 0)
+            return -1;
+        chunk->ops[chunk->nops++] = chunk->len;
+    }
+    if (self->stats)
+        self->stats->opcodes[(unsigned char)*s]++;
+    return chunk_put(chunk, s, n);
+}
+
+/* Write opcode argument or payload bytes */
+static int
+write_data(chutney_dump_state *self, const char *s, size_t n)
+{
+    if (self->chunk)
+        return chunk_put(self->chunk, s, n);
+    if (self->protocol >= 4)
+        return frame_append(self, s, n);
+    return dump_write(self, s, n);
+}
+
+/* Write an opcode, possibly followed by some or all of its arguments */
+static int
+write_op(chutney_dump_state *self, const char *s, size_t n)
+{
+    if (self->chunk)
+        return chunk_op(self, s, n);
+    if (!self->started && dump_start(self) < 0)
+        return -1;
+    if (self->protocol >= 4 && self->frame_len >= CHUTNEY_FRAME_SIZE_TARGET)
+        if (frame_commit(self) < 0)
+            return -1;
+    if (self->stats)
+        self->stats->opcodes[(unsigned char)*s]++;
+    return write_data(self, s, n);
+}
+
+/* Reference a payload in place, rather than writing it */
+static int
+dump_reference(chutney_dump_state *self, const char *s, size_t n)
+{
+    if (self->stats) {
+        self->stats->bytes += n;
+        self->stats->writes++;
+    }
+    if (self->hash)
+        chutney_hash_update(self->hash, s, n);
+    return add_segment(self, s, 0, n);
+}
+
+/*
+ * Write a string opcode and its payload. With framing, large payloads are
+ * written outside of any frame, rather than being copied into it - as are
+ * payloads referenced by chutney_dump_init_iov.
+ */
+static int
+write_payload(chutney_dump_state *self, const char *op, size_t op_len,
+              const char *value, size_t size)
+{
+    chutney_dump_chunk *chunk = self->chunk;
+    int ref = self->iov_threshold && size >= self->iov_threshold;
+
+    if (chunk && chunk->threshold && size >= chunk->threshold) {
+        if (grow(&chunk->payloads, &chunk->payloads_alloc, 
+                 chunk->npayloads + 1, sizeof(*chunk->payloads)) < 0)
+            return -1;
+        chunk->payloads[chunk->npayloads].op = chunk->len;
+        if (chunk_op(self, op, op_len) < 0)
+            return -1;
+        chunk->payloads[chunk->npayloads].off = chunk->len;
+        chunk->payloads[chunk->npayloads].value = value;
+        chunk->payloads[chunk->npayloads].len = size;
+        chunk->npayloads++;
+        return 0;
+    }
+    if (ref || (self->protocol >= 4 && size >= CHUTNEY_FRAME_SIZE_TARGET)) {
+        if (!self->started && dump_start(self) < 0)
+            return -1;
+        if (frame_commit(self) < 0)
+            return -1;
+        if (self->stats)
+            self->stats->opcodes[(unsigned char)*op]++;
+        if (dump_write(self, op, op_len) < 0)
+            return -1;
+        if (ref)
+            return dump_reference(self, value, size);
+        return dump_write(self, value, size);
+    }
+    if (write_op(self, op, op_len) < 0)
+        return -1;
+    return write_data(self, value, size);
+}
+
+/*
+ * Write the chunk bytes from /pos/ to /end/, both opcode offsets. With
+ * framing, frames end where they would have had the opcodes been written
+ * one at a time: at the first opcode once the frame reaches the target
+ * size. /op/ is the index of the first opcode offset not yet passed.
+ */
+static int
+chunk_run(chutney_dump_state *self, const chutney_dump_chunk *chunk,
+          size_t pos, size_t end, size_t *op)
+{
+    size_t i = *op, next;
+
+    if (self->protocol < 4)
+        return pos < end ? dump_write(self, chunk->buf + pos, end - pos) : 0;
+    while (pos < end) {
+        if (self->frame_len >= CHUTNEY_FRAME_SIZE_TARGET)
+            if (frame_commit(self) < 0)
+                return -1;
+        next = pos + CHUTNEY_FRAME_SIZE_TARGET - self->frame_len;
+        while (i < chunk->nops && chunk->ops[i] < next)
+            ++i;
+        next = i < chunk->nops && chunk->ops[i] < end ? chunk->ops[i] : end;
+        if (frame_append(self, chunk->buf + pos, next - pos) < 0)
+            return -1;
+        pos = next;
+    }
+    *op = i;
+    return 0;
+}
+
+/*
+ * Write a chunk recorded for chutney_dump_tree, producing the same output
+ * as its save calls would have if made on this state.
+ */
+int
+chutney_save_chunk(chutney_dump_state *self, const chutney_dump_chunk *chunk)
+{
+    const chutney_chunk_payload *payload;
+    size_t i, pos = 0, op = 0;
+    int res;
+
+    if (!self->started && dump_start(self) < 0)
+        return -1;
+    if (self->stats)
+        for (i = 0; i < 256; ++i)
+            self->stats->opcodes[i] += chunk->stats.opcodes[i];
+    for (i = 0; i < chunk->npayloads; ++i) {
+        payload = &chunk->payloads[i];
+        if (chunk_run(self, chunk, pos, payload->op, &op) < 0)
+            return -1;
+        /* as write_payload: outside any frame */
+        if (frame_commit(self) < 0)
+            return -1;
+        if (dump_write(self, chunk->buf + payload->op, 
+                       payload->off - payload->op) < 0)
+            return -1;
+        if (self->iov_threshold && payload->len >= self->iov_threshold)
+            res = dump_reference(self, payload->value, payload->len);
+        else
+            res = dump_write(self, payload->value, payload->len);
+        if (res < 0)
+            return -1;
+        pos = payload->off;
+    }
+    return chunk_run(self, chunk, pos, chunk->len, &op);
 }
 
 int
@@ -24,7 +511,9 @@ chutney_save_stop(chutney_dump_state *self)
 {
     static char stop = STOP;
 
-    return self->write(self->write_context, &stop, 1);
+    if (write_op(self, &stop, 1) < 0)
+        return -1;
+    return frame_commit(self);
 }
 
 int
@@ -32,7 +521,7 @@ chutney_save_mark(chutney_dump_state *self)
 {
     static char mark = MARK;
 
-    return self->write(self->write_context, &mark, 1);
+    return write_op(self, &mark, 1);
 }
 
 int
@@ -40,7 +529,7 @@ chutney_save_null(chutney_dump_state *self)
 {
     static char none = NONE;
 
-    return self->write(self->write_context, &none, 1);
+    return write_op(self, &none, 1);
 }
 
 int 
@@ -50,7 +539,7 @@ chutney_save_bool(chutney_dump_state *self, int value)
     char opcode;
     
     opcode = value ? NEWTRUE : NEWFALSE;
-    return self->write(self->write_context, &opcode, 1);
+    return write_op(self, &opcode, 1);
 }
 
 int
@@ -70,7 +559,7 @@ chutney_save_int(chutney_dump_state *self, long value)
         c_str[0] = BININT;
         len = 5;
     }
-    return self->write(self->write_context, c_str, len);
+    return write_op(self, c_str, len);
 
     /* protocol 0
     char c_str[32];
@@ -100,7 +589,7 @@ chutney_save_float(chutney_dump_state *self, double value)
     default:
         return -1;
     }
-    return self->write(self->write_context, buf, sizeof(buf));
+    return write_op(self, buf, sizeof(buf));
     /* protocol 0
     char c_str[250];
 
@@ -110,49 +599,114 @@ chutney_save_float(chutney_dump_state *self, double value)
     */
 }
 
+/*
+ * Encode the opcode and length of a /size/ byte string into /c_str/,
+ * using the short (1 byte length) form /op1/ if there is one and it
+ * fits, else the 4 byte form /op4/ up to /max4/ bytes, else the 8 byte
+ * form /op8/. Returns the encoded length, or -1 if there is no form for
+ * this size.
+ */
+static int
+string_op(char *c_str, char op1, char op4, char op8, 
+          size_t size, size_t max4)
+{
+    unsigned long long l = size;
+    int i, n;
+
+    if (op1 && size < 256) {
+        c_str[0] = op1;
+        c_str[1] = size;
+        return 2;
+    }
+    if (size <= max4) {
+        c_str[0] = op4;
+        n = 4;
+    } else if (op8) {
+        c_str[0] = op8;
+        n = 8;
+    } else
+        return -1;
+    for (i = 0; i < n; ++i)
+        c_str[1 + i] = (l >> (i * 8)) & 0xff;
+    return 1 + n;
+}
+
 int
-chutney_save_string(chutney_dump_state *self, const char *value, int size)
+chutney_save_string(chutney_dump_state *self, const char *value, size_t size)
 {
-    char c_str[5];
+    char c_str[9];
     int len;
 
     /* We use the protocol 1 here, as protocol 0 requires python repr() of the
-     * string */
-    if (size < 256) {
-        c_str[0] = SHORT_BINSTRING;
-        c_str[1] = size;
-        len = 2;
-    }
-    else {
-        c_str[0] = BINSTRING;
-        c_str[1] = (int)( size        & 0xff);
-        c_str[2] = (int)((size >> 8)  & 0xff);
-        c_str[3] = (int)((size >> 16) & 0xff);
-        c_str[4] = (int)((size >> 24) & 0xff);
-        len = 5;
-    }
-    if (self->write(self->write_context, c_str, len) < 0)
+     * string. Protocol 3 introduced the bytes type, which is the better match
+     * for an 8 bit clean string. BINSTRING's length is signed, and strings 
+     * of 4GB or more need protocol 4's BINBYTES8. */
+    if (self->protocol >= 3)
+        len = string_op(c_str, SHORT_BINBYTES, BINBYTES, 
+                        self->protocol >= 4 ? BINBYTES8 : 0,
+                        size, 0xffffffffUL);
+    else
+        len = string_op(c_str, SHORT_BINSTRING, BINSTRING, 0,
+                        size, 0x7fffffffUL);
+    if (len < 0)
+        return -1;
+    return write_payload(self, c_str, len, value, size);
+}
+
+/*
+ * Encode /value/ as chutney_save_string would save it - opcode, length and
+ * body - into /buf/, returning the encoded length. If this is more than
+ * /size/, nothing is written. The encoding can then be saved any number
+ * of times with chutney_save_encoded, in a single write. Returns -1 for a
+ * string that would be referenced or framed on its own rather than
+ * copied, which must be saved with chutney_save_string.
+ */
+int
+chutney_encode_string(chutney_dump_state *self, const char *value, 
+                      size_t len, char *buf, int size)
+{
+    char c_str[9];
+    int op_len;
+
+    if ((self->iov_threshold && len >= self->iov_threshold) ||
+            (self->chunk && self->chunk->threshold && 
+             len >= self->chunk->threshold) ||
+            len >= CHUTNEY_FRAME_SIZE_TARGET)
         return -1;
-    return self->write(self->write_context, value, size);
+    if (self->protocol >= 3)
+        op_len = string_op(c_str, SHORT_BINBYTES, BINBYTES, 0, len, 
+                           0xffffffffUL);
+    else
+        op_len = string_op(c_str, SHORT_BINSTRING, BINSTRING, 0, len, 
+                           0x7fffffffUL);
+    if (op_len + len > (size_t)size)
+        return op_len + len;
+    memcpy(buf, c_str, op_len);
+    memcpy(buf + op_len, value, len);
+    return op_len + len;
+}
+
+/* Save a string encoded by chutney_encode_string */
+int
+chutney_save_encoded(chutney_dump_state *self, const char *buf, int len)
+{
+    return write_op(self, buf, len);
 }
 
 int
-chutney_save_utf8(chutney_dump_state *self, const char *value, int size)
+chutney_save_utf8(chutney_dump_state *self, const char *value, size_t size)
 {
-    char c_str[5];
+    char c_str[9];
     int len;
 
     /* We use the protocol 1 here, as protocol 0 requires python-specific
      * UTF-8 repr() escaping. */
-    c_str[0] = BINUNICODE;
-    c_str[1] = (int)( size        & 0xff);
-    c_str[2] = (int)((size >> 8)  & 0xff);
-    c_str[3] = (int)((size >> 16) & 0xff);
-    c_str[4] = (int)((size >> 24) & 0xff);
-    len = 5;
-    if (self->write(self->write_context, c_str, len) < 0)
+    len = string_op(c_str, self->protocol >= 4 ? SHORT_BINUNICODE : 0,
+                    BINUNICODE, self->protocol >= 4 ? BINUNICODE8 : 0,
+                    size, 0xffffffffUL);
+    if (len < 0)
         return -1;
-    return self->write(self->write_context, value, size);
+    return write_payload(self, c_str, len, value, size);
 }
 
 int
@@ -162,7 +716,7 @@ chutney_save_tuple(chutney_dump_state *self)
 
     /* This creates a tuple from all items on the stack back to the most recent
      * MARK */
-    return self->write(self->write_context, &tuple, 1);
+    return write_op(self, &tuple, 1);
 }
 
 int
@@ -170,7 +724,7 @@ chutney_save_empty_dict(chutney_dump_state *self)
 {
     static char empty_dict = EMPTY_DICT;
 
-    return self->write(self->write_context, &empty_dict, 1);
+    return write_op(self, &empty_dict, 1);
 }
 
 int
@@ -180,7 +734,36 @@ chutney_save_setitems(chutney_dump_state *self)
 
     /* This adds all pairs of items on the stack up to the the most recent MARK
      * to the dictionary preceeding the MARK */
-    return self->write(self->write_context, &setitems, 1);
+    return write_op(self, &setitems, 1);
+}
+
+/*
+ * Encode the EXT opcode for module.name into /buf/ (of at least 5 bytes),
+ * returning its length, or 0 if the class is not registered.
+ */
+static int
+ext_op(chutney_dump_state *self, const char *module, const char *name,
+       char *buf)
+{
+    long code;
+    int n, i;
+
+    if (!self->registry || 
+            !(code = chutney_registry_code(self->registry, module, name)))
+        return 0;
+    if (code < 0x100) {
+        buf[0] = EXT1;
+        n = 1;
+    } else if (code < 0x10000) {
+        buf[0] = EXT2;
+        n = 2;
+    } else {
+        buf[0] = EXT4;
+        n = 4;
+    }
+    for (i = 0; i < n; ++i)
+        buf[i + 1] = (code >> (i * 8)) & 0xff;
+    return n + 1;
 }
 
 int chutney_save_global(chutney_dump_state *self, 
@@ -189,26 +772,178 @@ int chutney_save_global(chutney_dump_state *self,
     static char global = GLOBAL, nl = '\n';
     int module_len = strlen(module);
     int name_len = strlen(name);
+    char ext[5];
+    int ext_len;
 
-    if (self->write(self->write_context, &global, 1) < 0)
+    if ((ext_len = ext_op(self, module, name, ext)) > 0)
+        return write_op(self, ext, ext_len);
+    if (write_op(self, &global, 1) < 0)
         return -1;
-    if (self->write(self->write_context, module, module_len) < 0)
+    if (write_data(self, module, module_len) < 0)
         return -1;
-    if (self->write(self->write_context, &nl, 1) < 0)
+    if (write_data(self, &nl, 1) < 0)
         return -1;
-    if (self->write(self->write_context, name, name_len) < 0)
+    if (write_data(self, name, name_len) < 0)
         return -1;
-    if (self->write(self->write_context, &nl, 1) < 0)
+    if (write_data(self, &nl, 1) < 0)
         return -1;
     return 0;
 }
 
+/*
+ * Encode the MARK, GLOBAL and OBJ opcodes that start an instance of
+ * module.name (or its EXT code, if it is registered) into /buf/,
+ * returning the encoded length. If this is more
+ * than /size/, nothing is written, and the call should be repeated with a
+ * larger buffer. The encoded header can then be saved any number of times
+ * with chutney_save_inst_header, avoiding the per-instance name handling.
+ */
+int
+chutney_encode_inst_header(chutney_dump_state *self, 
+                           const char *module, const char *name,
+                           char *buf, int size)
+{
+    int module_len = strlen(module);
+    int name_len = strlen(name);
+    int len = module_len + name_len + 5;
+    char ext[5];
+    int ext_len;
+
+    if ((ext_len = ext_op(self, module, name, ext)) > 0) {
+        if (ext_len + 2 <= size) {
+            buf[0] = MARK;
+            memcpy(buf + 1, ext, ext_len);
+            buf[ext_len + 1] = OBJ;
+        }
+        return ext_len + 2;
+    }
+    if (len > size)
+        return len;
+    *buf++ = MARK;
+    *buf++ = GLOBAL;
+    memcpy(buf, module, module_len);
+    buf += module_len;
+    *buf++ = '\n';
+    memcpy(buf, name, name_len);
+    buf += name_len;
+    *buf++ = '\n';
+    *buf++ = OBJ;
+    return len;
+}
+
+/* Save a header encoded by chutney_encode_inst_header in a single write */
+int
+chutney_save_inst_header(chutney_dump_state *self, 
+                         const char *header, int len)
+{
+    if (self->stats) {
+        self->stats->opcodes[(unsigned char)header[1]]++;
+        self->stats->opcodes[(unsigned char)OBJ]++;
+    }
+    return write_op(self, header, len);
+}
+
+/* Write an opcode and 4 byte count */
+static int
+counted_op(chutney_dump_state *self, char op, size_t count)
+{
+    char buf[5];
+    int i;
+
+    if (count > CHUTNEY_COLUMNS_MAX)
+        return -1;
+    buf[0] = op;
+    for (i = 0; i < 4; ++i)
+        buf[1 + i] = (count >> (i * 8)) & 0xff;
+    return write_op(self, buf, sizeof(buf));
+}
+
+/*
+ * Save a column of /count/ ints (which must fit in 32 bits) as a single
+ * INTS opcode with little-endian values, pushing them all when loaded.
+ */
+int
+chutney_save_ints(chutney_dump_state *self, const int *values, size_t count)
+{
+    char buf[4096], *q;
+    unsigned int v;
+    size_t i, n;
+
+    if (counted_op(self, INTS, count) < 0)
+        return -1;
+    for (i = 0; i < count; i += n) {
+        n = count - i < sizeof(buf) / 4 ? count - i : sizeof(buf) / 4;
+        for (q = buf; q < buf + n * 4; q += 4) {
+            v = (unsigned int)values[i + (q - buf) / 4];
+            q[0] = v & 0xff;
+            q[1] = (v >> 8) & 0xff;
+            q[2] = (v >> 16) & 0xff;
+            q[3] = (v >> 24) & 0xff;
+        }
+        if (write_data(self, buf, n * 4) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* As chutney_save_ints, for a FLOATS column of little-endian doubles */
+int
+chutney_save_floats(chutney_dump_state *self, const double *values, 
+                    size_t count)
+{
+    char buf[4096];
+    const char *p;
+    size_t i, j, n;
+    int k;
+    enum ieee_fp fp = detect_ieee_fp();
+
+    if (fp != IEEE_LE && fp != IEEE_BE)
+        return -1;
+    if (counted_op(self, FLOATS, count) < 0)
+        return -1;
+    for (i = 0; i < count; i += n) {
+        n = count - i < sizeof(buf) / 8 ? count - i : sizeof(buf) / 8;
+        if (fp == IEEE_LE)
+            memcpy(buf, values + i, n * 8);
+        else
+            for (j = 0; j < n; ++j)
+                for (k = 0, p = (const char *)(values + i + j); k < 8; ++k)
+                    buf[j * 8 + 7 - k] = p[k];
+        if (write_data(self, buf, n * 8) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Build /rows/ instances from the items since the last MARK: the class
+ * (saved with chutney_save_global), /attrs/ attribute names, then a
+ * column of /rows/ values for each attribute in turn (saved singly, or
+ * with chutney_save_ints or chutney_save_floats). They load as a tuple of
+ * the instances.
+ */
+int
+chutney_save_columns(chutney_dump_state *self, size_t attrs, size_t rows)
+{
+    char buf[9];
+    int i;
+
+    if (attrs > CHUTNEY_COLUMNS_MAX || rows > CHUTNEY_COLUMNS_MAX)
+        return -1;
+    buf[0] = COLUMNS;
+    for (i = 0; i < 4; ++i) {
+        buf[1 + i] = (attrs >> (i * 8)) & 0xff;
+        buf[5 + i] = (rows >> (i * 8)) & 0xff;
+    }
+    return write_op(self, buf, sizeof(buf));
+}
+
 int
 chutney_save_obj(chutney_dump_state *self)
 {
     static char obj = OBJ;
 
-    return self->write(self->write_context, &obj, 1);
+    return write_op(self, &obj, 1);
 }
 
 int
@@ -216,6 +951,6 @@ chutney_save_build(chutney_dump_state *self)
 {
     static char build = BUILD;
 
-    return self->write(self->write_context, &build, 1);
+    return write_op(self, &build, 1);
 }
 
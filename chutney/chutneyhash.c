@@ -0,0 +1,141 @@
+#include <string.h>
+#include "chutney.h"
+
+/*
+ * Streaming 64 bit content hash - this is XXH64, so digests match other
+ * implementations given the same seed. Point chutney_dump_state.hash at
+ * an initialised chutney_hash and the output is hashed as it is written.
+ */
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static unsigned long long
+read64(const unsigned char *p)
+{
+    return (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) |
+           ((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24) |
+           ((unsigned long long)p[4] << 32) | ((unsigned long long)p[5] << 40) |
+           ((unsigned long long)p[6] << 48) | ((unsigned long long)p[7] << 56);
+}
+
+static unsigned long long
+read32(const unsigned char *p)
+{
+    return (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) |
+           ((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24);
+}
+
+static unsigned long long
+round64(unsigned long long acc, unsigned long long input)
+{
+    acc += input * PRIME2;
+    acc = ROTL(acc, 31);
+    return acc * PRIME1;
+}
+
+static unsigned long long
+merge64(unsigned long long acc, unsigned long long v)
+{
+    acc ^= round64(0, v);
+    return acc * PRIME1 + PRIME4;
+}
+
+void
+chutney_hash_init(chutney_hash *hash, unsigned long long seed)
+{
+    hash->v[0] = seed + PRIME1 + PRIME2;
+    hash->v[1] = seed + PRIME2;
+    hash->v[2] = seed;
+    hash->v[3] = seed - PRIME1;
+    hash->seed = seed;
+    hash->total = 0;
+    hash->buf_len = 0;
+}
+
+/* Consume 32 byte stripes */
+static const unsigned char *
+stripes(chutney_hash *hash, const unsigned char *p, const unsigned char *end)
+{
+    unsigned long long v0 = hash->v[0], v1 = hash->v[1];
+    unsigned long long v2 = hash->v[2], v3 = hash->v[3];
+
+    for (; end - p >= 32; p += 32) {
+        v0 = round64(v0, read64(p));
+        v1 = round64(v1, read64(p + 8));
+        v2 = round64(v2, read64(p + 16));
+        v3 = round64(v3, read64(p + 24));
+    }
+    hash->v[0] = v0;
+    hash->v[1] = v1;
+    hash->v[2] = v2;
+    hash->v[3] = v3;
+    return p;
+}
+
+void
+chutney_hash_update(chutney_hash *hash, const char *s, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)s, *end = p + n;
+    size_t fill;
+
+    hash->total += n;
+    if (hash->buf_len) {
+        fill = 32 - hash->buf_len;
+        if (n < fill) {
+            memcpy(hash->buf + hash->buf_len, p, n);
+            hash->buf_len += n;
+            return;
+        }
+        memcpy(hash->buf + hash->buf_len, p, fill);
+        p += fill;
+        stripes(hash, hash->buf, hash->buf + 32);
+        hash->buf_len = 0;
+    }
+    p = stripes(hash, p, end);
+    memcpy(hash->buf, p, end - p);
+    hash->buf_len = end - p;
+}
+
+/* The digest of the input so far - more input can still be added */
+unsigned long long
+chutney_hash_digest(const chutney_hash *hash)
+{
+    const unsigned char *p = hash->buf, *end = p + hash->buf_len;
+    unsigned long long h;
+
+    if (hash->total >= 32) {
+        h = ROTL(hash->v[0], 1) + ROTL(hash->v[1], 7) +
+            ROTL(hash->v[2], 12) + ROTL(hash->v[3], 18);
+        h = merge64(h, hash->v[0]);
+        h = merge64(h, hash->v[1]);
+        h = merge64(h, hash->v[2]);
+        h = merge64(h, hash->v[3]);
+    } else
+        h = hash->seed + PRIME5;
+    h += hash->total;
+    for (; end - p >= 8; p += 8) {
+        h ^= round64(0, read64(p));
+        h = ROTL(h, 27) * PRIME1 + PRIME4;
+    }
+    if (end - p >= 4) {
+        h ^= read32(p) * PRIME1;
+        h = ROTL(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= *p * PRIME5;
+        h = ROTL(h, 11) * PRIME1;
+    }
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,112 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "chutney.h"
+#include "chutneyutil.h"
+
+/*
+ * Scatter/gather I/O, using the POSIX struct iovec (leave this file out of
+ * the build on platforms without it).
+ */
+
+/*
+ * Parse a chutney from the /iovcnt/ segments of /iov/, in order, as if
+ * they had been passed to chutney_load one at a time - opcode arguments
+ * (including string bodies) are only copied if they straddle segments,
+ * otherwise the callbacks are passed pointers into the segment. If
+ * /consumed/ is not NULL, it is set to the number of bytes used, which on
+ * CHUTNEY_OKAY locates the end of the chutney. Returns CHUTNEY_CONTINUE if
+ * the segments end before the chutney does, in which case the call can be
+ * repeated with further segments.
+ */
+enum chutney_status
+chutney_loadv(chutney_load_state *state, const struct iovec *iov, int iovcnt,
+              size_t *consumed)
+{
+    enum chutney_status status = CHUTNEY_CONTINUE;
+    const char *data;
+    size_t len, used = 0;
+    int i;
+
+    for (i = 0; i < iovcnt && status == CHUTNEY_CONTINUE; ++i) {
+        data = (const char *)iov[i].iov_base;
+        len = iov[i].iov_len;
+        status = chutney_load(state, &data, &len);
+        used += iov[i].iov_len - len;
+    }
+    if (consumed)
+        *consumed = used;
+    return status;
+}
+
+/*
+ * Return the output of a state initialised with chutney_dump_init_iov as
+ * an array of iovecs, owned by the state and valid until
+ * chutney_dump_dealloc. Returns -1 if memory could not be allocated.
+ */
+int
+chutney_dump_iov(chutney_dump_state *state, const struct iovec **iovp,
+                 int *iovcnt)
+{
+    struct iovec *iov;
+    size_t alloc = (state->segment_count ? state->segment_count : 1) *
+                   sizeof(*iov);
+    int i;
+
+    chutney_free(&state->allocator, state->iov, state->iov_alloc);
+    state->iov = NULL;
+    state->iov_alloc = 0;
+    if ((iov = chutney_alloc(&state->allocator, alloc)) == NULL)
+        return -1;
+    for (i = 0; i < state->segment_count; ++i) {
+        iov[i].iov_base = state->segments[i].ref ?
+                          (void *)state->segments[i].ref :
+                          state->segment_buf + state->segments[i].off;
+        iov[i].iov_len = state->segments[i].len;
+    }
+    state->iov = iov;
+    state->iov_alloc = alloc;
+    *iovp = iov;
+    *iovcnt = state->segment_count;
+    return 0;
+}
+
+/*
+ * Write the output of a state initialised with chutney_dump_init_iov to
+ * /fd/ with writev, continuing after partial writes. Returns -1 with errno
+ * set on failure.
+ */
+int
+chutney_dump_writev(chutney_dump_state *state, int fd)
+{
+    const struct iovec *iov;
+    struct iovec *v;
+    long max = sysconf(_SC_IOV_MAX);
+    ssize_t n;
+    int iovcnt;
+
+    if (chutney_dump_iov(state, &iov, &iovcnt) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (max <= 0)
+        max = 16;               // the POSIX minimum
+    v = (struct iovec *)iov;
+    while (iovcnt > 0) {
+        n = writev(fd, v, iovcnt > max ? (int)max : iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (; iovcnt && (size_t)n >= v->iov_len; --iovcnt, ++v)
+            n -= v->iov_len;
+        if (iovcnt) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
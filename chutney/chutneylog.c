@@ -0,0 +1,760 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chutney.h"
+
+/*
+ * Append-only record log (POSIX only). The file starts with
+ * CHUTNEY_LOG_MAGIC and is followed by frames, each with a header of:
+ *
+ *      kind            1 byte: 'R' record, 'I' index block, 'F' footer
+ *      flags           1 byte, zero
+ *      key length      16 bits
+ *      body length     32 bits
+ *      crc32c          of the first 8 header bytes, the key and the body
+ *
+ * All integers are little-endian. A record's body is normally a chutney,
+ * preceded by its optional key. After every CHUTNEY_LOG_INDEX_EVERY
+ * records an index block is written, giving the number of the first
+ * record it covers and the offset of each record. Closing the log writes
+ * an index block for any remaining records, then a footer listing the
+ * index blocks and keys, then a trailer holding the footer's offset and
+ * CHUTNEY_LOG_TRAILER_MAGIC.
+ *
+ * Each frame is written with a single write, and is only trusted if its
+ * CRC is correct, so a crash can only leave a torn frame at the end of the
+ * file. When there is no valid footer, opening the log rebuilds the index
+ * by walking the frames, and opening it to append truncates any torn tail.
+ */
+
+#define KIND_RECORD     'R'
+#define KIND_INDEX      'I'
+#define KIND_FOOTER     'F'
+#define MAGIC_LEN       4
+#define TRAILER_LEN     12      // footer offset, trailer magic
+#define MAX_KEY         65535
+
+static void
+put_le16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void
+put_le32(unsigned char *p, unsigned long v)
+{
+    put_le16(p, v & 0xffff);
+    put_le16(p + 2, (v >> 16) & 0xffff);
+}
+
+static void
+put_le64(unsigned char *p, unsigned long long v)
+{
+    put_le32(p, (unsigned long)(v & 0xffffffffUL));
+    put_le32(p + 4, (unsigned long)(v >> 32));
+}
+
+static unsigned int
+get_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long
+get_le32(const unsigned char *p)
+{
+    return get_le16(p) | ((unsigned long)get_le16(p + 2) << 16);
+}
+
+static unsigned long long
+get_le64(const unsigned char *p)
+{
+    return get_le32(p) | ((unsigned long long)get_le32(p + 4) << 32);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Frames */
+
+typedef struct {
+    int kind;
+    const char *key;
+    int key_len;
+    const char *body;
+    unsigned long body_len;
+    long long end;              // offset of the following frame
+} log_frame;
+
+static unsigned int
+frame_crc(const unsigned char *header, const char *key, int key_len,
+          const char *body, unsigned long body_len)
+{
+    unsigned int crc;
+
+    crc = chutney_crc32c(0, (const char *)header, 8);
+    crc = chutney_crc32c(crc, key, key_len);
+    return chutney_crc32c(crc, body, body_len);
+}
+
+/* Decode the frame at /off/ in the mapping, returning -1 if it is torn */
+static int
+frame_get(const chutney_mapping *map, long long off, log_frame *frame)
+{
+    const unsigned char *header = (const unsigned char *)map->data + off;
+    unsigned long long need;
+
+    if (off < 0 || (size_t)off + CHUTNEY_LOG_HEADER > map->len)
+        return -1;
+    frame->kind = header[0];
+    frame->key_len = get_le16(header + 2);
+    frame->body_len = get_le32(header + 4);
+    need = CHUTNEY_LOG_HEADER + frame->key_len +
+           (unsigned long long)frame->body_len;
+    if (need > map->len - off)
+        return -1;
+    frame->key = (const char *)header + CHUTNEY_LOG_HEADER;
+    frame->body = frame->key + frame->key_len;
+    frame->end = off + need;
+    if (frame_crc(header, frame->key, frame->key_len, frame->body,
+                  frame->body_len) != get_le32(header + 8))
+        return -1;
+    return 0;
+}
+
+/* Write all of /n/ bytes, returning -1 with errno set on failure */
+static int
+write_all(int fd, const char *s, size_t n)
+{
+    ssize_t res;
+
+    while (n) {
+        if ((res = write(fd, s, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        s += res;
+        n -= res;
+    }
+    return 0;
+}
+
+/* Write a frame at the end of the log, removing it again on failure */
+static int
+frame_put(chutney_log *log, int kind, const char *key, int key_len,
+          const char *body, unsigned long body_len)
+{
+    unsigned char header[CHUTNEY_LOG_HEADER];
+    struct iovec iov[3];
+    int iovcnt = 3, i, saved;
+    ssize_t n;
+
+    header[0] = kind;
+    header[1] = 0;
+    put_le16(header + 2, key_len);
+    put_le32(header + 4, body_len);
+    put_le32(header + 8, frame_crc(header, key, key_len, body, body_len));
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)key;
+    iov[1].iov_len = key_len;
+    iov[2].iov_base = (void *)body;
+    iov[2].iov_len = body_len;
+    for (i = 0; i < iovcnt;) {
+        n = writev(log->fd, iov + i, iovcnt - i);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            goto error;
+        }
+        for (; i < iovcnt && (size_t)n >= iov[i].iov_len; ++i)
+            n -= iov[i].iov_len;
+        if (i < iovcnt) {
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+    log->size += CHUTNEY_LOG_HEADER + key_len + body_len;
+    return 0;
+
+error:
+    saved = errno;
+    if (ftruncate(log->fd, log->size) == 0)
+        lseek(log->fd, log->size, SEEK_SET);
+    errno = saved;
+    return -1;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Index */
+
+static int
+add_block(chutney_log *log, long long off)
+{
+    long long *blocks;
+    long alloc;
+
+    if (log->nblocks == log->blocks_alloc) {
+        alloc = log->blocks_alloc ? log->blocks_alloc * 2 : 64;
+        if (!(blocks = realloc(log->blocks, alloc * sizeof(*blocks))))
+            return -1;
+        log->blocks = blocks;
+        log->blocks_alloc = alloc;
+    }
+    log->blocks[log->nblocks++] = off;
+    return 0;
+}
+
+static int
+add_key(chutney_log *log, long long record, const char *key, int key_len)
+{
+    chutney_log_key *keys;
+    char *keydata;
+    size_t alloc;
+
+    if (log->nkeys == log->keys_alloc) {
+        alloc = log->keys_alloc ? log->keys_alloc * 2 : 64;
+        if (!(keys = realloc(log->keys, alloc * sizeof(*keys))))
+            return -1;
+        log->keys = keys;
+        log->keys_alloc = alloc;
+    }
+    if (log->keydata_len + key_len > log->keydata_alloc) {
+        alloc = log->keydata_alloc ? log->keydata_alloc : 1024;
+        while (alloc < log->keydata_len + key_len)
+            alloc *= 2;
+        if (!(keydata = realloc(log->keydata, alloc)))
+            return -1;
+        log->keydata = keydata;
+        log->keydata_alloc = alloc;
+    }
+    memcpy(log->keydata + log->keydata_len, key, key_len);
+    log->keys[log->nkeys].record = record;
+    log->keys[log->nkeys].key = log->keydata_len;
+    log->keys[log->nkeys].key_len = key_len;
+    log->keydata_len += key_len;
+    log->nkeys++;
+    return 0;
+}
+
+/* Number of records covered by the index block at /off/ */
+static long
+block_count(const chutney_log *log, long long off)
+{
+    const unsigned char *header;
+
+    header = (const unsigned char *)log->map.data + off;
+    return (long)(get_le32(header + 4) / 8) - 1;
+}
+
+/* Read the index from the footer, returning -1 if there isn't a valid one */
+static int
+index_footer(chutney_log *log)
+{
+    const unsigned char *trailer, *p, *end;
+    unsigned long long nblocks, nkeys, i;
+    long long off;
+    log_frame frame;
+    int key_len;
+
+    if (log->map.len < MAGIC_LEN + TRAILER_LEN)
+        return -1;
+    trailer = (const unsigned char *)log->map.data + log->map.len -
+              TRAILER_LEN;
+    if (memcmp(trailer + 8, CHUTNEY_LOG_TRAILER_MAGIC, 4) != 0)
+        return -1;
+    off = (long long)get_le64(trailer);
+    if (frame_get(&log->map, off, &frame) < 0 ||
+            frame.kind != KIND_FOOTER ||
+            frame.end != (long long)log->map.len - TRAILER_LEN ||
+            frame.body_len < 16)
+        return -1;
+    p = (const unsigned char *)frame.body;
+    end = p + frame.body_len;
+    log->count = get_le64(p);
+    nblocks = get_le64(p + 8);
+    p += 16;
+    if (nblocks > (unsigned long long)(end - p) / 8)
+        return -1;
+    for (i = 0; i < nblocks; ++i, p += 8)
+        if (add_block(log, get_le64(p)) < 0)
+            return -2;
+    if (end - p < 8)
+        return -1;
+    nkeys = get_le64(p);
+    p += 8;
+    for (i = 0; i < nkeys; ++i) {
+        if (end - p < 10)
+            return -1;
+        key_len = get_le16(p + 8);
+        if (end - p - 10 < key_len)
+            return -1;
+        if (add_key(log, get_le64(p), (const char *)p + 10, key_len) < 0)
+            return -2;
+        p += 10 + key_len;
+    }
+    log->footer = off;
+    log->size = off;
+    return 0;
+}
+
+/* Rebuild the index by walking the frames, stopping at any torn tail */
+static int
+index_scan(chutney_log *log)
+{
+    long long off = MAGIC_LEN, partial = 0;
+    log_frame frame;
+
+    while (frame_get(&log->map, off, &frame) == 0) {
+        if (frame.kind == KIND_RECORD) {
+            if (log->ntail == CHUTNEY_LOG_INDEX_EVERY)
+                break;          // missing index block
+            if (frame.key_len &&
+                    add_key(log, log->count, frame.key, frame.key_len) < 0)
+                return -2;
+            log->tail[log->ntail++] = off;
+            log->count++;
+            partial = 0;
+        } else if (frame.kind == KIND_INDEX &&
+                   log->ntail < CHUTNEY_LOG_INDEX_EVERY) {
+            /* the partial block written by a close that crashed before its
+             * footer - its records stay in the tail, so record numbers
+             * still map onto full blocks, and appending overwrites it */
+            partial = off;
+        } else if (frame.kind == KIND_INDEX) {
+            if (add_block(log, off) < 0)
+                return -2;
+            log->ntail = 0;
+        } else
+            break;
+        off = frame.end;
+    }
+    log->size = partial ? partial : off;
+    return 0;
+}
+
+/* Hash the keys, so chutney_log_find can look them up */
+static int
+index_keys(chutney_log *log)
+{
+    const char *key;
+    long i, h, size;
+
+    for (size = 16; size < log->nkeys * 2; size *= 2)
+        ;
+    if (!(log->key_hash = calloc(size, sizeof(*log->key_hash))))
+        return -1;
+    log->key_hash_size = size;
+    for (i = 0; i < log->nkeys; ++i) {
+        key = log->keydata + log->keys[i].key;
+        h = chutney_crc32c(0, key, log->keys[i].key_len) & (size - 1);
+        for (; log->key_hash[h]; h = (h + 1) & (size - 1)) {
+            chutney_log_key *other = &log->keys[log->key_hash[h] - 1];
+            if (other->key_len == log->keys[i].key_len &&
+                    !memcmp(log->keydata + other->key, key, other->key_len))
+                break;          // later records replace earlier
+        }
+        log->key_hash[h] = i + 1;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Opening and closing */
+
+static int write_index(chutney_log *log);
+
+static void
+log_free(chutney_log *log)
+{
+    chutney_unmap_file(&log->map);
+    free(log->blocks);
+    free(log->keys);
+    free(log->keydata);
+    free(log->key_hash);
+    log->blocks = NULL;
+    log->keys = NULL;
+    log->keydata = NULL;
+    log->key_hash = NULL;
+    if (log->fd >= 0)
+        close(log->fd);
+    log->fd = -1;
+}
+
+/*
+ * Open the log at /path/, returning -1 with errno set on failure. If
+ * /append/ is set the file is created if necessary, a torn tail is
+ * truncated, and records can then be added with chutney_log_append;
+ * otherwise the file is mapped and records can be read.
+ */
+int
+chutney_log_open(chutney_log *log, const char *path, int append)
+{
+    const unsigned char *index;
+    log_frame frame;
+    long long off;
+    int res, saved, i;
+
+    memset(log, 0, sizeof(*log));
+    log->fd = -1;
+    if (append && (log->fd = open(path, O_RDWR | O_CREAT, 0666)) < 0)
+        return -1;
+    if (chutney_map_file(&log->map, path) < 0)
+        goto error;
+    if (log->map.data)      /* random access, unlike chutney_load_mapping */
+        madvise((void *)log->map.data, log->map.len, MADV_NORMAL);
+    if (memcmp(log->map.data ? log->map.data : "", CHUTNEY_LOG_MAGIC,
+               log->map.len < MAGIC_LEN ? log->map.len : MAGIC_LEN) != 0) {
+        errno = EINVAL;
+        goto error;
+    }
+    if (log->map.len < MAGIC_LEN)
+        res = 0;                // empty, or torn magic
+    else if ((res = index_footer(log)) == -1) {
+        /* no valid footer - start again from the frames */
+        free(log->blocks);
+        free(log->keys);
+        free(log->keydata);
+        log->blocks = NULL;
+        log->keys = NULL;
+        log->keydata = NULL;
+        log->nblocks = log->blocks_alloc = 0;
+        log->nkeys = log->keys_alloc = 0;
+        log->keydata_len = log->keydata_alloc = 0;
+        log->count = 0;
+        log->footer = 0;
+        res = index_scan(log);
+    }
+    if (res < 0) {
+        errno = ENOMEM;
+        goto error;
+    }
+    if (!append) {
+        if (log->nkeys && index_keys(log) < 0) {
+            errno = ENOMEM;
+            goto error;
+        }
+        return 0;
+    }
+
+    /* Reopened after a clean close - appending resumes before the footer,
+     * and a partial final index block is taken back into the tail */
+    off = log->nblocks ? log->blocks[log->nblocks - 1] : 0;
+    if (log->footer && off && frame_get(&log->map, off, &frame) == 0 &&
+            frame.kind == KIND_INDEX && frame.body_len >= 8 &&
+            block_count(log, off) < CHUTNEY_LOG_INDEX_EVERY) {
+        index = (const unsigned char *)frame.body + 8;
+        log->ntail = block_count(log, off);
+        for (i = 0; i < log->ntail; ++i)
+            log->tail[i] = get_le64(index + 8 * i);
+        log->nblocks--;
+        log->size = off;
+    }
+    if (log->size < MAGIC_LEN) {
+        log->size = 0;
+        if (ftruncate(log->fd, 0) < 0 ||
+                write_all(log->fd, CHUTNEY_LOG_MAGIC, MAGIC_LEN) < 0)
+            goto error;
+        log->size = MAGIC_LEN;
+    } else if ((size_t)log->size < log->map.len &&
+               ftruncate(log->fd, log->size) < 0)
+        goto error;
+    if (lseek(log->fd, log->size, SEEK_SET) < 0)
+        goto error;
+    /* a crash after a block's last record, before its index, leaves a full
+     * tail - write the missing index block before accepting appends */
+    if (log->ntail == CHUTNEY_LOG_INDEX_EVERY && write_index(log) < 0)
+        goto error;
+    chutney_unmap_file(&log->map);
+    log->footer = 0;
+    return 0;
+
+error:
+    saved = errno;
+    log_free(log);
+    errno = saved;
+    return -1;
+}
+
+static int
+write_index(chutney_log *log)
+{
+    unsigned char *body;
+    long long off = log->size;
+    int i, res;
+
+    if (!(body = malloc(8 + 8 * log->ntail)))
+        return -1;
+    put_le64(body, log->count - log->ntail);
+    for (i = 0; i < log->ntail; ++i)
+        put_le64(body + 8 + 8 * i, log->tail[i]);
+    res = frame_put(log, KIND_INDEX, NULL, 0, (const char *)body,
+                    8 + 8 * log->ntail);
+    free(body);
+    if (res < 0)
+        return -1;
+    if (add_block(log, off) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    log->ntail = 0;
+    return 0;
+}
+
+/*
+ * Append a record - normally a chutney - with an optional key (which need
+ * not be unique). Returns -1 with errno set on failure, in which case the
+ * log is unchanged.
+ */
+int
+chutney_log_append(chutney_log *log, const char *key, int key_len,
+                   const char *data, size_t len)
+{
+    long long off = log->size;
+
+    if (log->fd < 0 || key_len < 0 || key_len > MAX_KEY ||
+            (unsigned long long)len > 0xffffffffUL) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* an earlier index block write failed - retry it first */
+    if (log->ntail == CHUTNEY_LOG_INDEX_EVERY && write_index(log) < 0)
+        return -1;
+    if (key_len && add_key(log, log->count, key, key_len) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (frame_put(log, KIND_RECORD, key, key_len, data, len) < 0) {
+        if (key_len) {
+            log->nkeys--;
+            log->keydata_len -= key_len;
+        }
+        return -1;
+    }
+    log->tail[log->ntail++] = off;
+    log->count++;
+    if (log->ntail == CHUTNEY_LOG_INDEX_EVERY)
+        return write_index(log);
+    return 0;
+}
+
+/* Flush appended records to stable storage */
+int
+chutney_log_sync(chutney_log *log)
+{
+    return log->fd < 0 ? 0 : fsync(log->fd);
+}
+
+static int
+write_footer(chutney_log *log)
+{
+    unsigned char *body, *p, trailer[TRAILER_LEN];
+    long long off;
+    size_t len;
+    long i;
+    int res;
+
+    if (log->ntail && write_index(log) < 0)
+        return -1;
+    len = 24 + 8 * log->nblocks + 10 * log->nkeys + log->keydata_len;
+    if (len > 0xffffffffUL) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (!(p = body = malloc(len))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    put_le64(p, log->count);
+    put_le64(p + 8, log->nblocks);
+    p += 16;
+    for (i = 0; i < log->nblocks; ++i, p += 8)
+        put_le64(p, log->blocks[i]);
+    put_le64(p, log->nkeys);
+    p += 8;
+    for (i = 0; i < log->nkeys; ++i) {
+        put_le64(p, log->keys[i].record);
+        put_le16(p + 8, log->keys[i].key_len);
+        memcpy(p + 10, log->keydata + log->keys[i].key, log->keys[i].key_len);
+        p += 10 + log->keys[i].key_len;
+    }
+    off = log->size;
+    res = frame_put(log, KIND_FOOTER, NULL, 0, (const char *)body, len);
+    free(body);
+    if (res < 0)
+        return -1;
+    put_le64(trailer, off);
+    memcpy(trailer + 8, CHUTNEY_LOG_TRAILER_MAGIC, 4);
+    return write_all(log->fd, (const char *)trailer, TRAILER_LEN);
+}
+
+/*
+ * Close the log, writing the footer if it was opened to append. Returns -1
+ * with errno set if the footer could not be written - the records are
+ * still intact, and the index will be rebuilt when the log is next opened.
+ */
+int
+chutney_log_close(chutney_log *log)
+{
+    int res = 0, saved = 0;
+
+    if (log->fd >= 0 && write_footer(log) < 0) {
+        res = -1;
+        saved = errno;
+    }
+    log_free(log);
+    errno = saved;
+    return res;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Reading */
+
+/*
+ * Find record /n/ (counting from zero) in a log opened for reading. The
+ * key and data point into the mapping, and are valid until the log is
+ * closed. Returns CHUTNEY_PARSE_ERR if there is no such record, or
+ * CHUTNEY_CHECKSUM_ERR if it is corrupt.
+ */
+enum chutney_status
+chutney_log_record(const chutney_log *log, long long n,
+                   const char **key, int *key_len,
+                   const char **data, size_t *len)
+{
+    const unsigned char *index;
+    long long off, block = n / CHUTNEY_LOG_INDEX_EVERY;
+    long i = n % CHUTNEY_LOG_INDEX_EVERY;
+    log_frame frame;
+
+    if (n < 0 || n >= log->count || !log->map.data)
+        return CHUTNEY_PARSE_ERR;
+    if (block < log->nblocks) {
+        off = log->blocks[block];
+        if (frame_get(&log->map, off, &frame) < 0)
+            return CHUTNEY_CHECKSUM_ERR;
+        if (frame.kind != KIND_INDEX || i >= block_count(log, off))
+            return CHUTNEY_PARSE_ERR;
+        index = (const unsigned char *)frame.body;
+        off = (long long)get_le64(index + 8 + 8 * i);
+    } else if (block == log->nblocks && i < log->ntail)
+        off = log->tail[i];
+    else
+        return CHUTNEY_PARSE_ERR;
+    if (frame_get(&log->map, off, &frame) < 0)
+        return CHUTNEY_CHECKSUM_ERR;
+    if (frame.kind != KIND_RECORD)
+        return CHUTNEY_PARSE_ERR;
+    if (key) {
+        *key = frame.key;
+        *key_len = frame.key_len;
+    }
+    *data = frame.body;
+    *len = frame.body_len;
+    return CHUTNEY_OKAY;
+}
+
+/* The number of the last record with the given key, or -1 */
+long long
+chutney_log_find(const chutney_log *log, const char *key, int key_len)
+{
+    const chutney_log_key *entry;
+    long h;
+
+    if (!log->key_hash)
+        return -1;
+    h = chutney_crc32c(0, key, key_len) & (log->key_hash_size - 1);
+    for (; log->key_hash[h]; h = (h + 1) & (log->key_hash_size - 1)) {
+        entry = &log->keys[log->key_hash[h] - 1];
+        if (entry->key_len == key_len &&
+                !memcmp(log->keydata + entry->key, key, key_len))
+            return entry->record;
+    }
+    return -1;
+}
+
+/*
+ * Parallel scan. The records are divided into shards, one per index block
+ * (plus the tail), and the threads take shards in turn, so /fn/ is called
+ * for every record but in no particular order. Within a shard records are
+ * passed in order.
+ */
+typedef struct {
+    const chutney_log *log;
+    chutney_log_scan_fn fn;
+    void *context;
+    long next;                  // next shard, taken atomically
+    long shards;
+    int status;                 // first failure, set atomically
+} scan_state;
+
+static void *
+scan_worker(void *arg)
+{
+    scan_state *scan = (scan_state *)arg;
+    const char *key, *data;
+    long long n, end;
+    long shard;
+    size_t len;
+    int key_len, status;
+
+    while (!scan->status &&
+           (shard = __sync_fetch_and_add(&scan->next, 1)) < scan->shards) {
+        n = (long long)shard * CHUTNEY_LOG_INDEX_EVERY;
+        end = n + CHUTNEY_LOG_INDEX_EVERY;
+        if (end > scan->log->count)
+            end = scan->log->count;
+        for (; n < end && !scan->status; ++n) {
+            status = chutney_log_record(scan->log, n, &key, &key_len,
+                                        &data, &len);
+            if (status == CHUTNEY_OKAY &&
+                    scan->fn(scan->context, n, key, key_len, data, len) < 0)
+                status = CHUTNEY_CALLBACK_ERR;
+            if (status != CHUTNEY_OKAY) {
+                __sync_bool_compare_and_swap(&scan->status, 0, status);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Call /fn/ for each record of a log opened for reading, using up to
+ * /threads/ threads (including the caller's). Stops at the first record
+ * that is corrupt (CHUTNEY_CHECKSUM_ERR) or for which /fn/ returns -1
+ * (CHUTNEY_CALLBACK_ERR).
+ */
+enum chutney_status
+chutney_log_scan(const chutney_log *log, int threads,
+                 chutney_log_scan_fn fn, void *context)
+{
+    pthread_t *tids = NULL;
+    scan_state scan;
+    int i, started = 0;
+
+    scan.log = log;
+    scan.fn = fn;
+    scan.context = context;
+    scan.next = 0;
+    scan.shards = (long)((log->count + CHUTNEY_LOG_INDEX_EVERY - 1) /
+                         CHUTNEY_LOG_INDEX_EVERY);
+    scan.status = 0;
+    if (threads > scan.shards)
+        threads = scan.shards;
+    if (threads > 1 && (tids = malloc((threads - 1) * sizeof(*tids))))
+        for (i = 0; i < threads - 1; ++i, ++started)
+            if (pthread_create(&tids[i], NULL, scan_worker, &scan) != 0)
+                break;
+    scan_worker(&scan);
+    for (i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    return scan.status;
+}
@@ -0,0 +1,104 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "chutney.h"
+
+/*
+ * Loading directly from a memory mapped file (POSIX only - leave this file
+ * out of the build on other platforms).
+ *
+ * Opcode arguments wholly within the input are passed to the callbacks in
+ * place, so string payloads are pointers into the mapping rather than
+ * copies. The mapping must outlive any such pointers the callbacks keep.
+ */
+
+/* Map /path/ read-only, returning -1 with errno set on failure */
+int
+chutney_map_file(chutney_mapping *map, const char *path)
+{
+    struct stat st;
+    void *data;
+    int fd, saved;
+
+    map->data = NULL;
+    map->len = 0;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0)
+        goto error;
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        goto error;
+    close(fd);
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    map->data = data;
+    map->len = st.st_size;
+    return 0;
+
+error:
+    saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+}
+
+void
+chutney_unmap_file(chutney_mapping *map)
+{
+    if (map->data)
+        munmap((void *)map->data, map->len);
+    map->data = NULL;
+    map->len = 0;
+}
+
+/*
+ * Parse the mapping, optionally as a framed container. chutney_load is
+ * passed the rest of the mapping each time, so no argument is copied, but
+ * pauses at the first opcode after each CHUTNEY_MAP_CHUNK bytes; pages
+ * that have been parsed are released at each pause, so the resident size
+ * stays small however large the file. (chutney_frame_load is passed
+ * CHUTNEY_MAP_CHUNK bytes at a time - a block that crosses a chunk is
+ * collected, as it would be from a stream.) Released pages are simply read
+ * back in if a callback's pointer is used later. Returns CHUTNEY_CONTINUE
+ * if the file ends before the chutney does.
+ */
+enum chutney_status
+chutney_load_mapping(chutney_load_state *state, chutney_frame_reader *frames,
+                     const chutney_mapping *map)
+{
+    size_t pos = 0, released = 0, done, page = sysconf(_SC_PAGESIZE), len;
+    enum chutney_status status = CHUTNEY_CONTINUE;
+    const char *data;
+
+    while (pos < map->len) {
+        data = map->data + pos;
+        len = map->len - pos;
+        if (frames) {
+            if (len > CHUTNEY_MAP_CHUNK)
+                len = CHUTNEY_MAP_CHUNK;
+            status = chutney_frame_load(frames, state, &data, &len);
+        } else {
+            state->in_pause = len > CHUTNEY_MAP_CHUNK ?
+                              data + CHUTNEY_MAP_CHUNK : NULL;
+            status = chutney_load(state, &data, &len);
+            state->in_pause = NULL;
+        }
+        pos = data - map->data;
+        if (status != CHUTNEY_CONTINUE)
+            break;
+        done = pos & ~(page - 1);
+        if (done > released) {
+            madvise((char *)map->data + released, done - released,
+                    MADV_DONTNEED);
+            released = done;
+        }
+    }
+    return status;
+}
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <assert.h>
 #include <string.h>
 #include "chutney.h"
@@ -10,8 +11,31 @@
 #define STACK_POP(S) \
     ((S)->stack_size ? (S)->stack[--((S)->stack_size)] : (void *)0)
 
+/* Fetch callback F, counting the invocation if stats are being collected */
+#define CALLBACK(S, F) \
+    (((S)->stats ? (S)->stats->callbacks++ : 0), (S)->callbacks.F)
+
+/* Record a high-water mark if stats are being collected */
+#define STATS_MAX(S, F, V) \
+    do { \
+        if ((S)->stats && (V) > (S)->stats->F) \
+            (S)->stats->F = (V); \
+    } while (0)
+
+/* Count an event if stats are being collected */
+#define STATS_INC(S, F) \
+    do { \
+        if ((S)->stats) \
+            (S)->stats->F++; \
+    } while (0)
+
+/*
+ * Initialise the state to build objects with /callbacks/, allocating its
+ * own buffers from /allocator/ (or malloc, if NULL).
+ */
 int
-chutney_load_init(chutney_load_state *state, chutney_load_callbacks *callbacks)
+chutney_load_init(chutney_load_state *state, chutney_load_callbacks *callbacks,
+                  const chutney_allocator *allocator)
 {
     assert(callbacks->dealloc != NULL);
     assert(callbacks->make_null != NULL);
@@ -28,10 +52,17 @@ chutney_load_init(chutney_load_state *state, chutney_load_callbacks *callbacks)
     assert(callbacks->object_build != NULL);
 
     state->parser_state = CHUTNEY_S_OPCODE;
+    state->stats = NULL;
+    state->registry = NULL;
+    state->opcode = 0;
+    state->in_pause = NULL;
     state->callbacks = *callbacks;
+    state->allocator = allocator ? *allocator : chutney_malloc_allocator;
+    state->op_state.global.module = NULL;
     state->stack_size = 0;
     state->stack_alloc = 256;
-    if (!(state->stack = malloc(state->stack_alloc * sizeof(void *))))
+    if (!(state->stack = chutney_alloc(&state->allocator, 
+                                       state->stack_alloc * sizeof(void *))))
         return -1;
     state->marks = NULL;
     state->marks_alloc = 0;
@@ -40,23 +71,32 @@ chutney_load_init(chutney_load_state *state, chutney_load_callbacks *callbacks)
     state->buf_alloc = 0;
     state->buf = NULL;
     state->completion = NULL;
+    state->in = state->in_end = NULL;
     return 0;
 }
 
+static void global_free(chutney_load_state *state, char **copy,
+                        size_t alloc);
+
 void
 chutney_load_dealloc(chutney_load_state *state)
 {
     void *obj;
 
     while ((obj = STACK_POP(state)))
-        state->callbacks.dealloc(obj);
-    free(state->stack);
+        CALLBACK(state, dealloc)(obj);
+    chutney_free(&state->allocator, state->stack, 
+                 state->stack_alloc * sizeof(void *));
     state->stack = NULL;
-    free(state->marks);
+    chutney_free(&state->allocator, state->marks, 
+                 state->marks_alloc * sizeof(size_t));
     state->marks = NULL;
-    if (state->buf)
-        free(state->buf);
+    chutney_free(&state->allocator, state->buf, state->buf_alloc);
     state->buf = NULL;
+    /* input ended within a GLOBAL opcode */
+    if (state->op_state.global.module)
+        global_free(state, &state->op_state.global.module,
+                    state->op_state.global.module_alloc);
 }
 
 void
@@ -65,28 +105,25 @@ stack_dealloc(chutney_load_state *state, void **values, long count)
     long i;
 
     for (i = 0; i < count; ++i)
-        state->callbacks.dealloc(values[i]);
+        CALLBACK(state, dealloc)(values[i]);
 }
 
 static int stack_grow(chutney_load_state *state)
 {
     void *tmp;
-    int bigger;
-    size_t nbytes;
+    size_t bigger;
 
     bigger = state->stack_alloc << 1;
-    if (bigger <= 0)
-        return -1;
-    if ((int)(size_t)bigger != bigger)
-        return -1;
-    nbytes = (size_t)bigger * sizeof(void *);
-    if (nbytes / sizeof(void *) != (size_t)bigger)
+    if (bigger <= state->stack_alloc || bigger > SIZE_MAX / sizeof(void *))
         return -1;
-    tmp = realloc(state->stack, nbytes);
+    tmp = chutney_realloc(&state->allocator, state->stack, 
+                          state->stack_alloc * sizeof(void *), 
+                          bigger * sizeof(void *));
     if (!tmp)
         return -1;
     state->stack = tmp;
     state->stack_alloc = bigger;
+    STATS_INC(state, stack_grows);
     return 0;
 }
 
@@ -99,43 +136,39 @@ stack_push(chutney_load_state *state, void *obj)
         if (stack_grow(state) < 0)
             return CHUTNEY_NOMEM;
     state->stack[state->stack_size++] = obj;
+    STATS_MAX(state, stack_max, state->stack_size);
     return CHUTNEY_OKAY;
 }
 
 static int
 mark_push(chutney_load_state *state)
 {
-    int alloc, *marks;
+    size_t alloc, *marks;
+
     if (state->marks_alloc == state->marks_size) {
         alloc = state->marks_alloc + 20;
-        if (state->marks)
-            marks = (int *)malloc(alloc * sizeof(int));
-        else
-            marks = (int *)realloc(state->marks, alloc * sizeof(int));
+        marks = (size_t *)chutney_realloc(&state->allocator, state->marks,
+                                          state->marks_alloc * sizeof(size_t),
+                                          alloc * sizeof(size_t));
         if (!marks)
             return -1;
         state->marks = marks;
         state->marks_alloc = alloc;
+        STATS_INC(state, marks_grows);
     }
     state->marks[state->marks_size++] = state->stack_size;
+    STATS_MAX(state, marks_max, state->marks_size);
     return 0;
 }
 
-static int
-mark_pop(chutney_load_state *state)
-{
-    if (!state->marks_size)
-        return -1;
-    return state->marks[--state->marks_size];
-}
-
 static enum chutney_status
 stack_pop_mark(chutney_load_state *state, void ***items, long *count)
 {
-    long mark;
+    size_t mark;
 
-    if ((mark = mark_pop(state)) < 0)
+    if (!state->marks_size)
         return CHUTNEY_NOMARK_ERR;
+    mark = state->marks[--state->marks_size];
     *items = &state->stack[mark];
     *count = state->stack_size - mark;
     state->stack_size = mark;
@@ -143,110 +176,194 @@ stack_pop_mark(chutney_load_state *state, void ***items, long *count)
 }
 
 static int
-buf_grow(chutney_load_state *state) {
+buf_grow(chutney_load_state *state, size_t want) {
     char *tmp;
-    int bigger;
-
-    if (!state->buf_alloc) {
-        bigger = 256;
-        tmp = malloc(bigger);
-    } else {
-        bigger = state->buf_alloc << 1;
-        if (bigger <= 0)
-            return -1;
-        if ((int)(size_t)bigger != bigger)
+    size_t bigger;
+
+    bigger = state->buf_alloc ? state->buf_alloc : 256;
+    while (bigger < want) {
+        if (bigger > SIZE_MAX / 2)
             return -1;
-        tmp = realloc(state->buf, bigger);
+        bigger <<= 1;
     }
+    tmp = chutney_realloc(&state->allocator, state->buf, state->buf_alloc, 
+                          bigger);
     if (!tmp)
         return -1;
     state->buf = tmp;
     state->buf_alloc = bigger;
+    STATS_INC(state, buf_grows);
     return 0;
 }
 
+/* Append /n/ bytes to buf */
 static int
-buf_putc(chutney_load_state *state, char c)
+buf_append(chutney_load_state *state, const char *s, size_t n)
 {
-    if (state->buf_alloc == state->buf_len)
-        if (buf_grow(state) < 0)
+    if (n > SIZE_MAX - state->buf_len)
+        return -1;
+    if (state->buf_alloc < state->buf_len + n)
+        if (buf_grow(state, state->buf_len + n) < 0)
             return -1;
-    state->buf[state->buf_len++] = c;
+    memcpy(state->buf + state->buf_len, s, n);
+    state->buf_len += n;
+    STATS_MAX(state, buf_max, state->buf_len);
     return 0;
 }
 
 /*
- * Return a malloc'ed copy of the current buffer. The storage pointed to by
- * *copy must be free()'ed.
+ * Return an allocated, nul terminated copy of the current opcode argument,
+ * and its allocated size in *alloc. The storage pointed to by *copy must be
+ * released with global_free, passing that size - the argument may itself
+ * contain nul bytes.
  */
 static enum chutney_status
-buf_dupe(chutney_load_state *state, char **copy)
+arg_dupe(chutney_load_state *state, char **copy, size_t *alloc)
 {
-    if ((*copy = malloc(state->buf_len + 1)) == NULL)
+    if (state->arg_len == SIZE_MAX)
         return CHUTNEY_NOMEM;
-    memcpy(*copy, state->buf, state->buf_len + 1);
+    if ((*copy = chutney_alloc(&state->allocator, 
+                               state->arg_len + 1)) == NULL)
+        return CHUTNEY_NOMEM;
+    memcpy(*copy, state->arg, state->arg_len);
+    (*copy)[state->arg_len] = '\0';
+    *alloc = state->arg_len + 1;
     return CHUTNEY_OKAY;
 }
 
+/* Free a copy made by arg_dupe */
+static void
+global_free(chutney_load_state *state, char **copy, size_t alloc)
+{
+    chutney_free(&state->allocator, *copy, alloc);
+    *copy = NULL;
+}
+
 /*
- * Set up the state machine to read bytes into buf up to the next \n, and then
- * call the given /completion/ function.
+ * Call /completion/ with the opcode argument in buf.
  */
-static void
-state_buf_nl(chutney_load_state *state, 
-             int (*completion)(chutney_load_state *state))
+static enum chutney_status
+buf_complete(chutney_load_state *state)
 {
+    completion_fn completion = state->completion;
+    enum chutney_status err;
+
+    state->completion = NULL;
+    state->parser_state = CHUTNEY_S_OPCODE;
+    state->arg = state->buf;
+    state->arg_len = state->buf_len;
+    err = completion(state);
+    state->buf_len = 0;
+    return err;
+}
+
+/*
+ * Read the opcode argument up to the next \n, and then call the given
+ * /completion/ function. If the \n is in the current input, the completion
+ * is called immediately with the argument pointing into the input,
+ * otherwise the state machine is set up to collect the argument in buf.
+ */
+static enum chutney_status
+state_buf_nl(chutney_load_state *state, completion_fn completion)
+{
+    const char *nl;
+
     assert(state->completion == NULL);
+    nl = memchr(state->in, '\n', state->in_end - state->in);
+    if (nl) {
+        state->arg = state->in;
+        state->arg_len = nl - state->in;
+        state->in = nl + 1;
+        return completion(state);
+    }
     state->parser_state = CHUTNEY_S_BUF_NL;
     state->completion = completion;
+    return CHUTNEY_OKAY;
 }
 
 /*
- * Set up the state machine read /count/ bytes into buf, and then call the
- * given /completion/ function.
+ * Read a /count/ byte opcode argument, and then call the given /completion/
+ * function - directly from the input if it is all present, otherwise once
+ * it has been collected in buf.
  */
-static void
-state_buf_count(chutney_load_state *state, int count, 
-                int (*completion)(chutney_load_state *state))
+static enum chutney_status
+state_buf_count(chutney_load_state *state, size_t count, 
+                completion_fn completion)
 {
     assert(state->completion == NULL);
+    if ((size_t)(state->in_end - state->in) >= count) {
+        state->arg = state->in;
+        state->arg_len = count;
+        state->in += count;
+        return completion(state);
+    }
     state->parser_state = CHUTNEY_S_BUF_CNT;
     state->buf_want = count;
     state->completion = completion;
+    return CHUTNEY_OKAY;
 }
 
 static enum chutney_status
 load_int(chutney_load_state *state)
 {
+    char buf[32], *end;
     long l;
-    char *end;
 
+    if (state->arg_len >= sizeof(buf))
+        return CHUTNEY_PARSE_ERR;
+    memcpy(buf, state->arg, state->arg_len);
+    buf[state->arg_len] = '\0';
     errno = 0;
-    l = strtol(state->buf, &end, 0);
+    l = strtol(buf, &end, 0);
     if (errno || *end != '\0')
         return CHUTNEY_PARSE_ERR;
-    return stack_push(state, state->callbacks.make_int(l));
+    return stack_push(state, CALLBACK(state, make_int)(l));
 }
 
 static long
 parse_binint(chutney_load_state *state)
 {
+    const unsigned char *arg = (const unsigned char *)state->arg;
     long l = 0;
-    int i;
+    size_t i;
 
-    for (i = 0; i < state->buf_len; ++i)
-        l |= (long)(unsigned char)state->buf[i] << (i * 8);
+    for (i = 0; i < state->arg_len; ++i)
+        l |= (long)arg[i] << (i * 8);
 #if LONG_MAX > 2147483647
-    if (state->buf_len == 4 && l & (1L << 31))
+    if (state->arg_len == 4 && l & (1L << 31))
         l |= (~0L) << 32;
 #endif
     return l;
 }
 
+/*
+ * Parse an unsigned little-endian length of arg_len bytes into *length,
+ * returning -1 if it is not representable.
+ */
+static int
+parse_length(chutney_load_state *state, size_t *length)
+{
+    const unsigned char *arg = (const unsigned char *)state->arg;
+    unsigned long long l = 0;
+    size_t i;
+
+    for (i = 0; i < state->arg_len; ++i)
+        l |= (unsigned long long)arg[i] << (i * 8);
+    /* BINSTRING's length is signed */
+    if (state->opcode == BINSTRING && l > 0x7fffffffUL)
+        return -1;
+    if (l > (size_t)PTRDIFF_MAX)
+        return -1;
+    *length = (size_t)l;
+    return 0;
+}
+
 static enum chutney_status
 load_binint(chutney_load_state *state)
 {
-    return stack_push(state, state->callbacks.make_int(parse_binint(state)));
+    long l = parse_binint(state);
+
+    return stack_push(state, CALLBACK(state, make_int)(l));
 }
 
 static enum chutney_status
@@ -256,21 +373,21 @@ load_binfloat(chutney_load_state *state)
     char buf[8], *q;
     int i;
 
-    if (state->buf_len != sizeof(double))
+    if (state->arg_len != sizeof(double))
         return CHUTNEY_PARSE_ERR;
     switch (detect_ieee_fp()) {
     case IEEE_LE:
         for (i = 0, q = &buf[sizeof(buf)]; i < sizeof(buf); ++i)
-            *--q = state->buf[i];
-        l = *(double *)buf;
+            *--q = state->arg[i];
+        memcpy(&l, buf, sizeof(l));
         break;
     case IEEE_BE:
-        l = *(double *)state->buf;
+        memcpy(&l, state->arg, sizeof(l));
         break;
     default:
         return CHUTNEY_PARSE_ERR;
     }
-    return stack_push(state, state->callbacks.make_float(l));
+    return stack_push(state, CALLBACK(state, make_float)(l));
 }
 
 static enum chutney_status
@@ -283,10 +400,34 @@ load_tuple(chutney_load_state *state, void **objp)
     err = stack_pop_mark(state, &values, &count);
     if (err != CHUTNEY_OKAY)
         return err;
-    *objp = state->callbacks.make_tuple(values, count);
+    *objp = CALLBACK(state, make_tuple)(values, count);
     return *objp ? CHUTNEY_OKAY : CHUTNEY_CALLBACK_ERR;
 }
 
+/* Number of stack items above the most recent MARK */
+static size_t
+stack_avail(chutney_load_state *state)
+{
+    if (state->marks_size)
+        return state->stack_size - state->marks[state->marks_size - 1];
+    return state->stack_size;
+}
+
+/* TUPLE1, TUPLE2, TUPLE3 and EMPTY_TUPLE - build a tuple of the top count
+ * stack items */
+static enum chutney_status
+load_counted_tuple(chutney_load_state *state, size_t count)
+{
+    void *obj;
+
+    if (stack_avail(state) < count)
+        return CHUTNEY_STACK_ERR;
+    state->stack_size -= count;
+    obj = CALLBACK(state, make_tuple)(&state->stack[state->stack_size],
+                                       count);
+    return stack_push(state, obj);
+}
+
 static enum chutney_status
 dict_setitems(chutney_load_state *state)
 {
@@ -305,47 +446,65 @@ dict_setitems(chutney_load_state *state)
         return CHUTNEY_PARSE_ERR;
     }
     dict = state->stack[state->stack_size - 1];
-    if (state->callbacks.dict_setitems(dict, values, count) < 0)
+    if (CALLBACK(state, dict_setitems)(dict, values, count) < 0)
         return CHUTNEY_CALLBACK_ERR;
     else
         return CHUTNEY_OKAY;
 }
 
+/* SETITEM - add the top key and value on the stack to the dict below them */
+static enum chutney_status
+dict_setitem(chutney_load_state *state)
+{
+    void *dict;
+
+    if (stack_avail(state) < 3)
+        return CHUTNEY_STACK_ERR;
+    state->stack_size -= 2;
+    dict = state->stack[state->stack_size - 1];
+    if (CALLBACK(state, dict_setitems)(dict, &state->stack[state->stack_size],
+                                       2) < 0)
+        return CHUTNEY_CALLBACK_ERR;
+    return CHUTNEY_OKAY;
+}
+
 static enum chutney_status
 load_binstring(struct chutney_load_state *state)
 {
-    return stack_push(state, state->callbacks.make_string(state->buf, 
-                                                         state->buf_len));
+    return stack_push(state, CALLBACK(state, make_string)(state->arg,
+                                                          state->arg_len));
 }
 
 
 static enum chutney_status
 s_binstring(struct chutney_load_state *state)
 {
-    int want = parse_binint(state);
+    size_t want;
 
+    if (parse_length(state, &want) < 0)
+        return CHUTNEY_PARSE_ERR;
     if (!want)
-        return stack_push(state, state->callbacks.make_string("", 0));
-    state_buf_count(state, want, load_binstring);
-    return CHUTNEY_OKAY;
+        return stack_push(state, CALLBACK(state, make_string)("", 0));
+    return state_buf_count(state, want, load_binstring);
 }
 
 static enum chutney_status
 load_binunicode(struct chutney_load_state *state)
 {
-    return stack_push(state, state->callbacks.make_unicode(state->buf, 
-                                                          state->buf_len));
+    return stack_push(state, CALLBACK(state, make_unicode)(state->arg,
+                                                           state->arg_len));
 }
 
 static enum chutney_status
 s_binunicode(struct chutney_load_state *state)
 {
-    int want = parse_binint(state);
+    size_t want;
 
+    if (parse_length(state, &want) < 0)
+        return CHUTNEY_PARSE_ERR;
     if (!want)
-        return stack_push(state, state->callbacks.make_unicode("", 0));
-    state_buf_count(state, want, load_binunicode);
-    return CHUTNEY_OKAY;
+        return stack_push(state, CALLBACK(state, make_unicode)("", 0));
+    return state_buf_count(state, want, load_binunicode);
 }
 
 /* Load second argument of GLOBAL opcode, construct "global" object */
@@ -355,11 +514,14 @@ load_global(struct chutney_load_state *state)
     void *obj;
     chutney_op_global *global = &state->op_state.global;
 
-    if (buf_dupe(state, &state->op_state.global.name) < 0)
+    if (arg_dupe(state, &global->name, &global->name_alloc) < 0) {
+        global_free(state, &global->module, global->module_alloc);
         return CHUTNEY_NOMEM;
-    obj = state->callbacks.get_global(global->module, global->name);
-    free(global->name);
-    free(global->module);
+    }
+    obj = CALLBACK(state, get_global)(global->module, global->name);
+    /* the name is the latest allocation, so an arena reclaims it */
+    global_free(state, &global->name, global->name_alloc);
+    global_free(state, &global->module, global->module_alloc);
     return stack_push(state, obj);
 }
 
@@ -367,9 +529,206 @@ load_global(struct chutney_load_state *state)
 static enum chutney_status
 s_global_module(struct chutney_load_state *state)
 {
-    if (buf_dupe(state, &state->op_state.global.module) < 0)
+    chutney_op_global *global = &state->op_state.global;
+
+    if (arg_dupe(state, &global->module, &global->module_alloc) < 0)
+        return CHUTNEY_NOMEM;
+    return state_buf_nl(state, load_global);
+}
+
+/* EXT1, EXT2, EXT4 - a class from the registry, refusing any other code */
+static enum chutney_status
+load_ext(struct chutney_load_state *state)
+{
+    const chutney_extension *ext;
+    unsigned long code = 0;
+    size_t i;
+
+    for (i = state->arg_len; i; --i)
+        code = (code << 8) | (unsigned char)state->arg[i - 1];
+    if (!state->registry || 
+            (ext = chutney_registry_get(state->registry, code)) == NULL)
+        return CHUTNEY_OPCODE_ERR;
+    return stack_push(state, CALLBACK(state, get_global)(ext->module,
+                                                         ext->name));
+}
+
+/* Make room on the stack for /n/ more items */
+static int
+stack_reserve(chutney_load_state *state, size_t n)
+{
+    while (state->stack_alloc - state->stack_size < n)
+        if (stack_grow(state) < 0)
+            return -1;
+    return 0;
+}
+
+/* INTS - push a column of 4 byte ints */
+static enum chutney_status
+load_ints(chutney_load_state *state)
+{
+    const unsigned char *p = (const unsigned char *)state->arg;
+    const unsigned char *end = p + state->arg_len;
+    unsigned int v;
+    void *obj;
+
+    if (stack_reserve(state, state->arg_len / 4) < 0)
         return CHUTNEY_NOMEM;
-    state_buf_nl(state, load_global);
+    for (; p < end; p += 4) {
+        v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+        if ((obj = CALLBACK(state, make_int)((int)v)) == NULL)
+            return CHUTNEY_CALLBACK_ERR;
+        state->stack[state->stack_size++] = obj;
+    }
+    STATS_MAX(state, stack_max, state->stack_size);
+    return CHUTNEY_OKAY;
+}
+
+/* FLOATS - push a column of 8 byte little-endian floats */
+static enum chutney_status
+load_floats(chutney_load_state *state)
+{
+    const char *p = state->arg, *end = p + state->arg_len;
+    enum ieee_fp fp = detect_ieee_fp();
+    char buf[8];
+    double d;
+    void *obj;
+    int i;
+
+    if (fp != IEEE_LE && fp != IEEE_BE)
+        return CHUTNEY_PARSE_ERR;
+    if (stack_reserve(state, state->arg_len / 8) < 0)
+        return CHUTNEY_NOMEM;
+    for (; p < end; p += 8) {
+        if (fp == IEEE_LE)
+            memcpy(&d, p, sizeof(d));
+        else {
+            for (i = 0; i < 8; ++i)
+                buf[7 - i] = p[i];
+            memcpy(&d, buf, sizeof(d));
+        }
+        if ((obj = CALLBACK(state, make_float)(d)) == NULL)
+            return CHUTNEY_CALLBACK_ERR;
+        state->stack[state->stack_size++] = obj;
+    }
+    STATS_MAX(state, stack_max, state->stack_size);
+    return CHUTNEY_OKAY;
+}
+
+/* Count of an INTS or FLOATS column, then collect the values */
+static enum chutney_status
+s_column(chutney_load_state *state)
+{
+    size_t count;
+
+    if (parse_length(state, &count) < 0)
+        return CHUTNEY_PARSE_ERR;
+    if (!count)
+        return CHUTNEY_OKAY;
+    return state_buf_count(state, count * (state->opcode == INTS ? 4 : 8),
+                           state->opcode == INTS ? load_ints : load_floats);
+}
+
+/*
+ * COLUMNS - the items since the MARK are a class, /attrs/ attribute
+ * names, and a column of /rows/ values for each attribute. Build an
+ * instance for each row, and push a tuple of them. The class and names
+ * are shared by every instance, so need the incref callback.
+ */
+static enum chutney_status
+load_columns(chutney_load_state *state)
+{
+    const unsigned char *arg = (const unsigned char *)state->arg;
+    void **values, **keys, **cols, **pairs = NULL, **objs = NULL;
+    void *obj, *dict;
+    size_t attrs = 0, rows = 0, i, j, made = 0;
+    long count;
+    enum chutney_status err;
+
+    for (i = 4; i; --i) {
+        attrs = (attrs << 8) | arg[i - 1];
+        rows = (rows << 8) | arg[i + 3];
+    }
+    if (!state->callbacks.incref)
+        return CHUTNEY_OPCODE_ERR;
+    if ((err = stack_pop_mark(state, &values, &count)) != CHUTNEY_OKAY)
+        return err;
+    if (count < 1 || !attrs || (size_t)count - 1 < attrs ||
+            (unsigned long long)attrs * rows != (size_t)count - 1 - attrs) {
+        stack_dealloc(state, values, count);
+        return CHUTNEY_PARSE_ERR;
+    }
+    keys = values + 1;
+    cols = keys + attrs;
+    err = CHUTNEY_NOMEM;
+    if (!(pairs = chutney_alloc(&state->allocator, 
+                                (attrs * 2 + 1) * sizeof(void *))) ||
+            !(objs = chutney_alloc(&state->allocator, 
+                                   (rows + 1) * sizeof(void *))))
+        goto finally;
+    err = CHUTNEY_CALLBACK_ERR;
+    for (i = 0; i < rows; ++i) {
+        CALLBACK(state, incref)(values[0]);
+        if ((obj = CALLBACK(state, make_object)(values[0])) == NULL)
+            goto finally;
+        if ((dict = CALLBACK(state, make_empty_dict)()) == NULL) {
+            CALLBACK(state, dealloc)(obj);
+            goto finally;
+        }
+        for (j = 0; j < attrs; ++j) {
+            CALLBACK(state, incref)(keys[j]);
+            pairs[j * 2] = keys[j];
+            pairs[j * 2 + 1] = cols[j * rows + i];
+            cols[j * rows + i] = NULL;
+        }
+        if (CALLBACK(state, dict_setitems)(dict, pairs, attrs * 2) < 0) {
+            CALLBACK(state, dealloc)(dict);
+            CALLBACK(state, dealloc)(obj);
+            goto finally;
+        }
+        if (CALLBACK(state, object_build)(obj, dict) < 0) {
+            CALLBACK(state, dealloc)(obj);
+            goto finally;
+        }
+        objs[made++] = obj;
+    }
+    err = CHUTNEY_OKAY;
+finally:
+    /* the class, names, and any values not yet used */
+    for (i = 0; i < (size_t)count; ++i)
+        if (values[i])
+            CALLBACK(state, dealloc)(values[i]);
+    if (err == CHUTNEY_OKAY) {
+        made = 0;
+        err = stack_push(state, CALLBACK(state, make_tuple)(objs, rows));
+    }
+    stack_dealloc(state, objs, made);
+    chutney_free(&state->allocator, objs, (rows + 1) * sizeof(void *));
+    chutney_free(&state->allocator, pairs, (attrs * 2 + 1) * sizeof(void *));
+    return err;
+}
+
+/* PROTO - we understand protocols up to 4 */
+static enum chutney_status
+load_proto(chutney_load_state *state)
+{
+    if ((unsigned char)state->arg[0] > 4)
+        return CHUTNEY_OPCODE_ERR;
+    return CHUTNEY_OKAY;
+}
+
+/*
+ * FRAME - the frame length is checked, but otherwise frames need no
+ * special handling, as any opcode argument wholly within the input is
+ * parsed in place.
+ */
+static enum chutney_status
+load_frame(chutney_load_state *state)
+{
+    size_t length;
+
+    if (parse_length(state, &length) < 0)
+        return CHUTNEY_PARSE_ERR;
     return CHUTNEY_OKAY;
 }
 
@@ -387,7 +746,7 @@ load_object(chutney_load_state *state)
         stack_dealloc(state, values, count);
         return CHUTNEY_PARSE_ERR;
     }
-    return stack_push(state, state->callbacks.make_object(*values));
+    return stack_push(state, CALLBACK(state, make_object)(*values));
 }
 
 static enum chutney_status
@@ -398,120 +757,216 @@ object_build(chutney_load_state *state)
     if ((objstate = STACK_POP(state)) == NULL)
         return CHUTNEY_STACK_ERR;
     if ((obj = STACK_POP(state)) == NULL) {
-        state->callbacks.dealloc(objstate);
+        CALLBACK(state, dealloc)(objstate);
         return CHUTNEY_STACK_ERR;
     }
-    if (state->callbacks.object_build(obj, objstate) < 0) {
-        state->callbacks.dealloc(obj);
+    if (CALLBACK(state, object_build)(obj, objstate) < 0) {
+        CALLBACK(state, dealloc)(obj);
         return CHUTNEY_CALLBACK_ERR;
     }
     return stack_push(state, obj);
 }
 
+/* Dispatch a single opcode - sets *stop on the STOP opcode */
+static enum chutney_status
+load_opcode(chutney_load_state *state, char c, int *stop)
+{
+    enum chutney_status err = CHUTNEY_OKAY;
+    void *obj;
+
+    switch (c) {
+    case STOP:
+        /* if stack empty, raise an error */
+        if (state->stack_size != 1)
+            err = CHUTNEY_STACK_ERR;
+        *stop = 1;
+        break;
+    case MARK:
+        if (mark_push(state) < 0)
+            err = CHUTNEY_NOMEM;
+        break;
+    case PROTO:
+        err = state_buf_count(state, 1, load_proto);
+        break;
+    case FRAME:
+        err = state_buf_count(state, 8, load_frame);
+        break;
+    case MEMOIZE:
+        /* We never refer back to the memo, so can ignore this */
+        break;
+    case NONE:
+        err = stack_push(state, CALLBACK(state, make_null)());
+        break;
+    case NEWTRUE:
+    case NEWFALSE:
+        obj = CALLBACK(state, make_bool)(c == NEWTRUE);
+        err = stack_push(state, obj);
+        break;
+    case INT:
+        err = state_buf_nl(state, load_int);
+        break;
+    case BININT:
+        err = state_buf_count(state, 4, load_binint);
+        break;
+    case BININT1:
+        err = state_buf_count(state, 1, load_binint);
+        break;
+    case BININT2:
+        err = state_buf_count(state, 2, load_binint);
+        break;
+    case BINFLOAT:
+        err = state_buf_count(state, 8, load_binfloat);
+        break;
+    case SHORT_BINSTRING:
+    case SHORT_BINBYTES:
+        err = state_buf_count(state, 1, s_binstring);
+        break;
+    case BINSTRING:
+    case BINBYTES:
+        err = state_buf_count(state, 4, s_binstring);
+        break;
+    case BINBYTES8:
+        err = state_buf_count(state, 8, s_binstring);
+        break;
+    case SHORT_BINUNICODE:
+        err = state_buf_count(state, 1, s_binunicode);
+        break;
+    case BINUNICODE:
+        err = state_buf_count(state, 4, s_binunicode);
+        break;
+    case BINUNICODE8:
+        err = state_buf_count(state, 8, s_binunicode);
+        break;
+    case TUPLE:
+        err = load_tuple(state, &obj);
+        if (err == CHUTNEY_OKAY)
+            err = stack_push(state, obj);
+        break;
+    case EMPTY_TUPLE:
+        err = load_counted_tuple(state, 0);
+        break;
+    case TUPLE1:
+        err = load_counted_tuple(state, 1);
+        break;
+    case TUPLE2:
+        err = load_counted_tuple(state, 2);
+        break;
+    case TUPLE3:
+        err = load_counted_tuple(state, 3);
+        break;
+    case EMPTY_DICT:
+        obj = CALLBACK(state, make_empty_dict)();
+        err = stack_push(state, obj);
+        break;
+    case SETITEM:
+        err = dict_setitem(state);
+        break;
+    case SETITEMS:
+        err = dict_setitems(state);
+        break;
+    case GLOBAL:
+        err = state_buf_nl(state, s_global_module);
+        break;
+    case EXT1:
+        err = state_buf_count(state, 1, load_ext);
+        break;
+    case EXT2:
+        err = state_buf_count(state, 2, load_ext);
+        break;
+    case EXT4:
+        err = state_buf_count(state, 4, load_ext);
+        break;
+    case INTS:
+    case FLOATS:
+        err = state_buf_count(state, 4, s_column);
+        break;
+    case COLUMNS:
+        err = state_buf_count(state, 8, load_columns);
+        break;
+    case OBJ:
+        err = load_object(state);
+        break;
+    case BUILD:
+        err = object_build(state);
+        break;
+    default:
+        err = CHUTNEY_OPCODE_ERR;
+        break;
+    }
+    return err;
+}
+
 enum chutney_status 
-chutney_load(chutney_load_state *state, const char **datap, int *len)
+chutney_load(chutney_load_state *state, const char **datap, size_t *len)
 {
+    const char *nl;
     char c;
     enum chutney_status err = CHUTNEY_OKAY;
-    void *obj = NULL;
+    size_t n;
+    int stop = 0;
+#ifdef CHUTNEY_STATS_CYCLES
+    unsigned long long start_cycles = 0;
+#endif
 
-    while (err == CHUTNEY_OKAY && (*len)--) {
-        c = *(*datap)++;
+    state->in = *datap;
+    state->in_end = *datap + *len;
+    while (err == CHUTNEY_OKAY && !stop && state->in < state->in_end) {
+        if (state->in_pause && state->in >= state->in_pause &&
+                state->parser_state == CHUTNEY_S_OPCODE)
+            break;
+#ifdef CHUTNEY_STATS_CYCLES
+        if (state->stats)
+            start_cycles = chutney_cycles();
+#endif
         switch (state->parser_state) {
         case CHUTNEY_S_OPCODE:
-            switch (c) {
-            case STOP:
-                /* if stack empty, raise an error */
-                if (state->stack_size != 1)
-                    return CHUTNEY_STACK_ERR;
-                return CHUTNEY_OKAY;
-            case MARK:
-                if (mark_push(state) < 0)
-                    return CHUTNEY_NOMEM;
-                break;
-            case NONE:
-                err = stack_push(state, state->callbacks.make_null());
-                break;
-            case NEWTRUE:
-            case NEWFALSE:
-                obj = state->callbacks.make_bool(c == NEWTRUE);
-                err = stack_push(state, obj);
-                break;
-            case INT:
-                state_buf_nl(state, load_int);
-                break;
-            case BININT:
-                state_buf_count(state, 4, load_binint);
-                break;
-            case BININT2:
-                state_buf_count(state, 2, load_binint);
-                break;
-            case BINFLOAT:
-                state_buf_count(state, 8, load_binfloat);
-                break;
-            case SHORT_BINSTRING:
-                state_buf_count(state, 1, s_binstring);
-                break;
-            case BINSTRING:
-                state_buf_count(state, 4, s_binstring);
-                break;
-            case BINUNICODE:
-                state_buf_count(state, 4, s_binunicode);
-                break;
-            case TUPLE:
-                err = load_tuple(state, &obj);
-                if (err == CHUTNEY_OKAY)
-                    err = stack_push(state, obj);
-                break;
-            case EMPTY_DICT:
-                obj = state->callbacks.make_empty_dict();
-                err = stack_push(state, obj);
-                break;
-            case SETITEMS:
-                err = dict_setitems(state);
-                break;
-            case GLOBAL:
-                state_buf_nl(state, s_global_module);
-                break;
-            case OBJ:
-                err = load_object(state);
-                break;
-            case BUILD:
-                err = object_build(state);
-                break;
-            default:
-                return CHUTNEY_OPCODE_ERR;
-            }
+            c = *state->in++;
+            state->opcode = c;
+            if (state->stats)
+                state->stats->opcodes[(unsigned char)c]++;
+            err = load_opcode(state, c, &stop);
             break;
 
         /* collect bytes until newline, then call /completion/ */
         case CHUTNEY_S_BUF_NL:
-            if (c != '\n')
-                buf_putc(state, c);
-            else {
-                completion_fn completion = state->completion;
-                buf_putc(state, '\0'); --state->buf_len;
-                state->completion = NULL;
-                state->parser_state = CHUTNEY_S_OPCODE;
-                err = completion(state);
-                state->buf_len = 0;
+            nl = memchr(state->in, '\n', state->in_end - state->in);
+            n = (nl ? nl : state->in_end) - state->in;
+            if (buf_append(state, state->in, n) < 0) {
+                err = CHUTNEY_NOMEM;
+                break;
+            }
+            state->in += n;
+            if (nl) {
+                state->in++;
+                err = buf_complete(state);
             }
             break;
 
         /* collect want_buf bytes, then call /completion/ */
         case CHUTNEY_S_BUF_CNT:
-            buf_putc(state, c);
-            if (state->buf_len == state->buf_want) {
-                completion_fn completion = state->completion;
-                state->completion = NULL;
-                state->parser_state = CHUTNEY_S_OPCODE;
-                err = completion(state);
-                state->buf_len = 0;
+            n = state->buf_want - state->buf_len;
+            if (n > (size_t)(state->in_end - state->in))
+                n = state->in_end - state->in;
+            if (buf_append(state, state->in, n) < 0) {
+                err = CHUTNEY_NOMEM;
+                break;
             }
+            state->in += n;
+            if (state->buf_len == state->buf_want)
+                err = buf_complete(state);
             break;
         }
+#ifdef CHUTNEY_STATS_CYCLES
+        if (state->stats)
+            state->stats->cycles[chutney_opcode_class(state->opcode)] +=
+                chutney_cycles() - start_cycles;
+#endif
     }
-    return err != CHUTNEY_OKAY ? err : CHUTNEY_CONTINUE;
+    if (state->stats)
+        state->stats->bytes += state->in - *datap;
+    *len -= state->in - *datap;
+    *datap = state->in;
+    return err != CHUTNEY_OKAY || stop ? err : CHUTNEY_CONTINUE;
 }
 
 void *
@@ -519,3 +974,49 @@ chutney_load_result(chutney_load_state *state)
 {
     return state->stack_size == 1 ? state->stack[0] : NULL;
 }
+
+enum chutney_opclass
+chutney_opcode_class(char opcode)
+{
+    switch (opcode) {
+    case NONE:
+    case NEWTRUE:
+    case NEWFALSE:
+    case INT:
+    case BININT:
+    case BININT1:
+    case BININT2:
+    case BINFLOAT:
+    case INTS:
+    case FLOATS:
+        return CHUTNEY_OPCLASS_SCALAR;
+    case SHORT_BINSTRING:
+    case BINSTRING:
+    case SHORT_BINBYTES:
+    case BINBYTES:
+    case BINBYTES8:
+    case SHORT_BINUNICODE:
+    case BINUNICODE:
+    case BINUNICODE8:
+        return CHUTNEY_OPCLASS_STRING;
+    case TUPLE:
+    case EMPTY_TUPLE:
+    case TUPLE1:
+    case TUPLE2:
+    case TUPLE3:
+    case EMPTY_DICT:
+    case SETITEM:
+    case SETITEMS:
+        return CHUTNEY_OPCLASS_CONTAINER;
+    case GLOBAL:
+    case EXT1:
+    case EXT2:
+    case EXT4:
+    case OBJ:
+    case BUILD:
+    case COLUMNS:
+        return CHUTNEY_OPCLASS_OBJECT;
+    default:
+        return CHUTNEY_OPCLASS_CONTROL;
+    }
+}
@@ -57,6 +57,29 @@
 #define LONG1    '\x8a' /* push long from < 256 bytes */
 #define LONG4    '\x8b' /* push really big long */
 
+/* Protocol 3 (Python 3.x) */
+#define BINBYTES       'B'   /* push bytes; counted binary string argument */
+#define SHORT_BINBYTES 'C'   /* push bytes; length < 256 bytes */
+
+/* Protocol 4 */
+#define SHORT_BINUNICODE '\x8c' /* push short string; UTF-8 length < 256 */
+#define BINUNICODE8      '\x8d' /* push very long string */
+#define BINBYTES8        '\x8e' /* push very long bytes string */
+#define EMPTY_SET        '\x8f' /* push empty set on the stack */
+#define ADDITEMS         '\x90' /* modify set by adding topmost stack items */
+#define FROZENSET        '\x91' /* build frozenset from topmost stack items */
+#define NEWOBJ_EX        '\x92' /* like NEWOBJ, with keyword only arguments */
+#define STACK_GLOBAL     '\x93' /* same as GLOBAL, names on the stack */
+#define MEMOIZE          '\x94' /* store top of the stack in memo */
+#define FRAME            '\x95' /* indicate the beginning of a new frame */
+
+/* Chutney's own columnar opcodes - not understood by pickle */
+#define COLUMNS          '\xf0' /* build instances from columns; 4-byte
+                                    attribute and row counts */
+#define INTS             '\xf1' /* push 4-byte ints; 4-byte count */
+#define FLOATS           '\xf2' /* push 8-byte little-endian IEEE floats;
+                                    4-byte count */
+
 /* There aren't opcodes -- they're ways to pickle bools before protocol 2,
  * so that unpicklers written before bools were introduced unpickle them
  * as ints, but unpicklers after can recognize that bools were intended.
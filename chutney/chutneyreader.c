@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include "chutney.h"
+#include "chutneyprotocol.h"
+#include "chutneyutil.h"
+
+/*
+ * Pull parser. Unlike chutney_load, nothing is built - each call returns
+ * the next opcode as an event, so memory use is fixed regardless of the
+ * size or depth of the chutney. String bodies are not buffered: they are
+ * returned as one or more chunks pointing directly into the input.
+ */
+
+/* Return code for opcodes that produce no event */
+#define SKIP 2
+
+void
+chutney_reader_init(chutney_reader *reader)
+{
+    reader->state = CHUTNEY_R_OPCODE;
+    reader->opcode = 0;
+    reader->want = 0;
+    reader->lines = 0;
+    reader->lines_found = 0;
+    reader->scratch_len = 0;
+    reader->registry = NULL;
+    reader->body_left = 0;
+    reader->body_total = 0;
+}
+
+/* Argument of an opcode: fixed length /want/, or /lines/ lines */
+static int
+arg_spec(chutney_reader *reader)
+{
+    reader->want = 0;
+    reader->lines = 0;
+    switch (reader->opcode) {
+    case NONE: case NEWTRUE: case NEWFALSE: case MARK: case STOP:
+    case TUPLE: case EMPTY_TUPLE: case TUPLE1: case TUPLE2: case TUPLE3:
+    case EMPTY_DICT: case SETITEM: case SETITEMS: case OBJ: case BUILD:
+    case MEMOIZE:
+        break;
+    case PROTO: case BININT1: case EXT1:
+    case SHORT_BINSTRING: case SHORT_BINBYTES: case SHORT_BINUNICODE:
+        reader->want = 1;
+        break;
+    case BININT2: case EXT2:
+        reader->want = 2;
+        break;
+    case BININT: case BINSTRING: case BINBYTES: case BINUNICODE: case EXT4:
+        reader->want = 4;
+        break;
+    case BINFLOAT: case FRAME: case BINBYTES8: case BINUNICODE8:
+        reader->want = 8;
+        break;
+    case INT:
+        reader->lines = 1;
+        break;
+    case GLOBAL:
+        reader->lines = 2;
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Collect the argument, directly from the input if it is all there,
+ * otherwise via the scratch buffer.
+ */
+static enum chutney_status
+gather_fixed(chutney_reader *reader, const char **inp, const char *end,
+             const char **argp, size_t *arg_len)
+{
+    const char *in = *inp;
+    size_t n = reader->want - reader->scratch_len;
+
+    if (!reader->scratch_len && (size_t)(end - in) >= n) {
+        *argp = in;
+        *arg_len = n;
+        *inp = in + n;
+        return CHUTNEY_OKAY;
+    }
+    if (n > (size_t)(end - in))
+        n = end - in;
+    memcpy(reader->scratch + reader->scratch_len, in, n);
+    reader->scratch_len += n;
+    *inp = in + n;
+    if (reader->scratch_len < reader->want)
+        return CHUTNEY_CONTINUE;
+    *argp = reader->scratch;
+    *arg_len = reader->scratch_len;
+    return CHUTNEY_OKAY;
+}
+
+static enum chutney_status
+gather_lines(chutney_reader *reader, const char **inp, const char *end,
+             const char **argp, size_t *arg_len)
+{
+    const char *in = *inp, *p = in, *nl;
+    size_t n;
+
+    while (reader->lines_found < reader->lines &&
+           (nl = memchr(p, '\n', end - p)) != NULL) {
+        reader->lines_found++;
+        p = nl + 1;
+    }
+    if (reader->lines_found == reader->lines && !reader->scratch_len) {
+        *argp = in;
+        *arg_len = p - in;
+        *inp = p;
+        return CHUTNEY_OKAY;
+    }
+    n = (reader->lines_found == reader->lines ? p : end) - in;
+    if (n > (size_t)(CHUTNEY_READER_SCRATCH - reader->scratch_len))
+        return CHUTNEY_PARSE_ERR;
+    memcpy(reader->scratch + reader->scratch_len, in, n);
+    reader->scratch_len += n;
+    *inp = in + n;
+    if (reader->lines_found < reader->lines)
+        return CHUTNEY_CONTINUE;
+    *argp = reader->scratch;
+    *arg_len = reader->scratch_len;
+    return CHUTNEY_OKAY;
+}
+
+/* Event for an opcode without an argument */
+static int
+opcode_event(chutney_reader *reader, chutney_event *event)
+{
+    event->ival = 0;
+    switch (reader->opcode) {
+    case NONE:
+        event->type = CHUTNEY_EV_NONE;
+        break;
+    case NEWTRUE:
+    case NEWFALSE:
+        event->type = CHUTNEY_EV_BOOL;
+        event->ival = reader->opcode == NEWTRUE;
+        break;
+    case MARK:
+        event->type = CHUTNEY_EV_MARK;
+        break;
+    case STOP:
+        event->type = CHUTNEY_EV_STOP;
+        break;
+    case TUPLE:
+        event->type = CHUTNEY_EV_TUPLE;
+        event->ival = -1;
+        break;
+    case EMPTY_TUPLE:
+    case TUPLE1:
+    case TUPLE2:
+    case TUPLE3:
+        event->type = CHUTNEY_EV_TUPLE;
+        event->ival = reader->opcode == EMPTY_TUPLE ? 0 :
+                      reader->opcode - TUPLE1 + 1;
+        break;
+    case EMPTY_DICT:
+        event->type = CHUTNEY_EV_DICT;
+        break;
+    case SETITEM:
+        event->type = CHUTNEY_EV_SETITEMS;
+        event->ival = 1;
+        break;
+    case SETITEMS:
+        event->type = CHUTNEY_EV_SETITEMS;
+        event->ival = -1;
+        break;
+    case OBJ:
+        event->type = CHUTNEY_EV_OBJ;
+        break;
+    case BUILD:
+        event->type = CHUTNEY_EV_BUILD;
+        break;
+    default:
+        return SKIP;    /* MEMOIZE */
+    }
+    return CHUTNEY_OKAY;
+}
+
+static unsigned long long
+arg_length(const char *arg, size_t arg_len)
+{
+    unsigned long long l = 0;
+
+    while (arg_len--)
+        l = (l << 8) | (unsigned char)arg[arg_len];
+    return l;
+}
+
+static enum chutney_event_type
+string_type(chutney_reader *reader)
+{
+    if (reader->opcode == SHORT_BINUNICODE || reader->opcode == BINUNICODE ||
+            reader->opcode == BINUNICODE8)
+        return CHUTNEY_EV_UNICODE;
+    return CHUTNEY_EV_STRING;
+}
+
+static int
+string_event(chutney_reader *reader, chutney_event *event,
+             unsigned long long len)
+{
+    if (len > (unsigned long long)LLONG_MAX)
+        return CHUTNEY_PARSE_ERR;
+    event->type = string_type(reader);
+    reader->body_total = reader->body_left = len;
+    if (len) {
+        reader->state = CHUTNEY_R_BODY;
+        return SKIP;
+    }
+    /* empty string - no body */
+    event->str = "";
+    event->len = 0;
+    event->offset = event->total = 0;
+    event->more = 0;
+    return CHUTNEY_OKAY;
+}
+
+/* Event for an opcode and its complete argument */
+static int
+arg_event(chutney_reader *reader, chutney_event *event,
+          const char *arg, size_t arg_len)
+{
+    char buf[32], *end, *q;
+    const chutney_extension *ext;
+    const char *nl;
+    long l;
+    double d;
+    int i;
+
+    switch (reader->opcode) {
+    case PROTO:
+        if ((unsigned char)arg[0] > CHUTNEY_HIGHEST_PROTOCOL)
+            return CHUTNEY_OPCODE_ERR;
+        return SKIP;
+    case FRAME:
+        return SKIP;
+    case BININT1:
+    case BININT2:
+    case BININT:
+        l = (long)arg_length(arg, arg_len);
+        if (arg_len == 4)
+            l = (long)(int)(unsigned int)l;
+        event->type = CHUTNEY_EV_INT;
+        event->ival = l;
+        return CHUTNEY_OKAY;
+    case INT:
+        if (arg_len >= sizeof(buf))
+            return CHUTNEY_PARSE_ERR;
+        memcpy(buf, arg, arg_len - 1);
+        buf[arg_len - 1] = '\0';
+        errno = 0;
+        l = strtol(buf, &end, 0);
+        if (errno || *end != '\0')
+            return CHUTNEY_PARSE_ERR;
+        event->type = CHUTNEY_EV_INT;
+        event->ival = l;
+        return CHUTNEY_OKAY;
+    case BINFLOAT:
+        switch (detect_ieee_fp()) {
+        case IEEE_LE:
+            for (i = 0, q = &buf[8]; i < 8; ++i)
+                *--q = arg[i];
+            memcpy(&d, buf, sizeof(d));
+            break;
+        case IEEE_BE:
+            memcpy(&d, arg, sizeof(d));
+            break;
+        default:
+            return CHUTNEY_PARSE_ERR;
+        }
+        event->type = CHUTNEY_EV_FLOAT;
+        event->fval = d;
+        return CHUTNEY_OKAY;
+    case GLOBAL:
+        nl = memchr(arg, '\n', arg_len);
+        event->type = CHUTNEY_EV_GLOBAL;
+        event->str = arg;
+        event->len = nl - arg;
+        event->name_str = nl + 1;
+        event->name_len = arg_len - (nl - arg) - 2;
+        return CHUTNEY_OKAY;
+    case EXT1:
+    case EXT2:
+    case EXT4:
+        if (!reader->registry || (ext = chutney_registry_get(reader->registry,
+                                        arg_length(arg, arg_len))) == NULL)
+            return CHUTNEY_OPCODE_ERR;
+        event->type = CHUTNEY_EV_GLOBAL;
+        event->str = ext->module;
+        event->len = strlen(ext->module);
+        event->name_str = ext->name;
+        event->name_len = strlen(ext->name);
+        return CHUTNEY_OKAY;
+    default:
+        return string_event(reader, event, arg_length(arg, arg_len));
+    }
+}
+
+/*
+ * Return the next event from the input, updating data and length to
+ * account for the input consumed. Returns CHUTNEY_CONTINUE when the input
+ * is exhausted before the next event is complete, in which case the call
+ * should be repeated with more input.
+ *
+ * Pointers in the event refer either to the input or to the reader, and
+ * are only valid until the next call. String bodies are returned in
+ * chunks as input is available - "offset" and "total" locate the chunk in
+ * the string, and "more" is set if further chunks follow. The reader
+ * can be called again after CHUTNEY_EV_STOP to read a following chutney.
+ */
+enum chutney_status
+chutney_reader_next(chutney_reader *reader, const char **datap, size_t *len,
+                    chutney_event *event)
+{
+    const char *in = *datap, *end = in + *len, *arg;
+    size_t arg_len, n;
+    int err;
+
+    for (;;) {
+        switch (reader->state) {
+        case CHUTNEY_R_OPCODE:
+            if (in == end) {
+                err = CHUTNEY_CONTINUE;
+                goto done;
+            }
+            reader->opcode = *in++;
+            if (arg_spec(reader) < 0) {
+                err = CHUTNEY_OPCODE_ERR;
+                goto done;
+            }
+            if (!reader->want && !reader->lines) {
+                err = opcode_event(reader, event);
+                break;
+            }
+            reader->scratch_len = 0;
+            reader->lines_found = 0;
+            reader->state = CHUTNEY_R_ARG;
+            /* fall through */
+        case CHUTNEY_R_ARG:
+            if (reader->lines)
+                err = gather_lines(reader, &in, end, &arg, &arg_len);
+            else
+                err = gather_fixed(reader, &in, end, &arg, &arg_len);
+            if (err != CHUTNEY_OKAY)
+                goto done;
+            reader->state = CHUTNEY_R_OPCODE;
+            err = arg_event(reader, event, arg, arg_len);
+            break;
+        case CHUTNEY_R_BODY:
+            if (in == end) {
+                err = CHUTNEY_CONTINUE;
+                goto done;
+            }
+            n = end - in;
+            if ((long long)n > reader->body_left)
+                n = reader->body_left;
+            event->type = string_type(reader);
+            event->str = in;
+            event->len = n;
+            event->offset = reader->body_total - reader->body_left;
+            event->total = reader->body_total;
+            reader->body_left -= n;
+            event->more = reader->body_left > 0;
+            in += n;
+            if (!event->more)
+                reader->state = CHUTNEY_R_OPCODE;
+            err = CHUTNEY_OKAY;
+            break;
+        }
+        if (err != SKIP)
+            break;
+    }
+done:
+    *len -= in - *datap;
+    *datap = in;
+    return err;
+}
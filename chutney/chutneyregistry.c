@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "chutney.h"
+
+/*
+ * Extension registry, as Python's copy_reg: a class registered under a
+ * code is saved as EXT1, EXT2 or EXT4 and the code, rather than GLOBAL
+ * with its module and name. The entries are kept in the order added, and
+ * found through two open addressed hashes, one by module and name for
+ * saving and one by code for loading - so codes may be sparse, and cost
+ * nothing beyond the entries actually registered.
+ */
+
+static unsigned long
+names_hash(const char *module, const char *name)
+{
+    unsigned long h = 2166136261UL;
+
+    for (; *module; ++module)
+        h = (h ^ (unsigned char)*module) * 16777619UL;
+    h = (h ^ '\n') * 16777619UL;
+    for (; *name; ++name)
+        h = (h ^ (unsigned char)*name) * 16777619UL;
+    return h;
+}
+
+static unsigned long
+code_hash(unsigned long code)
+{
+    return (code * 2654435761UL) ^ (code >> 16);
+}
+
+/* Slot for module.name in by_name - holding its index + 1, or 0 if absent */
+static long *
+name_slot(const chutney_registry *reg, const char *module, const char *name)
+{
+    unsigned long i = names_hash(module, name) & (reg->hash_size - 1);
+    const chutney_extension *ext;
+
+    while (reg->by_name[i]) {
+        ext = &reg->entries[reg->by_name[i] - 1];
+        if (strcmp(ext->module, module) == 0 && strcmp(ext->name, name) == 0)
+            break;
+        i = (i + 1) & (reg->hash_size - 1);
+    }
+    return &reg->by_name[i];
+}
+
+/* Slot for /code/ in by_code - holding its index + 1, or 0 if absent */
+static long *
+code_slot(const chutney_registry *reg, unsigned long code)
+{
+    unsigned long i = code_hash(code) & (reg->hash_size - 1);
+
+    while (reg->by_code[i] &&
+           (unsigned long)reg->entries[reg->by_code[i] - 1].code != code)
+        i = (i + 1) & (reg->hash_size - 1);
+    return &reg->by_code[i];
+}
+
+/* Double the hashes, keeping them at most half full */
+static int
+hash_grow(chutney_registry *reg)
+{
+    long size = reg->hash_size ? reg->hash_size * 2 : 64, i;
+    long *by_name, *by_code;
+    const chutney_extension *ext;
+
+    by_name = calloc(size, sizeof(long));
+    by_code = calloc(size, sizeof(long));
+    if (!by_name || !by_code) {
+        free(by_name);
+        free(by_code);
+        return -1;
+    }
+    free(reg->by_name);
+    free(reg->by_code);
+    reg->by_name = by_name;
+    reg->by_code = by_code;
+    reg->hash_size = size;
+    for (i = 0; i < reg->count; ++i) {
+        ext = &reg->entries[i];
+        *name_slot(reg, ext->module, ext->name) = i + 1;
+        *code_slot(reg, ext->code) = i + 1;
+    }
+    return 0;
+}
+
+static int
+entries_grow(chutney_registry *reg)
+{
+    chutney_extension *tmp;
+    long alloc = reg->entries_alloc ? reg->entries_alloc * 2 : 16;
+
+    if (!(tmp = realloc(reg->entries, alloc * sizeof(*tmp))))
+        return -1;
+    reg->entries = tmp;
+    reg->entries_alloc = alloc;
+    return 0;
+}
+
+void
+chutney_registry_init(chutney_registry *reg)
+{
+    reg->entries = NULL;
+    reg->count = 0;
+    reg->entries_alloc = 0;
+    reg->by_name = NULL;
+    reg->by_code = NULL;
+    reg->hash_size = 0;
+}
+
+void
+chutney_registry_dealloc(chutney_registry *reg)
+{
+    long i;
+
+    for (i = 0; i < reg->count; ++i) {
+        free(reg->entries[i].module);
+        free(reg->entries[i].name);
+    }
+    free(reg->entries);
+    free(reg->by_name);
+    free(reg->by_code);
+    chutney_registry_init(reg);
+}
+
+/*
+ * Register module.name under /code/, from 1 to CHUTNEY_EXT_MAX. Returns -1
+ * with errno EINVAL for a code out of range, EEXIST if the code or the
+ * class is already registered otherwise, or ENOMEM. Registering the same
+ * class under the same code again is harmless.
+ */
+int
+chutney_registry_add(chutney_registry *reg, const char *module,
+                     const char *name, long code)
+{
+    chutney_extension *ext;
+
+    if (code < 1 || code > CHUTNEY_EXT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (chutney_registry_code(reg, module, name) == code)
+        return 0;
+    if (chutney_registry_code(reg, module, name) ||
+            chutney_registry_get(reg, code)) {
+        errno = EEXIST;
+        return -1;
+    }
+    if ((reg->count == reg->entries_alloc && entries_grow(reg) < 0) ||
+            ((reg->count + 1) * 2 > reg->hash_size && hash_grow(reg) < 0)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ext = &reg->entries[reg->count];
+    ext->module = strdup(module);
+    ext->name = strdup(name);
+    if (!ext->module || !ext->name) {
+        free(ext->module);
+        free(ext->name);
+        errno = ENOMEM;
+        return -1;
+    }
+    ext->code = code;
+    reg->count++;
+    *name_slot(reg, module, name) = reg->count;
+    *code_slot(reg, code) = reg->count;
+    return 0;
+}
+
+/* The code registered for module.name, or 0 */
+long
+chutney_registry_code(const chutney_registry *reg, const char *module,
+                      const char *name)
+{
+    long i;
+
+    if (!reg->count)
+        return 0;
+    i = *name_slot(reg, module, name);
+    return i ? reg->entries[i - 1].code : 0;
+}
+
+/* The extension registered under /code/, or NULL */
+const chutney_extension *
+chutney_registry_get(const chutney_registry *reg, unsigned long code)
+{
+    long i;
+
+    if (!reg->count)
+        return NULL;
+    i = *code_slot(reg, code);
+    return i ? &reg->entries[i - 1] : NULL;
+}
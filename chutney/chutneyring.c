@@ -0,0 +1,361 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "chutney.h"
+
+/*
+ * Single producer, single consumer message ring in POSIX shared memory
+ * (Linux only, as waits use futexes - leave this file out of the build on
+ * other platforms).
+ *
+ * head and tail count bytes ever published and released, so the ring is
+ * empty when they are equal. Each message is an 8 byte header holding its
+ * length, then the chutney, padded to 8 bytes - so headers never wrap,
+ * though a chutney may, in which case it is received as two segments. The
+ * producer encodes straight into the free space beyond head, and publishes
+ * the message by advancing head; the consumer parses the message in place
+ * and releases it by advancing tail. A side that finds nothing to do
+ * spins briefly, then sets its waiting flag and sleeps on the low word of
+ * the other side's counter, which that side wakes after moving it.
+ */
+
+#define MSG_HEADER 8
+#define PAD(n) (((n) + 7) & ~7ULL)
+
+static int
+futex(volatile unsigned int *word, int op, unsigned int val,
+      const struct timespec *timeout)
+{
+    return syscall(SYS_futex, word, op, val, timeout, NULL, 0);
+}
+
+/* Time left until /deadline/ (if any), or -1 with errno ETIMEDOUT */
+static int
+remaining(const struct timespec *deadline, struct timespec *left)
+{
+    struct timespec now;
+
+    if (!deadline)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left->tv_sec = deadline->tv_sec - now.tv_sec;
+    left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (left->tv_nsec < 0) {
+        left->tv_sec--;
+        left->tv_nsec += 1000000000L;
+    }
+    if (left->tv_sec < 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Wait until the counter /pos/ moves from /seen/, setting /waiting/ while
+ * asleep so the other side knows to wake us. Returns -1 with errno
+ * ETIMEDOUT if /deadline/ (if not NULL) passes first.
+ */
+static int
+ring_wait(volatile unsigned long long *pos, volatile unsigned int *word,
+          volatile unsigned int *waiting, unsigned long long seen,
+          const struct timespec *deadline)
+{
+    struct timespec left;
+    int i;
+
+    for (i = 0; i < CHUTNEY_RING_SPIN; ++i)
+        if (*pos != seen)
+            return 0;
+    while (*pos == seen) {
+        if (remaining(deadline, &left) < 0)
+            return -1;
+        *waiting = 1;
+        __sync_synchronize();
+        if (*pos == seen)
+            futex(word, FUTEX_WAIT, (unsigned int)seen,
+                  deadline ? &left : NULL);
+        *waiting = 0;
+    }
+    __sync_synchronize();
+    return 0;
+}
+
+/* Move the counter /pos/ on to /value/, waking the other side if needed */
+static void
+ring_advance(volatile unsigned long long *pos, volatile unsigned int *word,
+             volatile unsigned int *waiting, unsigned long long value)
+{
+    __sync_synchronize();
+    *pos = value;
+    *word = (unsigned int)value;
+    __sync_synchronize();
+    if (*waiting)
+        futex(word, FUTEX_WAKE, 1, NULL);
+}
+
+static void
+set_deadline(chutney_ring *ring, struct timespec *deadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ring->timeout / 1000;
+    deadline->tv_nsec += (ring->timeout % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static int
+ring_map(chutney_ring *ring, int fd, size_t size)
+{
+    void *mem;
+
+    mem = mmap(NULL, CHUTNEY_RING_HEADER + size, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+        return -1;
+    ring->shared = (chutney_ring_shared *)mem;
+    ring->data = (char *)mem + CHUTNEY_RING_HEADER;
+    ring->size = size;
+    ring->timeout = -1;
+    ring->pos = ring->start = 0;
+    return 0;
+}
+
+/*
+ * Create the shared memory object /name/ (which must not exist) holding a
+ * ring of /size/ bytes, a power of two of at least 4096. Returns -1 with
+ * errno set on failure.
+ */
+int
+chutney_ring_create(chutney_ring *ring, const char *name, size_t size)
+{
+    int fd, saved;
+
+    if (size < 4096 || (size & (size - 1)) || size > CHUTNEY_RING_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+        return -1;
+    if (ftruncate(fd, CHUTNEY_RING_HEADER + size) < 0 ||
+            ring_map(ring, fd, size) < 0) {
+        saved = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = saved;
+        return -1;
+    }
+    close(fd);
+    ring->shared->size = size;
+    __sync_synchronize();
+    memcpy(ring->shared->magic, CHUTNEY_RING_MAGIC, 8);
+    return 0;
+}
+
+/* Open an existing ring, returning -1 with errno set on failure */
+int
+chutney_ring_open(chutney_ring *ring, const char *name)
+{
+    struct stat st;
+    size_t size;
+    int fd, saved;
+
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0)
+        goto error;
+    size = st.st_size > CHUTNEY_RING_HEADER ?
+           st.st_size - CHUTNEY_RING_HEADER : 0;
+    if (size < 4096 || (size & (size - 1))) {
+        errno = EINVAL;
+        goto error;
+    }
+    if (ring_map(ring, fd, size) < 0)
+        goto error;
+    close(fd);
+    if (memcmp(ring->shared->magic, CHUTNEY_RING_MAGIC, 8) ||
+            ring->shared->size != size) {
+        chutney_ring_close(ring);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+
+error:
+    saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+}
+
+void
+chutney_ring_close(chutney_ring *ring)
+{
+    if (ring->shared)
+        munmap(ring->shared, CHUTNEY_RING_HEADER + ring->size);
+    ring->shared = NULL;
+    ring->data = NULL;
+}
+
+/* Producer: start a message at head */
+void
+chutney_ring_send_begin(chutney_ring *ring)
+{
+    ring->start = ring->shared->head;
+    ring->pos = ring->start + MSG_HEADER;
+}
+
+/* Producer: wait until the ring has room up to /end/ */
+static int
+send_wait(chutney_ring *ring, unsigned long long end)
+{
+    chutney_ring_shared *shared = ring->shared;
+    struct timespec deadline;
+    unsigned long long tail;
+
+    if (end - ring->start > ring->size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (ring->timeout >= 0)
+        set_deadline(ring, &deadline);
+    while (end - (tail = shared->tail) > ring->size)
+        if (ring_wait(&shared->tail, &shared->tail_word,
+                      &shared->producer_waiting, tail,
+                      ring->timeout >= 0 ? &deadline : NULL) < 0)
+            return -1;
+    return 0;
+}
+
+/*
+ * Producer: whether /n/ more bytes can be written without waiting (or
+ * without failing, if the message would be too large). Space is reserved
+ * to the next 8 bytes, so chutney_ring_send_end has no need to wait.
+ */
+int
+chutney_ring_writable(chutney_ring *ring, size_t n)
+{
+    unsigned long long end = PAD(ring->pos + n);
+
+    return end - ring->start > ring->size || 
+           end - ring->shared->tail <= ring->size;
+}
+
+/* Producer: wait until chutney_ring_writable(ring, n) */
+int
+chutney_ring_reserve(chutney_ring *ring, size_t n)
+{
+    return send_wait(ring, PAD(ring->pos + n));
+}
+
+/*
+ * Producer: write function for chutney_dump_init, with the ring as the
+ * context, appending to the message begun by chutney_ring_send_begin. It
+ * waits for the consumer if the ring is full, and fails with EMSGSIZE if
+ * the message will not fit in the ring at all.
+ */
+int
+chutney_ring_write(void *context, const char *s, size_t n)
+{
+    chutney_ring *ring = (chutney_ring *)context;
+    size_t off, first;
+
+    if (!s)
+        return 0;
+    if (chutney_ring_reserve(ring, n) < 0)
+        return -1;
+    off = ring->pos & (ring->size - 1);
+    first = ring->size - off < n ? ring->size - off : n;
+    memcpy(ring->data + off, s, first);
+    memcpy(ring->data, s + first, n - first);
+    ring->pos += n;
+    return 0;
+}
+
+/* Producer: publish the message, waking the consumer if it is waiting */
+int
+chutney_ring_send_end(chutney_ring *ring)
+{
+    chutney_ring_shared *shared = ring->shared;
+    unsigned long long len = ring->pos - ring->start - MSG_HEADER;
+    unsigned long long end = ring->start + MSG_HEADER + PAD(len);
+    char *header;
+    int i;
+
+    if (send_wait(ring, end) < 0)
+        return -1;
+    header = ring->data + (ring->start & (ring->size - 1));
+    for (i = 0; i < MSG_HEADER; ++i)
+        header[i] = (len >> (i * 8)) & 0xff;
+    ring_advance(&shared->head, &shared->head_word,
+                 &shared->consumer_waiting, end);
+    return 0;
+}
+
+/*
+ * Consumer: wait for the next message, and return it in place as one or
+ * two segments (two if it wraps around the end of the ring) - suitable
+ * for chutney_loadv. The message stays in the ring until
+ * chutney_ring_release. Returns -1 with errno ETIMEDOUT if the ring's
+ * timeout passes first, or EBADMSG if the header's length runs beyond
+ * what the producer has published (as only a corrupt peer could send).
+ */
+int
+chutney_ring_recv(chutney_ring *ring, struct iovec *iov, int *iovcnt)
+{
+    chutney_ring_shared *shared = ring->shared;
+    struct timespec deadline;
+    unsigned long long tail = shared->tail, head, len = 0;
+    size_t off;
+    int i;
+
+    if (ring->timeout >= 0)
+        set_deadline(ring, &deadline);
+    if (ring_wait(&shared->head, &shared->head_word,
+                  &shared->consumer_waiting, tail,
+                  ring->timeout >= 0 ? &deadline : NULL) < 0)
+        return -1;
+    head = shared->head;
+    off = tail & (ring->size - 1);
+    for (i = MSG_HEADER - 1; i >= 0; --i)
+        len = (len << 8) | (unsigned char)ring->data[off + i];
+    if (len > ring->size || MSG_HEADER + PAD(len) > ring->size ||
+            MSG_HEADER + PAD(len) > head - tail) {
+        errno = EBADMSG;
+        return -1;
+    }
+    off = (off + MSG_HEADER) & (ring->size - 1);
+    iov[0].iov_base = ring->data + off;
+    if (off + len > ring->size) {
+        iov[0].iov_len = ring->size - off;
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = len - iov[0].iov_len;
+        *iovcnt = 2;
+    } else {
+        iov[0].iov_len = len;
+        *iovcnt = 1;
+    }
+    ring->start = tail;
+    ring->pos = tail + MSG_HEADER + PAD(len);
+    return 0;
+}
+
+/* Consumer: release the message returned by chutney_ring_recv */
+void
+chutney_ring_release(chutney_ring *ring)
+{
+    chutney_ring_shared *shared = ring->shared;
+
+    ring_advance(&shared->tail, &shared->tail_word,
+                 &shared->producer_waiting, ring->pos);
+}
@@ -0,0 +1,226 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chutney.h"
+
+/*
+ * Tree encoding. A document described by a chutney_tree is saved either
+ * on the calling thread, or with the items of its root container divided
+ * into tasks, each of which is encoded by one of a pool of threads into a
+ * chunk of its own. The chunks are then written in order, between the
+ * root's own opcodes, by chutney_save_chunk. Tasks never straddle a
+ * CHUTNEY_BATCHSIZE boundary of a dict's items, so the MARK and SETITEMS
+ * opcodes fall where they would when saving serially, and the output is
+ * the same whatever the number of threads.
+ */
+
+typedef struct {
+    long first;                 // items first to last - 1 of the root
+    long last;
+    chutney_dump_chunk chunk;
+} tree_task;
+
+typedef struct {
+    const chutney_tree *tree;
+    const void *root;
+    enum chutney_tree_kind kind;
+    const chutney_dump_state *out;
+    tree_task *tasks;
+    long ntasks;
+    long next;                  // next task, taken atomically
+    int failed;                 // set atomically
+} tree_state;
+
+static int save_node(chutney_dump_state *state, const chutney_tree *tree,
+                     const void *node);
+
+/* Save items /first/ to /last/ - 1 of a tuple or dict node */
+static int
+save_items(chutney_dump_state *state, const chutney_tree *tree,
+           const void *node, enum chutney_tree_kind kind,
+           long first, long last)
+{
+    long i;
+
+    for (i = first; i < last; ++i) {
+        if (kind == CHUTNEY_TREE_DICT) {
+            if (save_node(state, tree,
+                          tree->child(tree->context, node, 2 * i)) < 0 ||
+                    save_node(state, tree,
+                              tree->child(tree->context, node, 2 * i + 1)) < 0)
+                return -1;
+        } else if (save_node(state, tree,
+                             tree->child(tree->context, node, i)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+save_node(chutney_dump_state *state, const chutney_tree *tree,
+          const void *node)
+{
+    enum chutney_tree_kind kind;
+    long count = 0, i, last;
+
+    kind = tree->kind(tree->context, node, &count);
+    switch (kind) {
+    case CHUTNEY_TREE_TUPLE:
+        if (chutney_save_mark(state) < 0 ||
+                save_items(state, tree, node, kind, 0, count) < 0)
+            return -1;
+        return chutney_save_tuple(state);
+    case CHUTNEY_TREE_DICT:
+        if (chutney_save_empty_dict(state) < 0)
+            return -1;
+        for (i = 0; i < count; i = last) {
+            last = i + CHUTNEY_BATCHSIZE < count ?
+                   i + CHUTNEY_BATCHSIZE : count;
+            if (chutney_save_mark(state) < 0 ||
+                    save_items(state, tree, node, kind, i, last) < 0 ||
+                    chutney_save_setitems(state) < 0)
+                return -1;
+        }
+        return 0;
+    default:
+        return tree->save(state, tree->context, node);
+    }
+}
+
+static void *
+tree_worker(void *arg)
+{
+    tree_state *ts = (tree_state *)arg;
+    chutney_dump_state state;
+    tree_task *task;
+    long t;
+
+    while (!ts->failed &&
+           (t = __sync_fetch_and_add(&ts->next, 1)) < ts->ntasks) {
+        task = &ts->tasks[t];
+        chutney_dump_init(&state, NULL, NULL);
+        state.depth = ts->out->depth + 1;
+        state.canonical = ts->out->canonical;
+        state.registry = ts->out->registry;
+        state.protocol = ts->out->protocol;
+        state.started = 1;
+        state.chunk = &task->chunk;
+        state.stats = &task->chunk.stats;
+        if (save_items(&state, ts->tree, ts->root, ts->kind,
+                       task->first, task->last) < 0)
+            __sync_bool_compare_and_swap(&ts->failed, 0, 1);
+        chutney_dump_dealloc(&state);
+    }
+    return NULL;
+}
+
+/* Divide the /count/ items of the root into tasks */
+static int
+make_tasks(tree_state *ts, long count, int threads)
+{
+    long per, first, last, limit;
+
+    per = (count + threads * CHUTNEY_TREE_TASKS - 1) /
+          (threads * CHUTNEY_TREE_TASKS);
+    if ((ts->tasks = calloc(count / per + count / CHUTNEY_BATCHSIZE + 1,
+                            sizeof(*ts->tasks))) == NULL)
+        return -1;
+    for (first = 0; first < count; first = last) {
+        last = first + per < count ? first + per : count;
+        if (ts->kind == CHUTNEY_TREE_DICT) {
+            limit = (first / CHUTNEY_BATCHSIZE + 1) * CHUTNEY_BATCHSIZE;
+            if (last > limit)
+                last = limit;
+        }
+        ts->tasks[ts->ntasks].first = first;
+        ts->tasks[ts->ntasks].last = last;
+        ts->ntasks++;
+    }
+    return 0;
+}
+
+/* Write the root container around the chunks of its items */
+static int
+stitch(chutney_dump_state *state, tree_state *ts, long count)
+{
+    tree_task *task;
+    long t;
+
+    if (ts->kind == CHUTNEY_TREE_TUPLE) {
+        if (chutney_save_mark(state) < 0)
+            return -1;
+    } else if (chutney_save_empty_dict(state) < 0)
+        return -1;
+    for (t = 0; t < ts->ntasks; ++t) {
+        task = &ts->tasks[t];
+        if (ts->kind == CHUTNEY_TREE_DICT &&
+                task->first % CHUTNEY_BATCHSIZE == 0 &&
+                chutney_save_mark(state) < 0)
+            return -1;
+        if (chutney_save_chunk(state, &task->chunk) < 0)
+            return -1;
+        if (ts->kind == CHUTNEY_TREE_DICT &&
+                (task->last % CHUTNEY_BATCHSIZE == 0 || task->last == count) &&
+                chutney_save_setitems(state) < 0)
+            return -1;
+    }
+    if (ts->kind == CHUTNEY_TREE_TUPLE)
+        return chutney_save_tuple(state);
+    return 0;
+}
+
+/*
+ * Save the document /root/ (without the STOP opcode), using up to
+ * /threads/ threads (including the caller's). Tuples are saved with MARK
+ * and TUPLE, and dicts with EMPTY_DICT and batches of CHUTNEY_BATCHSIZE
+ * items between MARK and SETITEMS. The output is identical to that of a
+ * single thread, but all the chunks are held in memory until the last
+ * task completes. Returns -1 if a save function fails or memory runs out.
+ */
+int
+chutney_dump_tree(chutney_dump_state *state, const chutney_tree *tree,
+                  const void *root, int threads)
+{
+    pthread_t *tids = NULL;
+    tree_state ts;
+    long count = 0, t;
+    int i, started = 0, res = -1;
+
+    memset(&ts, 0, sizeof(ts));
+    ts.kind = tree->kind(tree->context, root, &count);
+    if (threads <= 1 || ts.kind == CHUTNEY_TREE_VALUE || count < 2 ||
+            state->chunk)
+        return save_node(state, tree, root);
+    ts.tree = tree;
+    ts.root = root;
+    ts.out = state;
+    if (make_tasks(&ts, count, threads) < 0)
+        return -1;
+    for (t = 0; t < ts.ntasks; ++t) {
+        if (state->iov_threshold)
+            ts.tasks[t].chunk.threshold = state->iov_threshold;
+        if (state->protocol >= 4 &&
+                (!state->iov_threshold ||
+                 state->iov_threshold > CHUTNEY_FRAME_SIZE_TARGET))
+            ts.tasks[t].chunk.threshold = CHUTNEY_FRAME_SIZE_TARGET;
+    }
+    if (threads > ts.ntasks)
+        threads = ts.ntasks;
+    if ((tids = malloc((threads - 1) * sizeof(*tids))))
+        for (i = 0; i < threads - 1; ++i, ++started)
+            if (pthread_create(&tids[i], NULL, tree_worker, &ts) != 0)
+                break;
+    tree_worker(&ts);
+    for (i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    if (!ts.failed)
+        res = stitch(state, &ts, count);
+    for (t = 0; t < ts.ntasks; ++t) {
+        free(ts.tasks[t].chunk.buf);
+        free(ts.tasks[t].chunk.ops);
+        free(ts.tasks[t].chunk.payloads);
+    }
+    free(ts.tasks);
+    return res;
+}
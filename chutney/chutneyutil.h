@@ -7,3 +7,26 @@ enum ieee_fp {
 
 extern enum ieee_fp detect_ieee_fp(void);
 
+
+#ifdef CHUTNEY_STATS_CYCLES
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define chutney_cycles() ((unsigned long long)__rdtsc())
+#else
+#include <time.h>
+static inline unsigned long long chutney_cycles(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+#endif /* CHUTNEY_STATS_CYCLES */
+
+/* Allocation through a state's chutney_allocator */
+#define chutney_alloc(a, n) ((a)->alloc((a)->context, (n)))
+#define chutney_realloc(a, p, old, n) \
+    ((a)->realloc((a)->context, (p), (old), (n)))
+#define chutney_free(a, p, n) \
+    do { if (p) (a)->free((a)->context, (p), (n)); } while (0)
@@ -0,0 +1,529 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chutney.h"
+#include "chutneyprotocol.h"
+
+/*
+ * Validation of untrusted input. The opcodes are run through the same
+ * stack machine as chutney_load, but the stack holds only the kind and
+ * nesting depth of each item, so nothing is built: string bodies are
+ * stepped over using their length prefix (checking that unicode is
+ * UTF-8), and the objects a load would make are only counted. Anything
+ * that validates is accepted by chutney_load, given callbacks able to
+ * build what it names - the converse does not quite hold, as a STOP with
+ * a MARK still open, or a SETITEM or BUILD state that is not a dict, is
+ * refused.
+ */
+
+enum item_kind {
+    K_VALUE,
+    K_DICT,
+    K_CLASS,                    // GLOBAL or EXT
+    K_OBJ,
+};
+
+typedef struct {
+    int kind;
+    long depth;
+} item;
+
+typedef struct {
+    const chutney_limits *limits;
+    chutney_report *report;
+    item *stack;
+    long stack_size;
+    long stack_alloc;
+    long *marks;
+    long marks_size;
+    long marks_alloc;
+} validator;
+
+#define OVER(value, limit) ((limit) && (value) > (limit))
+
+/* Make room on the stack for /n/ more items, within max_stack */
+static enum chutney_status
+reserve(validator *v, unsigned long long n)
+{
+    item *tmp;
+    long alloc;
+
+    if (n > (unsigned long long)(LONG_MAX - v->stack_size))
+        return CHUTNEY_NOMEM;
+    if (OVER(v->stack_size + (long)n, v->limits->max_stack))
+        return CHUTNEY_LIMIT_ERR;
+    if (v->stack_alloc - v->stack_size >= (long)n)
+        return CHUTNEY_OKAY;
+    alloc = v->stack_alloc ? v->stack_alloc : 64;
+    while (alloc - v->stack_size < (long)n)
+        if ((alloc *= 2) > (long)(SIZE_MAX / 2 / sizeof(*tmp)))
+            return CHUTNEY_NOMEM;
+    if (!(tmp = realloc(v->stack, alloc * sizeof(*tmp))))
+        return CHUTNEY_NOMEM;
+    v->stack = tmp;
+    v->stack_alloc = alloc;
+    return CHUTNEY_OKAY;
+}
+
+/* Count /n/ new objects against max_objects */
+static enum chutney_status
+made(validator *v, unsigned long long n)
+{
+    v->report->objects += n;
+    return OVER(v->report->objects, v->limits->max_objects) ?
+           CHUTNEY_LIMIT_ERR : CHUTNEY_OKAY;
+}
+
+/* Push an item (reserved beforehand) */
+static enum chutney_status
+push(validator *v, int kind, long depth)
+{
+    item *top;
+
+    if (OVER(depth, v->limits->max_depth))
+        return CHUTNEY_LIMIT_ERR;
+    top = &v->stack[v->stack_size++];
+    top->kind = kind;
+    top->depth = depth;
+    if (v->stack_size > v->report->max_stack)
+        v->report->max_stack = v->stack_size;
+    if (depth > v->report->max_depth)
+        v->report->max_depth = depth;
+    return CHUTNEY_OKAY;
+}
+
+/* Push a new object */
+static enum chutney_status
+push_new(validator *v, int kind, long depth)
+{
+    enum chutney_status err;
+
+    if ((err = made(v, 1)) != CHUTNEY_OKAY ||
+            (err = reserve(v, 1)) != CHUTNEY_OKAY)
+        return err;
+    return push(v, kind, depth);
+}
+
+static enum chutney_status
+push_mark(validator *v)
+{
+    long *tmp, alloc;
+
+    if (v->marks_size == v->marks_alloc) {
+        alloc = v->marks_alloc ? v->marks_alloc * 2 : 16;
+        if (!(tmp = realloc(v->marks, alloc * sizeof(*tmp))))
+            return CHUTNEY_NOMEM;
+        v->marks = tmp;
+        v->marks_alloc = alloc;
+    }
+    v->marks[v->marks_size++] = v->stack_size;
+    return CHUTNEY_OKAY;
+}
+
+/* Pop the innermost MARK, returning the stack size when it was pushed */
+static enum chutney_status
+pop_mark(validator *v, long *first)
+{
+    if (!v->marks_size)
+        return CHUTNEY_NOMARK_ERR;
+    *first = v->marks[--v->marks_size];
+    return *first <= v->stack_size ? CHUTNEY_OKAY : CHUTNEY_STACK_ERR;
+}
+
+/* The size of the stack above the innermost MARK */
+static long
+above_mark(validator *v)
+{
+    return v->stack_size -
+           (v->marks_size ? v->marks[v->marks_size - 1] : 0);
+}
+
+/* The deepest of items /first/ to the top of the stack */
+static long
+deepest(validator *v, long first)
+{
+    long depth = 0;
+
+    for (; first < v->stack_size; ++first)
+        if (v->stack[first].depth > depth)
+            depth = v->stack[first].depth;
+    return depth;
+}
+
+/* Replace items /first/ to the top of the stack with a tuple of them */
+static enum chutney_status
+make_tuple(validator *v, long first)
+{
+    long depth = deepest(v, first) + 1;
+    enum chutney_status err;
+
+    v->stack_size = first;
+    v->report->containers++;
+    if ((err = made(v, 1)) != CHUTNEY_OKAY ||
+            (err = reserve(v, 1)) != CHUTNEY_OKAY)
+        return err;
+    return push(v, K_VALUE, depth);
+}
+
+/* Add the items from /first/ to the top of the stack to the dict below */
+static enum chutney_status
+set_items(validator *v, long first)
+{
+    item *dict = &v->stack[first - 1];
+    long depth = deepest(v, first) + 1;
+
+    if (dict->kind != K_DICT)
+        return CHUTNEY_PARSE_ERR;
+    if (OVER(depth, v->limits->max_depth))
+        return CHUTNEY_LIMIT_ERR;
+    if (depth > dict->depth)
+        dict->depth = depth;
+    if (depth > v->report->max_depth)
+        v->report->max_depth = depth;
+    v->stack_size = first;
+    return CHUTNEY_OKAY;
+}
+
+static int
+allowed(const chutney_limits *limits, const char *module, size_t module_len,
+        const char *name, size_t name_len)
+{
+    const char *const *g;
+
+    if (!limits->globals)
+        return 1;
+    for (g = limits->globals; g[0] && g[1]; g += 2)
+        if (strlen(g[0]) == module_len && !memcmp(g[0], module, module_len) &&
+                strlen(g[1]) == name_len && !memcmp(g[1], name, name_len))
+            return 1;
+    return 0;
+}
+
+static unsigned long long
+get_length(const char *p, int n)
+{
+    unsigned long long l = 0;
+
+    while (n--)
+        l = (l << 8) | (unsigned char)p[n];
+    return l;
+}
+
+/*
+ * Whether /s/ is UTF-8 as the Python 2 decoder accepts it - surrogates
+ * included, but no overlong forms or code points beyond U+10FFFF. ASCII
+ * is skipped eight bytes at a time.
+ */
+static int
+utf8_valid(const unsigned char *s, size_t n)
+{
+    const unsigned char *end = s + n;
+    unsigned long long word;
+    unsigned int c;
+    int more;
+
+    while (s < end) {
+        while (end - s >= 8) {
+            memcpy(&word, s, 8);
+            if (word & 0x8080808080808080ULL)
+                break;
+            s += 8;
+        }
+        if (s == end)
+            break;
+        if ((c = *s++) < 0x80)
+            continue;
+        if (c < 0xc2 || c > 0xf4)
+            return 0;
+        more = c < 0xe0 ? 1 : c < 0xf0 ? 2 : 3;
+        if (end - s < more ||
+                (c == 0xe0 && s[0] < 0xa0) ||
+                (c == 0xf0 && s[0] < 0x90) ||
+                (c == 0xf4 && s[0] > 0x8f))
+            return 0;
+        for (; more; --more)
+            if ((*s++ & 0xc0) != 0x80)
+                return 0;
+    }
+    return 1;
+}
+
+/* INT - the decimal argument, as load_int parses it */
+static int
+int_valid(const char *p, size_t n)
+{
+    char buf[32], *end;
+
+    if (n >= sizeof(buf))
+        return 0;
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    errno = 0;
+    strtol(buf, &end, 0);
+    return !errno && *end == '\0';
+}
+
+/* A string of /len/ bytes at /p/ */
+static enum chutney_status
+string(validator *v, char op, const char *p, unsigned long long len)
+{
+    const chutney_limits *limits = v->limits;
+
+    v->report->strings++;
+    v->report->payload += len;
+    if (OVER(len, limits->max_string) ||
+            OVER(v->report->payload, limits->max_payload))
+        return CHUTNEY_LIMIT_ERR;
+    if ((op == SHORT_BINUNICODE || op == BINUNICODE || op == BINUNICODE8) &&
+            !utf8_valid((const unsigned char *)p, len))
+        return CHUTNEY_PARSE_ERR;
+    return push_new(v, K_VALUE, 0);
+}
+
+/* INTS or FLOATS - /count/ values of /size/ bytes */
+static enum chutney_status
+column(validator *v, unsigned long long count, int size)
+{
+    enum chutney_status err;
+
+    v->report->payload += count * size;
+    if (OVER(v->report->payload, v->limits->max_payload))
+        return CHUTNEY_LIMIT_ERR;
+    if ((err = made(v, count)) != CHUTNEY_OKAY ||
+            (err = reserve(v, count)) != CHUTNEY_OKAY)
+        return err;
+    for (; count; --count)
+        push(v, K_VALUE, 0);
+    return CHUTNEY_OKAY;
+}
+
+/*
+ * COLUMNS - the items from /first/ are a class, /attrs/ names and /rows/
+ * values of each, which become a tuple of /rows/ instances.
+ */
+static enum chutney_status
+columns(validator *v, long first, unsigned long long attrs,
+        unsigned long long rows)
+{
+    unsigned long long count = v->stack_size - first;
+    long depth = deepest(v, first) + 2;
+    enum chutney_status err;
+
+    if (count < 1 || !attrs || count - 1 < attrs ||
+            attrs * rows != count - 1 - attrs ||
+            v->stack[first].kind != K_CLASS)
+        return CHUTNEY_PARSE_ERR;
+    v->stack_size = first;
+    v->report->instances += rows;
+    v->report->containers += rows + 1;
+    if ((err = made(v, rows * 2 + 1)) != CHUTNEY_OKAY)
+        return err;
+    return push(v, K_VALUE, depth);
+}
+
+static enum chutney_status
+run(validator *v, const char *p, const char *end)
+{
+    const char *start = p, *op, *module, *name, *nl;
+    const chutney_extension *ext;
+    unsigned long long len;
+    long first;
+    int n;
+    enum chutney_status err;
+
+    while (p < end) {
+        op = p++;
+        err = CHUTNEY_OKAY;
+        switch (*op) {
+        case STOP:
+            if (v->stack_size != 1 || v->marks_size)
+                return CHUTNEY_STACK_ERR;
+            v->report->length = p - start;
+            return CHUTNEY_OKAY;
+        case MARK:
+            err = push_mark(v);
+            break;
+        case MEMOIZE:
+            break;
+        case PROTO:
+            if (p == end)
+                return CHUTNEY_CONTINUE;
+            if ((unsigned char)*p++ > 4)
+                return CHUTNEY_OPCODE_ERR;
+            break;
+        case FRAME:
+            if (end - p < 8)
+                return CHUTNEY_CONTINUE;
+            if (get_length(p, 8) > PTRDIFF_MAX)
+                return CHUTNEY_PARSE_ERR;
+            p += 8;
+            break;
+        case NONE: case NEWTRUE: case NEWFALSE:
+            err = push_new(v, K_VALUE, 0);
+            break;
+        case BININT1: case BININT2: case BININT: case BINFLOAT:
+            n = *op == BINFLOAT ? 8 : *op == BININT ? 4 :
+                *op == BININT2 ? 2 : 1;
+            if (end - p < n)
+                return CHUTNEY_CONTINUE;
+            p += n;
+            err = push_new(v, K_VALUE, 0);
+            break;
+        case INT:
+            if (!(nl = memchr(p, '\n', end - p)))
+                return CHUTNEY_CONTINUE;
+            if (!int_valid(p, nl - p))
+                return CHUTNEY_PARSE_ERR;
+            p = nl + 1;
+            err = push_new(v, K_VALUE, 0);
+            break;
+        case SHORT_BINSTRING: case SHORT_BINBYTES: case SHORT_BINUNICODE:
+        case BINSTRING: case BINBYTES: case BINUNICODE:
+        case BINBYTES8: case BINUNICODE8:
+            n = (*op == SHORT_BINSTRING || *op == SHORT_BINBYTES ||
+                 *op == SHORT_BINUNICODE) ? 1 :
+                (*op == BINBYTES8 || *op == BINUNICODE8) ? 8 : 4;
+            if (end - p < n)
+                return CHUTNEY_CONTINUE;
+            len = get_length(p, n);
+            if ((*op == BINSTRING && len > 0x7fffffffUL) || len > PTRDIFF_MAX)
+                return CHUTNEY_PARSE_ERR;
+            p += n;
+            if (len > (unsigned long long)(end - p))
+                return CHUTNEY_CONTINUE;
+            err = string(v, *op, p, len);
+            p += len;
+            break;
+        case INTS: case FLOATS:
+            if (end - p < 4)
+                return CHUTNEY_CONTINUE;
+            n = *op == INTS ? 4 : 8;
+            len = get_length(p, 4);
+            p += 4;
+            if (len * n > (unsigned long long)(end - p))
+                return CHUTNEY_CONTINUE;
+            err = column(v, len, n);
+            p += len * n;
+            break;
+        case EMPTY_TUPLE:
+            v->report->containers++;
+            err = push_new(v, K_VALUE, 1);
+            break;
+        case EMPTY_DICT:
+            v->report->containers++;
+            err = push_new(v, K_DICT, 1);
+            break;
+        case TUPLE:
+            if ((err = pop_mark(v, &first)) == CHUTNEY_OKAY)
+                err = make_tuple(v, first);
+            break;
+        case TUPLE1: case TUPLE2: case TUPLE3:
+            n = *op - TUPLE1 + 1;
+            if (above_mark(v) < n)
+                return CHUTNEY_STACK_ERR;
+            err = make_tuple(v, v->stack_size - n);
+            break;
+        case SETITEM:
+            if (above_mark(v) < 3)
+                return CHUTNEY_STACK_ERR;
+            err = set_items(v, v->stack_size - 2);
+            break;
+        case SETITEMS:
+            if ((err = pop_mark(v, &first)) != CHUTNEY_OKAY)
+                break;
+            if (first < 1 || (v->stack_size - first) % 2)
+                return CHUTNEY_PARSE_ERR;
+            err = set_items(v, first);
+            break;
+        case GLOBAL:
+            module = p;
+            if (!(nl = memchr(p, '\n', end - p)))
+                return CHUTNEY_CONTINUE;
+            name = p = nl + 1;
+            if (!(nl = memchr(p, '\n', end - p)))
+                return CHUTNEY_CONTINUE;
+            p = nl + 1;
+            if (!allowed(v->limits, module, name - 1 - module,
+                         name, nl - name))
+                return CHUTNEY_LIMIT_ERR;
+            err = push_new(v, K_CLASS, 0);
+            break;
+        case EXT1: case EXT2: case EXT4:
+            n = *op == EXT4 ? 4 : *op == EXT2 ? 2 : 1;
+            if (end - p < n)
+                return CHUTNEY_CONTINUE;
+            len = get_length(p, n);
+            p += n;
+            if (!v->limits->registry ||
+                    !(ext = chutney_registry_get(v->limits->registry, len)))
+                return CHUTNEY_OPCODE_ERR;
+            if (!allowed(v->limits, ext->module, strlen(ext->module),
+                         ext->name, strlen(ext->name)))
+                return CHUTNEY_LIMIT_ERR;
+            err = push_new(v, K_CLASS, 0);
+            break;
+        case COLUMNS:
+            if (end - p < 8)
+                return CHUTNEY_CONTINUE;
+            if ((err = pop_mark(v, &first)) == CHUTNEY_OKAY)
+                err = columns(v, first, get_length(p, 4),
+                              get_length(p + 4, 4));
+            p += 8;
+            break;
+        case OBJ:
+            if ((err = pop_mark(v, &first)) != CHUTNEY_OKAY)
+                break;
+            if (v->stack_size - first != 1 || v->stack[first].kind != K_CLASS)
+                return CHUTNEY_PARSE_ERR;
+            v->stack_size = first;
+            v->report->instances++;
+            err = push_new(v, K_OBJ, 1);
+            break;
+        case BUILD:
+            if (above_mark(v) < 2)
+                return CHUTNEY_STACK_ERR;
+            if (v->stack[v->stack_size - 2].kind != K_OBJ ||
+                    v->stack[v->stack_size - 1].kind != K_DICT)
+                return CHUTNEY_PARSE_ERR;
+            /* the instance is as deep as its state */
+            v->stack_size--;
+            if (v->stack[v->stack_size].depth >
+                    v->stack[v->stack_size - 1].depth)
+                v->stack[v->stack_size - 1].depth =
+                    v->stack[v->stack_size].depth;
+            break;
+        default:
+            return CHUTNEY_OPCODE_ERR;
+        }
+        if (err != CHUTNEY_OKAY)
+            return err;
+    }
+    return CHUTNEY_CONTINUE;
+}
+
+/*
+ * Check that /data/ holds a well formed chutney within /limits/, without
+ * building any objects, filling in /report/. Returns CHUTNEY_OKAY,
+ * CHUTNEY_CONTINUE if the data ends (or a length runs) before the STOP,
+ * CHUTNEY_LIMIT_ERR if over a limit or naming a class not allowed, or
+ * another error as chutney_load would. Anything after the STOP is
+ * ignored, as by chutney_load - report->length says where it ended.
+ */
+enum chutney_status
+chutney_validate(const char *data, size_t length,
+                 const chutney_limits *limits, chutney_report *report)
+{
+    validator v;
+    enum chutney_status status;
+
+    memset(report, 0, sizeof(*report));
+    memset(&v, 0, sizeof(v));
+    v.limits = limits;
+    v.report = report;
+    status = run(&v, data, data + length);
+    free(v.stack);
+    free(v.marks);
+    return status;
+}
@@ -21,6 +21,22 @@ sources = [
     'chutney/chutneyparse.c',
     'chutney/chutneygen.c',
     'chutney/chutneyutil.c',
+    'chutney/chutneyframe.c',
+    'chutney/chutneyreader.c',
+    'chutney/chutneymap.c',
+    'chutney/chutneylog.c',
+    'chutney/chutneyhash.c',
+    'chutney/chutneyextract.c',
+    'chutney/chutneyiov.c',
+    'chutney/chutneytree.c',
+    'chutney/chutneyarena.c',
+    'chutney/chutneyring.c',
+    'chutney/chutneyregistry.c',
+    'chutney/chutneyvalidate.c',
+    ]
+
+libraries = [
+    'rt',                       # shm_open, before glibc 2.34
     ]
 
 includes = [
@@ -52,6 +68,7 @@ chutney_module = Extension(
     'chutney', ['chutney.c'] + sources,
     define_macros=defines,
     include_dirs=includes,
+    libraries=libraries,
     )
 
 setup(
@@ -1,4 +1,12 @@
+import os
 import sys
+import mmap
+import random
+import shutil
+import subprocess
+import tempfile
+import threading
+import time
 import unittest
 import chutney
 
@@ -11,11 +19,47 @@ class BasicTests(unittest.TestCase):
         self.failUnless(issubclass(chutney.UnpicklingError, Exception))
         self.failUnless(callable(chutney.dumps))
         self.failUnless(callable(chutney.loads))
+        self.failUnless(callable(chutney.dumps_into))
+        self.failUnless(callable(chutney.dumps_delta))
+        self.failUnless(callable(chutney.apply_delta))
+        self.failUnless(callable(chutney.load_path))
+        self.failUnless(callable(chutney.scan))
+        self.failUnless(callable(chutney.extract))
+        self.failUnless(callable(chutney.stats))
+        self.failUnless(callable(chutney.register_extension))
+        self.failUnless(callable(chutney.ShmChannel))
+        self.failUnless(callable(chutney.dump_iter))
+        self.failUnless(callable(chutney.dump_iter_items))
+        self.failUnless(callable(chutney.validate))
+        self.failUnless(callable(chutney.read_events))
+        self.failUnless(callable(chutney.frame_blocks))
+        self.failUnless(callable(chutney.frame_decode_into))
+
+    def test_stats(self):
+        chutney.stats(True)
+        data = chutney.dumps({'a': (1, 2.0)})
+        self.assertEqual(chutney.loads(data), {'a': (1, 2.0)})
+        stats = chutney.stats()
+        dump, load = stats['dump'], stats['load']
+        self.assertEqual(dump['bytes'], len(data))
+        self.assertEqual(dump['opcodes'], {'}': 1, '(': 2, 'U': 1, 'M': 1,
+                                           'G': 1, 't': 1, 'u': 1, '.': 1})
+        self.assertEqual(load['bytes'], len(data))
+        self.assertEqual(load['opcodes'], dump['opcodes'])
+        self.assertEqual(load['stack_max'], 4)
+        self.assertEqual(load['marks_max'], 2)
+        # Opcode arguments are parsed in place, as the input is contiguous
+        self.assertEqual(load['buf_max'], 0)
+        # 6 creators, plus dealloc of the result by chutney_load_dealloc
+        self.assertEqual(load['callbacks'], 7)
+        chutney.stats(True)
+        self.assertEqual(chutney.stats()['load']['bytes'], 0)
 
 
 class BasicSuite(unittest.TestSuite):
     tests = [
         'test_module_const',
+        'test_stats',
     ]
     def __init__(self):
         unittest.TestSuite.__init__(self, map(BasicTests, self.tests))
@@ -26,6 +70,8 @@ class TestInstanceGetState:
     def __getstate__(self):
         return {}
 class TestObject(object): pass
+class TestExtension(object): pass
+class TestExtensionSparse(object): pass
 class TestObjectSlotted(object): 
     __slots__ = ('abc',)
 class TestObjectSlottedAndDict(object): 
@@ -125,6 +171,329 @@ class DumpTests(unittest.TestCase):
         self.assertRaises(chutney.UnpickleableError, 
                           chutney.dumps, obj)
 
+    def test_protocol(self):
+        self.assertEqual(chutney.dumps(None, protocol=2), '\x80\x02N.')
+        self.assertEqual(chutney.dumps('abc', protocol=3),
+                         '\x80\x03C\x03abc.')
+        self.assertEqual(chutney.dumps('X' * 256, protocol=3),
+                         '\x80\x03B\x00\x01\x00\x00' + 'X' * 256 + '.')
+        self.assertEqual(chutney.dumps((u'abc', 'd'), protocol=4),
+                         '\x80\x04\x95\x0b\x00\x00\x00\x00\x00\x00\x00'
+                         '(\x8c\x03abcC\x01dt.')
+        self.assertEqual(chutney.dumps(u'X' * 256, protocol=4),
+                         '\x80\x04\x95\x06\x01\x00\x00\x00\x00\x00\x00'
+                         'X\x00\x01\x00\x00' + 'X' * 256 + '.')
+        self.assertRaises(ValueError, chutney.dumps, None, protocol=5)
+        self.assertRaises(ValueError, chutney.dumps, None, protocol=1)
+
+    def test_protocol4_frames(self):
+        # Large payloads are written outside frames
+        big = 'X' * 100000
+        data = chutney.dumps(('a', big, 'b'), protocol=4)
+        self.assertEqual(data[:15], '\x80\x04\x95\x04\x00\x00\x00\x00\x00'
+                                    '\x00\x00(C\x01a')
+        self.assertEqual(data[15:20], 'B\xa0\x86\x01\x00')
+        self.assertEqual(data[100020:], '\x95\x05\x00\x00\x00\x00\x00\x00'
+                                        '\x00C\x01bt.')
+        self.assertEqual(chutney.loads(data), ('a', big, 'b'))
+        # Frames are committed once they reach the target size
+        obj = tuple(range(50000))
+        chutney.stats(True)
+        data = chutney.dumps(obj, protocol=4)
+        self.assertEqual(len(data), 150032)
+        self.assertEqual(chutney.stats()['dump']['opcodes']['\x95'], 3)
+        self.assertEqual(chutney.loads(data), obj)
+
+    def test_dumps_into(self):
+        buf = bytearray(16)
+        self.assertEqual(chutney.dumps_into((None, 1), buf), 7)
+        self.assertEqual(str(buf[:7]), '(NM\x01\x00t.')
+        self.assertEqual(chutney.dumps_into(None, buf, 7), 2)
+        self.assertEqual(str(buf[:10]), '(NM\x01\x00t.N.\x00')
+        self.assertRaises(ValueError, chutney.dumps_into, 'X' * 16, buf)
+        self.assertRaises(ValueError, chutney.dumps_into, None, buf, 17)
+        self.assertRaises(TypeError, chutney.dumps_into, None, 'abc')
+        m = mmap.mmap(-1, 64)
+        n = chutney.dumps_into({'a': 1.0}, m, 8)
+        self.assertEqual(chutney.loads(m[8:8 + n]), {'a': 1.0})
+        # Overflow reports the size required
+        self.assertRaisesRegexp(ValueError, '19 bytes needed', 
+                                chutney.dumps_into, 'X' * 16, buf)
+        # Frames are built in place
+        obj = tuple(['x' * 1000] * 150)
+        buf = bytearray(200000)
+        n = chutney.dumps_into(obj, buf, protocol=4)
+        self.assertEqual(str(buf[:n]), chutney.dumps(obj, protocol=4))
+
+    def test_inst_cache(self):
+        # Instances after the first reuse a cached class header
+        inst = '(c__main__\nTestInstance\no}b'
+        obj = '(c__main__\nTestObject\no}b'
+        self.assertEqual(chutney.dumps((TestInstance(), TestObject(),
+                                        TestInstance(), TestObject())),
+                         '(' + inst + obj + inst + obj + 't.')
+        # The cache doesn't outlive a dump
+        class Renamed(object): pass
+        self.assertEqual(chutney.dumps((Renamed(), Renamed())),
+                         '((c__main__\nRenamed\no}b(c__main__\nRenamed\no}bt.')
+        Renamed.__name__ = 'Other'
+        self.assertEqual(chutney.dumps(Renamed()), '(c__main__\nOther\no}b.')
+        # __getstate__ is still refused on cached classes
+        o = TestInstance()
+        o.__getstate__ = None
+        self.assertRaises(chutney.UnpickleableError, chutney.dumps,
+                          [TestInstance(), o])
+        o = TestObject()
+        o.__getstate__ = None
+        self.assertRaises(chutney.UnpickleableError, chutney.dumps,
+                          [TestObject(), o])
+
+    def test_extension(self):
+        import copy_reg, cPickle
+        module = TestExtension.__module__
+        inst = TestExtension()
+        inst.a = 1
+        chutney.register_extension(module, 'TestExtension', 300)
+        chutney.register_extension(module, 'TestExtension', 300)
+        data = chutney.dumps((inst, inst))
+        self.assertEqual(data, '((\x83,\x01o}(U\x01aM\x01\x00ub'
+                               '(\x83,\x01o}(U\x01aM\x01\x00ubt.')
+        res = chutney.loads(data)
+        self.assertEqual(type(res[1]), TestExtension)
+        self.assertEqual(res[1].a, 1)
+        # cPickle understands the code, given the same registration
+        copy_reg.add_extension(module, 'TestExtension', 300)
+        try:
+            self.assertEqual(type(cPickle.loads(data)[0]), TestExtension)
+        finally:
+            copy_reg.remove_extension(module, 'TestExtension', 300)
+        # Conflicting registrations and unregistered codes are refused
+        self.assertRaises(ValueError, chutney.register_extension,
+                          module, 'TestExtension', 301)
+        self.assertRaises(ValueError, chutney.register_extension,
+                          module, 'TestObject', 300)
+        self.assertRaises(ValueError, chutney.register_extension,
+                          module, 'TestObject', 0)
+        self.assertRaises(chutney.UnpicklingError, chutney.loads,
+                          '(\x82\x07o}b.')
+        self.assertRaises(chutney.UnpicklingError, chutney.loads,
+                          '(\x84\x2d\x01\x00\x00o}b.')
+        # Codes may be sparse, up to 2**31 - 1
+        chutney.register_extension(module, 'TestExtensionSparse', 2**31 - 1)
+        data = chutney.dumps(TestExtensionSparse())
+        self.assertEqual(data, '(\x84\xff\xff\xff\x7fo}b.')
+        self.assertEqual(type(chutney.loads(data)), TestExtensionSparse)
+        self.assertRaises(ValueError, chutney.register_extension,
+                          module, 'TestObject', 2**31)
+
+    def test_columnar(self):
+        def row(cls, i):
+            r = cls()
+            r.id, r.price, r.name = i, i * 0.5, 'item%d' % i
+            return r
+        rows = [row(TestObject, i) for i in range(1000)]
+        data = chutney.dumps(rows, columnar=True)
+        self.failUnless(len(data) * 2 < len(chutney.dumps(rows)))
+        res = chutney.loads(data)
+        self.assertEqual(len(res), 1000)
+        self.assertEqual(type(res[999]), TestObject)
+        self.assertEqual([r.__dict__ for r in res],
+                         [r.__dict__ for r in rows])
+        # Attribute names once, then ints and floats packed
+        self.assertEqual(chutney.dumps([row(TestInstance, 1),
+                                        row(TestInstance, 2)],
+                                       columnar=True),
+            '(c__main__\nTestInstance\nU\x02idU\x04nameU\x05price'
+            '\xf1\x02\x00\x00\x00\x01\x00\x00\x00\x02\x00\x00\x00'
+            'U\x05item1U\x05item2'
+            '\xf2\x02\x00\x00\x00\x00\x00\x00\x00\x00\x00\xe0?'
+            '\x00\x00\x00\x00\x00\x00\xf0?'
+            '\xf0\x03\x00\x00\x00\x02\x00\x00\x00.')
+        # Mixed columns are saved value by value
+        rows[1].id, rows[2].price = 'one', 2
+        res = chutney.loads(chutney.dumps(rows, columnar=True, protocol=4))
+        self.assertEqual([r.__dict__ for r in res],
+                         [r.__dict__ for r in rows])
+        # Anything else is saved as usual
+        rows[3].extra = 1
+        for obj in (rows, [rows[0], TestInstance()], [1, 2], [rows[0]]):
+            self.assertEqual(chutney.dumps(obj, columnar=True),
+                             chutney.dumps(obj))
+        self.assertRaises(chutney.UnpicklingError, chutney.loads,
+                          '(c__main__\nTestObject\nU\x01aK\x01'
+                          '\xf0\x01\x00\x00\x00\x02\x00\x00\x00.')
+
+    def test_key_cache(self):
+        # Interned keys are saved from a cache, identically
+        a = intern('alpha')
+        obj = [{a: 1, 'b': 2}, {a: 3, 'b': 4}]
+        self.assertEqual(chutney.dumps(obj, canonical=True),
+                         '(}(U\x05alphaM\x01\x00U\x01bM\x02\x00u'
+                         '}(U\x05alphaM\x03\x00U\x01bM\x04\x00ut.')
+        self.assertEqual(chutney.dumps(obj, protocol=3, canonical=True)[2:],
+                         '(}(C\x05alphaM\x01\x00C\x01bM\x02\x00u'
+                         '}(C\x05alphaM\x03\x00C\x01bM\x04\x00ut.')
+        self.assertEqual(chutney.dumps([{a: 1}, {'alph' + 'a': 1}]),
+                         chutney.dumps([{'alpha': 1}] * 2))
+        # Large vocabularies, and keys referenced by dumps_iov
+        keys = [intern('key%d' % i) for i in range(5000)]
+        obj = [dict.fromkeys(keys[i:i + 10], i) for i in range(5000)]
+        self.assertEqual(chutney.loads(chutney.dumps(obj)), tuple(obj))
+        self.assertEqual(''.join(chutney.dumps_iov(obj[:10], 1)),
+                         chutney.dumps(obj[:10]))
+
+    def test_dump_iter(self):
+        import cStringIO
+        f = cStringIO.StringIO()
+        self.assertEqual(chutney.dump_iter((i * 2 for i in range(3000)), f),
+                         3000)
+        self.assertEqual(f.getvalue(), chutney.dumps(range(0, 6000, 2)))
+        # A write function, framing and an empty iterator
+        for framed in (True, False):
+            chunks = []
+            chutney.dump_iter(iter(['a' * 100000, 1]), chunks.append,
+                              framed=framed)
+            self.assertEqual(chutney.loads(''.join(chunks), framed=framed),
+                             ('a' * 100000, 1))
+        self.failUnless(len(chunks) > 1)
+        chunks = []
+        self.assertEqual(chutney.dump_iter([], chunks.append), 0)
+        self.assertEqual(''.join(chunks), '(t.')
+        # Key/value pairs are saved in batches of SETITEMS
+        obj = dict(('k%d' % i, i) for i in range(2500))
+        f = cStringIO.StringIO()
+        self.assertEqual(chutney.dump_iter_items(sorted(obj.items()), f),
+                         2500)
+        self.assertEqual(f.getvalue(), chutney.dumps(obj, canonical=True))
+        f = cStringIO.StringIO()
+        chutney.dump_iter_items(iter([]), f, protocol=2)
+        self.assertEqual(chutney.loads(f.getvalue()), {})
+        self.assertRaises(ValueError, chutney.dump_iter_items, [(1, 2, 3)], f)
+        self.assertRaises(TypeError, chutney.dump_iter_items, [1], f)
+        self.assertRaises(TypeError, chutney.dump_iter, [1], object())
+        self.assertRaises(chutney.UnpickleableError, chutney.dump_iter,
+                          [object()], f)
+
+    def test_dumps_iov(self):
+        big, text = 'B' * 100000, u'\u20ac' * 10000
+        obj = {'a': (big, 1, 'small'), 'b': text}
+        segments = chutney.dumps_iov(obj)
+        self.assertEqual(''.join(segments), chutney.dumps(obj))
+        for protocol in (0, 2, 4):
+            segments = chutney.dumps_iov(obj, protocol=protocol)
+            # protocol 4 frames end at each referenced payload
+            self.assertEqual(chutney.loads(''.join(segments)), obj)
+            # Large payloads are the objects themselves, not copies
+            self.failUnless([s for s in segments if s is big])
+            self.failUnless(text.encode('utf-8') in segments)
+        self.assertEqual(chutney.dumps_iov(None), ['N.'])
+        segments = chutney.dumps_iov(('abc', 'defg'), threshold=4)
+        self.assertEqual(segments, ['(U\x03abcU\x04', 'defg', 't.'])
+        self.assertRaises(chutney.UnpickleableError, chutney.dumps_iov, 
+                          (big, object()))
+
+    def test_hash(self):
+        # The digest is XXH64 (seed 0) of the chutney
+        self.assertEqual(chutney.dumps(None, hash=True),
+                         ('N.', 10496444311781796765L))
+        obj = {'a': tuple(['x' * 1000] * 150), 'b': (1, 2.0)}
+        for protocol in (0, 4):
+            data, digest = chutney.dumps(obj, protocol=protocol, hash=True)
+            self.assertEqual(data, chutney.dumps(obj, protocol=protocol))
+            self.assertEqual(chutney.dumps(obj, protocol=protocol, 
+                                           hash=True), (data, digest))
+        # Framed output is hashed before compression
+        self.assertEqual(chutney.dumps(obj, framed=True, hash=True)[1],
+                         chutney.dumps(obj, hash=True)[1])
+        self.assertNotEqual(chutney.dumps((1,), hash=True)[1],
+                            chutney.dumps((2,), hash=True)[1])
+
+    def test_canonical(self):
+        # Equal dicts built in a different order dump equally
+        keys = ['k%d' % i for i in range(2000)]
+        a, b = {}, {}
+        for k in keys:
+            a[k] = {k: 1, 'z': 2, 'a': 3}
+        for k in reversed(keys):
+            b[k] = {'a': 3, 'z': 2, k: 1}
+        self.assertEqual(chutney.dumps(a, canonical=True, hash=True),
+                         chutney.dumps(b, canonical=True, hash=True))
+        self.assertEqual(chutney.dumps({'b': 1, 'a': 2}, canonical=True),
+                         '}(U\x01aM\x02\x00U\x01bM\x01\x00u.')
+        self.assertEqual(chutney.loads(chutney.dumps(a, canonical=True)), a)
+
+    def test_delta(self):
+        blob = 'x' * 10000
+        base = {'a': 1, 'b': {'c': (1, 2), 'd': blob}, 'e': 2, 'f': True}
+        new = {'a': 1, 'b': {'c': (1, 2, 3), 'd': blob}, 'g': 3, 'f': 1}
+        patch = chutney.dumps_delta(new, base)
+        self.failUnless(len(patch) < 100)
+        old = {'a': 1, 'b': {'c': (1, 2), 'd': blob}, 'e': 2, 'f': True}
+        res = chutney.apply_delta(old, patch)
+        self.failUnless(res is old)
+        self.assertEqual(res, new)
+        self.assertEqual(type(res['f']), int)
+        # Unchanged values, whether the same object or not, are left out
+        self.assertEqual(chutney.dumps_delta(new, new), '(t.')
+        self.assertEqual(chutney.dumps_delta({'b': {'d': 'x' * 10000}},
+                                             {'b': {'d': blob}}), '(t.')
+        # Anything but a dict is replaced whole
+        self.assertEqual(chutney.apply_delta(5, chutney.dumps_delta(6, 5)), 6)
+        self.assertEqual(chutney.apply_delta(5, chutney.dumps_delta(5, 5)), 5)
+        self.assertEqual(chutney.apply_delta(base,
+                            chutney.dumps_delta((1,), base)), (1,))
+        self.assertRaises(ValueError, chutney.apply_delta, {},
+                          chutney.dumps_delta({'a': {'b': 1}}, {'a': {}}))
+        self.assertRaises(ValueError, chutney.apply_delta, {},
+                          chutney.dumps_delta({}, {'a': 1}))
+        self.assertRaises(ValueError, chutney.apply_delta, {}, 'K\x01.')
+
+    def test_threads(self):
+        doc = dict(('k%d' % i, (i, 'v' * (i % 50), [1.5, None, True], 
+                                {u'\u20ac' * (i % 3): -i}))
+                   for i in range(20000))
+        doc['big'] = ('x' * 200000, u'\u20ac' * 100000)
+        # The same bytes whatever the number of threads, with dict batches
+        # and protocol 4 frames ending within the chunks
+        for root in (doc, doc.items(), tuple(doc.values())):
+            for protocol in (0, 2, 4):
+                data = chutney.dumps(root, protocol=protocol)
+                for threads in (1, 2, 7):
+                    self.assertEqual(chutney.dumps(root, protocol=protocol,
+                                                   threads=threads), data)
+        for kwds in (dict(canonical=True), dict(framed=True), 
+                     dict(hash=True)):
+            self.assertEqual(chutney.dumps(doc, threads=4, **kwds), 
+                             chutney.dumps(doc, **kwds))
+        self.assertEqual(chutney.dumps(1.5, threads=4), chutney.dumps(1.5))
+        # An unsaveable value within a chunk
+        for threads in (1, 4):
+            for obj in (object(), TestObject(), type('D', (dict,), {})()):
+                doc['k10000'] = (1, [obj])
+                self.assertRaises(chutney.UnpickleableError, chutney.dumps,
+                                  doc, threads=threads)
+        del doc['k10000']
+        deep = []
+        for i in range(sys.getrecursionlimit() + 10):
+            deep = [deep]
+        self.assertRaises(RuntimeError, chutney.dumps, deep, threads=2)
+        self.assertRaises(ValueError, chutney.dumps, doc, threads=-1)
+        self.assertRaises(ValueError, chutney.dumps, doc, threads=2,
+                          columnar=True)
+
+    def test_large(self):
+        # Needs some 16GB of memory
+        if not os.environ.get('CHUTNEY_TEST_LARGE'):
+            self.skipTest('set CHUTNEY_TEST_LARGE to run')
+        big = 'X' * (5 << 30)
+        self.assertRaises(OverflowError, chutney.dumps, big, protocol=3)
+        data = chutney.dumps(big, protocol=4)
+        self.assertEqual(len(data), len(big) + 21)
+        self.assertEqual(data[2:11], '\x8e\x00\x00\x00\x40\x01\x00\x00\x00')
+        res = chutney.loads(data)
+        del data
+        self.assertEqual(res, big)
+
 
 class DumpSuite(unittest.TestSuite):
     tests = [
@@ -140,6 +509,20 @@ class DumpSuite(unittest.TestSuite):
         'test_dict',
         'test_inst',
         'test_obj',
+        'test_protocol',
+        'test_protocol4_frames',
+        'test_dumps_into',
+        'test_inst_cache',
+        'test_extension',
+        'test_columnar',
+        'test_key_cache',
+        'test_dump_iter',
+        'test_dumps_iov',
+        'test_hash',
+        'test_canonical',
+        'test_delta',
+        'test_threads',
+        'test_large',
     ]
     def __init__(self):
         unittest.TestSuite.__init__(self, map(DumpTests, self.tests))
@@ -262,6 +645,301 @@ class LoadTests(unittest.TestCase):
         self.failUnless(isinstance(o, TestObject))
         self.assertEqual(o.__dict__, dict(attr='abc'))
  
+    def test_protocol4(self):
+        # As generated by Python 3 pickle.dumps(obj, 4)
+        self.assertEqual(chutney.loads(
+            '\x80\x04\x95\x1f\x00\x00\x00\x00\x00\x00\x00}\x94(\x8c\x01a'
+            '\x94(C\x01q\x94\x8c\x01r\x94K\x01M,\x01t\x94\x8c\x01b\x94}'
+            '\x94u.'), {u'a': ('q', u'r', 1, 300), u'b': {}})
+        self.assertEqual(chutney.loads(
+            '\x80\x04\x95\x0c\x00\x00\x00\x00\x00\x00\x00(K\x01K\x02K\x03'
+            'K\x04t\x94.'), (1, 2, 3, 4))
+        self.assertEqual(chutney.loads('\x80\x04).'), ())
+        self.assertEqual(chutney.loads('K\x01K\x02K\x03\x87.'), (1, 2, 3))
+        self.assertEqual(chutney.loads('}K\x01K\x02s.'), {1: 2})
+        self.assertEqual(chutney.loads('B\x01\x00\x00\x00x.'), 'x')
+        self.assertEqual(chutney.loads('\x8e\x01' + '\x00' * 7 + 'x.'), 'x')
+        self.assertEqual(chutney.loads('\x8d\x01' + '\x00' * 7 + 'x.'), u'x')
+        # Unsupported protocol
+        self.assertRaises(chutney.UnpicklingError, chutney.loads, '\x80\x05N.')
+        # Stack underflow, and tuples crossing a MARK
+        self.assertRaises(chutney.UnpicklingError, chutney.loads, '\x86.')
+        self.assertRaises(chutney.UnpicklingError, chutney.loads, 'N(N\x86.')
+        self.assertRaises(chutney.UnpicklingError, chutney.loads, '}(NNs.')
+        # Oversized length
+        self.assertRaises(chutney.UnpicklingError, chutney.loads, 
+                          '\x8e' + '\xff' * 8 + '.')
+
+    def test_buffer(self):
+        data = '}(U\x04attr(NM\x01\x00tu.'
+        for buf in (bytearray(data), buffer(data), memoryview(data)):
+            self.assertEqual(chutney.loads(buf), dict(attr=(None, 1)))
+        m = mmap.mmap(-1, len(data))
+        m.write(data)
+        self.assertEqual(chutney.loads(m), dict(attr=(None, 1)))
+        self.assertRaises(EOFError, chutney.loads, bytearray(data[:-1]))
+        self.assertRaises(TypeError, chutney.loads, u'N.')
+
+    def test_load_path(self):
+        obj = {'a': ('X' * 100000, u'\u20ac', 1.5), 'b': None}
+        fd, path = tempfile.mkstemp()
+        try:
+            for framed in (False, True):
+                data = chutney.dumps(obj, framed=framed)
+                f = open(path, 'wb')
+                f.write(data)
+                f.close()
+                self.assertEqual(chutney.load_path(path, framed=framed), obj)
+                f = open(path, 'wb')
+                f.write(data[:-1])
+                f.close()
+                self.assertRaises(EOFError, chutney.load_path, path, framed)
+            open(path, 'wb').close()
+            self.assertRaises(EOFError, chutney.load_path, path)
+            # A string straddling CHUTNEY_MAP_CHUNK is still passed in place
+            obj = ('a' * ((64 << 20) - 500), 'X' * 1000)
+            f = open(path, 'wb')
+            f.write(chutney.dumps(obj))
+            f.close()
+            chutney.stats(True)
+            self.assertEqual(chutney.load_path(path), obj)
+            self.assertEqual(chutney.stats()['load']['buf_max'], 0)
+        finally:
+            os.close(fd)
+            os.unlink(path)
+        self.assertRaises(IOError, chutney.load_path, path)
+
+    def test_segments(self):
+        obj = {'a': ('X' * 1000, u'\u20ac', 1.5), 'b': None}
+        data = chutney.dumps(obj)
+        for i in range(len(data) + 1):
+            self.assertEqual(chutney.loads([data[:i], data[i:]]), obj)
+        pieces = [buffer(data, i, 7) for i in range(0, len(data), 7)]
+        self.assertEqual(chutney.loads(pieces), obj)
+        self.assertEqual(chutney.loads((bytearray(data),)), obj)
+        self.assertRaises(EOFError, chutney.loads, [data[:10], data[10:-1]])
+        self.assertRaises(TypeError, chutney.loads, [data, None])
+        framed = chutney.dumps(obj, framed=True)
+        self.assertEqual(chutney.loads([framed[:5], framed[5:]], 
+                                       framed=True), obj)
+        # Only arguments that straddle segments are copied
+        chutney.stats(True)
+        i = data.index('X' * 1000)
+        chutney.loads([data[:i + 10], data[i + 10:]])
+        self.assertEqual(chutney.stats()['load']['buf_max'], 1000)
+        chutney.stats(True)
+        chutney.loads([data[:i + 1000], data[i + 1000:]])
+        self.assertEqual(chutney.stats()['load']['buf_max'], 0)
+
+    def test_extract(self):
+        msg = {'header': {'route': 'north', 'id': 7}, 
+               'body': ('x' * 100000, {'route': 'wrong'}),
+               u'\u20ac': (1, (2, 3), None)}
+        for protocol in (0, 2, 4):
+            data = chutney.dumps(msg, protocol=protocol)
+            self.assertEqual(chutney.extract(data, ('header', 'route')),
+                             'north')
+            self.assertEqual(chutney.extract(data, ('header',)), 
+                             msg['header'])
+            self.assertEqual(chutney.extract(data, ()), chutney.loads(data))
+            self.assertEqual(chutney.extract(data, (u'\u20ac', 1, 0)), 2)
+            self.assertEqual(chutney.extract(data, (u'\u20ac', -1)), None)
+            self.assertEqual(chutney.extract(data, ('body', 1, 'route')),
+                             'wrong')
+            self.assertRaises(KeyError, chutney.extract, data, ('nope',))
+            self.assertRaises(KeyError, chutney.extract, data, 
+                              ('header', 0))
+            try:
+                chutney.extract(data, ('header', 'x'))
+            except KeyError, e:
+                self.assertEqual(e.args, (('header', 'x'),))
+            else:
+                self.fail('no KeyError')
+            self.assertEqual(chutney.extract(data, ('body', 5), 'd'), 'd')
+        # Instance attributes, and pickle's postfix forms
+        o = TestObject()
+        o.route = ('a', 'b')
+        self.assertEqual(chutney.extract(chutney.dumps(o), ('route', 1)), 
+                         'b')
+        self.assertEqual(chutney.extract('(K\x01K\x02\x86}U\x01aK\x03s'
+                                         't.', (1, 'a')), 3)
+        self.assertRaises(EOFError, chutney.extract, 
+                          chutney.dumps(msg)[:-10], ('header',))
+        self.assertRaises(chutney.UnpicklingError, chutney.extract, 
+                          ')t.', (0,))
+
+    def test_validate(self):
+        msg = {'a': (1, [2.5, {u'\u20ac': None}]), 'b': 'x' * 1000}
+        for protocol in (0, 2, 4):
+            data = chutney.dumps(msg, protocol=protocol)
+            report = chutney.validate(data + 'trailing')
+            self.assertEqual(report['length'], len(data))
+            self.assertEqual((report['depth'], report['strings'],
+                              report['containers'], report['objects']),
+                             (4, 4, 4, 11))
+            self.assertEqual(report['payload'], 1005)
+            self.assertRaises(EOFError, chutney.validate, data[:-1])
+        self.assertEqual(chutney.validate(u'\ud800'.encode('utf-8').join(
+            ['X\x03\x00\x00\x00', '.']))['strings'], 1)
+        # Limits
+        data = chutney.dumps(msg)
+        for limit in ('max_depth', 'max_objects', 'max_payload',
+                      'max_string', 'max_stack'):
+            self.assertRaises(chutney.UnpicklingError, chutney.validate,
+                              data, **{limit: 3})
+        chutney.validate(data, max_depth=4, max_string=1000, max_objects=11)
+        # Classes, allowed by name or through the extension registry
+        module = TestInstance.__module__
+        o = TestInstance()
+        o.x = 1
+        data = chutney.dumps(o)
+        self.assertEqual(chutney.validate(data, globals=[(module, 
+            'TestInstance')])['instances'], 1)
+        self.assertRaises(chutney.UnpicklingError, chutney.validate, data,
+                          globals=[(module, 'TestObject')])
+        self.assertRaises(chutney.UnpicklingError, chutney.validate, data,
+                          globals=[])
+        chutney.register_extension(module, 'TestExtension', 300)
+        data = chutney.dumps(TestExtension())
+        chutney.validate(data, globals=[(module, 'TestExtension')])
+        self.assertRaises(TypeError, chutney.validate, data, globals=[1])
+        # Malformed input is refused without building anything
+        for data in ('(K\x01.', 'K\x01K\x02.', 'u.', ')K\x01K\x02s.',
+                     '\x8c\x02\xc0\x80.', 'I1x\n.', '\xff.', 
+                     'K\x01b.', '(K\x01o.', '(c__main__\nC\no}(bt\x87.'):
+            self.assertRaises(chutney.UnpicklingError, chutney.validate, 
+                              data)
+        self.assertRaises(EOFError, chutney.validate, 'X\xff\xff\x00\x00a')
+
+    def events_value(self, events):
+        # Rebuild the value the way chutney_load would from the events
+        stack, marks, chunks = [], [], []
+        for event in events:
+            kind = event[0]
+            if kind in ('string', 'unicode'):
+                self.assertEqual(event[2], sum(map(len, chunks)))
+                chunks.append(event[1])
+                if event[4]:
+                    continue
+                s = ''.join(chunks)
+                self.assertEqual(len(s), event[3])
+                stack.append(kind == 'unicode' and s.decode('utf-8') or s)
+                chunks = []
+            elif kind == 'none':
+                stack.append(None)
+            elif kind == 'bool':
+                stack.append(bool(event[1]))
+            elif kind in ('int', 'float'):
+                stack.append(event[1])
+            elif kind == 'mark':
+                marks.append(len(stack))
+            elif kind in ('tuple', 'setitems'):
+                n = event[1]
+                if n < 0:
+                    n = len(stack) - marks.pop()
+                elif kind == 'setitems':
+                    n = 2
+                items = stack[len(stack) - n:]
+                del stack[len(stack) - n:]
+                if kind == 'tuple':
+                    stack.append(tuple(items))
+                else:
+                    stack[-1].update(zip(items[::2], items[1::2]))
+            elif kind == 'dict':
+                stack.append({})
+            elif kind == 'global':
+                stack.append(getattr(sys.modules[event[1]], event[2]))
+            elif kind == 'obj':
+                cls = stack.pop()
+                self.assertEqual(marks.pop(), len(stack))
+                stack.append(cls())
+            elif kind == 'build':
+                state = stack.pop()
+                stack[-1].__dict__.update(state)
+            elif kind == 'stop':
+                self.assertEqual(len(stack), 1)
+                return stack.pop()
+        self.fail('no stop')
+
+    def test_arena(self):
+        # Loads share an arena, reset after each, which must not leak
+        # between them
+        obj = {'a': ('X' * 1000, u'\u20ac' * 10, 1.5), 'b': (None,) * 100}
+        data = chutney.dumps(obj)
+        big = ('Y' * 200000, tuple(range(50000)))
+        for i in range(3):
+            self.assertEqual(chutney.loads([data[:10], data[10:]]), obj)
+            self.assertEqual(chutney.loads([data[:-5], data[-5:]]), obj)
+            self.assertEqual(chutney.loads(chutney.dumps(big)[:-1] + '.'), 
+                             big)
+            self.assertEqual(chutney.extract(data, ('a', 0)), 'X' * 1000)
+            self.assertRaises(EOFError, chutney.loads, data[:-1])
+        # A load started during another, by a key's __hash__
+        nested = []
+        class Key(TestObject):
+            def __hash__(self):
+                nested.append(chutney.loads([data[:7], data[7:]]))
+                return 1
+        module = Key.__module__
+        setattr(sys.modules[module], 'Key', Key)
+        try:
+            key = Key()
+            key.attr = 'X' * 1000
+            pair = chutney.dumps(({key: obj}, 'Z' * 1000))
+            del nested[:]
+            # the outer load grows its buffer after the nested one ends
+            i = pair.index('Z' * 1000) + 10
+            loaded = chutney.loads([pair[:i], pair[i:]])
+        finally:
+            delattr(sys.modules[module], 'Key')
+        self.assertEqual(nested, [obj])
+        (k, v), = loaded[0].items()
+        self.assertEqual((k.attr, v), ('X' * 1000, obj))
+        self.assertEqual(loaded[1], 'Z' * 1000)
+        self.assertEqual(chutney.loads(data), obj)
+
+    def test_read_events(self):
+        o = TestObject()
+        o.attr = ('abc', 1.5)
+        msg = {'a': (1, -70000, 2.5, True, None, (), (7,), {}),
+               'b': ['x' * 1000, u'\u20ac' * 10], 'c': o}
+        for protocol in (0, 2, 4):
+            data = chutney.dumps(msg, protocol=protocol)
+            expect = chutney.loads(data)
+            expect_obj = expect.pop('c')
+            self.assertEqual(chutney.read_events(data)[-1], ('stop',))
+            # Split at every byte offset (or into single bytes), the events
+            # build what loads builds
+            splits = [[data[:i], data[i:]] for i in range(len(data) + 1)]
+            for pieces in splits + [list(data)]:
+                value = self.events_value(chutney.read_events(pieces))
+                obj = value.pop('c')
+                self.failUnless(isinstance(obj, TestObject))
+                self.assertEqual(obj.__dict__, expect_obj.__dict__)
+                self.assertEqual(value, expect)
+            # Every chunk of a string body is reported as it arrives
+            i = data.index('x' * 1000)
+            chunks = [e for e in chutney.read_events([data[:i + 10], 
+                                                      data[i + 10:]])
+                      if e[0] == 'string' and e[3] == 1000]
+            self.assertEqual(chunks, [('string', 'x' * 10, 0, 1000, 1),
+                                      ('string', 'x' * 990, 10, 1000, 0)])
+            # Input ending within an event, not between events
+            self.assertRaises(EOFError, chutney.read_events, 
+                              [data[:i], data[i:i + 10]])
+        # Input runs on past STOP into the next chutney
+        self.assertEqual(chutney.read_events(['K\x01.N', '.']),
+                         [('int', 1), ('stop',), ('none',), ('stop',)])
+        self.assertEqual(chutney.read_events(bytearray('I12\n.')),
+                         [('int', 12), ('stop',)])
+        self.assertEqual(chutney.read_events('c__main__\nTestObject\n.'),
+                         [('global', '__main__', 'TestObject'), ('stop',)])
+        self.assertRaises(chutney.UnpicklingError, chutney.read_events, 
+                          '\xff.')
+        self.assertRaises(chutney.UnpicklingError, chutney.read_events, 
+                          ['\x80', '\x05N.'])
+        self.assertRaises(TypeError, chutney.read_events, [None])
+
 
 class LoadSuite(unittest.TestSuite):
     tests = [
@@ -278,17 +956,445 @@ class LoadSuite(unittest.TestSuite):
         'test_inst_err',
         'test_inst',
         'test_obj',
+        'test_protocol4',
+        'test_buffer',
+        'test_load_path',
+        'test_segments',
+        'test_extract',
+        'test_validate',
+        'test_read_events',
+        'test_arena',
     ]
     def __init__(self):
         unittest.TestSuite.__init__(self, map(LoadTests, self.tests))
 
 
+class FrameTests(unittest.TestCase):
+    def test_roundtrip(self):
+        for obj in (None, (), {}, 'abc', u'\u20ac', (1, 2.0, 'X' * 1000)):
+            data = chutney.dumps(obj, framed=True)
+            self.assertEqual(data[:4], 'CHZ\x01')
+            self.assertEqual(chutney.loads(data, framed=True), obj)
+
+    def test_compress(self):
+        obj = [{'key_one': i, 'key_two': 'value', 'key_three': (i, i)}
+               for i in range(10000)]
+        raw = chutney.dumps(obj)
+        data = chutney.dumps(obj, framed=True)
+        self.failUnless(len(data) < len(raw) / 4)
+        self.assertEqual(chutney.loads(data, framed=True), tuple(obj))
+
+    def test_stored(self):
+        # Incompressible data is stored
+        rand = random.Random(1)
+        obj = ''.join([chr(rand.randrange(256)) for i in range(200000)])
+        data = chutney.dumps(obj, framed=True)
+        self.failUnless(len(data) > len(obj))
+        self.assertEqual(chutney.loads(data, framed=True), obj)
+
+    def test_errors(self):
+        data = chutney.dumps(('abc' * 100,), framed=True)
+        self.assertRaises(EOFError, chutney.loads, data[:-1], framed=True)
+        self.assertRaises(chutney.UnpicklingError, chutney.loads, 
+                          'CHZ\x02' + data[4:], framed=True)
+        # Corrupt the stored CRC
+        bad = data[:12] + chr(ord(data[12]) ^ 1) + data[13:]
+        self.assertRaises(chutney.UnpicklingError, chutney.loads, bad,
+                          framed=True)
+        # Oversized block header
+        self.assertRaises(chutney.UnpicklingError, chutney.loads, 
+                          'CHZ\x01\xff\xff\xff\x7f' + '\x00' * 8,
+                          framed=True)
+
+    def test_blocks(self):
+        # Blocks are located from their headers and decoded independently
+        rand = random.Random(1)
+        obj = (tuple(range(50000)), 
+               ''.join([chr(rand.randrange(256)) for i in range(100000)]))
+        raw = chutney.dumps(obj)
+        data = chutney.dumps(obj, framed=True)
+        blocks = chutney.frame_blocks(data)
+        self.failUnless(len(blocks) > 2)
+        self.assertEqual(blocks[0][0], 4)
+        self.assertEqual(sum(n for off, n in blocks), len(data) - 4)
+        buf = bytearray(len(raw) + 10)
+        pos = 10
+        for off, n in blocks:
+            pos += chutney.frame_decode_into(buffer(data, off, n), buf, pos)
+        self.assertEqual(pos, len(buf))
+        self.assertEqual(str(buf[10:]), raw)
+        self.assertEqual(chutney.frame_blocks('CHZ\x01'), [])
+        # Truncated containers and blocks
+        self.assertRaises(EOFError, chutney.frame_blocks, data[:-1])
+        self.assertRaises(EOFError, chutney.frame_blocks, data[:10])
+        self.assertRaises(chutney.UnpicklingError, chutney.frame_blocks, raw)
+        off, n = blocks[-1]
+        for block in (data[off:off + n - 1], data[off:off + 11]):
+            self.assertRaises(chutney.UnpicklingError, 
+                              chutney.frame_decode_into, block, buf)
+        # A corrupt body, and a buffer too small for the block
+        block = data[off:off + n]
+        bad = block[:-1] + chr(ord(block[-1]) ^ 1)
+        self.assertRaises(chutney.UnpicklingError, chutney.frame_decode_into,
+                          bad, buf)
+        need = len(raw) - sum(chutney.frame_decode_into(data[o:o + m], buf)
+                              for o, m in blocks[:-1])
+        self.assertEqual(chutney.frame_decode_into(block, buf, 
+                                                   len(buf) - need), need)
+        self.assertRaisesRegexp(ValueError, '%d bytes needed' % need,
+                                chutney.frame_decode_into, block, buf,
+                                len(buf) - need + 1)
+        self.assertRaises(ValueError, chutney.frame_decode_into, block, buf,
+                          len(buf) + 1)
+
+
+class FrameSuite(unittest.TestSuite):
+    tests = [
+        'test_roundtrip',
+        'test_compress',
+        'test_stored',
+        'test_errors',
+        'test_blocks',
+    ]
+    def __init__(self):
+        unittest.TestSuite.__init__(self, map(FrameTests, self.tests))
+
+
+class LogTests(unittest.TestCase):
+    def setUp(self):
+        fd, self.path = tempfile.mkstemp()
+        os.close(fd)
+        os.unlink(self.path)
+
+    def tearDown(self):
+        if os.path.exists(self.path):
+            os.unlink(self.path)
+
+    def write(self, start, stop):
+        log = chutney.LogWriter(self.path)
+        for i in range(start, stop):
+            key = i % 100 == 0 and 'key%d' % i or None
+            self.assertEqual(log.append((i, 'x' * (i % 7)), key=key), i)
+        log.close()
+
+    def test_roundtrip(self):
+        # More than one index block, and a partial one at the end
+        self.write(0, 2500)
+        log = chutney.LogReader(self.path)
+        self.assertEqual(len(log), 2500)
+        self.assertEqual(log[0], (0, ''))
+        self.assertEqual(log[1500], (1500, 'x' * (1500 % 7)))
+        self.assertEqual(log[-1], (2499, 'x' * (2499 % 7)))
+        self.assertRaises(IndexError, lambda: log[2500])
+        self.assertEqual([r[0] for r in reversed(log)], 
+                         range(2499, -1, -1))
+        self.assertEqual(log.find('key1200'), 1200)
+        self.assertEqual(log.find('missing'), -1)
+        log.close()
+        self.assertRaises(ValueError, len, log)
+
+    def test_reopen(self):
+        # Appending after a clean close continues the partial index block
+        self.write(0, 1500)
+        self.write(1500, 2100)
+        log = chutney.LogReader(self.path)
+        self.assertEqual(len(log), 2100)
+        self.assertEqual([r[0] for r in log], range(2100))
+        self.assertEqual(log.find('key100'), 100)
+        self.assertEqual(log.find('key2000'), 2000)
+
+    def test_torn(self):
+        log = chutney.LogWriter(self.path)
+        for i in range(1100):
+            log.append(i, key=str(i))
+        log.sync()
+        good = os.path.getsize(self.path)
+        log.append('torn')
+        # Simulate a crash part way through the last record
+        data = open(self.path, 'rb').read()
+        del log
+        open(self.path, 'wb').write(data[:-3])
+        log = chutney.LogReader(self.path)
+        self.assertEqual(len(log), 1100)
+        self.assertEqual(log[1099], 1099)
+        self.assertEqual(log.find('1050'), 1050)
+        log.close()
+        chutney.LogWriter(self.path).append('next')
+        self.failUnless(os.path.getsize(self.path) > good)
+        log = chutney.LogReader(self.path)
+        self.assertEqual(len(log), 1101)
+        self.assertEqual(log[-1], 'next')
+
+    def test_missing_index(self):
+        # A crash after record 1024 but before its index block is written
+        log = chutney.LogWriter(self.path)
+        for i in range(1023):
+            log.append(i)
+        log.sync()
+        size = os.path.getsize(self.path)
+        log.append(1023)
+        log.sync()
+        data = open(self.path, 'rb').read()
+        del log
+        open(self.path, 'wb').write(data[:size + 12 + len(chutney.dumps(1023))])
+        log = chutney.LogWriter(self.path)
+        for i in range(1024, 1034):
+            log.append(i)
+        log.close()
+        log = chutney.LogReader(self.path)
+        self.assertEqual(list(log), range(1034))
+
+    def test_torn_footer(self):
+        # A crash during close, after the final index block but before the
+        # footer
+        log = chutney.LogWriter(self.path)
+        for i in range(3):
+            log.append(i)
+        log.sync()
+        size = os.path.getsize(self.path)
+        log.close()
+        data = open(self.path, 'rb').read()
+        open(self.path, 'wb').write(data[:size + 12 + 8 + 8 * 3])
+        self.assertEqual(list(chutney.LogReader(self.path)), range(3))
+        log = chutney.LogWriter(self.path)
+        for i in range(3, 8):
+            log.append(i)
+        log.close()
+        log = chutney.LogReader(self.path)
+        self.assertEqual([log[i] for i in range(8)], range(8))
+        seen = {}
+        def fn(n, obj):
+            seen[n] = obj
+        chutney.scan(self.path, fn)
+        self.assertEqual(seen, dict([(i, i) for i in range(8)]))
+
+    def test_corrupt(self):
+        self.write(0, 10)
+        data = open(self.path, 'rb').read()
+        i = data.index(chutney.dumps((5, 'xxxxx')))
+        open(self.path, 'wb').write(data[:i] + 'X' + data[i + 1:])
+        log = chutney.LogReader(self.path)
+        self.assertEqual(log[4], (4, 'xxxx'))
+        self.assertRaises(chutney.UnpicklingError, lambda: log[5])
+        open(self.path, 'wb').write('not a log')
+        self.assertRaises(IOError, chutney.LogReader, self.path)
+
+    def test_scan(self):
+        self.write(0, 5000)
+        for threads in (1, 4):
+            seen = {}
+            def fn(n, obj):
+                seen[n] = obj[0]
+            chutney.scan(self.path, fn, threads=threads)
+            self.assertEqual(seen, dict([(i, i) for i in range(5000)]))
+        def fail(n, obj):
+            if n == 3000:
+                raise KeyError(n)
+        self.assertRaises(KeyError, chutney.scan, self.path, fail, threads=4)
+
+
+class LogSuite(unittest.TestSuite):
+    tests = [
+        'test_roundtrip',
+        'test_reopen',
+        'test_torn',
+        'test_missing_index',
+        'test_torn_footer',
+        'test_corrupt',
+        'test_scan',
+    ]
+    def __init__(self):
+        unittest.TestSuite.__init__(self, map(LogTests, self.tests))
+
+
+class ChannelTests(unittest.TestCase):
+    def setUp(self):
+        self.name = '/chutney-test-%d' % os.getpid()
+        self.tx = chutney.ShmChannel(self.name, 4096)
+        self.rx = chutney.ShmChannel(self.name)
+
+    def tearDown(self):
+        self.rx.close()
+        self.tx.close()
+
+    def test_roundtrip(self):
+        # Messages of varying size wrap around the ring
+        for i in range(500):
+            obj = (i, 'x' * (i % 700), {'k': u'v'})
+            self.tx.send(obj, protocol=i % 2 and 4 or 0)
+            self.assertEqual(self.rx.recv(), obj)
+        self.tx.send(None)
+        self.tx.send(1)
+        self.assertEqual(self.rx.recv(), None)
+        self.assertEqual(self.rx.recv(), 1)
+
+    def test_errors(self):
+        self.assertRaises(OSError, self.rx.recv, timeout=0.01)
+        self.assertRaises(OSError, self.tx.send, 'x' * 4096)
+        self.assertRaises(OSError, chutney.ShmChannel, self.name, 4096)
+        self.assertRaises(OSError, chutney.ShmChannel, self.name + 'x')
+        self.assertRaises(OSError, chutney.ShmChannel, self.name + 'x', 5000)
+        # A full ring times out, and failed sends publish nothing
+        self.tx.send('x' * 3000)
+        self.assertRaises(OSError, self.tx.send, 'y' * 2000, timeout=0.01)
+        self.assertRaises(chutney.UnpickleableError, self.tx.send, [object])
+        self.assertEqual(self.rx.recv(), 'x' * 3000)
+        self.assertRaises(OSError, self.rx.recv, timeout=0)
+        self.tx.close()
+        self.assertRaises(ValueError, self.tx.send, 1)
+
+    def test_threads(self):
+        # The producer waits for space without holding the GIL
+        def produce():
+            for i in range(5000):
+                self.tx.send(('m', 'y' * (i % 1000), i))
+        thread = threading.Thread(target=produce)
+        thread.start()
+        for i in range(5000):
+            self.assertEqual(self.rx.recv(), ('m', 'y' * (i % 1000), i))
+        thread.join()
+
+    def test_corrupt(self):
+        # A header claiming more than was published is refused
+        self.tx.send('abc')
+        f = open('/dev/shm' + self.name, 'r+b')
+        try:
+            f.seek(256)
+            f.write('\xff' * 4)
+            f.flush()
+            self.assertRaises(OSError, self.rx.recv, timeout=0)
+            f.seek(256)
+            f.write('\x00\x10\x00\x00')
+            f.flush()
+            self.assertRaises(OSError, self.rx.recv, timeout=0)
+        finally:
+            f.close()
+
+    def test_close_busy(self):
+        # A channel can't be closed under a call waiting on another thread
+        thread = threading.Thread(target=self.assertRaises,
+                                  args=(OSError, self.rx.recv, 0.5))
+        thread.start()
+        time.sleep(0.1)
+        self.assertRaises(ValueError, self.rx.close)
+        thread.join()
+        self.rx.close()
+        self.assertRaises(ValueError, self.rx.recv)
+        # Sends from several threads are serialised
+        def produce(n):
+            for i in range(500):
+                self.tx.send((n, i, 'w' * (i % 300)))
+        threads = [threading.Thread(target=produce, args=(n,)) 
+                   for n in range(2)]
+        for thread in threads:
+            thread.start()
+        rx = chutney.ShmChannel(self.name)
+        got = sorted(rx.recv(timeout=10) for i in range(1000))
+        for thread in threads:
+            thread.join()
+        rx.close()
+        self.assertEqual(got, sorted((n, i, 'w' * (i % 300)) 
+                                     for n in range(2) for i in range(500)))
+
+    def test_fork(self):
+        pid = os.fork()
+        if pid == 0:
+            try:
+                for i in range(5000):
+                    self.tx.send({'n': i, 's': 'z' * (i % 300)})
+            finally:
+                os._exit(0)
+        for i in range(5000):
+            self.assertEqual(self.rx.recv(timeout=10), 
+                             {'n': i, 's': 'z' * (i % 300)})
+        os.waitpid(pid, 0)
+
+
+class ChannelSuite(unittest.TestSuite):
+    tests = [
+        'test_roundtrip',
+        'test_errors',
+        'test_threads',
+        'test_close_busy',
+        'test_corrupt',
+        'test_fork',
+    ]
+    def __init__(self):
+        unittest.TestSuite.__init__(self, map(ChannelTests, self.tests))
+
+
+class CppTests(unittest.TestCase):
+    # Values printed by tests_hpp.cpp, as the Python binding would save
+    # them
+    values = {
+        'none': None, 'bool': True, 'int': 1, 'int2': 300, 
+        'int4': -70000, 'float': 2.5, 'string': 'abc', 
+        'long_string': 'x' * 300, 'tuple': (1, 2.5, 'abc'), 'pair': (7, 8),
+        'vector': (1, 2, 3, 70000), 'empty': (), 'array': (1.5, -0.25),
+        'map': {'a': 1, 'b': 2}, 'nested': {'k': ('x', 'y')},
+        'batches': dict((i, -i) for i in range(2500)), 
+        'unordered': {5: False},
+        'dict_then_tuple': (({}, (1,)), ({2: 3}, ()), ({}, ())),
+    }
+
+    def test_hpp(self):
+        # Compile and run the checks of chutney.hpp, which exits non-zero
+        # if any fail, then compare its encodings with dumps
+        here = os.path.dirname(os.path.abspath(__file__))
+        tmp = tempfile.mkdtemp()
+        try:
+            exe = os.path.join(tmp, 'tests_hpp')
+            try:
+                cc = subprocess.Popen([os.environ.get('CXX', 'c++'), 
+                                       '-std=c++17', '-Wall', '-I', 
+                                       os.path.join(here, 'chutney'), '-o',
+                                       exe, 
+                                       os.path.join(here, 'tests_hpp.cpp')],
+                                      stdout=subprocess.PIPE, 
+                                      stderr=subprocess.STDOUT)
+            except OSError:
+                self.skipTest('no C++ compiler')
+            out = cc.communicate()[0]
+            self.assertEqual(cc.returncode, 0, out)
+            run = subprocess.Popen([exe], stdout=subprocess.PIPE,
+                                   stderr=subprocess.PIPE)
+            out, err = run.communicate()
+            self.assertEqual(run.returncode, 0, err)
+        finally:
+            shutil.rmtree(tmp)
+        encoded = dict(line.split() for line in out.splitlines())
+        for label, value in self.values.items():
+            data = encoded.pop(label).decode('hex')
+            self.assertEqual(data, chutney.dumps(value, canonical=True))
+            self.assertEqual(chutney.loads(data), value)
+        data = encoded.pop('point').decode('hex')
+        self.assertEqual(chutney.read_events(data), [
+            ('mark',), ('global', 'geometry', 'Point'), ('obj',), ('dict',),
+            ('mark',), ('string', 'x', 0, 1, 0), ('int', 3), 
+            ('string', 'y', 0, 1, 0), ('float', 0.5), 
+            ('string', 'label', 0, 5, 0), ('string', 'origin', 0, 6, 0),
+            ('setitems', -1), ('build',), ('stop',)])
+        self.assertEqual(encoded, {})
+
+
+class CppSuite(unittest.TestSuite):
+    tests = [
+        'test_hpp',
+    ]
+    def __init__(self):
+        unittest.TestSuite.__init__(self, map(CppTests, self.tests))
+
+
 class ChutneySuite(unittest.TestSuite):
     def __init__(self):
         unittest.TestSuite.__init__(self)
         self.addTest(BasicSuite())
         self.addTest(DumpSuite())
         self.addTest(LoadSuite())
+        self.addTest(FrameSuite())
+        self.addTest(LogSuite())
+        self.addTest(ChannelSuite())
+        self.addTest(CppSuite())
 
 
 suite = ChutneySuite
@@ -0,0 +1,181 @@
+/*
+ * Checks of the C++ interface, chutney/chutney.hpp, compiled and run by
+ * tests.py (CppTests). Each value is encoded, decoded again, and printed
+ * as "label hex" for tests.py to compare with the Python binding. Failed
+ * checks are reported on stderr, and make the exit status non-zero.
+ */
+#include <array>
+#include <cstdio>
+#include <map>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "chutney.hpp"
+
+struct Point {
+    int x;
+    double y;
+    std::string label;
+
+    bool operator==(const Point &o) const
+    {
+        return x == o.x && y == o.y && label == o.label;
+    }
+};
+
+namespace chutney {
+template <> struct fields<Point> {
+    static constexpr const char *module = "geometry";
+    static constexpr const char *name = "Point";
+    static constexpr auto list = std::make_tuple(
+        field("x", &Point::x), field("y", &Point::y),
+        field("label", &Point::label));
+};
+}
+
+static int failures;
+
+#define CHECK(...) do { \
+        if (!(__VA_ARGS__)) { \
+            std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, \
+                         #__VA_ARGS__); \
+            ++failures; \
+        } \
+    } while (0)
+
+static void
+print(const char *label, const std::string &data)
+{
+    std::printf("%s ", label);
+    for (unsigned char c : data)
+        std::printf("%02x", c);
+    std::printf("\n");
+}
+
+template <class T>
+static std::string
+roundtrip(const char *label, const T &value)
+{
+    std::string data = chutney::encode(value);
+
+    CHECK(chutney::decode<T>(data) == value);
+    print(label, data);
+    return data;
+}
+
+// Whether decoding /data/ as a T throws chutney::error
+template <class T>
+static bool
+refused(std::string_view data)
+{
+    try {
+        chutney::decode<T>(data);
+    } catch (const chutney::error &) {
+        return true;
+    }
+    return false;
+}
+
+struct counter : chutney::visitor {
+    int ints = 0, strings = 0, tuples = 0, dicts = 0, objects = 0;
+
+    void on_int(long long) { ++ints; }
+    void on_string(std::string_view) { ++strings; }
+    void on_unicode(std::string_view) { ++strings; }
+    void begin_tuple() { ++tuples; }
+    void begin_dict() { ++dicts; }
+    void begin_object(std::string_view module, std::string_view name)
+    {
+        CHECK(module == "geometry" && name == "Point");
+        ++objects;
+    }
+};
+
+int
+main()
+{
+    using namespace std::string_literals;
+    std::string data;
+
+    roundtrip("none", std::optional<int>());
+    roundtrip("bool", true);
+    roundtrip("int", 1);
+    roundtrip("int2", 300);
+    roundtrip("int4", -70000);
+    roundtrip("float", 2.5);
+    roundtrip("string", "abc"s);
+    roundtrip("long_string", std::string(300, 'x'));
+    roundtrip("tuple", std::make_tuple(1, 2.5, "abc"s));
+    roundtrip("pair", std::make_pair(7, std::optional<int>(8)));
+    roundtrip("vector", std::vector<int>{1, 2, 3, 70000});
+    roundtrip("empty", std::vector<int>());
+    roundtrip("array", std::array<double, 2>{{1.5, -0.25}});
+    roundtrip("map", std::map<std::string, int>{{"a", 1}, {"b", 2}});
+    roundtrip("nested", std::map<std::string, std::vector<std::string>>{
+        {"k", {"x", "y"}}});
+    std::map<int, int> big;
+    for (int i = 0; i < 2500; ++i)
+        big[i] = -i;
+    roundtrip("batches", big);
+    roundtrip("unordered", std::unordered_map<int, bool>{{5, false}});
+    data = roundtrip("point", Point{3, 0.5, "origin"});
+
+    // Appending to an existing buffer, and std::vector<char> output
+    std::vector<char> out{'!'};
+    chutney::encode(out, 300);
+    CHECK(std::string(out.begin() + 1, out.end()) == chutney::encode(300));
+
+    // The visitor sees the events of a struct, without building it
+    counter c;
+    CHECK(chutney::parse(data, c) == data.size());
+    CHECK(c.objects == 1 && c.dicts == 1 && c.ints == 1 && c.strings == 4);
+    auto nested = chutney::encode(std::make_tuple(
+        std::vector<int>{1, 2}, std::map<std::string, int>{{"a", 1}}));
+    counter n;
+    chutney::parse(nested, n);
+    CHECK(n.tuples == 2 && n.dicts == 1 && n.ints == 3 && n.strings == 1);
+
+    // A long chain of dictionaries each followed by a MARK
+    std::string chain;
+    for (int i = 0; i < 900; ++i)
+        chain += "(}";
+    chain += "}(K\x01K\x02u";
+    chain += std::string(900, 't') + ".";
+    counter ch;
+    CHECK(chutney::parse(chain, ch) == chain.size());
+    CHECK(ch.tuples == 900 && ch.dicts == 901 && ch.ints == 2);
+    roundtrip("dict_then_tuple", std::vector<std::tuple<std::map<int, int>,
+        std::vector<int>>>{{{}, {1}}, {{{2, 3}}, {}}, {{}, {}}});
+
+    // Errors
+    data = chutney::encode(std::make_tuple(1, 2.5, "abc"s));
+    CHECK(refused<std::tuple<int, double, std::string>>(
+        data.substr(0, data.size() - 1)));
+    CHECK(refused<std::tuple<int, double, std::string>>(
+        data.substr(0, data.size() - 3)));
+    CHECK(refused<std::tuple<int, double>>(data));
+    CHECK(refused<std::tuple<int, double, std::string, int>>(data));
+    CHECK(refused<std::string>(chutney::encode(1)));
+    CHECK(refused<int>(chutney::encode("1"s)));
+    CHECK(refused<signed char>(chutney::encode(300)));
+    CHECK(refused<int>("\xff."));
+    CHECK(refused<int>("\x80\x09K\x01."));
+    CHECK(refused<int>(""));
+    CHECK(refused<int>("K\x01"));
+    CHECK(refused<int>("K\x01K"));
+    CHECK(refused<std::tuple<int>>("K\x01\x85."));   // postfix TUPLE1
+    data = chutney::encode(Point{1, 2, "p"});
+    CHECK(refused<Point>(data.replace(data.find("Point"), 5, "Other")));
+    std::string deep;
+    for (int i = 0; i <= chutney::max_depth; ++i)
+        deep += '(';
+    counter d;
+    try {
+        chutney::parse(deep, d);
+        CHECK(!"parse of deep nesting returned");
+    } catch (const chutney::error &) {
+    }
+    return failures != 0;
+}